@@ -0,0 +1,662 @@
+
+// ================================================================================================
+// -*- C++ -*-
+// File: grammar.hpp
+// Created on: 18/10/26
+//
+// About:
+//  Table-driven LL(1) parsing on top of the lexer.
+//  Productions are declared in C++ and compiled to a parse table at init.
+//
+// License:
+//  This source file is released under the terms of the GNU General Public License version 3.
+//  See the accompanying LICENSE file for full disclosure.
+// ================================================================================================
+
+#ifndef GRAMMAR_HPP
+#define GRAMMAR_HPP
+
+// Defining this before including the file prevents pulling the Standard headers.
+// Useful to be able to place this file inside a user-defined namespace or to simply
+// avoid redundant inclusions. User is responsible for providing all the necessary
+// Standard headers before #including this one.
+#ifndef GRAMMAR_NO_STD_INCLUDES
+    #include <cstdint>
+    #include <initializer_list>
+    #include <string>
+    #include <unordered_map>
+    #include <vector>
+#endif // GRAMMAR_NO_STD_INCLUDES
+
+// Hook to allow providing a custom assert() before including this file.
+#ifndef GRAMMAR_ASSERT
+    #ifndef GRAMMAR_NO_STD_INCLUDES
+        #include <cassert>
+    #endif // GRAMMAR_NO_STD_INCLUDES
+    #define GRAMMAR_ASSERT assert
+#endif // GRAMMAR_ASSERT
+
+//
+// LL(1) grammar of terminals, nonterminals and productions, compiled to a
+// parse table by build(). A grammar::parser then drives a lexer with the
+// table, using an explicit stack instead of recursion, and reports what it
+// finds to a grammar::listener.
+//
+// Terminals are the token kinds (identifier, number, string, literal) plus
+// "atoms": punctuations or keywords with a fixed text, declared with atom().
+// An identifier token whose text was declared as an atom is that atom, not
+// an identifier. Actions are markers placed in the right-hand side of a
+// production that match nothing and call listener::on_action() when reached,
+// which is where a translation scheme does its work. For example:
+//
+//   grammar g;
+//   const auto expr  = g.nonterminal("expr");
+//   const auto rest  = g.nonterminal("rest");
+//   const auto plus  = g.atom("+");
+//   const auto add   = g.action(0);
+//   g.production(expr, { grammar::number, rest });
+//   g.production(rest, { plus, grammar::number, add, rest });
+//   g.production(rest, {}); // Empty
+//   g.build(expr);
+//
+//   grammar::parser p{ g };
+//   p.parse(&lex, &my_listener);
+//
+// Like the preprocessor, this relies on the lexer class, which must be
+// included BEFORE including grammar.hpp:
+//
+//  #define LEXER_IMPLEMENTATION
+//  #include "lexer.hpp"
+//
+//  #define GRAMMAR_IMPLEMENTATION
+//  #include "grammar.hpp"
+//
+class grammar final
+{
+public:
+
+    // Terminals, nonterminals and actions are all symbols.
+    // The kind is kept in the top bits, the index in the rest.
+    using symbol = std::uint32_t;
+
+    static constexpr symbol nonterminal_bit = 1u << 30;
+    static constexpr symbol action_bit      = 1u << 29;
+    static constexpr symbol index_mask      = action_bit - 1;
+    static constexpr symbol invalid_symbol  = ~0u;
+
+    // Predefined terminals for the token kinds:
+    static constexpr symbol end_of_input = 0;
+    static constexpr symbol identifier   = 1;
+    static constexpr symbol number       = 2;
+    static constexpr symbol string       = 3;
+    static constexpr symbol literal      = 4;
+
+    static bool is_terminal(const symbol s)    noexcept { return (s & (nonterminal_bit | action_bit)) == 0; }
+    static bool is_nonterminal(const symbol s) noexcept { return (s & nonterminal_bit) != 0; }
+    static bool is_action(const symbol s)      noexcept { return (s & action_bit) != 0; }
+
+    // Receives the parse as it happens. All methods are optional.
+    class listener
+    {
+    public:
+        virtual ~listener();
+
+        // A nonterminal was expanded with the given production (index returned by production()).
+        virtual void enter_production(std::uint32_t prod_index) { (void)prod_index; }
+
+        // All the symbols of the production entered last with this index were matched.
+        virtual void exit_production(std::uint32_t prod_index) { (void)prod_index; }
+
+        // A token was matched by a terminal.
+        virtual void on_terminal(symbol terminal, const lexer::token & tok) { (void)terminal; (void)tok; }
+
+        // An action symbol was reached.
+        virtual void on_action(std::uint32_t action_id) { (void)action_id; }
+    };
+
+    // Drives a lexer with the parse table of a built grammar. Keeps its
+    // stack and token between calls to parse(), so after the first parse
+    // no memory is allocated unless the input needs a deeper stack. The
+    // grammar must outlive the parser and not change while in use.
+    class parser final
+    {
+    public:
+        explicit parser(const grammar & g);
+
+        // Copies share the grammar but not the stack.
+        parser(const parser & other) = default;
+        parser & operator = (const parser & other) = default;
+
+        // Parses from the current position of 'lex' up to its end. Syntax errors are reported
+        // with lexer::error(), so they might throw. Returns true if the whole input matched.
+        bool parse(lexer * lex, listener * l);
+
+    private:
+        const grammar *     m_grammar;
+        std::vector<symbol> m_stack;
+        lexer::token        m_token;
+    };
+
+    grammar();
+
+    // Copyable and movable.
+    grammar(const grammar & other) = default;
+    grammar & operator = (const grammar & other) = default;
+    grammar(grammar && other) = default;
+    grammar & operator = (grammar && other) = default;
+
+    // Terminal for a token with the given text: a punctuation, or an identifier used as a keyword.
+    // Declaring the same text again returns the same symbol.
+    symbol atom(const std::string & text);
+
+    // New nonterminal. The name is only used for error messages.
+    symbol nonterminal(const std::string & name);
+
+    // Action symbol, placed in productions to call listener::on_action() with 'action_id'.
+    static symbol action(std::uint32_t action_id) noexcept { return action_bit | (action_id & index_mask); }
+
+    // Adds the production 'lhs -> rhs'. An empty 'rhs' is the empty string. Returns the
+    // index of the production, passed to listener::enter_production()/exit_production().
+    std::uint32_t production(symbol lhs, std::initializer_list<symbol> rhs);
+    std::uint32_t production(symbol lhs, const symbol * rhs, std::size_t rhs_count);
+
+    // Computes the FIRST and FOLLOW sets and fills the parse table, with 'start' as the start symbol.
+    // Fails if the grammar isn't LL(1) or some nonterminal has no productions. 'out_error_message'
+    // is optional and receives the reason of the failure. Called again after adding symbols.
+    bool build(symbol start, std::string * out_error_message = nullptr);
+
+    // Terminal that a token matches, or invalid_symbol if none does.
+    symbol classify(const lexer::token & tok) const;
+
+    // Name of a terminal or nonterminal, for error messages.
+    const std::string & symbol_name(symbol s) const;
+
+    // Miscellaneous queries:
+    bool          is_built()              const noexcept { return m_built; }
+    symbol        get_start_symbol()      const noexcept { return m_start; }
+    std::size_t   get_terminal_count()    const noexcept { return m_terminal_names.size(); }
+    std::size_t   get_nonterminal_count() const noexcept { return m_nonterminal_names.size(); }
+    std::size_t   get_production_count()  const noexcept { return m_productions.size(); }
+
+private:
+
+    struct production_def final
+    {
+        symbol        lhs;
+        std::uint32_t first_rhs; // Index in m_rhs_symbols.
+        std::uint32_t rhs_count;
+    };
+
+    using symbol_set = std::vector<bool>; // One entry per terminal.
+
+    bool first_of_sequence(const symbol * seq, std::size_t count,
+                           const std::vector<symbol_set> & first_sets,
+                           const std::vector<bool> & nullable, symbol_set * out_first) const;
+
+    std::int32_t table_entry(symbol nonterm, symbol terminal) const noexcept;
+
+    std::vector<std::string>                m_terminal_names;    // Indexed by terminal symbol.
+    std::vector<std::string>                m_nonterminal_names; // Indexed by nonterminal symbol & index_mask.
+    std::unordered_map<std::string, symbol> m_atoms;             // Text to terminal, for atoms longer than one char.
+    symbol                                  m_char_atoms[256];   // Single-char atoms, the common case for punctuation.
+    std::vector<production_def>             m_productions;       // In declaration order.
+    std::vector<symbol>                     m_rhs_symbols;       // Right-hand sides of all the productions.
+    std::vector<std::int32_t>               m_table;             // Production for each [nonterminal][terminal], -1 if an error.
+    symbol                                  m_start;             // Set by build().
+    bool                                    m_built;             // Set by build(), cleared when adding symbols.
+};
+
+// ================== End of header file ==================
+#endif // GRAMMAR_HPP
+// ================== End of header file ==================
+
+// ================================================================================================
+//
+//                                   Grammar Implementation
+//
+// ================================================================================================
+
+#ifdef GRAMMAR_IMPLEMENTATION
+
+#ifndef GRAMMAR_NO_STD_INCLUDES
+    #include <algorithm>
+    #include <utility>
+#endif // GRAMMAR_NO_STD_INCLUDES
+
+// ========================================================
+// grammar class:
+// ========================================================
+
+constexpr grammar::symbol grammar::nonterminal_bit;
+constexpr grammar::symbol grammar::action_bit;
+constexpr grammar::symbol grammar::index_mask;
+constexpr grammar::symbol grammar::invalid_symbol;
+constexpr grammar::symbol grammar::end_of_input;
+constexpr grammar::symbol grammar::identifier;
+constexpr grammar::symbol grammar::number;
+constexpr grammar::symbol grammar::string;
+constexpr grammar::symbol grammar::literal;
+
+grammar::listener::~listener()
+{
+}
+
+grammar::grammar()
+    : m_terminal_names{ "end of input", "identifier", "number", "string", "literal" }
+    , m_nonterminal_names{}
+    , m_atoms{}
+    , m_productions{}
+    , m_rhs_symbols{}
+    , m_table{}
+    , m_start{ invalid_symbol }
+    , m_built{ false }
+{
+    std::fill_n(m_char_atoms, 256, invalid_symbol);
+}
+
+grammar::symbol grammar::atom(const std::string & text)
+{
+    GRAMMAR_ASSERT(!text.empty());
+
+    const symbol existing = (text.length() == 1) ? m_char_atoms[static_cast<unsigned char>(text[0])] : invalid_symbol;
+    if (existing != invalid_symbol)
+    {
+        return existing;
+    }
+
+    const auto iter = m_atoms.find(text);
+    if (iter != m_atoms.end())
+    {
+        return iter->second;
+    }
+
+    const auto new_atom = static_cast<symbol>(m_terminal_names.size());
+    GRAMMAR_ASSERT(new_atom <= index_mask && "Too many terminals!");
+
+    if (text.length() == 1)
+    {
+        m_char_atoms[static_cast<unsigned char>(text[0])] = new_atom;
+    }
+    else
+    {
+        m_atoms.emplace(text, new_atom);
+    }
+
+    m_terminal_names.push_back(text);
+    m_built = false;
+    return new_atom;
+}
+
+grammar::symbol grammar::nonterminal(const std::string & name)
+{
+    const auto index = static_cast<symbol>(m_nonterminal_names.size());
+    GRAMMAR_ASSERT(index <= index_mask && "Too many nonterminals!");
+
+    m_nonterminal_names.push_back(name);
+    m_built = false;
+    return nonterminal_bit | index;
+}
+
+std::uint32_t grammar::production(const symbol lhs, const std::initializer_list<symbol> rhs)
+{
+    return production(lhs, rhs.begin(), rhs.size());
+}
+
+std::uint32_t grammar::production(const symbol lhs, const symbol * const rhs, const std::size_t rhs_count)
+{
+    GRAMMAR_ASSERT(is_nonterminal(lhs) && (lhs & index_mask) < m_nonterminal_names.size());
+    GRAMMAR_ASSERT(rhs != nullptr || rhs_count == 0);
+
+    production_def prod;
+    prod.lhs       = lhs;
+    prod.first_rhs = static_cast<std::uint32_t>(m_rhs_symbols.size());
+    prod.rhs_count = static_cast<std::uint32_t>(rhs_count);
+
+    m_rhs_symbols.insert(m_rhs_symbols.end(), rhs, rhs + rhs_count);
+    m_productions.push_back(prod);
+    m_built = false;
+
+    return static_cast<std::uint32_t>(m_productions.size() - 1);
+}
+
+bool grammar::first_of_sequence(const symbol * const seq, const std::size_t count,
+                                const std::vector<symbol_set> & first_sets,
+                                const std::vector<bool> & nullable, symbol_set * out_first) const
+{
+    // Adds FIRST(seq) to the set and returns true if 'seq' can derive the empty string.
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const symbol s = seq[i];
+        if (is_action(s))
+        {
+            continue;
+        }
+
+        if (is_terminal(s))
+        {
+            (*out_first)[s] = true;
+            return false;
+        }
+
+        const symbol_set & first = first_sets[s & index_mask];
+        for (std::size_t t = 0; t < first.size(); ++t)
+        {
+            if (first[t])
+            {
+                (*out_first)[t] = true;
+            }
+        }
+
+        if (!nullable[s & index_mask])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool grammar::build(const symbol start, std::string * out_error_message)
+{
+    GRAMMAR_ASSERT(is_nonterminal(start) && (start & index_mask) < m_nonterminal_names.size());
+
+    const std::size_t num_terminals    = m_terminal_names.size();
+    const std::size_t num_nonterminals = m_nonterminal_names.size();
+
+    auto fail = [&](std::string message)
+    {
+        if (out_error_message != nullptr)
+        {
+            *out_error_message = std::move(message);
+        }
+        m_table.clear();
+        m_built = false;
+        return false;
+    };
+
+    std::vector<bool> has_production(num_nonterminals, false);
+    for (const production_def & prod : m_productions)
+    {
+        has_production[prod.lhs & index_mask] = true;
+    }
+    for (std::size_t n = 0; n < num_nonterminals; ++n)
+    {
+        if (!has_production[n])
+        {
+            return fail("grammar::build() -> nonterminal '" + m_nonterminal_names[n] + "' has no productions!");
+        }
+    }
+
+    // FIRST sets and nullable nonterminals, iterated until nothing changes.
+    std::vector<symbol_set> first_sets(num_nonterminals, symbol_set(num_terminals, false));
+    std::vector<bool> nullable(num_nonterminals, false);
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (const production_def & prod : m_productions)
+        {
+            const std::size_t lhs = prod.lhs & index_mask;
+            symbol_set first = first_sets[lhs];
+
+            const bool empty = first_of_sequence(m_rhs_symbols.data() + prod.first_rhs, prod.rhs_count,
+                                                 first_sets, nullable, &first);
+            if (first != first_sets[lhs])
+            {
+                first_sets[lhs] = std::move(first);
+                changed = true;
+            }
+            if (empty && !nullable[lhs])
+            {
+                nullable[lhs] = true;
+                changed = true;
+            }
+        }
+    }
+
+    // FOLLOW sets. The input ends after the start symbol.
+    std::vector<symbol_set> follow_sets(num_nonterminals, symbol_set(num_terminals, false));
+    follow_sets[start & index_mask][end_of_input] = true;
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (const production_def & prod : m_productions)
+        {
+            const symbol * const rhs = m_rhs_symbols.data() + prod.first_rhs;
+            for (std::uint32_t i = 0; i < prod.rhs_count; ++i)
+            {
+                if (!is_nonterminal(rhs[i]))
+                {
+                    continue;
+                }
+
+                // FOLLOW(Xi) gets FIRST of what comes after it, plus FOLLOW(lhs) if that can be empty.
+                symbol_set & follow = follow_sets[rhs[i] & index_mask];
+                symbol_set updated  = follow;
+
+                if (first_of_sequence(rhs + i + 1, prod.rhs_count - i - 1, first_sets, nullable, &updated))
+                {
+                    const symbol_set & lhs_follow = follow_sets[prod.lhs & index_mask];
+                    for (std::size_t t = 0; t < num_terminals; ++t)
+                    {
+                        if (lhs_follow[t])
+                        {
+                            updated[t] = true;
+                        }
+                    }
+                }
+
+                if (updated != follow)
+                {
+                    follow  = std::move(updated);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Parse table. Two productions for the same entry means the grammar isn't LL(1).
+    m_table.assign(num_nonterminals * num_terminals, -1);
+
+    for (std::size_t p = 0; p < m_productions.size(); ++p)
+    {
+        const production_def & prod = m_productions[p];
+        const std::size_t lhs = prod.lhs & index_mask;
+
+        symbol_set predict(num_terminals, false);
+        if (first_of_sequence(m_rhs_symbols.data() + prod.first_rhs, prod.rhs_count, first_sets, nullable, &predict))
+        {
+            predict = follow_sets[lhs];
+            first_of_sequence(m_rhs_symbols.data() + prod.first_rhs, prod.rhs_count, first_sets, nullable, &predict);
+        }
+
+        for (std::size_t t = 0; t < num_terminals; ++t)
+        {
+            if (!predict[t])
+            {
+                continue;
+            }
+
+            std::int32_t & entry = m_table[lhs * num_terminals + t];
+            if (entry >= 0)
+            {
+                return fail("grammar::build() -> LL(1) conflict in '" + m_nonterminal_names[lhs] + "' on '" +
+                            m_terminal_names[t] + "' between productions " + std::to_string(entry) +
+                            " and " + std::to_string(p) + "!");
+            }
+            entry = static_cast<std::int32_t>(p);
+        }
+    }
+
+    m_start = start;
+    m_built = true;
+    return true;
+}
+
+grammar::symbol grammar::classify(const lexer::token & tok) const
+{
+    switch (tok.get_type())
+    {
+    case lexer::token::type::number :
+        return number;
+
+    case lexer::token::type::string :
+        return string;
+
+    case lexer::token::type::literal :
+        return literal;
+
+    case lexer::token::type::identifier :
+    case lexer::token::type::punctuation :
+        {
+            const std::string & text = tok.as_string();
+            if (text.length() == 1)
+            {
+                const symbol char_atom = m_char_atoms[static_cast<unsigned char>(text[0])];
+                if (char_atom != invalid_symbol)
+                {
+                    return char_atom;
+                }
+            }
+            else
+            {
+                const auto iter = m_atoms.find(text);
+                if (iter != m_atoms.end())
+                {
+                    return iter->second;
+                }
+            }
+            return tok.is_identifier() ? identifier : invalid_symbol;
+        }
+
+    default :
+        return invalid_symbol;
+    } // switch (tok.get_type())
+}
+
+const std::string & grammar::symbol_name(const symbol s) const
+{
+    if (is_nonterminal(s))
+    {
+        return m_nonterminal_names[s & index_mask];
+    }
+
+    GRAMMAR_ASSERT(is_terminal(s) && s < m_terminal_names.size());
+    return m_terminal_names[s];
+}
+
+std::int32_t grammar::table_entry(const symbol nonterm, const symbol terminal) const noexcept
+{
+    if (terminal >= m_terminal_names.size())
+    {
+        return -1;
+    }
+    return m_table[(nonterm & index_mask) * m_terminal_names.size() + terminal];
+}
+
+// ========================================================
+// grammar::parser class:
+// ========================================================
+
+grammar::parser::parser(const grammar & g)
+    : m_grammar{ &g }
+    , m_stack{}
+    , m_token{}
+{
+}
+
+bool grammar::parser::parse(lexer * lex, listener * l)
+{
+    GRAMMAR_ASSERT(lex != nullptr);
+    GRAMMAR_ASSERT(m_grammar->is_built());
+
+    // Production ends are pushed below their right-hand sides to call exit_production().
+    constexpr symbol production_end_bit = 1u << 31;
+
+    listener no_listener;
+    if (l == nullptr)
+    {
+        l = &no_listener;
+    }
+
+    const std::uint32_t errors_before = lex->get_error_count();
+
+    auto advance = [&]() -> symbol
+    {
+        if (lex->next_token(&m_token))
+        {
+            return m_grammar->classify(m_token);
+        }
+        m_token.clear();
+        return (lex->get_error_count() == errors_before) ? end_of_input : invalid_symbol;
+    };
+
+    auto found_text = [&](const symbol lookahead)
+    {
+        return (lookahead == end_of_input) ? std::string{ "end of input" } : ("'" + m_token.as_string() + "'");
+    };
+
+    m_stack.clear();
+    m_stack.push_back(end_of_input);
+    m_stack.push_back(m_grammar->get_start_symbol());
+
+    symbol lookahead = advance();
+
+    while (!m_stack.empty())
+    {
+        if (lookahead == invalid_symbol && lex->get_error_count() != errors_before)
+        {
+            return false; // The lexer already reported it.
+        }
+
+        const symbol top = m_stack.back();
+        m_stack.pop_back();
+
+        if (top & production_end_bit)
+        {
+            l->exit_production(top & ~production_end_bit);
+        }
+        else if (is_action(top))
+        {
+            l->on_action(top & index_mask);
+        }
+        else if (is_terminal(top))
+        {
+            if (top != lookahead)
+            {
+                return lex->error("expected '" + m_grammar->symbol_name(top) + "', found " + found_text(lookahead) + ".");
+            }
+
+            if (top == end_of_input)
+            {
+                return true;
+            }
+
+            l->on_terminal(top, m_token);
+            lookahead = advance();
+        }
+        else
+        {
+            const std::int32_t prod_index = m_grammar->table_entry(top, lookahead);
+            if (prod_index < 0)
+            {
+                return lex->error("unexpected " + found_text(lookahead) + " in '" + m_grammar->symbol_name(top) + "'.");
+            }
+
+            const production_def & prod = m_grammar->m_productions[static_cast<std::size_t>(prod_index)];
+            l->enter_production(static_cast<std::uint32_t>(prod_index));
+
+            m_stack.push_back(production_end_bit | static_cast<symbol>(prod_index));
+            for (std::uint32_t i = prod.rhs_count; i != 0; --i)
+            {
+                m_stack.push_back(m_grammar->m_rhs_symbols[prod.first_rhs + i - 1]);
+            }
+        }
+    }
+
+    return true;
+}
+
+// ================ End of implementation =================
+#endif // GRAMMAR_IMPLEMENTATION
+// ================ End of implementation =================
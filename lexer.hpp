@@ -23,9 +23,16 @@
 // avoid redundant inclusions. User is responsible for providing all the necessary
 // Standard headers before #including this one.
 #ifndef LEXER_NO_STD_INCLUDES
+    #include <cstddef>
     #include <cstdint>
+    #include <cstdlib>
+    #include <new>
     #include <string>
     #include <type_traits>
+    #include <vector>
+    #ifndef LEXER_NO_THREADS
+        #include <atomic>
+    #endif // LEXER_NO_THREADS
 #endif // LEXER_NO_STD_INCLUDES
 
 // Hook to allow providing a custom assert() before including this file.
@@ -41,6 +48,42 @@
     #include <stdexcept>
 #endif // !LEXER_NO_CXX_EXCEPTIONS && !LEXER_NO_STD_INCLUDES
 
+// Defining this disables the SSE2 code paths used by the bulk scanning helpers
+// (structural index, newline counting). A portable scalar version is used instead.
+// SSE2 is otherwise enabled automatically when the target supports it.
+// #define LEXER_NO_SIMD
+
+// Defining this makes lexer::lex_files() run on the calling thread only and
+// leaves out lexer::diagnostic_queue, removing the dependency on <thread> and <atomic>.
+// #define LEXER_NO_THREADS
+
+// Enables lexer::pmr_memory_resource, an adapter for std::pmr memory resources.
+// On by default when compiling for C++17 or newer if <memory_resource> is available.
+#ifndef LEXER_PMR_MEMORY_RESOURCE
+    #if defined(__has_include) && ((__cplusplus >= 201703L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+        #if __has_include(<memory_resource>)
+            #define LEXER_PMR_MEMORY_RESOURCE 1
+        #endif // __has_include(<memory_resource>)
+    #endif // __has_include && C++17
+    #ifndef LEXER_PMR_MEMORY_RESOURCE
+        #define LEXER_PMR_MEMORY_RESOURCE 0
+    #endif // LEXER_PMR_MEMORY_RESOURCE
+#endif // LEXER_PMR_MEMORY_RESOURCE
+
+#if (LEXER_PMR_MEMORY_RESOURCE && !defined(LEXER_NO_STD_INCLUDES))
+    #include <memory_resource>
+#endif // LEXER_PMR_MEMORY_RESOURCE && !LEXER_NO_STD_INCLUDES
+
+// Enables lexer::static_tokenize() for compile-time tokenization. On by default
+// when compiling for C++17 or newer. Define it to 0 to leave the function out.
+#ifndef LEXER_STATIC_TOKENIZE
+    #if (__cplusplus >= 201703L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+        #define LEXER_STATIC_TOKENIZE 1
+    #else // C++11/14
+        #define LEXER_STATIC_TOKENIZE 0
+    #endif // C++17
+#endif // LEXER_STATIC_TOKENIZE
+
 //
 // ----------
 //  OVERVIEW
@@ -57,7 +100,8 @@
 // It does not allocate memory during scanning if you have provided
 // an input text buffer on initialization. If loading a script from
 // file then the lexer will allocate a memory buffer big enough to
-// hold the contents of the whole file. The output tokens will not
+// hold the contents of the whole file (see set_memory_resource() to
+// control where it comes from). The output tokens will not
 // explicitly allocate memory either, but they use a std::string
 // internally, which might allocate for long strings. Normally you
 // can reuse tokens as you parse a file, so the overall memory
@@ -129,7 +173,8 @@ public:
             string,
             literal,
             identifier,
-            punctuation
+            punctuation,
+            custom       // Matched by a token_rules pattern. Flags are the rule id.
         }; // type
 
         // Subtypes and flags:
@@ -187,7 +232,9 @@ public:
         bool                is_literal()        const noexcept;
         bool                is_identifier()     const noexcept;
         bool                is_punctuation()    const noexcept;
+        bool                is_custom()         const noexcept;
         std::size_t         get_length()        const noexcept;
+        std::uint64_t       get_hash()          const noexcept;
         std::uint32_t       get_flags()         const noexcept;
         std::uint32_t       get_line_number()   const noexcept;
         std::uint32_t       get_lines_crossed() const noexcept;
@@ -203,10 +250,12 @@ public:
 
         // Setters used by the lexer:
         void set_string(std::string new_text);
+        void set_string(const char * str, std::size_t length);
         void set_flags(std::uint32_t new_flags) noexcept;
         void set_line_number(std::uint32_t new_line_num) noexcept;
         void set_lines_crossed(std::uint32_t new_lines_crossed) noexcept;
         void set_type(type new_type) noexcept;
+        void set_hash(std::uint64_t new_hash) noexcept; // Must be hash_text() of the current string.
 
         // Miscellaneous:
         char operator[](int index) const;
@@ -233,8 +282,10 @@ public:
         std::uint32_t         m_lines_crossed = 0;
         type                  m_type          = type::none;
         mutable bool          m_values_valid  = true;
+        mutable bool          m_hash_valid    = false;
         mutable std::uint64_t m_u64_value     = 0;
         mutable double        m_double_value  = 0.0;
+        mutable std::uint64_t m_hash          = 0;
     }; // token
 
     //
@@ -331,8 +382,67 @@ public:
     // tables is also not thread-safe since it writes to the
     // shared punctuation table pointers.
     //
-    static const punctuation_def  default_punctuations[];
-    static const std::size_t      default_punctuations_size;
+    // default_punctuations[] is constexpr so that static_tokenize()
+    // can match punctuations at compile time.
+    //
+    static constexpr punctuation_def default_punctuations[]
+    {
+        { nullptr, punctuation_id::none                },
+        { "=",     punctuation_id::assign              },
+        { "+",     punctuation_id::add                 },
+        { "-",     punctuation_id::sub                 },
+        { "*",     punctuation_id::mul                 },
+        { "/",     punctuation_id::div                 },
+        { "%",     punctuation_id::mod                 },
+        { ">>",    punctuation_id::rshift              },
+        { "<<",    punctuation_id::lshift              },
+        { "+=",    punctuation_id::add_assign          },
+        { "-=",    punctuation_id::sub_assign          },
+        { "*=",    punctuation_id::mul_assign          },
+        { "/=",    punctuation_id::div_assign          },
+        { "%=",    punctuation_id::mod_assign          },
+        { ">>=",   punctuation_id::rshift_assign       },
+        { "<<=",   punctuation_id::lshift_assign       },
+        { "&&",    punctuation_id::logic_and           },
+        { "||",    punctuation_id::logic_or            },
+        { "!",     punctuation_id::logic_not           },
+        { "==",    punctuation_id::logic_eq            },
+        { "!=",    punctuation_id::logic_not_eq        },
+        { ">",     punctuation_id::logic_greater       },
+        { "<",     punctuation_id::logic_less          },
+        { ">=",    punctuation_id::logic_greater_eq    },
+        { "<=",    punctuation_id::logic_less_eq       },
+        { "++",    punctuation_id::plus_plus           },
+        { "--",    punctuation_id::minus_minus         },
+        { "&",     punctuation_id::bitwise_and         },
+        { "|",     punctuation_id::bitwise_or          },
+        { "^",     punctuation_id::bitwise_xor         },
+        { "~",     punctuation_id::bitwise_not         },
+        { "&=",    punctuation_id::bitwise_and_assign  },
+        { "|=",    punctuation_id::bitwise_or_assign   },
+        { "^=",    punctuation_id::bitwise_xor_assign  },
+        { ".",     punctuation_id::dot                 },
+        { "->",    punctuation_id::arrow               },
+        { "::",    punctuation_id::colon_colon         },
+        { ".*",    punctuation_id::dot_star            },
+        { ",",     punctuation_id::comma               },
+        { ";",     punctuation_id::semicolon           },
+        { ":",     punctuation_id::colon               },
+        { "?",     punctuation_id::question_mark       },
+        { "...",   punctuation_id::ellipsis            },
+        { "\\",    punctuation_id::backslash           },
+        { "(",     punctuation_id::open_parentheses    },
+        { ")",     punctuation_id::close_parentheses   },
+        { "[",     punctuation_id::open_bracket        },
+        { "]",     punctuation_id::close_bracket       },
+        { "{",     punctuation_id::open_curly_bracket  },
+        { "}",     punctuation_id::close_curly_bracket },
+        { "#",     punctuation_id::preprocessor        },
+        { "##",    punctuation_id::preprocessor_merge  },
+        { "$",     punctuation_id::dollar_sign         }
+    };
+
+    static constexpr std::size_t  default_punctuations_size = sizeof(default_punctuations) / sizeof(default_punctuations[0]);
     static punct_table_index_type default_punctuations_table[];
     static punct_table_index_type default_punctuations_next[];
     static bool                   default_punctuations_initialized;
@@ -350,6 +460,9 @@ public:
     // punctuations_table[] must match the ASCII table, so it requires 256 entries at least.
     // punctuations_next[] must have at least punctuations_size entries in it.
     //
+    // The set is also compiled into a trie that lets the lexer find the longest
+    // matching punctuation in a single pass over the input characters.
+    //
     // Note: Not thread-safe.
     //
     static void set_punctuation_tables(const punctuation_def  * punctuations,
@@ -376,6 +489,95 @@ public:
     static std::string get_punctuation_from_id(punctuation_id id);
     static punctuation_id get_punctuation_id_from_str(const char * punctuation_string);
 
+    //
+    // Error / warning codes:
+    //
+    // Every diagnostic the lexer generates has a code. The comments show
+    // the messages produced, with the arguments of the diagnostic in <>.
+    //
+    enum class error_code : std::uint16_t
+    {
+        // Errors:
+        custom,                    // <arg0> (free-form message passed to error() or warning())
+        no_filename,               // lexer::init_from_file() -> no filename provided!
+        already_loaded,            // lexer::<arg0>() -> another script is already loaded!
+        file_load_failed,          // lexer::init_from_file() -> failed to load text file "<arg0>".
+        not_initialized,           // lexer not properly initialized; no script loaded!
+        unknown_punctuation,       // unknown punctuation character '<arg0>'
+        expected_token_missing,    // couldn't find expected token '<arg0>'
+        unexpected_token,          // expected '<arg0>' but found '<arg1>'
+        token_missing,             // couldn't read expected token!
+        unexpected_token_type,     // expected a <int_arg: token::type> but found '<arg1>'
+        unexpected_number_type,    // expected <int_arg: token::flags> but found '<arg1>'
+        bad_punctuation_index,     // bad punctuation index in subtype_flags!
+        bool_missing,              // couldn't read expected boolean literal!
+        bool_expected,             // expected boolean literal or number, found '<arg1>'.
+        float_missing,             // couldn't read expected floating-point number!
+        float_format,              // number format cannot be scanned as a floating-point value!
+        float_expected,            // expected float value, found '<arg1>'.
+        uint_missing,              // couldn't read expected unsigned integer number!
+        uint_expected,             // expected unsigned integer value, found '<arg1>'.
+        int_missing,               // couldn't read expected integer number!
+        int_expected,              // expected integer value, found '<arg1>'.
+        string_missing,            // couldn't read expected string!
+        string_expected,           // expected string or character literal, found '<arg1>'.
+        missing_closing_bracket,   // missing closing '{'!
+        invalid_escape_char,       // unknown/invalid escape char!
+        missing_concat_string,     // expecting string after '\' terminated line!
+        missing_trailing_quote,    // missing trailing quote!
+        newline_in_string,         // newline inside string!
+        multi_char_literal,        // char literal is not one character long! ...
+        float_exception,           // floating-point exception scanned: <arg1>
+        multiple_dots_in_number,   // more than one dot in number! ...
+        bad_ip_address,            // IP address should have three dots!
+        out_of_memory,             // lexer::<arg0>() -> out of memory!
+
+        // Warnings:
+        nested_comment,            // nested C-style multi-line comment!
+        unget_token_twice,         // lexer::unget_token() called twice in a row!
+        bool_not_0_or_1,           // expected 0 or 1 for numerical boolean literal!
+        uint_from_float,           // expected unsigned integer number, got float; truncating it to integer...
+        uint_from_negative,        // expected unsigned integer number, got a negative value instead!
+        int_from_float,            // expected integer number, got float; truncating it to integer...
+        hex_escape_too_big,        // hexadecimal value in escape character is too big! Truncating to 0xFF...
+        escape_value_too_big       // value in escape character is too big! Truncating to 0xFF...
+    }; // error_code
+
+    //
+    // diagnostic:
+    //
+    // An error or warning as passed to error_callbacks::diagnose(). The message
+    // is only formatted when requested, and the text arguments reference the
+    // strings of the caller, so a diagnostic is only valid during the callback.
+    //
+    struct diagnostic final
+    {
+        struct text final
+        {
+            const char * str;
+            std::size_t  length;
+
+            text() noexcept : str{ nullptr }, length{ 0 } { }
+            text(const char * s, std::size_t len) noexcept : str{ s }, length{ len } { }
+            text(const char * s) noexcept : str{ s }, length{ (s != nullptr) ? std::char_traits<char>::length(s) : 0 } { }
+            text(const std::string & s) noexcept : str{ s.data() }, length{ s.length() } { }
+        }; // text
+
+        const lexer * source     = nullptr;            // Lexer that generated it. Provides the filename.
+        error_code    code       = error_code::custom; // What went wrong.
+        std::uint32_t line_num   = 0;                  // Line where it happened.
+        std::uint32_t int_arg    = 0;                  // Token type or flags, for the codes that use it.
+        text          args[2]    = {};                 // Text arguments, usually expected and found token strings.
+        bool          is_warning = false;              // Warning if true, error otherwise.
+        bool          is_fatal   = false;              // Set for errors unless flags::no_fatal_errors.
+
+        // Only the message text, e.g.: "missing trailing quote!".
+        std::string message() const;
+
+        // Full message with filename, line and error or warning tag, as given to error_callbacks.
+        std::string to_string() const;
+    }; // diagnostic
+
     //
     // Error / warning output:
     //
@@ -385,6 +587,11 @@ public:
         virtual void error(const std::string & message, bool fatal) = 0;
         virtual void warning(const std::string & message) = 0;
         virtual ~error_callbacks() = default;
+
+        // Called for every error and warning not suppressed by the lexer flags. The default formats
+        // the message with diagnostic::to_string() and forwards it to error() or warning(). Override
+        // to inspect the error code or to defer formatting until the message is actually needed.
+        virtual void diagnose(const diagnostic & diag);
     }; // error_callbacks
 
     // Default error/warning callbacks print to std::cerr.
@@ -395,6 +602,62 @@ public:
     static void set_error_callbacks(error_callbacks * err_callbacks) noexcept;
     static error_callbacks * get_error_callbacks() noexcept;
 
+    #ifndef LEXER_NO_THREADS
+    //
+    // diagnostic_queue:
+    //
+    // Lock-free multiple producer, single consumer queue of diagnostics. Set it as the
+    // instance callbacks of the lexers used by worker threads: they push formatted messages
+    // without blocking each other or writing to std::cerr, and a single thread drains them
+    // in the order they were pushed. Pushing never throws lexer::exception, fatal errors
+    // are just flagged in the entries.
+    //
+    class diagnostic_queue final
+        : public error_callbacks
+    {
+    public:
+        struct entry final
+        {
+            std::string message;    // Same as diagnostic::to_string().
+            error_code  code;       // error_code::custom for messages pushed with error()/warning().
+            bool        is_warning;
+            bool        is_fatal;
+        }; // entry
+
+        diagnostic_queue() = default;
+        ~diagnostic_queue();
+
+        diagnostic_queue(const diagnostic_queue & other) = delete;
+        diagnostic_queue & operator = (const diagnostic_queue & other) = delete;
+
+        // Producer side. Safe to call from any number of threads at once.
+        void diagnose(const diagnostic & diag) override;
+        void error(const std::string & message, bool fatal) override;
+        void warning(const std::string & message) override;
+
+        // Consumer side. Only one thread at a time should drain the queue. Appends the entries
+        // pushed so far to the vector, oldest first, and returns how many were appended.
+        std::size_t drain(std::vector<entry> * out_entries);
+
+        // Drains the queue into other callbacks, the shared ones if null. Useful for printing
+        // everything from one thread. The default callbacks throw on fatal errors.
+        std::size_t drain(error_callbacks * target = nullptr);
+
+        // Nothing pushed since the last drain.
+        bool empty() const noexcept;
+
+    private:
+        struct node final
+        {
+            entry  item;
+            node * next;
+        };
+
+        void push(entry item);
+        std::atomic<node *> m_head{ nullptr };
+    }; // diagnostic_queue
+    #endif // LEXER_NO_THREADS
+
     //
     // lexer::error() throws lexer::exception if errors are set to fatal.
     // Disabling exceptions globally via the preprocessor causes the default
@@ -426,8 +689,312 @@ public:
         static constexpr std::uint32_t allow_multi_char_literals     = 1 << 9;  // Allow multi-character literals.
         static constexpr std::uint32_t allow_backslash_string_concat = 1 << 10; // Allow multiple strings separated by '\' to be concatenated.
         static constexpr std::uint32_t only_strings                  = 1 << 11; // Scan as whitespace delimited strings (quoted strings keep quotes).
+        static constexpr std::uint32_t structural_index              = 1 << 12; // Index brackets and ';' on first skip, so skipping sections doesn't tokenize them.
+        static constexpr std::uint32_t lazy_line_numbers             = 1 << 13; // Don't count lines while scanning. Tokens get zero line numbers. See get_line_number_at().
+        static constexpr std::uint32_t hash_identifiers              = 1 << 14; // Hash identifiers while scanning, so token::get_hash() is free. See hash_text().
     }; // flags
 
+    //
+    // Memory resources:
+    //
+    // The lexer allocates the buffer of scripts loaded from file and the structural index.
+    // The preprocessor also allocates its macro tables, conditional and include stacks and
+    // the lexers of #included files. All of that can be routed to a memory_resource, e.g.
+    // to place the allocations of a request in an arena that is released in bulk, or to cap
+    // how much memory an untrusted script can use. Running out of memory fails the operation
+    // with error_code::out_of_memory (or a preprocessor error) instead of throwing. Token
+    // strings still use std::string and the global heap, so they are not accounted for.
+    //
+    class memory_resource
+    {
+    public:
+        // Returns null if the memory can't be provided. Must not throw.
+        virtual void * allocate(std::size_t size_bytes, std::size_t alignment) = 0;
+        virtual void deallocate(void * ptr, std::size_t size_bytes, std::size_t alignment) noexcept = 0;
+        virtual ~memory_resource() = default;
+
+        // Allocate from the given resource, or from the global heap if it is null.
+        // The global heap supports alignments up to alignof(std::max_align_t).
+        static void * allocate_from(memory_resource * resource, std::size_t size_bytes, std::size_t alignment) noexcept;
+        static void deallocate_from(memory_resource * resource, void * ptr, std::size_t size_bytes, std::size_t alignment) noexcept;
+    }; // memory_resource
+
+    //
+    // Forwards to an upstream resource (the global heap if null) until 'cap_bytes'
+    // would be exceeded, then fails every allocation that doesn't fit. Not thread-safe.
+    //
+    class capped_memory_resource final
+        : public memory_resource
+    {
+    public:
+        explicit capped_memory_resource(std::size_t cap_bytes, memory_resource * upstream = nullptr) noexcept;
+
+        capped_memory_resource(const capped_memory_resource & other) = delete;
+        capped_memory_resource & operator = (const capped_memory_resource & other) = delete;
+
+        void * allocate(std::size_t size_bytes, std::size_t alignment) override;
+        void deallocate(void * ptr, std::size_t size_bytes, std::size_t alignment) noexcept override;
+
+        std::size_t   get_cap_bytes()    const noexcept { return m_cap_bytes;    }
+        std::size_t   get_used_bytes()   const noexcept { return m_used_bytes;   }
+        std::size_t   get_peak_bytes()   const noexcept { return m_peak_bytes;   }
+        std::uint32_t get_failed_count() const noexcept { return m_failed_count; }
+
+    private:
+        memory_resource * m_upstream;
+        std::size_t       m_cap_bytes;
+        std::size_t       m_used_bytes   = 0;
+        std::size_t       m_peak_bytes   = 0;
+        std::uint32_t     m_failed_count = 0; // Allocations refused because of the cap or the upstream.
+    }; // capped_memory_resource
+
+    //
+    // Arena that hands out memory from blocks taken from an upstream resource (the global
+    // heap if null). deallocate() is a no-op; everything is freed at once by release() or
+    // by the destructor. Not thread-safe.
+    //
+    class monotonic_memory_resource final
+        : public memory_resource
+    {
+    public:
+        explicit monotonic_memory_resource(std::size_t block_size = 4096, memory_resource * upstream = nullptr) noexcept;
+        ~monotonic_memory_resource();
+
+        monotonic_memory_resource(const monotonic_memory_resource & other) = delete;
+        monotonic_memory_resource & operator = (const monotonic_memory_resource & other) = delete;
+
+        void * allocate(std::size_t size_bytes, std::size_t alignment) override;
+        void deallocate(void * ptr, std::size_t size_bytes, std::size_t alignment) noexcept override;
+
+        // Gives all the blocks back to the upstream resource. Invalidates every allocation.
+        void release() noexcept;
+
+        // Bytes currently taken from the upstream resource, including block headers.
+        std::size_t get_allocated_bytes() const noexcept { return m_allocated_bytes; }
+
+    private:
+        struct block_header final
+        {
+            block_header * next;
+            std::size_t    size_bytes;
+        };
+
+        memory_resource * m_upstream;
+        block_header    * m_blocks          = nullptr; // Most recent block first.
+        char            * m_current_ptr     = nullptr; // Next free byte in the most recent block.
+        char            * m_current_end     = nullptr; // End of the most recent block.
+        std::size_t       m_block_size;
+        std::size_t       m_allocated_bytes = 0;
+    }; // monotonic_memory_resource
+
+    #if LEXER_PMR_MEMORY_RESOURCE
+    //
+    // Allocates from a std::pmr::memory_resource, e.g. a std::pmr::monotonic_buffer_resource.
+    // std::bad_alloc thrown by the upstream resource is turned into a failed allocation.
+    //
+    class pmr_memory_resource final
+        : public memory_resource
+    {
+    public:
+        explicit pmr_memory_resource(std::pmr::memory_resource * upstream) noexcept
+            : m_upstream{ upstream }
+        { }
+
+        pmr_memory_resource(const pmr_memory_resource & other) = delete;
+        pmr_memory_resource & operator = (const pmr_memory_resource & other) = delete;
+
+        void * allocate(std::size_t size_bytes, std::size_t alignment) override;
+        void deallocate(void * ptr, std::size_t size_bytes, std::size_t alignment) noexcept override;
+
+    private:
+        std::pmr::memory_resource * m_upstream;
+    }; // pmr_memory_resource
+    #endif // LEXER_PMR_MEMORY_RESOURCE
+
+    //
+    // Standard allocator over a memory_resource, used by the lexer and preprocessor
+    // containers. A null resource uses the global heap. Allocation failures throw
+    // std::bad_alloc, or abort() if exceptions are disabled.
+    //
+    template<typename T>
+    class resource_allocator
+    {
+    public:
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap            = std::true_type;
+
+        resource_allocator() noexcept = default;
+
+        explicit resource_allocator(memory_resource * resource) noexcept
+            : m_resource{ resource }
+        { }
+
+        template<typename U>
+        resource_allocator(const resource_allocator<U> & other) noexcept
+            : m_resource{ other.get_resource() }
+        { }
+
+        T * allocate(const std::size_t count)
+        {
+            void * const ptr = memory_resource::allocate_from(m_resource, count * sizeof(T), alignof(T));
+            if (ptr == nullptr)
+            {
+                #ifndef LEXER_NO_CXX_EXCEPTIONS
+                throw std::bad_alloc{};
+                #else // LEXER_NO_CXX_EXCEPTIONS
+                std::abort();
+                #endif // LEXER_NO_CXX_EXCEPTIONS
+            }
+            return static_cast<T *>(ptr);
+        }
+
+        void deallocate(T * const ptr, const std::size_t count) noexcept
+        {
+            memory_resource::deallocate_from(m_resource, ptr, count * sizeof(T), alignof(T));
+        }
+
+        memory_resource * get_resource() const noexcept { return m_resource; }
+
+        template<typename U>
+        bool operator == (const resource_allocator<U> & other) const noexcept { return m_resource == other.get_resource(); }
+        template<typename U>
+        bool operator != (const resource_allocator<U> & other) const noexcept { return m_resource != other.get_resource(); }
+
+    private:
+        memory_resource * m_resource = nullptr;
+    }; // resource_allocator
+
+    //
+    // Batch loading:
+    //
+    // lex_files() loads and tokenizes a list of script files in parallel, using a pool
+    // of worker threads. The tokens of every file are placed in a single shared array,
+    // in the same order as the input filenames, so the results are deterministic
+    // regardless of the number of threads used. Errors and warnings are collected
+    // per file instead of being sent to the shared error_callbacks, so nothing is
+    // printed and lexer::exception is never thrown by the workers.
+    //
+    struct batch_file final
+    {
+        std::string              filename      {};  // Same as the input filename.
+        std::vector<std::string> diagnostics   {};  // Formatted errors and warnings, in the order emitted.
+        std::size_t              first_token   = 0; // Index of the file's first token in batch_result::tokens.
+        std::size_t              token_count   = 0; // Number of tokens lexed from the file.
+        std::uint32_t            error_count   = 0; // Errors generated while loading and lexing the file.
+        std::uint32_t            warning_count = 0; // Warnings generated while lexing the file.
+    }; // batch_file
+
+    struct batch_result final
+    {
+        std::vector<token>      tokens {}; // Token arena shared by all the files.
+        std::vector<batch_file> files  {}; // One entry for each input filename, in input order.
+    }; // batch_result
+
+    // Returns true if all files were loaded and lexed without errors. 'num_threads' is the
+    // maximum number of threads used, including the caller. Zero selects the number of hardware
+    // threads. Needs the shared punctuation tables and error_callbacks to stay unchanged until done.
+    static bool lex_files(const std::vector<std::string> & filenames, std::uint32_t flags,
+                          batch_result * out_result, unsigned num_threads = 0);
+
+    //
+    // Incremental lexing:
+    //
+    // incremental_lexer takes a script in fragments of any size, as they arrive from a
+    // socket or pipe, and makes each token available as soon as it is known to be complete.
+    // Tokens cut by a fragment boundary (mid-string, mid-comment, mid-number) are held back
+    // until more data comes in or finish() is called. See the class below for details.
+    //
+    class incremental_lexer;
+
+    //
+    // Custom token rules:
+    //
+    // token_rules compiles patterns for token kinds the lexer doesn't know about, like color
+    // codes or durations, into a single DFA. When set with set_token_rules(), the DFA is tried
+    // at the start of every token, before the built-in classes. See the class below for details.
+    //
+    class token_rules;
+
+    //
+    // Comment styles:
+    //
+    // By default the lexer skips C-style /* */ and C++-style // comments. A comment_style set
+    // with set_comment_style() replaces them with other line comment prefixes and block comment
+    // delimiters, like the '#' and ';' of INI files. Comments are skipped together with the
+    // whitespace, so they never produce tokens. See the class below for details.
+    //
+    class comment_style;
+
+    //
+    // Segmented scripts:
+    //
+    // A script assembled from several memory regions can be lexed by segmented_lexer
+    // without concatenating them first. Tokens can span segments and line numbers keep
+    // counting across them. The lexer needs a null terminator at the end of its input,
+    // so only null terminated segments are lexed in place. Any other segment is copied
+    // when its turn comes, which still avoids building the whole script in one buffer.
+    // Segments are not owned and must stay valid while in use by the lexer.
+    //
+    struct segment final
+    {
+        const char * data;            // Not owned.
+        std::size_t  length;          // Length in bytes of 'data'.
+        bool         null_terminated; // True if data[length] is a null terminator.
+
+        segment(const char * seg_data, const std::size_t seg_length, const bool seg_null_terminated = false) noexcept
+            : data{ seg_data }, length{ seg_length }, null_terminated{ seg_null_terminated } { }
+
+        // Implicit, so a list of strings can be used directly. Always null terminated.
+        segment(const std::string & str) noexcept
+            : data{ str.c_str() }, length{ str.size() }, null_terminated{ true } { }
+    };
+    class segmented_lexer;
+
+    //
+    // Pre-tokenized scripts:
+    //
+    // A static_token records where a token was found in a script and how it was
+    // classified, so the script can be replayed by init_from_static_tokens() without
+    // scanning it again. static_tokenize() produces them at compile time for scripts
+    // embedded as string literals. Offsets are relative to the start of the script.
+    //
+    struct static_token final
+    {
+        std::uint32_t start       = 0;                  // Offset of the first char of the token.
+        std::uint32_t end         = 0;                  // Offset past the last char scanned, including quotes and number suffixes.
+        std::uint32_t text_start  = 0;                  // Offset of the token text. Inside the quotes for strings.
+        std::uint32_t text_length = 0;                  // Length of the token text.
+        std::uint32_t flags       = 0;                  // token::flags or punctuation_id.
+        token::type   type        = token::type::none;  // Type of the token.
+        bool          rescan      = false;              // Text is not a plain slice of the script (escapes, concatenation), so it is scanned at runtime.
+    }; // static_token
+
+    template<std::size_t MaxTokens>
+    struct static_token_array final
+    {
+        static_token  tokens[MaxTokens] = {}; // The first 'count' entries are valid.
+        std::size_t   count             = 0;  // Number of tokens recorded.
+        std::uint32_t flags             = 0;  // Lexer flags used to tokenize the script.
+        bool          complete          = false; // False if stopped early on an error, unsupported input or too many tokens.
+    }; // static_token_array
+
+    #if LEXER_STATIC_TOKENIZE
+    // Tokenizes a null terminated script at compile time with the default punctuations.
+    // Supports the flags no_string_concat, no_string_escape_chars, allow_multi_char_literals
+    // and the ones that don't affect scanning. IP addresses, float exceptions and anything
+    // that would produce an error or warning stops the tokenization; whatever is left is
+    // then scanned at runtime. Usage:
+    //
+    //   static constexpr char script[] = "...";
+    //   static constexpr auto tokens = lexer::static_tokenize<64>(script);
+    //   static_assert(tokens.complete, "script needs more than 64 tokens or has errors");
+    //
+    template<std::size_t MaxTokens>
+    static constexpr static_token_array<MaxTokens> static_tokenize(const char * script, std::uint32_t flags = 0) noexcept;
+    #endif // LEXER_STATIC_TOKENIZE
+
     //
     // Lexer public interface:
     //
@@ -464,6 +1031,18 @@ public:
     bool init_from_memory(const char * ptr, std::uint32_t length, std::string filename,
                           std::uint32_t flags = 0, std::uint32_t starting_line = 1);
 
+    // Same as init_from_memory(), but the tokens recorded for the script are replayed by next_token()
+    // instead of being scanned, as long as the default punctuations are set and the scanning flags
+    // match 'token_flags'. Parts of the script not covered by the records are scanned as usual.
+    // The lexer WILL NOT take ownership of the tokens array, which must outlive the script.
+    bool init_from_static_tokens(const char * ptr, std::uint32_t length, const static_token * tokens,
+                                 std::size_t token_count, std::uint32_t token_flags, std::string filename,
+                                 std::uint32_t flags = 0);
+
+    template<std::size_t MaxTokens>
+    bool init_from_static_tokens(const char * ptr, std::uint32_t length, const static_token_array<MaxTokens> & tokens,
+                                 std::string filename, std::uint32_t flags = 0);
+
     // Frees the script, filename and any associated data. Flags stay the same.
     // Most internal states are reset to initials.
     void clear() noexcept;
@@ -483,6 +1062,12 @@ public:
     // Changes the line number but doesn't alter the position within the scrip.
     void set_line_number(std::uint32_t new_line_num) noexcept;
 
+    // Line number of the given offset into the script, computed by counting the newlines before it.
+    // Meant for flags::lazy_line_numbers, where lines are not tracked during scanning and tokens
+    // have zero line numbers. The start of the last token read is at get_last_whitespace_end().
+    // Moving forward from the last offset queried only counts the newlines in between.
+    std::uint32_t get_line_number_at(std::size_t offset) const noexcept;
+
     // Read the next token (or returns a cached token).
     // Returns false if no more tokens are available or any other errors occurred.
     bool next_token(token * out_token);
@@ -490,6 +1075,11 @@ public:
     // Read a token only if on the same line.
     bool next_token_on_line(token * out_token);
 
+    // Same as next_token(), but also records where the token was found, so a script read
+    // this way can be replayed later by init_from_static_tokens() with the same flags.
+    // Runtime counterpart of static_tokenize(). Doesn't work with unget_token().
+    bool next_static_token(token * out_token, static_token * out_record);
+
     // Unread the given token / put it back.
     void unget_token(const token & in_token);
 
@@ -516,16 +1106,92 @@ public:
     // Returns true if the next token equals the given type but does not remove the token from the source.
     bool peek_token_type(token::type type, std::uint32_t subtype_flags, token * out_token);
 
+    //
+    // Pattern matching:
+    //
+    // match() reads a fixed sequence of tokens in a single call, checking each one against the
+    // corresponding element of the pattern and capturing only the values asked for. If a token
+    // doesn't fit, the script position is restored as if nothing had been read and no error is
+    // generated, so alternative patterns can be tried in turn. Pattern elements are:
+    //
+    //   'c' or "str"           : Token equal to the char or string, like check_token_string().
+    //   match_identifier(&v)   : Identifier, text captured to a text_view.
+    //   match_number(&n)       : Number with an optional leading '-', converted to the type of 'n'.
+    //                            Integer captures only match integer numbers.
+    //   match_string(&s)       : Double-quoted string, captured to a std::string.
+    //   match_any(&tok)        : Any token, captured whole.
+    //
+    // Captures are optional, e.g. match_number<int>() just checks that a number follows.
+    // Captured values are unspecified if the match fails. Example, for 'width = 640;':
+    //
+    //   lexer::text_view key;
+    //   int value;
+    //   while (lex.match(lexer::match_identifier(&key), '=', lexer::match_number(&value), ';')) { ... }
+    //
+
+    // Span of characters that is not owned. The text of an identifier matched by match() points
+    // into the script and stays valid until the script is freed, unless it came from unget_token(),
+    // in which case it is only valid until the next match().
+    struct text_view final
+    {
+        const char * data;
+        std::size_t  length;
+
+        text_view() noexcept : data{ nullptr }, length{ 0 } { }
+        text_view(const char * str, std::size_t len) noexcept : data{ str }, length{ len } { }
+
+        bool empty() const noexcept { return length == 0; }
+        std::string as_string() const { return std::string(data, length); }
+
+        bool operator == (const char * str) const noexcept;
+        bool operator != (const char * str) const noexcept { return !(*this == str); }
+    };
+
+    struct match_identifier_element final { text_view   * out; };
+    struct match_string_element     final { std::string * out; };
+    struct match_any_element        final { token       * out; };
+    template<typename NumType>
+    struct match_number_element     final { NumType     * out; };
+
+    static match_identifier_element match_identifier(text_view * out_text = nullptr) noexcept { return { out_text }; }
+    static match_string_element     match_string(std::string * out_string = nullptr) noexcept { return { out_string }; }
+    static match_any_element        match_any(token * out_token = nullptr) noexcept { return { out_token }; }
+    template<typename NumType = double>
+    static match_number_element<NumType> match_number(NumType * out_number = nullptr) noexcept { return { out_number }; }
+
+    // Returns true and consumes the tokens if they match all the elements in order.
+    template<typename... Elements>
+    bool match(const Elements & ... elements);
+
     // Skip tokens until the given token string is read.
     bool skip_until_string(const char * string);
 
     // Skip the rest of the current line.
     bool skip_rest_of_line();
 
+    // Skips whole lines until one whose first non-blank character is 'c', stopping right before it.
+    // Meant for code that is discarded, like inactive preprocessor blocks: nothing is tokenized,
+    // only C/C++ comments, quotes and line continuations are followed, so unlike skipping tokens
+    // it is never an error. Returns false if the end of the script is reached first.
+    bool skip_to_line_starting_with(char c);
+
+    // Moves to 'offset' in the script without scanning anything, with 'line_num' as the line number
+    // there (ignored with flags::lazy_line_numbers). Both must come from an earlier pass over the same
+    // script, and 'offset' must be where a token or line starts. A token put back is dropped.
+    void jump_to_offset(std::size_t offset, std::uint32_t line_num) noexcept;
+
     // Skip a {} bracketed section.
     bool skip_bracketed_section(bool scan_first_bracket = true);
 
+    // Scans the whole script once and records the offsets of every '{', '}', '(', ')' and ';'
+    // found outside of strings and comments. With the index available, skip_bracketed_section()
+    // and skip_until_string() with one of those characters jump straight to the matching
+    // character instead of tokenizing everything in between. Skipped text is not validated.
+    // Called automatically on the first skip if flags::structural_index is set.
+    bool build_structural_index();
+
     // Skips spaces, tabs, C-style multi-line comments, C++ comments, etc.
+    // Skips the comments of the comment_style instead if one is set.
     // Returns false if there is no token left to read.
     bool skip_whitespace(bool current_line);
 
@@ -596,6 +1262,22 @@ public:
     // Pulls the entire line, including the '\n' at the end.
     std::string scan_complete_line();
 
+    // Views into the script buffer, with no copies. They stay valid until the script is freed.
+    // The offset in the script is 'view.data - get_script_start()'. A '{' or a first token put
+    // back with unget_token() must be the last token read.
+
+    // Text of a {} bracketed section, brackets included, exactly as in the script. Skipped
+    // like skip_bracketed_section(), so it can use the structural index. Calls lexer::error()
+    // and returns an empty view if the next token isn't a '{' or the section isn't closed.
+    text_view bracketed_section_view();
+
+    // Rest of the current line, untokenized, comments included. Leading and trailing
+    // whitespace is trimmed. The '\n' is not consumed, like scan_rest_of_line().
+    text_view rest_of_line_view();
+
+    // The entire line, including the '\n' at the end. Same as scan_complete_line().
+    text_view complete_line_view();
+
     // Retrieves the whitespace characters before the last read token.
     std::string get_last_whitespace() const;
 
@@ -608,9 +1290,38 @@ public:
     // Returns end index into text buffer of last whitespace.
     std::size_t get_last_whitespace_end() const noexcept;
 
+    // Callbacks for this instance only, overriding the shared ones from set_error_callbacks().
+    // Setting them to null goes back to the shared callbacks. Lexer will never attempt to
+    // deallocate the provided pointer. The callbacks are kept by clear() and when moving.
+    void set_instance_error_callbacks(error_callbacks * err_callbacks) noexcept;
+    error_callbacks * get_instance_error_callbacks() const noexcept;
+
+    // Memory resource for the script buffer of init_from_file() and the structural index.
+    // Null uses the global heap. Can only be changed while no script is loaded, returns false
+    // otherwise. Lexer will never attempt to deallocate the provided pointer. The resource is
+    // kept by clear() and when moving.
+    bool set_memory_resource(memory_resource * resource) noexcept;
+    memory_resource * get_memory_resource() const noexcept;
+
+    // Custom token rules tried before the built-in token classes. Must be compiled. Null disables
+    // them. Not owned; the rules must outlive their use and not change while set. Replaying static
+    // tokens is disabled while rules are set. Kept by clear() and when moving.
+    void set_token_rules(const token_rules * rules) noexcept;
+    const token_rules * get_token_rules() const noexcept;
+
+    // Comments skipped between tokens. Null goes back to the default C and C++ comments. Not
+    // owned; the style must outlive its use. Replaying static tokens is disabled while a style
+    // is set. Kept by clear() and when moving.
+    void set_comment_style(const comment_style * style) noexcept;
+    const comment_style * get_comment_style() const noexcept;
+
     // Error handing:
+    // Errors and warnings suppressed by the flags only bump the counters. The 'const char *'
+    // overloads don't need to build a std::string for them, so prefer those for literals.
     bool error(const std::string & message);
+    bool error(const char * message);
     void warning(const std::string & message);
+    void warning(const char * message);
 
     // Miscellaneous queries:
     bool                is_initialized()      const noexcept;
@@ -618,6 +1329,7 @@ public:
     std::size_t         get_allocated_bytes() const noexcept;
     std::size_t         get_script_offset()   const noexcept;
     std::size_t         get_script_length()   const noexcept;
+    const char *        get_script_start()    const noexcept;
     std::uint32_t       get_flags()           const noexcept;
     std::uint32_t       get_line_number()     const noexcept;
     std::uint32_t       get_error_count()     const noexcept;
@@ -634,6 +1346,12 @@ public:
     // C string with the file contents. Caller must free it with delete[].
     static bool load_text_file(const std::string & filename, char ** out_file_contents, std::uint32_t * out_file_length);
 
+    // Same as above, but the file contents are allocated from 'resource' (the global heap if null).
+    // Caller must free them with memory_resource::deallocate_from(resource, ptr, length + 1, 1).
+    // 'out_of_memory' is optional and tells a failed allocation apart from a failed read.
+    static bool load_text_file(const std::string & filename, memory_resource * resource, char ** out_file_contents,
+                               std::uint32_t * out_file_length, bool * out_of_memory = nullptr);
+
     // Trim leading white-spaces (in-place).
     static std::string & ltrim_string(std::string * s);
 
@@ -643,16 +1361,103 @@ public:
     // rtrim_string() + ltrim_string().
     static std::string & trim_string(std::string * s);
 
+    // Fast 64-bit hash of a string, 8 bytes per step. Used by token::get_hash().
+    // String not required to be null-terminated. Values are not portable across byte orders.
+    static std::uint64_t hash_text(const char * str, std::size_t count) noexcept;
+
 private:
 
+    // Punctuation set compiled by set_punctuation_tables().
+    struct punctuation_trie_node final
+    {
+        punct_table_index_type first_child;  // First node for the following char, -1 if none.
+        punct_table_index_type next_sibling; // Next alternative for the same char position, -1 if none.
+        punct_table_index_type punctuation;  // Index in m_punctuations of the punctuation ending here, -1 if none.
+        char                   ch;           // Character matched by this node.
+    };
+
+    struct punctuation_trie final
+    {
+        punct_table_index_type             roots[256]; // Node for each possible first char, -1 if none.
+        std::vector<punctuation_trie_node> nodes {};
+    };
+
+    // What internal_skip_styled_comment() found, or the comment left open by internal_resume_whitespace().
+    enum class comment_kind
+    {
+        none,
+        line,
+        block
+    };
+
+    static punctuation_trie * internal_get_punctuation_trie(bool default_set);
+    static void internal_build_punctuation_trie(const punctuation_def * punctuations,
+                                                std::size_t punctuations_size,
+                                                punctuation_trie * trie);
+
     // Internal helpers:
     bool internal_read_whitespace();
+    template<bool TrackLines> bool internal_skip_whitespace_and_comments();
+    template<bool TrackLines> bool internal_skip_line_comment();
+    template<bool TrackLines> bool internal_skip_block_comment();
+    bool internal_resume_whitespace(comment_kind * open_comment);
+    template<bool TrackLines> bool internal_resume_whitespace_and_comments(comment_kind * open_comment);
+    comment_kind internal_skip_styled_comment(bool track_lines);
+    std::uint32_t internal_lines_crossed(const token & tok) const noexcept;
+    std::uint32_t internal_last_line_number() const noexcept;
     bool internal_read_escape_character(char * out_char);
     bool internal_read_string(int quote, token * out_token);
     bool internal_read_name_ident(token * out_token);
     bool internal_read_number(token * out_token);
     bool internal_read_punctuation(token * out_token);
     bool internal_check_string(const char * string) const;
+    error_callbacks * internal_get_error_callbacks() const noexcept;
+    bool internal_error(error_code code, diagnostic::text arg0 = {}, diagnostic::text arg1 = {}, std::uint32_t int_arg = 0);
+    void internal_warning(error_code code, diagnostic::text arg0 = {});
+    bool internal_use_structural_index();
+    void internal_build_structural_index();
+    bool internal_skip_indexed_section(bool scan_first_bracket);
+    bool internal_skip_until_indexed_char(char c);
+    void internal_jump_to_script_ptr(const char * new_script_ptr);
+    bool internal_replay_static_token(token * out_token);
+    bool internal_read_custom_token(token * out_token);
+    void internal_free_script_buffer() noexcept;
+
+    // Pattern matching helpers, see match():
+    struct match_state final
+    {
+        const char *  script_ptr;
+        const char *  last_script_ptr;
+        const char *  whitespace_start_ptr;
+        const char *  whitespace_end_ptr;
+        std::uint32_t line_num;
+        std::uint32_t last_line_num;
+        std::size_t   static_token_cursor;
+        bool          token_available;
+    };
+
+    void internal_save_match_state(match_state * out_state, token * out_leftover) const;
+    void internal_restore_match_state(const match_state & state, token * leftover) noexcept;
+    bool internal_match_next(token * out_token, text_view * out_text);
+    bool internal_match_number(token * out_token, bool * out_negative);
+    bool internal_match_element(token * tok, char c);
+    bool internal_match_element(token * tok, const char * string);
+    bool internal_match_element(token * tok, const match_identifier_element & element);
+    bool internal_match_element(token * tok, const match_string_element & element);
+    bool internal_match_element(token * tok, const match_any_element & element);
+    template<typename NumType>
+    bool internal_match_element(token * tok, const match_number_element<NumType> & element);
+    bool internal_match_elements(token *) noexcept { return true; }
+    template<typename First, typename... Rest>
+    bool internal_match_elements(token * tok, const First & first, const Rest & ... rest);
+
+    using structural_index_vector = std::vector<std::uint32_t, resource_allocator<std::uint32_t>>;
+
+    // Flags that change how tokens are scanned. Static tokens are only valid if these match.
+    static constexpr std::uint32_t static_token_scan_flags =
+        flags::no_string_concat | flags::no_string_escape_chars | flags::allow_path_names |
+        flags::allow_number_names | flags::allow_ip_addresses | flags::allow_float_exceptions |
+        flags::allow_multi_char_literals | flags::allow_backslash_string_concat | flags::only_strings;
 
     // Instance data:
     const char *                          m_buffer_head_ptr      = nullptr; // Buffer containing the script; owned by the lexer if m_allocated == true.
@@ -661,17 +1466,30 @@ private:
     const char *                          m_last_script_ptr      = nullptr; // Script pointer before reading last token.
     const char *                          m_whitespace_start_ptr = nullptr; // Start of last white space.
     const char *                          m_whitespace_end_ptr   = nullptr; // End pointer of last white space.
+    mutable const char *                  m_line_cache_ptr       = nullptr; // Position last resolved by get_line_number_at().
     std::uint32_t                         m_flags                = 0;       // lexer::flags ORed together or zero.
     std::uint32_t                         m_last_line_num        = 0;       // Line number before reading a token.
     std::uint32_t                         m_line_num             = 0;       // Current line in script.
+    mutable std::uint32_t                 m_line_cache_num       = 0;       // Line number at m_line_cache_ptr.
     std::uint32_t                         m_script_length        = 0;       // Length of the script in characters, not counting a null terminator.
     std::uint32_t                         m_error_count          = 0;       // Bumped by lexer::error(), even if errors are suppressed.
     std::uint32_t                         m_warn_count           = 0;       // Bumped by lexer::warning(), even if warnings are suppressed.
+    std::uint32_t                         m_static_token_flags   = 0;       // Scanning flags the static tokens were made with.
+    const static_token *                  m_static_tokens        = nullptr; // Pre-tokenized script from init_from_static_tokens(). Not owned.
+    std::size_t                           m_static_token_count   = 0;       // Number of entries in m_static_tokens.
+    std::size_t                           m_static_token_cursor  = 0;       // Next entry of m_static_tokens to replay.
+    error_callbacks *                     m_instance_callbacks   = nullptr; // Overrides the shared m_error_callbacks for this instance if not null.
+    memory_resource *                     m_memory_resource      = nullptr; // Allocates the script buffer and the structural index. Global heap if null.
+    const token_rules *                   m_token_rules          = nullptr; // Custom token rules tried first by next_token(). Not owned.
+    const comment_style *                 m_comment_style        = nullptr; // Comments skipped instead of the C and C++ ones if not null. Not owned.
     token                                 m_leftover_token       {};        // Available token from unget_token(). May be empty.
+    structural_index_vector               m_structural_index     {};        // Sorted offsets of structural chars. See build_structural_index().
     std::string                           m_filename             {};        // Filename of the script being scanned. Used for error reporting.
+    std::string                           m_match_leftover_text  {};        // Text of an identifier from unget_token() captured by match().
     bool                                  m_token_available      = false;   // Set by unget_token() if m_leftover_token is available.
     bool                                  m_initialized          = false;   // Set when a script file is loaded from file or memory.
-    bool                                  m_allocated            = false;   // True if dynamic memory was allocated. False if external.
+    bool                                  m_allocated            = false;   // True if the buffer was allocated from m_memory_resource. False if external.
+    bool                                  m_structural_indexed   = false;   // Set once m_structural_index is built for the current script.
 
     // Shared data:
     static error_callbacks              * m_error_callbacks;                // Error and warning reporting callbacks.
@@ -679,99 +1497,444 @@ private:
     static const punct_table_index_type * m_punctuations_table;             // ASCII table with punctuations (256 entries at least).
     static const punct_table_index_type * m_punctuations_next;              // Next punctuation in chain (same size of m_punctuations).
     static std::size_t                    m_punctuations_size;              // Size in entries of m_punctuations and m_punctuations_next.
+    static const punctuation_trie       * m_punctuation_trie;               // Compiled m_punctuations, used for matching.
 };
 
 // ========================================================
-// token class inline methods:
+// class lexer::incremental_lexer:
 // ========================================================
 
-inline lexer::token::token(token && other) noexcept
-    : m_string        { std::move(other.m_string) }
-    , m_flags         { other.m_flags             }
-    , m_line_num      { other.m_line_num          }
-    , m_lines_crossed { other.m_lines_crossed     }
-    , m_type          { other.m_type              }
-    , m_values_valid  { other.m_values_valid      }
-    , m_u64_value     { other.m_u64_value         }
-    , m_double_value  { other.m_double_value      }
+//
+// Push-based lexer. feed() appends a fragment of the script and lexes as far as
+// the data allows, next_token() then pops the tokens found so far. A token is only
+// handed out once something that ends it was seen: the start of the next token, or
+// whitespace or a comment for anything but strings and char literals that could
+// still be concatenated, which wait for the next char that isn't. The tail of the
+// data is lexed again by the next feed(), so only the bytes of the last token are
+// buffered between calls. Whitespace and comments are dropped as soon as they are
+// scanned. An unfinished comment, or the whitespace after a string that could still
+// be concatenated, is scanned from where the last feed() stopped, so a long comment
+// arriving in fragments is only scanned once. Errors and warnings are reported once
+// the data around them is complete; the ones caused by a token cut short are never
+// reported. A character that can't start a token is reported and skipped.
+//
+// Usage:
+//
+//   lexer::incremental_lexer lex{ "(socket)" };
+//   while (receive(&fragment))
+//   {
+//       lex.feed(fragment.data(), fragment.size());
+//       while (lex.next_token(&tok)) { ... }
+//   }
+//   lex.finish();
+//   while (lex.next_token(&tok)) { ... }
+//
+class lexer::incremental_lexer final
 {
-    other.clear();
-}
+public:
 
-inline lexer::token & lexer::token::operator = (token && other) noexcept
-{
-    m_string        = std::move(other.m_string);
-    m_flags         = other.m_flags;
-    m_line_num      = other.m_line_num;
-    m_lines_crossed = other.m_lines_crossed;
-    m_type          = other.m_type;
-    m_values_valid  = other.m_values_valid;
-    m_u64_value     = other.m_u64_value;
-    m_double_value  = other.m_double_value;
+    explicit incremental_lexer(std::string filename = "(stream)", std::uint32_t flags = 0);
 
-    other.clear();
-    return *this;
-}
+    // Not copyable.
+    incremental_lexer(const incremental_lexer & other) = delete;
+    incremental_lexer & operator = (const incremental_lexer & other) = delete;
 
-inline bool lexer::token::as_bool() const noexcept
-{
-    return get_value_u64() != 0;
-}
+    // But movable.
+    incremental_lexer(incremental_lexer && other) = default;
+    incremental_lexer & operator = (incremental_lexer && other) = default;
 
-inline float lexer::token::as_float() const noexcept
-{
-    return static_cast<float>(get_value_double());
-}
+    // Appends a fragment of the script and lexes the complete tokens in it. Returns false
+    // after a fatal error or if called after finish(). The data is copied, so the fragment
+    // can be reused once this returns.
+    bool feed(const char * data, std::size_t length);
 
-inline double lexer::token::as_double() const noexcept
-{
-    return get_value_double();
-}
+    // Same as feed(), but 'data[length]' must be a null terminator. That lets the fragment be
+    // lexed in place, with only its unfinished tail copied. Not kept after this returns.
+    bool feed_in_place(const char * data, std::size_t length);
 
-inline std::int32_t lexer::token::as_int32() const noexcept
-{
-    return static_cast<std::int32_t>(get_value_u64());
-}
+    // Signals the end of the script. Whatever was held back is lexed as the end of the script.
+    bool finish();
 
-inline std::int64_t lexer::token::as_int64() const noexcept
-{
-    return static_cast<std::int64_t>(get_value_u64());
-}
+    // Pops the oldest complete token. Returns false if none is available yet.
+    bool next_token(token * out_token);
 
-inline std::uint32_t lexer::token::as_uint32() const noexcept
-{
-    return static_cast<std::uint32_t>(get_value_u64());
-}
+    // Drops all data and tokens, going back to the state after construction. Flags are kept.
+    void clear();
 
-inline std::uint64_t lexer::token::as_uint64() const noexcept
-{
-    return get_value_u64();
-}
+    // Callbacks for this instance only, like lexer::set_instance_error_callbacks().
+    void set_instance_error_callbacks(error_callbacks * err_callbacks) noexcept { m_instance_callbacks = err_callbacks; }
+    error_callbacks * get_instance_error_callbacks() const noexcept { return m_instance_callbacks; }
 
-inline const std::string & lexer::token::as_string() const noexcept
-{
-    return m_string;
-}
+    // Miscellaneous queries:
+    bool                has_token()         const noexcept { return m_ready_head < m_ready.size(); }
+    bool                is_finished()       const noexcept { return m_finished; }
+    bool                is_at_end()         const noexcept { return m_finished && !has_token(); }
+    std::size_t         get_pending_bytes() const noexcept { return m_pending.size(); }
+    std::uint32_t       get_flags()         const noexcept { return m_flags; }
+    std::uint32_t       get_line_number()   const noexcept { return m_line_num; }
+    std::uint32_t       get_error_count()   const noexcept { return m_error_count; }
+    std::uint32_t       get_warning_count() const noexcept { return m_warn_count; }
+    const std::string & get_filename()      const noexcept { return m_filename; }
 
-inline bool lexer::token::is_number() const noexcept
-{
-    return m_type == type::number;
-}
+private:
 
-inline bool lexer::token::is_integer() const noexcept
-{
-    return (m_flags & flags::integer) != 0;
-}
+    // Diagnostics of the current pass, kept until the tokens they belong to are complete.
+    struct deferred_callbacks final
+        : public error_callbacks
+    {
+        struct entry final
+        {
+            diagnostic  diag {};
+            std::string args[2];
+        };
 
-inline bool lexer::token::is_float() const noexcept
-{
-    return (m_flags & flags::floating_point) != 0;
-}
+        std::vector<entry> entries {};
 
-inline bool lexer::token::is_boolean() const noexcept
-{
-    return (m_flags & flags::boolean) != 0;
-}
+        void error(const std::string &, bool) override { }
+        void warning(const std::string &) override { }
+        void diagnose(const diagnostic & diag) override;
+    };
+
+    bool internal_lex_pending(const char * source, std::size_t source_size, bool at_end);
+    bool internal_is_terminated(const token & tok, std::size_t end_offset) const noexcept; // 'end_offset' into m_source.
+    bool internal_may_grow(const token & tok, std::size_t end_offset) const noexcept;       // 'end_offset' into m_source.
+    void internal_forward_diagnostics(std::size_t count);
+
+    lexer                   m_lexer;                    // Scans m_source on each pass.
+    deferred_callbacks      m_deferred;                 // Instance callbacks of m_lexer.
+    std::string             m_pending;                  // Received data not handed out as tokens yet.
+    const char *            m_source             = nullptr; // Data of the current pass: m_pending or a fragment fed in place.
+    std::size_t             m_source_size        = 0;   // Size in bytes of m_source.
+    std::string             m_filename;                 // Used for error reporting.
+    std::vector<token>      m_ready;                    // Complete tokens, next_token() pops from m_ready_head.
+    std::size_t             m_ready_head         = 0;   // First token of m_ready not popped yet.
+    std::size_t             m_consumed           = 0;   // Bytes of m_source already turned into tokens.
+    std::size_t             m_forwarded          = 0;   // Entries of m_deferred already reported in this pass.
+    std::size_t             m_scanned            = 0;   // Bytes of m_pending already scanned as a token and/or the whitespace and comments after it. Zero if none.
+    error_callbacks *       m_instance_callbacks = nullptr; // Overrides the shared callbacks if not null.
+    std::uint32_t           m_flags;                    // lexer::flags ORed together or zero.
+    std::uint32_t           m_line_num           = 1;   // Line at m_consumed.
+    std::uint32_t           m_token_line         = 1;   // Line where the last token handed out ended, for the lines crossed by the next one.
+    std::uint32_t           m_scanned_line       = 1;   // Line at m_scanned.
+    comment_kind            m_open_comment       = comment_kind::none; // Comment m_scanned is inside of. Its last char is kept, at m_scanned - 1.
+    bool                    m_held_pending     = false; // m_pending starts with a token that could still be continued, like a string concatenated with the next one.
+    std::uint32_t           m_error_count        = 0;   // Errors reported so far, including suppressed ones.
+    std::uint32_t           m_warn_count         = 0;   // Warnings reported so far, including suppressed ones.
+    bool                    m_finished           = false; // Set by finish().
+    bool                    m_failed             = false; // Set after a fatal error.
+}; // incremental_lexer
+
+// ========================================================
+// class lexer::segmented_lexer:
+// ========================================================
+
+//
+// Pull-based lexer over a list of segments, lexed in order as if they were
+// one buffer. The segments are fed to an incremental_lexer as tokens are
+// requested. A null terminated segment is lexed in place, with only a token
+// crossing into the next segment copied.
+//
+class lexer::segmented_lexer final
+{
+public:
+
+    explicit segmented_lexer(std::vector<segment> segments, std::string filename = "(segments)", std::uint32_t flags = 0);
+
+    // Not copyable.
+    segmented_lexer(const segmented_lexer & other) = delete;
+    segmented_lexer & operator = (const segmented_lexer & other) = delete;
+
+    // But movable.
+    segmented_lexer(segmented_lexer && other) = default;
+    segmented_lexer & operator = (segmented_lexer && other) = default;
+
+    // Same as lexer::next_token(). Returns false at the end of the last segment or after a fatal error.
+    bool next_token(token * out_token);
+
+    // Callbacks for this instance only, like lexer::set_instance_error_callbacks().
+    void set_instance_error_callbacks(error_callbacks * err_callbacks) noexcept { m_incremental.set_instance_error_callbacks(err_callbacks); }
+    error_callbacks * get_instance_error_callbacks() const noexcept { return m_incremental.get_instance_error_callbacks(); }
+
+    // Miscellaneous queries:
+    bool                has_failed()        const noexcept { return m_failed; }
+    bool                is_at_end()         const noexcept { return m_incremental.is_at_end(); }
+    std::size_t         get_segment_count() const noexcept { return m_segments.size(); }
+    std::size_t         get_next_segment()  const noexcept { return m_next_segment; }
+    std::uint32_t       get_flags()         const noexcept { return m_incremental.get_flags(); }
+    std::uint32_t       get_error_count()   const noexcept { return m_incremental.get_error_count(); }
+    std::uint32_t       get_warning_count() const noexcept { return m_incremental.get_warning_count(); }
+    const std::string & get_filename()      const noexcept { return m_incremental.get_filename(); }
+
+private:
+
+    std::vector<segment>    m_segments;                 // Segments of the script, in order. Data not owned.
+    incremental_lexer       m_incremental;              // Receives one segment at a time.
+    std::size_t             m_next_segment       = 0;   // Index of the next segment to feed.
+    bool                    m_failed             = false; // Set after a fatal error.
+}; // segmented_lexer
+
+// ========================================================
+// class lexer::token_rules:
+// ========================================================
+
+//
+// Extra token kinds defined by patterns, all compiled into one DFA.
+// A lexer with rules set tries them at the start of every token. The
+// longest match wins, ties going to the rule added first, and becomes
+// a token::type::custom with the rule id as its flags. If no rule
+// matches, the token is scanned as usual. Patterns are a restricted
+// form of regular expressions:
+//
+//   x            The character x. Metacharacters are escaped with a backslash.
+//   .            Any character but a newline.
+//   [a-z_]       Any character in the set. [^...] is any character not in it.
+//   \d \w \s     Digit, word character [A-Za-z0-9_] and whitespace.
+//   \x           Hexadecimal digit.
+//   \n \t \r     Newline, tab and carriage return.
+//   (...)        Grouping.
+//   a|b          Alternation.
+//   * + ?        Zero or more, one or more, zero or one.
+//   {n} {n,m}    Repetition, n to m times, up to 255. {n,} is n or more. {0} matches nothing.
+//
+// Usage:
+//
+//   lexer::token_rules rules;
+//   rules.add_rule(1, "#\\x{6}");          // Color codes, like #ff00ff
+//   rules.add_rule(2, "\\d+(ms|s|m|h)");   // Durations, like 10ms
+//   rules.compile();
+//   lex.set_token_rules(&rules);
+//
+class lexer::token_rules final
+{
+public:
+
+    // compile() fails if the DFA would need more states than this.
+    static constexpr std::size_t max_states = 4096;
+
+    token_rules();
+
+    // Adds a rule for the pattern. Fails if the pattern is malformed or can match an empty string.
+    // 'out_error_message' is optional and receives the reason of the failure. The rules must be
+    // compiled again after adding.
+    bool add_rule(std::uint32_t rule_id, const std::string & pattern, std::string * out_error_message = nullptr);
+
+    // Builds the DFA from all the rules added so far.
+    bool compile(std::string * out_error_message = nullptr);
+
+    // Removes all the rules and the DFA.
+    void clear();
+
+    // Length of the longest match at the start of 'text', zero if none. Never reads past 'text_end'
+    // or a null terminator. The id of the rule matched is written to 'out_rule_id' if there is a match.
+    std::size_t match(const char * text, const char * text_end, std::uint32_t * out_rule_id) const noexcept;
+
+    // Miscellaneous queries:
+    bool        is_compiled()     const noexcept { return m_compiled; }
+    std::size_t get_rule_count()  const noexcept { return m_rule_ids.size(); }
+    std::size_t get_state_count() const noexcept { return m_accept.size(); }
+    std::size_t get_class_count() const noexcept { return m_class_count; }
+
+private:
+
+    // 256 bits, one for each byte value.
+    struct char_set final
+    {
+        std::uint64_t bits[4];
+
+        void set(unsigned char c) noexcept { bits[c >> 6] |= (std::uint64_t{ 1 } << (c & 63)); }
+        bool test(unsigned char c) const noexcept { return (bits[c >> 6] >> (c & 63)) & 1; }
+        bool empty() const noexcept { return (bits[0] | bits[1] | bits[2] | bits[3]) == 0; }
+    };
+
+    // Thompson NFA. Each state has up to two empty transitions and one on a set of chars.
+    struct nfa_state final
+    {
+        char_set     chars;   // Chars that lead to 'next'. Empty if none.
+        std::int32_t next;    // Target of the char transition, -1 if none.
+        std::int32_t eps[2];  // Targets of the empty transitions, -1 if unused.
+        std::int32_t accept;  // Index of the rule accepted here, -1 if none.
+    };
+
+    struct fragment final
+    {
+        std::int32_t start;
+        std::int32_t end;     // Has no transitions out yet.
+    };
+
+    class pattern_parser;
+
+    std::int32_t new_state();
+    void add_epsilon(std::int32_t from, std::int32_t to);
+    void epsilon_closure(std::vector<std::int32_t> * states, std::vector<bool> * in_set) const;
+    fragment make_chars(const char_set & chars);
+    fragment make_empty();
+    fragment make_concat(fragment first, fragment second);
+    fragment make_alternation(fragment first, fragment second);
+    fragment make_star(fragment frag);
+    fragment make_plus(fragment frag);
+    fragment make_optional(fragment frag);
+
+    std::vector<nfa_state>     m_nfa;              // States of all the rules.
+    std::vector<std::int32_t>  m_rule_starts;      // NFA start state of each rule.
+    std::vector<std::uint32_t> m_rule_ids;         // User id of each rule.
+    std::vector<std::int32_t>  m_transitions;      // DFA, [state][byte class] to state, -1 if none. State 0 is the start.
+    std::vector<std::int32_t>  m_accept;           // Rule index accepted by each DFA state, -1 if none.
+    std::uint8_t               m_byte_classes[256];// Bytes that behave the same in every rule share a class.
+    std::size_t                m_class_count;      // Number of distinct byte classes.
+    bool                       m_compiled;         // Set by compile(), cleared by add_rule().
+}; // token_rules
+
+// ========================================================
+// class lexer::comment_style:
+// ========================================================
+
+//
+// Line comment prefixes and block comment delimiters, of up to max_delimiter_length
+// chars each. A line comment runs to the end of the line. Block comments don't nest.
+// If several delimiters match, the longest wins, so "--" and "--[[" can be used
+// together. The delimiters are copied. Usage:
+//
+//   lexer::comment_style ini_comments;
+//   ini_comments.add_line_comment("#");
+//   ini_comments.add_line_comment(";");
+//   lex.set_comment_style(&ini_comments);
+//
+class lexer::comment_style final
+{
+public:
+
+    static constexpr std::size_t max_delimiters       = 8;
+    static constexpr std::size_t max_delimiter_length = 4;
+
+    // Starts with no comments at all.
+    comment_style() noexcept;
+
+    // Fail if a delimiter is empty or too long, or if max_delimiters were already added.
+    bool add_line_comment(const char * prefix) noexcept;
+    bool add_block_comment(const char * open, const char * close) noexcept;
+
+    // Removes all the delimiters.
+    void clear() noexcept;
+
+    // True if some comment starts with the char. Rules out most chars with a single lookup.
+    bool may_start_comment(const char c) const noexcept { return m_first_chars[static_cast<unsigned char>(c)]; }
+
+    std::size_t get_delimiter_count() const noexcept { return m_count; }
+
+private:
+
+    friend class lexer;
+
+    struct delimiter final
+    {
+        char         open[max_delimiter_length + 1];
+        char         close[max_delimiter_length + 1]; // Empty for line comments.
+        std::uint8_t open_length;
+        std::uint8_t close_length;
+    };
+
+    bool internal_add(const char * open, const char * close) noexcept;
+
+    delimiter   m_delimiters[max_delimiters]; // Line and block comments, in the order added.
+    std::size_t m_count;                      // Entries used in m_delimiters.
+    bool        m_first_chars[256];           // Set for the first char of every opening delimiter.
+}; // comment_style
+
+// ========================================================
+// token class inline methods:
+// ========================================================
+
+inline lexer::token::token(token && other) noexcept
+    : m_string        { std::move(other.m_string) }
+    , m_flags         { other.m_flags             }
+    , m_line_num      { other.m_line_num          }
+    , m_lines_crossed { other.m_lines_crossed     }
+    , m_type          { other.m_type              }
+    , m_values_valid  { other.m_values_valid      }
+    , m_hash_valid    { other.m_hash_valid        }
+    , m_u64_value     { other.m_u64_value         }
+    , m_double_value  { other.m_double_value      }
+    , m_hash          { other.m_hash              }
+{
+    other.clear();
+}
+
+inline lexer::token & lexer::token::operator = (token && other) noexcept
+{
+    m_string        = std::move(other.m_string);
+    m_flags         = other.m_flags;
+    m_line_num      = other.m_line_num;
+    m_lines_crossed = other.m_lines_crossed;
+    m_type          = other.m_type;
+    m_values_valid  = other.m_values_valid;
+    m_hash_valid    = other.m_hash_valid;
+    m_u64_value     = other.m_u64_value;
+    m_double_value  = other.m_double_value;
+    m_hash          = other.m_hash;
+
+    other.clear();
+    return *this;
+}
+
+inline bool lexer::token::as_bool() const noexcept
+{
+    return get_value_u64() != 0;
+}
+
+inline float lexer::token::as_float() const noexcept
+{
+    return static_cast<float>(get_value_double());
+}
+
+inline double lexer::token::as_double() const noexcept
+{
+    return get_value_double();
+}
+
+inline std::int32_t lexer::token::as_int32() const noexcept
+{
+    return static_cast<std::int32_t>(get_value_u64());
+}
+
+inline std::int64_t lexer::token::as_int64() const noexcept
+{
+    return static_cast<std::int64_t>(get_value_u64());
+}
+
+inline std::uint32_t lexer::token::as_uint32() const noexcept
+{
+    return static_cast<std::uint32_t>(get_value_u64());
+}
+
+inline std::uint64_t lexer::token::as_uint64() const noexcept
+{
+    return get_value_u64();
+}
+
+inline const std::string & lexer::token::as_string() const noexcept
+{
+    return m_string;
+}
+
+inline bool lexer::token::is_number() const noexcept
+{
+    return m_type == type::number;
+}
+
+inline bool lexer::token::is_integer() const noexcept
+{
+    return (m_flags & flags::integer) != 0;
+}
+
+inline bool lexer::token::is_float() const noexcept
+{
+    return (m_flags & flags::floating_point) != 0;
+}
+
+inline bool lexer::token::is_boolean() const noexcept
+{
+    return (m_flags & flags::boolean) != 0;
+}
 
 inline bool lexer::token::is_string() const noexcept
 {
@@ -793,6 +1956,11 @@ inline bool lexer::token::is_punctuation() const noexcept
     return m_type == type::punctuation;
 }
 
+inline bool lexer::token::is_custom() const noexcept
+{
+    return m_type == type::custom;
+}
+
 inline std::size_t lexer::token::get_length() const noexcept
 {
     return m_string.length();
@@ -852,6 +2020,14 @@ inline void lexer::token::set_string(std::string new_text)
 {
     m_string = std::move(new_text);
     m_values_valid = false;
+    m_hash_valid = false;
+}
+
+inline void lexer::token::set_string(const char * const str, const std::size_t length)
+{
+    m_string.assign(str, length);
+    m_values_valid = false;
+    m_hash_valid = false;
 }
 
 inline void lexer::token::set_flags(const std::uint32_t new_flags) noexcept
@@ -876,12 +2052,30 @@ inline void lexer::token::set_type(const type new_type) noexcept
     m_values_valid = false;
 }
 
+inline void lexer::token::set_hash(const std::uint64_t new_hash) noexcept
+{
+    LEXER_ASSERT(new_hash == lexer::hash_text(m_string.data(), m_string.length()));
+    m_hash = new_hash;
+    m_hash_valid = true;
+}
+
+inline std::uint64_t lexer::token::get_hash() const noexcept
+{
+    if (!m_hash_valid)
+    {
+        m_hash = lexer::hash_text(m_string.data(), m_string.length());
+        m_hash_valid = true;
+    }
+    return m_hash;
+}
+
 inline void lexer::token::append(const char c)
 {
     if (c != '\0')
     {
         m_string.push_back(c);
         m_values_valid = false;
+        m_hash_valid = false;
     }
 }
 
@@ -891,6 +2085,7 @@ inline void lexer::token::append(const char * str)
     {
         m_string.append(str);
         m_values_valid = false;
+        m_hash_valid = false;
     }
 }
 
@@ -914,8 +2109,10 @@ inline void lexer::token::clear() noexcept
     m_lines_crossed = 0;
     m_type          = type::none;
     m_values_valid  = true;
+    m_hash_valid    = false;
     m_u64_value     = 0;
     m_double_value  = 0.0;
+    m_hash          = 0;
 }
 
 inline std::uint64_t lexer::token::get_value_u64() const noexcept
@@ -974,6 +2171,48 @@ struct scan_float_func final
     static T do_scan(lexer * lex) { return static_cast<T>(lex->scan_double()); }
 };
 
+// These are used by lexer::match() to convert a number token to the captured type.
+// Integers don't match floats and unsigned integers don't match negative numbers.
+template<typename T>
+struct match_sint_func final
+{
+    static bool convert(const lexer::token & tok, const bool negative, T * out)
+    {
+        if (!tok.is_integer()) { return false; }
+        if (out != nullptr) { *out = static_cast<T>(negative ? -tok.as_int64() : tok.as_int64()); }
+        return true;
+    }
+};
+
+template<typename T>
+struct match_uint_func final
+{
+    static bool convert(const lexer::token & tok, const bool negative, T * out)
+    {
+        if (!tok.is_integer() || negative) { return false; }
+        if (out != nullptr) { *out = static_cast<T>(tok.as_uint64()); }
+        return true;
+    }
+};
+
+template<typename T>
+struct match_float_func final
+{
+    static bool convert(const lexer::token & tok, const bool negative, T * out)
+    {
+        // Same restrictions as lexer::scan_double().
+        constexpr auto bad_flags = (lexer::token::flags::binary      |
+                                    lexer::token::flags::octal       |
+                                    lexer::token::flags::hexadecimal |
+                                    lexer::token::flags::ip_address  |
+                                    lexer::token::flags::ip_port);
+
+        if (tok.get_flags() & bad_flags) { return false; }
+        if (out != nullptr) { *out = static_cast<T>(negative ? -tok.as_double() : tok.as_double()); }
+        return true;
+    }
+};
+
 // This is used by the matrix scanning methods.
 inline bool ignore_trailing_comma(lexer * lex, const int i, const int num)
 {
@@ -1006,17 +2245,6 @@ inline bool ignore_trailing_comma(lexer * lex, const int i, const int num)
 // lexer class inline methods:
 // ========================================================
 
-inline void lexer::set_flags(const std::uint32_t new_flags) noexcept
-{
-    m_flags = new_flags;
-}
-
-inline void lexer::set_line_number(const std::uint32_t new_line_num) noexcept
-{
-    m_line_num      = new_line_num;
-    m_last_line_num = new_line_num;
-}
-
 inline bool lexer::is_initialized() const noexcept
 {
     return m_initialized && m_script_ptr != nullptr;
@@ -1029,7 +2257,8 @@ inline bool lexer::is_at_end() const noexcept
 
 inline std::size_t lexer::get_allocated_bytes() const noexcept
 {
-    return m_allocated ? (m_script_length + 1) : 0;
+    return (m_allocated ? (m_script_length + 1) : 0) +
+           (m_structural_index.capacity() * sizeof(std::uint32_t));
 }
 
 inline std::size_t lexer::get_script_offset() const noexcept
@@ -1042,14 +2271,14 @@ inline std::size_t lexer::get_script_length() const noexcept
     return m_script_length;
 }
 
-inline std::uint32_t lexer::get_flags() const noexcept
+inline const char * lexer::get_script_start() const noexcept
 {
-    return m_flags;
+    return m_buffer_head_ptr;
 }
 
-inline std::uint32_t lexer::get_line_number() const noexcept
+inline std::uint32_t lexer::get_flags() const noexcept
 {
-    return m_line_num;
+    return m_flags;
 }
 
 inline std::uint32_t lexer::get_error_count() const noexcept
@@ -1077,6 +2306,53 @@ inline std::size_t lexer::get_last_whitespace_start() const noexcept
     return static_cast<std::size_t>(m_whitespace_start_ptr - m_buffer_head_ptr);
 }
 
+inline void lexer::set_instance_error_callbacks(error_callbacks * err_callbacks) noexcept
+{
+    m_instance_callbacks = err_callbacks;
+}
+
+inline lexer::error_callbacks * lexer::get_instance_error_callbacks() const noexcept
+{
+    return m_instance_callbacks;
+}
+
+inline bool lexer::set_memory_resource(memory_resource * resource) noexcept
+{
+    if (m_initialized)
+    {
+        return false;
+    }
+
+    m_memory_resource  = resource;
+    m_structural_index = structural_index_vector{ resource_allocator<std::uint32_t>{ resource } };
+    return true;
+}
+
+inline lexer::memory_resource * lexer::get_memory_resource() const noexcept
+{
+    return m_memory_resource;
+}
+
+inline void lexer::set_token_rules(const token_rules * rules) noexcept
+{
+    m_token_rules = rules;
+}
+
+inline const lexer::token_rules * lexer::get_token_rules() const noexcept
+{
+    return m_token_rules;
+}
+
+inline void lexer::set_comment_style(const comment_style * style) noexcept
+{
+    m_comment_style = style;
+}
+
+inline const lexer::comment_style * lexer::get_comment_style() const noexcept
+{
+    return m_comment_style;
+}
+
 inline std::size_t lexer::get_last_whitespace_end() const noexcept
 {
     return static_cast<std::size_t>(m_whitespace_end_ptr - m_buffer_head_ptr);
@@ -1117,13 +2393,73 @@ inline NumType lexer::scan_number()
     return scan_func::do_scan(this);
 }
 
-template<typename NumType>
-inline bool lexer::scan_matrix1d(const int x, NumType * out_mat,
-                                 const char * open_delim, const char * close_delim,
-                                 const bool comma_separated_values)
+inline bool lexer::text_view::operator == (const char * const str) const noexcept
 {
-    static_assert(std::is_floating_point<NumType>::value || std::is_integral<NumType>::value,
-                  "Floating-point or integer type required!");
+    LEXER_ASSERT(str != nullptr);
+    return std::char_traits<char>::length(str) == length &&
+           (length == 0 || std::char_traits<char>::compare(data, str, length) == 0);
+}
+
+template<typename... Elements>
+inline bool lexer::match(const Elements & ... elements)
+{
+    static_assert(sizeof...(Elements) != 0, "Empty pattern!");
+
+    match_state state;
+    token leftover;
+    internal_save_match_state(&state, &leftover);
+
+    token tok;
+    if (internal_match_elements(&tok, elements...))
+    {
+        return true;
+    }
+
+    internal_restore_match_state(state, &leftover);
+    return false;
+}
+
+template<typename First, typename... Rest>
+inline bool lexer::internal_match_elements(token * tok, const First & first, const Rest & ... rest)
+{
+    return internal_match_element(tok, first) && internal_match_elements(tok, rest...);
+}
+
+template<typename NumType>
+inline bool lexer::internal_match_element(token * tok, const match_number_element<NumType> & element)
+{
+    static_assert((std::is_floating_point<NumType>::value || std::is_integral<NumType>::value) &&
+                  !std::is_same<NumType, bool>::value, "Floating-point or integer type required!");
+
+    using match_sint_or_uint = typename std::conditional
+                               <
+                                   std::is_signed<NumType>::value,
+                                   lexer_detail::match_sint_func<NumType>,
+                                   lexer_detail::match_uint_func<NumType>
+                               >::type;
+
+    using match_func = typename std::conditional
+                               <
+                                   std::is_floating_point<NumType>::value,
+                                   lexer_detail::match_float_func<NumType>,
+                                   match_sint_or_uint
+                               >::type;
+
+    bool negative = false;
+    if (!internal_match_number(tok, &negative))
+    {
+        return false;
+    }
+    return match_func::convert(*tok, negative, element.out);
+}
+
+template<typename NumType>
+inline bool lexer::scan_matrix1d(const int x, NumType * out_mat,
+                                 const char * open_delim, const char * close_delim,
+                                 const bool comma_separated_values)
+{
+    static_assert(std::is_floating_point<NumType>::value || std::is_integral<NumType>::value,
+                  "Floating-point or integer type required!");
 
     LEXER_ASSERT(out_mat != nullptr);
 
@@ -1225,2154 +2561,5563 @@ inline bool lexer::is_punctuation_token(const token & tok, const punctuation_id
     return tok.is_punctuation() && (tok.get_flags() == static_cast<std::uint32_t>(id));
 }
 
-// ================== End of header file ==================
-#endif // LEXER_HPP
-// ================== End of header file ==================
-
-// ================================================================================================
-//
-//                                    Lexer Implementation
-//
-// ================================================================================================
-
-#ifdef LEXER_IMPLEMENTATION
+template<std::size_t MaxTokens>
+inline bool lexer::init_from_static_tokens(const char * ptr, const std::uint32_t length,
+                                           const static_token_array<MaxTokens> & tokens,
+                                           std::string filename, const std::uint32_t flags)
+{
+    return init_from_static_tokens(ptr, length, tokens.tokens, tokens.count,
+                                   tokens.flags, std::move(filename), flags);
+}
 
-#ifndef LEXER_NO_STD_INCLUDES
-    #include <cstdio>
-    #include <cstring>
-    #include <iostream>
-    #include <algorithm>
-#endif // LEXER_NO_STD_INCLUDES
+#if LEXER_STATIC_TOKENIZE
 
 // ========================================================
-// token class:
+// Compile-time tokenization:
 // ========================================================
 
-void lexer::token::update_cached_values() const noexcept
+namespace lexer_detail
 {
-    const char * p = m_string.c_str();
-    std::uint64_t new_u64_val = 0;
-    double new_double_val = 0.0;
 
-    if (m_flags & flags::floating_point)
+// These mirror the lexer::internal_read_*() methods for the input accepted
+// by lexer::static_tokenize(). Any change in how the runtime lexer scans
+// must be reflected here, or the replayed tokens will differ.
+
+constexpr bool static_is_digit(const char c) noexcept
+{
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool static_is_name_start(const char c) noexcept
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+// Returns the start of the next token, or the null terminator if none.
+// Returns null on a nested comment, since the runtime lexer warns about it.
+constexpr const char * static_skip_whitespace(const char * p) noexcept
+{
+    for (;;)
     {
-        // Floating point exceptions:
-        if (m_flags & (flags::infinite | flags::indefinite | flags::nan))
+        while (*p <= ' ')
         {
-            if (m_flags & flags::infinite) // 1.#INF
+            if (!*p)
             {
-                const std::uint32_t inf = 0x7F800000;
-                new_double_val = static_cast<double>(*reinterpret_cast<const float *>(&inf));
+                return p;
             }
-            else if (m_flags & flags::indefinite) // 1.#IND
+            ++p;
+        }
+
+        if (*p != '/')
+        {
+            return p;
+        }
+
+        if (*(p + 1) == '/')
+        {
+            for (p += 2; *p != '\n'; ++p)
             {
-                const std::uint32_t ind = 0xFFC00000;
-                new_double_val = static_cast<double>(*reinterpret_cast<const float *>(&ind));
+                if (!*p)
+                {
+                    return p;
+                }
             }
-            else if (m_flags & flags::nan) // 1.#NAN
+            ++p;
+        }
+        else if (*(p + 1) == '*')
+        {
+            for (++p; ; )
             {
-                const std::uint32_t nan = 0x7FC00000;
-                new_double_val = static_cast<double>(*reinterpret_cast<const float *>(&nan));
+                ++p;
+                if (!*p)
+                {
+                    return p;
+                }
+                if (*p == '/')
+                {
+                    if (*(p - 1) == '*')
+                    {
+                        break;
+                    }
+                    if (*(p + 1) == '*')
+                    {
+                        return nullptr;
+                    }
+                }
             }
+            ++p;
         }
         else
         {
-            double m;
+            return p;
+        }
+    }
+}
 
-            while (*p && *p != '.' && *p != 'e')
+struct static_number final
+{
+    const char *  end      = nullptr; // Past the suffixes. Null if not handled at compile time.
+    const char *  text_end = nullptr; // Past the digits; suffixes are not part of the token text.
+    std::uint32_t flags    = 0;
+};
+
+constexpr static_number static_scan_number(const char * p) noexcept
+{
+    using tf = lexer::token::flags;
+    static_number number;
+
+    if (*p == '0' && *(p + 1) != '.')
+    {
+        if (*(p + 1) == 'x' || *(p + 1) == 'X')
+        {
+            p += 2;
+            while (static_is_digit(*p) || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F'))
             {
-                new_double_val = new_double_val * 10.0 + (static_cast<double>(*p - '0'));
                 ++p;
             }
-
-            if (*p == '.')
+            number.flags = tf::hexadecimal | tf::integer;
+        }
+        else if (*(p + 1) == 'b' || *(p + 1) == 'B')
+        {
+            p += 2;
+            while (*p == '0' || *p == '1')
+            {
+                ++p;
+            }
+            number.flags = tf::binary | tf::integer;
+        }
+        else
+        {
+            ++p;
+            while (*p >= '0' && *p <= '7')
             {
                 ++p;
-                for (m = 0.1; *p && *p != 'e'; ++p)
-                {
-                    new_double_val = new_double_val + (static_cast<double>(*p - '0')) * m;
-                    m *= 0.1;
-                }
             }
+            number.flags = tf::octal | tf::integer;
+        }
+    }
+    else
+    {
+        int dot = 0;
+        for (; static_is_digit(*p) || *p == '.'; ++p)
+        {
+            dot += (*p == '.');
+        }
 
-            if (*p == 'e')
+        if (*p == 'e' && dot == 0)
+        {
+            ++dot;
+        }
+
+        if (dot == 1)
+        {
+            // Float exceptions like 1.#INF are errors by default.
+            if (*p == '#')
             {
-                bool div;
+                return number;
+            }
 
+            number.flags = tf::decimal | tf::floating_point;
+            if (*p == 'e')
+            {
                 ++p;
-                if (*p == '-')
+                if (*p == '-' || *p == '+')
                 {
-                    div = true;
                     ++p;
                 }
-                else if (*p == '+')
+                while (static_is_digit(*p))
                 {
-                    div = false;
                     ++p;
                 }
-                else
-                {
-                    div = false;
-                }
-
-                int i, pow;
-                for (pow = 0; *p; ++p)
-                {
-                    pow = pow * 10 + (static_cast<int>(*p - '0'));
-                }
-                for (m = 1.0, i = 0; i < pow; ++i)
-                {
-                    m *= 10.0;
-                }
-
-                if (div)
-                {
-                    new_double_val /= m;
-                }
-                else
-                {
-                    new_double_val *= m;
-                }
             }
         }
-        new_u64_val = static_cast<std::uint64_t>(new_double_val);
+        else if (dot > 1) // IP addresses
+        {
+            return number;
+        }
+        else
+        {
+            number.flags = tf::decimal | tf::integer;
+        }
     }
-    else if (m_flags & flags::decimal) // Decimal integer number
+
+    number.text_end = p;
+
+    if (number.flags & tf::floating_point)
     {
-        while (*p != '\0')
+        if (*p == 'f' || *p == 'F')
         {
-            new_u64_val = new_u64_val * 10 + (*p - '0');
+            number.flags |= tf::single_precision;
             ++p;
         }
-        new_double_val = static_cast<double>(new_u64_val);
-    }
-    else if (m_flags & flags::octal) // Octal integer
-    {
-        ++p; // Step over the first zero
-        while (*p != '\0')
+        else if (*p == 'l' || *p == 'L')
         {
-            new_u64_val = (new_u64_val << 3) + (*p - '0');
+            number.flags |= tf::extended_precision;
             ++p;
         }
-        new_double_val = static_cast<double>(new_u64_val);
+        else
+        {
+            number.flags |= tf::double_precision;
+        }
     }
-    else if (m_flags & flags::hexadecimal) // Hexadecimal integer
+    else
     {
-        p += 2; // Step over the leading 0x or 0X
-        while (*p != '\0')
+        std::uint32_t int_flag = tf::signed_integer;
+        for (int i = 0; i < 2; ++i, ++p)
         {
-            new_u64_val <<= 4;
-            if (*p >= 'a' && *p <= 'f')
-            {
-                new_u64_val += *p - 'a' + 10;
-            }
-            else if (*p >= 'A' && *p <= 'F')
+            if (*p == 'u' || *p == 'U')
             {
-                new_u64_val += *p - 'A' + 10;
+                int_flag = tf::unsigned_integer;
             }
-            else
+            else if (*p != 'l' && *p != 'L')
             {
-                new_u64_val += *p - '0';
+                break;
             }
-            ++p;
         }
-        new_double_val = static_cast<double>(new_u64_val);
+        number.flags |= int_flag;
     }
-    else if (m_flags & flags::binary) // Binary integer number
+
+    number.end = p;
+    return number;
+}
+
+// Length of the longest default punctuation at 'p', zero if none.
+constexpr std::size_t static_match_punctuation(const char * const p, lexer::punctuation_id * out_id) noexcept
+{
+    std::size_t longest = 0;
+    for (std::size_t i = 1; i < lexer::default_punctuations_size; ++i)
     {
-        p += 2; // Step over the leading 0b or 0B
-        while (*p != '\0')
+        const char * const str = lexer::default_punctuations[i].str;
+        std::size_t len = 0;
+        while (str[len] != '\0' && str[len] == p[len])
         {
-            new_u64_val = (new_u64_val << 1) + (*p - '0');
-            ++p;
+            ++len;
+        }
+        if (str[len] == '\0' && len > longest)
+        {
+            longest = len;
+            *out_id = lexer::default_punctuations[i].id;
         }
-        new_double_val = static_cast<double>(new_u64_val);
     }
-    else if (m_flags & flags::ip_address)
+    return longest;
+}
+
+} // namespace lexer_detail {}
+
+template<std::size_t MaxTokens>
+constexpr lexer::static_token_array<MaxTokens> lexer::static_tokenize(const char * const script, const std::uint32_t lex_flags) noexcept
+{
+    static_assert(MaxTokens > 0, "static_tokenize() needs room for at least one token!");
+
+    constexpr std::uint32_t supported_flags =
+        flags::no_string_concat | flags::no_string_escape_chars | flags::allow_multi_char_literals;
+
+    static_token_array<MaxTokens> result;
+    result.flags = lex_flags;
+
+    if ((lex_flags & static_token_scan_flags) & ~supported_flags)
     {
-        std::uint32_t ip[5] = {0}; // 4 octets + port number
+        return result;
+    }
 
-        for (int i = 0; *p != '\0'; ++p)
+    const char * p = script;
+    for (;;)
+    {
+        p = lexer_detail::static_skip_whitespace(p);
+        if (p == nullptr)
         {
-            if (*p == '.' || *p == ':')
+            return result;
+        }
+        if (*p == '\0')
+        {
+            result.complete = true;
+            return result;
+        }
+        if (result.count == MaxTokens)
+        {
+            return result;
+        }
+
+        static_token tok;
+        tok.start = static_cast<std::uint32_t>(p - script);
+
+        if (lexer_detail::static_is_digit(*p) || (*p == '.' && lexer_detail::static_is_digit(*(p + 1))))
+        {
+            const lexer_detail::static_number number = lexer_detail::static_scan_number(p);
+            if (number.end == nullptr)
             {
-                ++i;
-                continue;
+                return result;
             }
-            ip[i] = ip[i] * 10 + (*p - '0');
+            tok.type        = token::type::number;
+            tok.flags       = number.flags;
+            tok.text_start  = tok.start;
+            tok.text_length = static_cast<std::uint32_t>(number.text_end - p);
+            p = number.end;
         }
+        else if (*p == '\'' || *p == '"')
+        {
+            const char quote = *p++;
+            std::uint32_t length = 0;
 
-        const std::uint64_t ip_word   = (ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3];
-        const std::uint64_t port_word = ip[4];
+            tok.type       = (quote == '"') ? token::type::string : token::type::literal;
+            tok.text_start = static_cast<std::uint32_t>(p - script);
 
-        new_u64_val    = (port_word << 32) | ip_word;
-        new_double_val = static_cast<double>(new_u64_val);
-    }
-    else if (m_flags & flags::boolean) // Boolean literal
-    {
-        if (std::strcmp(p, "true") == 0)
-        {
-            new_u64_val = 1;
-        }
-        new_double_val = static_cast<double>(new_u64_val);
-    }
+            for (;;)
+            {
+                if (*p == '\\' && !(lex_flags & flags::no_string_escape_chars))
+                {
+                    // Decoded at runtime. Just find the end of the string.
+                    const char c = *(p + 1);
+                    if (c != '0' && c != 'n' && c != 'r' && c != 't' && c != 'v' && c != 'b' && c != 'f' && c != 'a' &&
+                        c != '\\' && c != '\'' && c != '"' && c != '?' && c != 'x' && !lexer_detail::static_is_digit(c))
+                    {
+                        return result;
+                    }
+                    tok.rescan = true;
+                    p += 2;
+                }
+                else if (*p == quote)
+                {
+                    ++p;
+                    if (lex_flags & flags::no_string_concat)
+                    {
+                        break;
+                    }
 
-    // Save the newly computed values and set the ready flag:
-    m_u64_value    = new_u64_val;
-    m_double_value = new_double_val;
-    m_values_valid = true;
-}
+                    // Consecutive strings are concatenated at runtime.
+                    const char * const next = lexer_detail::static_skip_whitespace(p);
+                    if (next == nullptr)
+                    {
+                        return result;
+                    }
+                    if (*next != quote)
+                    {
+                        break;
+                    }
+                    tok.rescan = true;
+                    p = next + 1;
+                }
+                else if (*p == '\0' || *p == '\n')
+                {
+                    return result;
+                }
+                else
+                {
+                    ++p;
+                    ++length;
+                }
+            }
 
-lexer::token lexer::token::stringize() const
-{
-    // Flags the token as a string for the C preprocessor stringizing operator (#)
-    // and adds double quotes as needed.
-    token str_token;
+            if (quote == '\'' && !tok.rescan && length > 1 && !(lex_flags & flags::allow_multi_char_literals))
+            {
+                return result;
+            }
+            tok.text_length = length;
+        }
+        else if (lexer_detail::static_is_name_start(*p))
+        {
+            while (lexer_detail::static_is_name_start(*p) || lexer_detail::static_is_digit(*p))
+            {
+                ++p;
+            }
 
-    str_token.m_type          = type::string;
-    str_token.m_line_num      = m_line_num;
-    str_token.m_lines_crossed = m_lines_crossed;
+            const char * const name = script + tok.start;
+            const std::uint32_t length = static_cast<std::uint32_t>(p - name);
+            const bool is_true  = (length == 4 && name[0] == 't' && name[1] == 'r' && name[2] == 'u' && name[3] == 'e');
+            const bool is_false = (length == 5 && name[0] == 'f' && name[1] == 'a' && name[2] == 'l' && name[3] == 's' && name[4] == 'e');
 
-    if (!m_string.empty() && m_string[0] == '"')
-    {
-        str_token.m_string.push_back('"');
-        str_token.m_string.push_back('\\');
-        str_token.m_string.append(m_string);
-        lexer::rtrim_string(&str_token.m_string);
-        str_token.m_string.back() = '\\';
-        str_token.m_string.push_back('"');
-        str_token.m_string.push_back('"');
-    }
-    else
-    {
-        str_token.m_string.push_back('"');
-        str_token.m_string.append(m_string);
-        lexer::rtrim_string(&str_token.m_string);
-        str_token.m_string.push_back('"');
-    }
+            tok.type        = token::type::identifier;
+            tok.flags       = (is_true || is_false) ? token::flags::boolean : 0;
+            tok.text_start  = tok.start;
+            tok.text_length = length;
+        }
+        else
+        {
+            punctuation_id id = punctuation_id::none;
+            const std::size_t length = lexer_detail::static_match_punctuation(p, &id);
+            if (length == 0)
+            {
+                return result;
+            }
+            tok.type        = token::type::punctuation;
+            tok.flags       = static_cast<std::uint32_t>(id);
+            tok.text_start  = tok.start;
+            tok.text_length = static_cast<std::uint32_t>(length);
+            p += length;
+        }
 
-    return str_token;
+        tok.end = static_cast<std::uint32_t>(p - script);
+        result.tokens[result.count++] = tok;
+    }
 }
 
-lexer::token lexer::token::trim() const
-{
-    token t{ *this };
-    lexer::trim_string(&t.m_string);
-    return t;
-}
+#endif // LEXER_STATIC_TOKENIZE
 
-std::string lexer::token::type_string(const token::type type)
-{
-    std::string out;
-    switch (type)
-    {
-    case token::type::number      : { out = "number";      break; }
-    case token::type::string      : { out = "string";      break; }
-    case token::type::literal     : { out = "literal";     break; }
-    case token::type::identifier  : { out = "identifier";  break; }
-    case token::type::punctuation : { out = "punctuation"; break; }
-    default                       : { out = "(unknown)";   break; }
-    } // switch (type)
-    return out;
-}
+// ================== End of header file ==================
+#endif // LEXER_HPP
+// ================== End of header file ==================
 
-std::string lexer::token::flags_string(const std::uint32_t flags, const bool is_punct)
-{
-    std::string out;
+// ================================================================================================
+//
+//                                    Lexer Implementation
+//
+// ================================================================================================
 
-    // When a punctuation token, we actually steal the flags to store the punctuation_id!
-    if (is_punct)
-    {
-        out = lexer::get_punctuation_from_id(static_cast<punctuation_id>(flags));
-        return out;
-    }
+#ifdef LEXER_IMPLEMENTATION
 
-    if (flags & token::flags::infinite)           { out += "infinite ";           }
-    if (flags & token::flags::indefinite)         { out += "indefinite ";         }
-    if (flags & token::flags::nan)                { out += "nan ";                }
-    if (flags & token::flags::binary)             { out += "binary ";             }
-    if (flags & token::flags::octal)              { out += "octal ";              }
-    if (flags & token::flags::decimal)            { out += "decimal ";            }
-    if (flags & token::flags::hexadecimal)        { out += "hexadecimal ";        }
-    if (flags & token::flags::signed_integer)     { out += "signed ";             }
-    if (flags & token::flags::unsigned_integer)   { out += "unsigned ";           }
-    if (flags & token::flags::single_precision)   { out += "single-precision ";   }
-    if (flags & token::flags::double_precision)   { out += "double-precision ";   }
-    if (flags & token::flags::extended_precision) { out += "extended-precision "; }
-    if (flags & token::flags::integer)            { out += "integer ";            }
-    if (flags & token::flags::floating_point)     { out += "float ";              }
-    if (flags & token::flags::boolean)            { out += "boolean ";            }
-    if (flags & token::flags::ip_address)         { out += "IP address ";         }
-    if (flags & token::flags::ip_port)            { out += "IP port ";            }
+#ifndef LEXER_NO_STD_INCLUDES
+    #include <cstdio>
+    #include <cstring>
+    #include <iostream>
+    #include <algorithm>
+    #include <iterator>
+    #include <map>
+    #ifndef LEXER_NO_THREADS
+        #include <atomic>
+        #include <thread>
+    #endif // LEXER_NO_THREADS
+#endif // LEXER_NO_STD_INCLUDES
 
-    lexer::rtrim_string(&out);
-    return out;
-}
+#if !defined(LEXER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    #define LEXER_USE_SSE2
+    #include <emmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif // _MSC_VER
+#endif // !LEXER_NO_SIMD && SSE2
 
 // ========================================================
-// lexer class:
+// Bulk scanning helpers:
 // ========================================================
 
-lexer::lexer(lexer && other) noexcept
-    : m_buffer_head_ptr      { other.m_buffer_head_ptr           }
-    , m_script_ptr           { other.m_script_ptr                }
-    , m_end_ptr              { other.m_end_ptr                   }
-    , m_last_script_ptr      { other.m_last_script_ptr           }
-    , m_whitespace_start_ptr { other.m_whitespace_start_ptr      }
-    , m_whitespace_end_ptr   { other.m_whitespace_end_ptr        }
-    , m_flags                { other.m_flags                     }
-    , m_last_line_num        { other.m_last_line_num             }
-    , m_line_num             { other.m_line_num                  }
-    , m_script_length        { other.m_script_length             }
-    , m_error_count          { other.m_error_count               }
-    , m_warn_count           { other.m_warn_count                }
-    , m_leftover_token       { std::move(other.m_leftover_token) }
-    , m_filename             { std::move(other.m_filename)       }
-    , m_token_available      { other.m_token_available           }
-    , m_initialized          { other.m_initialized               }
-    , m_allocated            { other.m_allocated                 }
+namespace lexer_detail
 {
-    other.m_buffer_head_ptr = nullptr;
-    other.m_allocated       = false;
-    other.clear();
-}
 
-lexer & lexer::operator = (lexer && other) noexcept
+inline unsigned count_trailing_zeros(std::uint32_t mask) noexcept
 {
-    m_buffer_head_ptr      = other.m_buffer_head_ptr;
-    m_script_ptr           = other.m_script_ptr;
-    m_end_ptr              = other.m_end_ptr;
-    m_last_script_ptr      = other.m_last_script_ptr;
-    m_whitespace_start_ptr = other.m_whitespace_start_ptr;
-    m_whitespace_end_ptr   = other.m_whitespace_end_ptr;
-    m_flags                = other.m_flags;
-    m_last_line_num        = other.m_last_line_num;
-    m_line_num             = other.m_line_num;
-    m_script_length        = other.m_script_length;
-    m_error_count          = other.m_error_count;
-    m_warn_count           = other.m_warn_count;
-    m_leftover_token       = std::move(other.m_leftover_token);
-    m_filename             = std::move(other.m_filename);
-    m_token_available      = other.m_token_available;
-    m_initialized          = other.m_initialized;
-    m_allocated            = other.m_allocated;
-
-    other.m_buffer_head_ptr = nullptr;
-    other.m_allocated       = false;
-    other.clear();
-
-    return *this;
+    LEXER_ASSERT(mask != 0);
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else // Portable fallback
+    unsigned index = 0;
+    for (; !(mask & 1); mask >>= 1)
+    {
+        ++index;
+    }
+    return index;
+#endif // __GNUC__ || __clang__
 }
 
-lexer::lexer(std::string filename, const std::uint32_t flags)
+// Number of '\n' characters in the [begin, end) range.
+inline std::uint32_t count_newlines(const char * begin, const char * const end) noexcept
 {
-    init_from_file(std::move(filename), flags);
-}
+    std::uint32_t count = 0;
 
-lexer::lexer(const char * ptr, const std::uint32_t length, std::string filename,
-             const std::uint32_t flags, const std::uint32_t starting_line)
-{
-    init_from_memory(ptr, length, std::move(filename), flags, starting_line);
-}
+#ifdef LEXER_USE_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero    = _mm_setzero_si128();
 
-lexer::~lexer()
-{
-    if (m_allocated && m_buffer_head_ptr != nullptr)
+    while ((end - begin) >= 16)
     {
-        delete[] m_buffer_head_ptr;
-    }
-}
+        // Each 8-bit lane can accumulate up to 255 matches before we have to fold them.
+        const std::ptrdiff_t blocks = std::min<std::ptrdiff_t>((end - begin) / 16, 255);
+        const char * const blocks_end = begin + (blocks * 16);
 
-bool lexer::init_from_file(std::string filename, const std::uint32_t flags, const bool silent)
-{
-    if (filename.empty())
-    {
-        return (!silent ? error("lexer::init_from_file() -> no filename provided!") : false);
-    }
+        __m128i counters = zero;
+        for (; begin != blocks_end; begin += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(chunk, newline)); // Matches are -1
+        }
 
-    if (m_initialized)
-    {
-        return (!silent ? error("lexer::init_from_file() -> another script is already loaded!") : false);
+        const __m128i sums = _mm_sad_epu8(counters, zero);
+        count += static_cast<std::uint32_t>(_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4));
     }
+#endif // LEXER_USE_SSE2
 
-    char * file_contents;
-    std::uint32_t file_length;
-
-    if (!load_text_file(filename, &file_contents, &file_length))
+    for (; begin < end; ++begin)
     {
-        return (!silent ? error("lexer::init_from_file() -> failed to load text file \"" + filename + "\".") : false);
+        count += (*begin == '\n');
     }
+    return count;
+}
 
-    m_filename        = std::move(filename);
-    m_buffer_head_ptr = file_contents;
-    m_script_length   = file_length;
-    m_script_ptr      = m_buffer_head_ptr;
-    m_last_script_ptr = m_buffer_head_ptr;
-    m_end_ptr         = &m_buffer_head_ptr[file_length];
-    m_line_num        = 1;
-    m_last_line_num   = 1;
-    m_flags           = flags;
-    m_allocated       = true;
-    m_initialized     = true;
-
-    return true;
+// Characters that can change the state of the structural_scanner below.
+inline bool is_structural_candidate(const char c) noexcept
+{
+    switch (c)
+    {
+    case '{'  : case '}' : case '(' : case ')' : case ';' :
+    case '\"' : case '\'' : case '/' : case '*' : case '\\' : case '\n' :
+        return true;
+    default :
+        return false;
+    } // switch (c)
 }
 
-bool lexer::init_from_memory(const char * ptr, const std::uint32_t length, std::string filename,
-                             const std::uint32_t flags, const std::uint32_t starting_line)
+//
+// Tracks strings and comments while the candidate characters of a script are
+// fed in order, recording the structural characters found outside of them.
+// Must follow the same rules used by lexer::internal_read_whitespace() and
+// lexer::internal_read_string().
+//
+template<typename OffsetVector>
+class structural_scanner final
 {
-    LEXER_ASSERT(ptr != nullptr);
+public:
 
-    if (m_initialized)
-    {
-        return error("lexer::init_from_memory() -> another script is already loaded!");
-    }
+    structural_scanner(const char * const buffer, const bool escape_chars, OffsetVector * const offsets) noexcept
+        : m_buffer{ buffer }
+        , m_resume_ptr{ buffer }
+        , m_offsets{ offsets }
+        , m_escape_chars{ escape_chars }
+    { }
 
-    m_filename = std::move(filename);
-    if (m_filename.empty())
+    void feed(const char * const p)
     {
-        m_filename = "(memory)";
-    }
-
-    // Note that in this case, we DO NOT take ownership of the input buffer!
-    m_buffer_head_ptr = ptr;
-    m_script_length   = length;
-    m_script_ptr      = m_buffer_head_ptr;
-    m_last_script_ptr = m_buffer_head_ptr;
-    m_end_ptr         = &m_buffer_head_ptr[length];
-    m_line_num        = starting_line;
-    m_last_line_num   = starting_line;
-    m_flags           = flags;
-    m_allocated       = false;
-    m_initialized     = true;
+        if (p < m_resume_ptr) // Consumed by a previous character, e.g. escaped or a comment opener.
+        {
+            return;
+        }
 
-    return true;
-}
-
-void lexer::clear() noexcept
-{
-    free_script_source();
-    m_error_count = 0;
-    m_warn_count  = 0;
-    m_filename.clear();
-    // Note: m_flags remain unchanged.
-}
+        const char c = *p;
+        switch (m_state)
+        {
+        case state::code :
+            if (c == '"' || c == '\'')
+            {
+                m_quote = c;
+                m_state = state::string;
+            }
+            else if (c == '/')
+            {
+                if (p[1] == '/')
+                {
+                    m_state = state::line_comment;
+                    m_resume_ptr = p + 2;
+                }
+                else if (p[1] == '*')
+                {
+                    // The opener's '*' is fed again, since it can also close the comment, as in "/*/".
+                    m_state = state::block_comment;
+                    m_resume_ptr = p + 1;
+                }
+            }
+            else if (c != '*' && c != '\\' && c != '\n')
+            {
+                m_offsets->push_back(static_cast<std::uint32_t>(p - m_buffer));
+            }
+            break;
 
-void lexer::reset() noexcept
-{
-    m_script_ptr           = m_buffer_head_ptr;
-    m_last_script_ptr      = m_buffer_head_ptr;
-    m_whitespace_start_ptr = nullptr;
-    m_whitespace_end_ptr   = nullptr;
-    m_last_line_num        = 1;
-    m_line_num             = 1;
-    m_error_count          = 0;
-    m_warn_count           = 0;
-    m_token_available      = false;
+        case state::string :
+            if (c == '\\' && m_escape_chars)
+            {
+                m_resume_ptr = p + 2;
+            }
+            else if (c == m_quote || c == '\n') // The lexer errors on the newline, so resync after it.
+            {
+                m_state = state::code;
+            }
+            break;
 
-    m_leftover_token.clear();
-}
+        case state::line_comment :
+            if (c == '\n')
+            {
+                m_state = state::code;
+            }
+            break;
 
-void lexer::free_script_source() noexcept
-{
-    if (m_allocated && m_buffer_head_ptr != nullptr)
-    {
-        delete[] m_buffer_head_ptr;
+        case state::block_comment :
+            if (c == '*' && p[1] == '/')
+            {
+                m_state = state::code;
+                m_resume_ptr = p + 2;
+            }
+            break;
+        } // switch (m_state)
     }
 
-    m_buffer_head_ptr      = nullptr;
-    m_script_ptr           = nullptr;
-    m_end_ptr              = nullptr;
-    m_last_script_ptr      = nullptr;
-    m_whitespace_start_ptr = nullptr;
-    m_whitespace_end_ptr   = nullptr;
-    m_last_line_num        = 0;
-    m_line_num             = 0;
-    m_script_length        = 0;
-    m_token_available      = false;
-    m_initialized          = false;
-    m_allocated            = false;
-
-    m_leftover_token.clear();
-}
+private:
 
-bool lexer::error(const std::string & message)
-{
-    ++m_error_count;
-    if (m_flags & flags::no_errors)
+    enum class state
     {
-        return false;
-    }
+        code,
+        string,
+        line_comment,
+        block_comment
+    };
 
-    // When using the ANSI color codes the "error" tag prints in red.
-#ifdef LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
-    const std::string err_tag = "\033[31;1m error: \033[0;1m";
-#else // !LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
-    const std::string err_tag = " error: ";
-#endif // LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
+    const char * const                 m_buffer;
+    const char *                       m_resume_ptr;
+    OffsetVector * const               m_offsets;
+    state                              m_state = state::code;
+    char                               m_quote = '\0';
+    const bool                         m_escape_chars;
+};
 
-    const std::string error_str = get_filename() + "(" + std::to_string(m_last_line_num) + "):" + err_tag + message;
-    const bool is_fatal_error = !(m_flags & flags::no_fatal_errors);
-    m_error_callbacks->error(error_str, is_fatal_error);
+} // namespace lexer_detail {}
 
-    // Always returns false so we can write 'return error("foobar");' on methods returning boolean.
-    return false;
-}
+// ========================================================
+// token class:
+// ========================================================
 
-void lexer::warning(const std::string & message)
+void lexer::token::update_cached_values() const noexcept
 {
-    ++m_warn_count;
-    if (m_flags & flags::no_warnings)
+    const char * p = m_string.c_str();
+    std::uint64_t new_u64_val = 0;
+    double new_double_val = 0.0;
+
+    if (m_flags & flags::floating_point)
     {
-        return;
-    }
+        // Floating point exceptions:
+        if (m_flags & (flags::infinite | flags::indefinite | flags::nan))
+        {
+            if (m_flags & flags::infinite) // 1.#INF
+            {
+                const std::uint32_t inf = 0x7F800000;
+                new_double_val = static_cast<double>(*reinterpret_cast<const float *>(&inf));
+            }
+            else if (m_flags & flags::indefinite) // 1.#IND
+            {
+                const std::uint32_t ind = 0xFFC00000;
+                new_double_val = static_cast<double>(*reinterpret_cast<const float *>(&ind));
+            }
+            else if (m_flags & flags::nan) // 1.#NAN
+            {
+                const std::uint32_t nan = 0x7FC00000;
+                new_double_val = static_cast<double>(*reinterpret_cast<const float *>(&nan));
+            }
+        }
+        else
+        {
+            double m;
 
-    // When using the ANSI color codes the "warning" tag prints in magenta.
-#ifdef LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
-    const std::string warn_tag = "\033[35;1m warning: \033[0;1m";
-#else // !LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
-    const std::string warn_tag = " warning: ";
-#endif // LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
+            while (*p && *p != '.' && *p != 'e')
+            {
+                new_double_val = new_double_val * 10.0 + (static_cast<double>(*p - '0'));
+                ++p;
+            }
 
-    const std::string warn_str = get_filename() + "(" + std::to_string(m_last_line_num) + "):" + warn_tag + message;
-    m_error_callbacks->warning(warn_str);
-}
+            if (*p == '.')
+            {
+                ++p;
+                for (m = 0.1; *p && *p != 'e'; ++p)
+                {
+                    new_double_val = new_double_val + (static_cast<double>(*p - '0')) * m;
+                    m *= 0.1;
+                }
+            }
 
-bool lexer::load_text_file(const std::string & filename, char ** out_file_contents, std::uint32_t * out_file_length)
-{
-    LEXER_ASSERT(!filename.empty());
-    LEXER_ASSERT(out_file_contents != nullptr);
-    LEXER_ASSERT(out_file_length   != nullptr);
+            if (*p == 'e')
+            {
+                bool div;
 
-    FILE * file_in;
+                ++p;
+                if (*p == '-')
+                {
+                    div = true;
+                    ++p;
+                }
+                else if (*p == '+')
+                {
+                    div = false;
+                    ++p;
+                }
+                else
+                {
+                    div = false;
+                }
 
-#ifdef _MSC_VER
-    if (fopen_s(&file_in, filename.c_str(), "rb") != 0)
+                int i, pow;
+                for (pow = 0; *p; ++p)
+                {
+                    pow = pow * 10 + (static_cast<int>(*p - '0'));
+                }
+                for (m = 1.0, i = 0; i < pow; ++i)
+                {
+                    m *= 10.0;
+                }
+
+                if (div)
+                {
+                    new_double_val /= m;
+                }
+                else
+                {
+                    new_double_val *= m;
+                }
+            }
+        }
+        new_u64_val = static_cast<std::uint64_t>(new_double_val);
+    }
+    else if (m_flags & flags::decimal) // Decimal integer number
     {
-        return false;
+        while (*p != '\0')
+        {
+            new_u64_val = new_u64_val * 10 + (*p - '0');
+            ++p;
+        }
+        new_double_val = static_cast<double>(new_u64_val);
     }
-#else // !_MSC_VER
-    if ((file_in = std::fopen(filename.c_str(), "rb")) == nullptr)
+    else if (m_flags & flags::octal) // Octal integer
     {
-        return false;
+        ++p; // Step over the first zero
+        while (*p != '\0')
+        {
+            new_u64_val = (new_u64_val << 3) + (*p - '0');
+            ++p;
+        }
+        new_double_val = static_cast<double>(new_u64_val);
     }
-#endif // _MSC_VER
-
-    std::fseek(file_in, 0, SEEK_END);
-    const auto file_length = std::ftell(file_in);
-    std::fseek(file_in, 0, SEEK_SET);
-
-    if (file_length <= 0 || std::ferror(file_in))
+    else if (m_flags & flags::hexadecimal) // Hexadecimal integer
     {
-        std::fclose(file_in);
-        return false;
+        p += 2; // Step over the leading 0x or 0X
+        while (*p != '\0')
+        {
+            new_u64_val <<= 4;
+            if (*p >= 'a' && *p <= 'f')
+            {
+                new_u64_val += *p - 'a' + 10;
+            }
+            else if (*p >= 'A' && *p <= 'F')
+            {
+                new_u64_val += *p - 'A' + 10;
+            }
+            else
+            {
+                new_u64_val += *p - '0';
+            }
+            ++p;
+        }
+        new_double_val = static_cast<double>(new_u64_val);
     }
-
-    auto file_contents = new char[file_length + 1];
-    if (std::fread(file_contents, 1, file_length, file_in) != static_cast<std::size_t>(file_length))
+    else if (m_flags & flags::binary) // Binary integer number
     {
-        delete[] file_contents;
-        std::fclose(file_in);
-        return false;
+        p += 2; // Step over the leading 0b or 0B
+        while (*p != '\0')
+        {
+            new_u64_val = (new_u64_val << 1) + (*p - '0');
+            ++p;
+        }
+        new_double_val = static_cast<double>(new_u64_val);
     }
+    else if (m_flags & flags::ip_address)
+    {
+        std::uint32_t ip[5] = {0}; // 4 octets + port number
 
-    file_contents[file_length] = '\0';
-    std::fclose(file_in);
+        for (int i = 0; *p != '\0'; ++p)
+        {
+            if (*p == '.' || *p == ':')
+            {
+                ++i;
+                continue;
+            }
+            ip[i] = ip[i] * 10 + (*p - '0');
+        }
 
-    *out_file_contents = file_contents;
-    *out_file_length   = file_length;
-    return true;
+        const std::uint64_t ip_word   = (ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3];
+        const std::uint64_t port_word = ip[4];
+
+        new_u64_val    = (port_word << 32) | ip_word;
+        new_double_val = static_cast<double>(new_u64_val);
+    }
+    else if (m_flags & flags::boolean) // Boolean literal
+    {
+        if (std::strcmp(p, "true") == 0)
+        {
+            new_u64_val = 1;
+        }
+        new_double_val = static_cast<double>(new_u64_val);
+    }
+
+    // Save the newly computed values and set the ready flag:
+    m_u64_value    = new_u64_val;
+    m_double_value = new_double_val;
+    m_values_valid = true;
 }
 
-bool lexer::next_token(token * out_token)
+lexer::token lexer::token::stringize() const
 {
-    LEXER_ASSERT(out_token != nullptr);
+    // Flags the token as a string for the C preprocessor stringizing operator (#)
+    // and adds double quotes as needed.
+    token str_token;
 
-    if (!is_initialized())
+    str_token.m_type          = type::string;
+    str_token.m_line_num      = m_line_num;
+    str_token.m_lines_crossed = m_lines_crossed;
+
+    if (!m_string.empty() && m_string[0] == '"')
     {
-        return error("lexer not properly initialized; no script loaded!");
+        str_token.m_string.push_back('"');
+        str_token.m_string.push_back('\\');
+        str_token.m_string.append(m_string);
+        lexer::rtrim_string(&str_token.m_string);
+        str_token.m_string.back() = '\\';
+        str_token.m_string.push_back('"');
+        str_token.m_string.push_back('"');
     }
-
-    // If there is a token available (from unget_token)...
-    if (m_token_available)
+    else
     {
-        *out_token = std::move(m_leftover_token);
-        m_token_available = false;
-        return true;
+        str_token.m_string.push_back('"');
+        str_token.m_string.append(m_string);
+        lexer::rtrim_string(&str_token.m_string);
+        str_token.m_string.push_back('"');
     }
 
-    // Save script & line pointers:
-    m_last_line_num        = m_line_num;
-    m_last_script_ptr      = m_script_ptr;
-    m_whitespace_start_ptr = m_script_ptr;
+    return str_token;
+}
 
-    if (!internal_read_whitespace())
+lexer::token lexer::token::trim() const
+{
+    token t{ *this };
+    lexer::trim_string(&t.m_string);
+    t.m_values_valid = false;
+    t.m_hash_valid   = false;
+    return t;
+}
+
+std::string lexer::token::type_string(const token::type type)
+{
+    std::string out;
+    switch (type)
     {
-        return false;
+    case token::type::number      : { out = "number";      break; }
+    case token::type::string      : { out = "string";      break; }
+    case token::type::literal     : { out = "literal";     break; }
+    case token::type::identifier  : { out = "identifier";  break; }
+    case token::type::punctuation : { out = "punctuation"; break; }
+    case token::type::custom      : { out = "custom";      break; }
+    default                       : { out = "(unknown)";   break; }
+    } // switch (type)
+    return out;
+}
+
+std::string lexer::token::flags_string(const std::uint32_t flags, const bool is_punct)
+{
+    std::string out;
+
+    // When a punctuation token, we actually steal the flags to store the punctuation_id!
+    if (is_punct)
+    {
+        out = lexer::get_punctuation_from_id(static_cast<punctuation_id>(flags));
+        return out;
     }
 
-    m_whitespace_end_ptr = m_script_ptr;
+    if (flags & token::flags::infinite)           { out += "infinite ";           }
+    if (flags & token::flags::indefinite)         { out += "indefinite ";         }
+    if (flags & token::flags::nan)                { out += "nan ";                }
+    if (flags & token::flags::binary)             { out += "binary ";             }
+    if (flags & token::flags::octal)              { out += "octal ";              }
+    if (flags & token::flags::decimal)            { out += "decimal ";            }
+    if (flags & token::flags::hexadecimal)        { out += "hexadecimal ";        }
+    if (flags & token::flags::signed_integer)     { out += "signed ";             }
+    if (flags & token::flags::unsigned_integer)   { out += "unsigned ";           }
+    if (flags & token::flags::single_precision)   { out += "single-precision ";   }
+    if (flags & token::flags::double_precision)   { out += "double-precision ";   }
+    if (flags & token::flags::extended_precision) { out += "extended-precision "; }
+    if (flags & token::flags::integer)            { out += "integer ";            }
+    if (flags & token::flags::floating_point)     { out += "float ";              }
+    if (flags & token::flags::boolean)            { out += "boolean ";            }
+    if (flags & token::flags::ip_address)         { out += "IP address ";         }
+    if (flags & token::flags::ip_port)            { out += "IP port ";            }
 
-    out_token->clear();                                         // Ensure it is cleared
-    out_token->set_line_number(m_line_num);                     // Line the token is on
-    out_token->set_lines_crossed(m_line_num - m_last_line_num); // # of lines crossed before token
+    lexer::rtrim_string(&out);
+    return out;
+}
 
-    int c = *m_script_ptr;
+// ========================================================
+// lexer::diagnostic:
+// ========================================================
 
-    // If we're keeping everything as whitespace delimited strings...
-    if (m_flags & flags::only_strings)
+std::string lexer::diagnostic::message() const
+{
+    const std::string arg0{ (args[0].str != nullptr) ? args[0].str : "", args[0].length };
+    const std::string arg1{ (args[1].str != nullptr) ? args[1].str : "", args[1].length };
+
+    switch (code)
     {
-        // If there is a leading quote or double-quote:
-        if (c == '\'' || c == '"')
+    case error_code::custom                  : return arg0;
+    case error_code::no_filename             : return "lexer::init_from_file() -> no filename provided!";
+    case error_code::already_loaded          : return "lexer::" + arg0 + "() -> another script is already loaded!";
+    case error_code::file_load_failed        : return "lexer::init_from_file() -> failed to load text file \"" + arg0 + "\".";
+    case error_code::not_initialized         : return "lexer not properly initialized; no script loaded!";
+    case error_code::unknown_punctuation     : return "unknown punctuation character \'" + arg0 + "\'";
+    case error_code::expected_token_missing  : return "couldn't find expected token \'" + arg0 + "\'";
+    case error_code::unexpected_token        : return "expected \'" + arg0 + "\' but found \'" + arg1 + "\'";
+    case error_code::token_missing           : return "couldn't read expected token!";
+    case error_code::unexpected_token_type   : return "expected a " + token::type_string(static_cast<token::type>(int_arg)) + " but found \'" + arg1 + "\'";
+    case error_code::unexpected_number_type  :
         {
-            if (!internal_read_string(c, out_token))
+            auto str = token::flags_string(int_arg);
+            if (str.empty())
             {
-                return false;
+                str = "number";
             }
+            return "expected " + str + " but found \'" + arg1 + "\'";
         }
-        else if (!internal_read_name_ident(out_token))
-        {
-            return false;
-        }
-    }
-    // If there is a number...
-    else if ((c >= '0' && c <= '9') ||
-             (c == '.' && (*(m_script_ptr + 1) >= '0' && *(m_script_ptr + 1) <= '9')))
-    {
-        if (!internal_read_number(out_token))
-        {
-            return false;
-        }
+    case error_code::bad_punctuation_index   : return "bad punctuation index in subtype_flags!";
+    case error_code::bool_missing            : return "couldn't read expected boolean literal!";
+    case error_code::bool_expected           : return "expected boolean literal or number, found \'" + arg1 + "\'.";
+    case error_code::float_missing           : return "couldn't read expected floating-point number!";
+    case error_code::float_format            : return "number format cannot be scanned as a floating-point value!";
+    case error_code::float_expected          : return "expected float value, found \'" + arg1 + "\'.";
+    case error_code::uint_missing            : return "couldn't read expected unsigned integer number!";
+    case error_code::uint_expected           : return "expected unsigned integer value, found \'" + arg1 + "\'.";
+    case error_code::int_missing             : return "couldn't read expected integer number!";
+    case error_code::int_expected            : return "expected integer value, found \'" + arg1 + "\'.";
+    case error_code::string_missing          : return "couldn't read expected string!";
+    case error_code::string_expected         : return "expected string or character literal, found \'" + arg1 + "\'.";
+    case error_code::missing_closing_bracket : return "missing closing \'{\'!";
+    case error_code::invalid_escape_char     : return "unknown/invalid escape char!";
+    case error_code::missing_concat_string   : return "expecting string after '\\' terminated line!";
+    case error_code::missing_trailing_quote  : return "missing trailing quote!";
+    case error_code::newline_in_string       : return "newline inside string!";
+    case error_code::multi_char_literal      : return "char literal is not one character long! Set \'lexer::flags::allow_multi_char_literals\' to allow them.";
+    case error_code::float_exception         : return "floating-point exception scanned: " + arg1;
+    case error_code::multiple_dots_in_number : return "more than one dot in number! Set lexer::flags::allow_ip_addresses to parse IP addresses.";
+    case error_code::bad_ip_address          : return "IP address should have three dots!";
+    case error_code::out_of_memory           : return "lexer::" + arg0 + "() -> out of memory!";
+    case error_code::nested_comment          : return "nested C-style multi-line comment!";
+    case error_code::unget_token_twice       : return "lexer::unget_token() called twice in a row!";
+    case error_code::bool_not_0_or_1         : return "expected 0 or 1 for numerical boolean literal!";
+    case error_code::uint_from_float         : return "expected unsigned integer number, got float; truncating it to integer...";
+    case error_code::uint_from_negative      : return "expected unsigned integer number, got a negative value instead!";
+    case error_code::int_from_float          : return "expected integer number, got float; truncating it to integer...";
+    case error_code::hex_escape_too_big      : return "hexadecimal value in escape character is too big! Truncating to 0xFF...";
+    case error_code::escape_value_too_big    : return "value in escape character is too big! Truncating to 0xFF...";
+    default                                  : return "unknown error code " + std::to_string(static_cast<unsigned>(code));
+    } // switch (code)
+}
 
-        // If names are allowed to start with a number:
-        if (m_flags & flags::allow_number_names)
-        {
-            c = *m_script_ptr;
-            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
-            {
-                if (!internal_read_name_ident(out_token))
-                {
-                    return false;
-                }
-            }
-        }
-    }
-    // If there is a leading (double) quote...
-    else if (c == '\'' || c == '"')
-    {
-        if (!internal_read_string(c, out_token))
-        {
-            return false;
-        }
-    }
-    // If there is a name/identifier...
-    else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+std::string lexer::diagnostic::to_string() const
+{
+    // When using the ANSI color codes the "error" tag prints in red and "warning" in magenta.
+#ifdef LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
+    const char * const tag = is_warning ? "\033[35;1m warning: \033[0;1m" : "\033[31;1m error: \033[0;1m";
+#else // !LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
+    const char * const tag = is_warning ? " warning: " : " error: ";
+#endif // LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
+
+    const std::string filename = (source != nullptr) ? source->get_filename() : std::string{};
+    return filename + "(" + std::to_string(line_num) + "):" + tag + message();
+}
+
+void lexer::error_callbacks::diagnose(const diagnostic & diag)
+{
+    if (diag.is_warning)
     {
-        if (!internal_read_name_ident(out_token))
-        {
-            return false;
-        }
+        warning(diag.to_string());
     }
-    // Names may also start with a slash or dot when pathnames are allowed...
-    else if ((m_flags & flags::allow_path_names) && ((c == '/' || c == '\\') || c == '.'))
+    else
     {
-        if (!internal_read_name_ident(out_token))
-        {
-            return false;
-        }
+        error(diag.to_string(), diag.is_fatal);
     }
-    // Finally, check for punctuations:
-    else if (!internal_read_punctuation(out_token))
+}
+
+// ========================================================
+// Memory resources:
+// ========================================================
+
+void * lexer::memory_resource::allocate_from(memory_resource * resource, const std::size_t size_bytes,
+                                             const std::size_t alignment) noexcept
+{
+    if (resource != nullptr)
     {
-        return error("unknown punctuation character \'" + std::string(1u, static_cast<char>(c)) + "\'");
+        return resource->allocate(size_bytes, alignment);
     }
 
-    // Successfully read a token.
-    return true;
+    LEXER_ASSERT(alignment <= alignof(std::max_align_t));
+    return ::operator new(size_bytes, std::nothrow);
 }
 
-bool lexer::next_token_on_line(token * out_token)
+void lexer::memory_resource::deallocate_from(memory_resource * resource, void * ptr, const std::size_t size_bytes,
+                                             const std::size_t alignment) noexcept
 {
-    LEXER_ASSERT(out_token != nullptr);
-
-    token tok;
-    if (!next_token(&tok))
+    if (ptr == nullptr)
     {
-        m_script_ptr = m_last_script_ptr;
-        m_line_num   = m_last_line_num;
-        return false;
+        return;
     }
 
-    // If no lines were crossed before this token, OK.
-    if (tok.get_lines_crossed() == 0)
+    if (resource != nullptr)
     {
-        *out_token = std::move(tok);
-        return true;
+        resource->deallocate(ptr, size_bytes, alignment);
+    }
+    else
+    {
+        ::operator delete(ptr);
     }
-
-    // Restore our previous position:
-    m_script_ptr = m_last_script_ptr;
-    m_line_num   = m_last_line_num;
-    out_token->clear();
-    return false;
 }
 
-bool lexer::expect_token_char(const char c)
+lexer::capped_memory_resource::capped_memory_resource(const std::size_t cap_bytes, memory_resource * upstream) noexcept
+    : m_upstream{ upstream }
+    , m_cap_bytes{ cap_bytes }
 {
-    token tok;
-    return expect_token_char(c, &tok);
 }
 
-bool lexer::expect_token_char(const char c, token * out_token)
+void * lexer::capped_memory_resource::allocate(const std::size_t size_bytes, const std::size_t alignment)
 {
-    LEXER_ASSERT(out_token != nullptr);
+    if (size_bytes > (m_cap_bytes - m_used_bytes))
+    {
+        ++m_failed_count;
+        return nullptr;
+    }
 
-    if (!next_token(out_token))
+    void * const ptr = memory_resource::allocate_from(m_upstream, size_bytes, alignment);
+    if (ptr == nullptr)
     {
-        return error("couldn't find expected token \'" + std::string(1, c) + "\'");
+        ++m_failed_count;
+        return nullptr;
     }
-    if (*out_token != c)
+
+    m_used_bytes += size_bytes;
+    if (m_used_bytes > m_peak_bytes)
     {
-        return error("expected \'" + std::string(1, c) + "\' but found \'" + out_token->as_string() + "\'");
+        m_peak_bytes = m_used_bytes;
     }
-    return true;
+    return ptr;
 }
 
-bool lexer::expect_token_string(const char * const string)
+void lexer::capped_memory_resource::deallocate(void * ptr, const std::size_t size_bytes, const std::size_t alignment) noexcept
 {
-    token tok;
-    return expect_token_string(string, &tok);
+    if (ptr == nullptr)
+    {
+        return;
+    }
+
+    LEXER_ASSERT(size_bytes <= m_used_bytes);
+    m_used_bytes -= size_bytes;
+    memory_resource::deallocate_from(m_upstream, ptr, size_bytes, alignment);
 }
 
-bool lexer::expect_token_string(const char * const string, token * out_token)
+lexer::monotonic_memory_resource::monotonic_memory_resource(const std::size_t block_size, memory_resource * upstream) noexcept
+    : m_upstream{ upstream }
+    , m_block_size{ block_size }
 {
-    LEXER_ASSERT(string    != nullptr);
-    LEXER_ASSERT(out_token != nullptr);
+}
 
-    if (!next_token(out_token))
-    {
-        return error("couldn't find expected token \'" + std::string(string) + "\'");
-    }
-    if (*out_token != string)
-    {
-        return error("expected \'" + std::string(string) + "\' but found \'" + out_token->as_string() + "\'");
-    }
-    return true;
+lexer::monotonic_memory_resource::~monotonic_memory_resource()
+{
+    release();
 }
 
-bool lexer::expect_token_type(const token::type type, const std::uint32_t subtype_flags, token * out_token)
+void * lexer::monotonic_memory_resource::allocate(const std::size_t size_bytes, const std::size_t alignment)
 {
-    LEXER_ASSERT(out_token != nullptr);
+    LEXER_ASSERT(alignment != 0 && (alignment & (alignment - 1)) == 0);
 
-    if (!next_token(out_token))
+    auto aligned = [alignment](char * ptr) -> char *
+    {
+        const auto address = reinterpret_cast<std::uintptr_t>(ptr);
+        return ptr + (((address + alignment - 1) & ~(alignment - 1)) - address);
+    };
+
+    if (m_current_ptr != nullptr)
     {
-        return error("couldn't read expected token!");
+        char * const ptr = aligned(m_current_ptr);
+        if (ptr <= m_current_end && size_bytes <= static_cast<std::size_t>(m_current_end - ptr))
+        {
+            m_current_ptr = ptr + size_bytes;
+            return ptr;
+        }
     }
 
-    if (out_token->get_type() != type)
+    // Start a new block. Big requests get a block of their own size.
+    const std::size_t header_size = (sizeof(block_header) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    std::size_t block_bytes = header_size + size_bytes + (alignment > alignof(std::max_align_t) ? alignment : 0);
+    if (block_bytes < m_block_size)
     {
-        return error("expected a " + token::type_string(type) + " but found \'" + out_token->as_string() + "\'");
+        block_bytes = m_block_size;
     }
 
-    if (out_token->get_type() == token::type::number)
+    void * const memory = memory_resource::allocate_from(m_upstream, block_bytes, alignof(std::max_align_t));
+    if (memory == nullptr)
     {
-        if ((out_token->get_flags() & subtype_flags) != subtype_flags)
-        {
-            auto str = token::flags_string(subtype_flags);
-            if (str.empty())
-            {
-                str = "number";
+        return nullptr;
+    }
+
+    auto block        = static_cast<block_header *>(memory);
+    block->next       = m_blocks;
+    block->size_bytes = block_bytes;
+    m_blocks          = block;
+    m_allocated_bytes += block_bytes;
+
+    char * const ptr = aligned(static_cast<char *>(memory) + header_size);
+    m_current_ptr = ptr + size_bytes;
+    m_current_end = static_cast<char *>(memory) + block_bytes;
+    return ptr;
+}
+
+void lexer::monotonic_memory_resource::deallocate(void *, std::size_t, std::size_t) noexcept
+{
+    // Memory is only given back by release().
+}
+
+void lexer::monotonic_memory_resource::release() noexcept
+{
+    while (m_blocks != nullptr)
+    {
+        block_header * const next = m_blocks->next;
+        memory_resource::deallocate_from(m_upstream, m_blocks, m_blocks->size_bytes, alignof(std::max_align_t));
+        m_blocks = next;
+    }
+
+    m_current_ptr     = nullptr;
+    m_current_end     = nullptr;
+    m_allocated_bytes = 0;
+}
+
+#if LEXER_PMR_MEMORY_RESOURCE
+void * lexer::pmr_memory_resource::allocate(const std::size_t size_bytes, const std::size_t alignment)
+{
+    #ifndef LEXER_NO_CXX_EXCEPTIONS
+    try
+    {
+        return m_upstream->allocate(size_bytes, alignment);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+    #else // LEXER_NO_CXX_EXCEPTIONS
+    return m_upstream->allocate(size_bytes, alignment);
+    #endif // LEXER_NO_CXX_EXCEPTIONS
+}
+
+void lexer::pmr_memory_resource::deallocate(void * ptr, const std::size_t size_bytes, const std::size_t alignment) noexcept
+{
+    if (ptr != nullptr)
+    {
+        m_upstream->deallocate(ptr, size_bytes, alignment);
+    }
+}
+#endif // LEXER_PMR_MEMORY_RESOURCE
+
+// ========================================================
+// lexer class:
+// ========================================================
+
+lexer::lexer(lexer && other) noexcept
+    : m_buffer_head_ptr      { other.m_buffer_head_ptr           }
+    , m_script_ptr           { other.m_script_ptr                }
+    , m_end_ptr              { other.m_end_ptr                   }
+    , m_last_script_ptr      { other.m_last_script_ptr           }
+    , m_whitespace_start_ptr { other.m_whitespace_start_ptr      }
+    , m_whitespace_end_ptr   { other.m_whitespace_end_ptr        }
+    , m_line_cache_ptr       { other.m_line_cache_ptr            }
+    , m_flags                { other.m_flags                     }
+    , m_last_line_num        { other.m_last_line_num             }
+    , m_line_num             { other.m_line_num                  }
+    , m_line_cache_num       { other.m_line_cache_num            }
+    , m_script_length        { other.m_script_length             }
+    , m_error_count          { other.m_error_count               }
+    , m_warn_count           { other.m_warn_count                }
+    , m_static_token_flags   { other.m_static_token_flags        }
+    , m_static_tokens        { other.m_static_tokens             }
+    , m_static_token_count   { other.m_static_token_count        }
+    , m_static_token_cursor  { other.m_static_token_cursor       }
+    , m_instance_callbacks   { other.m_instance_callbacks        }
+    , m_memory_resource      { other.m_memory_resource           }
+    , m_token_rules          { other.m_token_rules               }
+    , m_comment_style        { other.m_comment_style             }
+    , m_leftover_token       { std::move(other.m_leftover_token)   }
+    , m_structural_index     { std::move(other.m_structural_index) }
+    , m_filename             { std::move(other.m_filename)         }
+    , m_match_leftover_text  { std::move(other.m_match_leftover_text) }
+    , m_token_available      { other.m_token_available             }
+    , m_initialized          { other.m_initialized                 }
+    , m_allocated            { other.m_allocated                   }
+    , m_structural_indexed   { other.m_structural_indexed          }
+{
+    other.m_buffer_head_ptr = nullptr;
+    other.m_allocated       = false;
+    other.clear();
+}
+
+lexer & lexer::operator = (lexer && other) noexcept
+{
+    // Freeing the buffer first would leave a self-move pointing at nothing.
+    if (this == &other)
+    {
+        return *this;
+    }
+
+    // Give our buffer back to the resource it came from before taking the other's.
+    internal_free_script_buffer();
+
+    m_buffer_head_ptr      = other.m_buffer_head_ptr;
+    m_script_ptr           = other.m_script_ptr;
+    m_end_ptr              = other.m_end_ptr;
+    m_last_script_ptr      = other.m_last_script_ptr;
+    m_whitespace_start_ptr = other.m_whitespace_start_ptr;
+    m_whitespace_end_ptr   = other.m_whitespace_end_ptr;
+    m_line_cache_ptr       = other.m_line_cache_ptr;
+    m_flags                = other.m_flags;
+    m_last_line_num        = other.m_last_line_num;
+    m_line_num             = other.m_line_num;
+    m_line_cache_num       = other.m_line_cache_num;
+    m_script_length        = other.m_script_length;
+    m_error_count          = other.m_error_count;
+    m_warn_count           = other.m_warn_count;
+    m_static_token_flags   = other.m_static_token_flags;
+    m_static_tokens        = other.m_static_tokens;
+    m_static_token_count   = other.m_static_token_count;
+    m_static_token_cursor  = other.m_static_token_cursor;
+    m_instance_callbacks   = other.m_instance_callbacks;
+    m_memory_resource      = other.m_memory_resource;
+    m_token_rules          = other.m_token_rules;
+    m_comment_style        = other.m_comment_style;
+    m_leftover_token       = std::move(other.m_leftover_token);
+    m_structural_index     = std::move(other.m_structural_index);
+    m_filename             = std::move(other.m_filename);
+    m_match_leftover_text  = std::move(other.m_match_leftover_text);
+    m_token_available      = other.m_token_available;
+    m_initialized          = other.m_initialized;
+    m_allocated            = other.m_allocated;
+    m_structural_indexed   = other.m_structural_indexed;
+
+    other.m_buffer_head_ptr = nullptr;
+    other.m_allocated       = false;
+    other.clear();
+
+    return *this;
+}
+
+lexer::lexer(std::string filename, const std::uint32_t flags)
+{
+    init_from_file(std::move(filename), flags);
+}
+
+lexer::lexer(const char * ptr, const std::uint32_t length, std::string filename,
+             const std::uint32_t flags, const std::uint32_t starting_line)
+{
+    init_from_memory(ptr, length, std::move(filename), flags, starting_line);
+}
+
+lexer::~lexer()
+{
+    internal_free_script_buffer();
+}
+
+bool lexer::init_from_file(std::string filename, const std::uint32_t flags, const bool silent)
+{
+    if (filename.empty())
+    {
+        return (!silent ? internal_error(error_code::no_filename) : false);
+    }
+
+    if (m_initialized)
+    {
+        return (!silent ? internal_error(error_code::already_loaded, "init_from_file") : false);
+    }
+
+    char * file_contents;
+    std::uint32_t file_length;
+    bool out_of_memory = false;
+
+    if (!load_text_file(filename, m_memory_resource, &file_contents, &file_length, &out_of_memory))
+    {
+        if (silent)
+        {
+            return false;
+        }
+        return (out_of_memory ? internal_error(error_code::out_of_memory, "init_from_file") :
+                                internal_error(error_code::file_load_failed, filename));
+    }
+
+    m_filename        = std::move(filename);
+    m_buffer_head_ptr = file_contents;
+    m_script_length   = file_length;
+    m_script_ptr      = m_buffer_head_ptr;
+    m_last_script_ptr = m_buffer_head_ptr;
+    m_end_ptr         = &m_buffer_head_ptr[file_length];
+    m_line_cache_ptr  = m_buffer_head_ptr;
+    m_line_num        = 1;
+    m_last_line_num   = 1;
+    m_line_cache_num  = 1;
+    m_flags           = flags;
+    m_allocated       = true;
+    m_initialized     = true;
+
+    return true;
+}
+
+bool lexer::init_from_memory(const char * ptr, const std::uint32_t length, std::string filename,
+                             const std::uint32_t flags, const std::uint32_t starting_line)
+{
+    LEXER_ASSERT(ptr != nullptr);
+
+    if (m_initialized)
+    {
+        return internal_error(error_code::already_loaded, "init_from_memory");
+    }
+
+    m_filename = std::move(filename);
+    if (m_filename.empty())
+    {
+        m_filename = "(memory)";
+    }
+
+    // Note that in this case, we DO NOT take ownership of the input buffer!
+    m_buffer_head_ptr = ptr;
+    m_script_length   = length;
+    m_script_ptr      = m_buffer_head_ptr;
+    m_last_script_ptr = m_buffer_head_ptr;
+    m_end_ptr         = &m_buffer_head_ptr[length];
+    m_line_cache_ptr  = m_buffer_head_ptr;
+    m_line_num        = starting_line;
+    m_last_line_num   = starting_line;
+    m_line_cache_num  = starting_line;
+    m_flags           = flags;
+    m_allocated       = false;
+    m_initialized     = true;
+
+    return true;
+}
+
+bool lexer::init_from_static_tokens(const char * ptr, const std::uint32_t length, const static_token * tokens,
+                                    const std::size_t token_count, const std::uint32_t token_flags,
+                                    std::string filename, const std::uint32_t flags)
+{
+    LEXER_ASSERT(tokens != nullptr || token_count == 0);
+
+    if (!init_from_memory(ptr, length, std::move(filename), flags))
+    {
+        return false;
+    }
+
+    m_static_tokens       = tokens;
+    m_static_token_count  = token_count;
+    m_static_token_flags  = token_flags;
+    m_static_token_cursor = 0;
+    return true;
+}
+
+void lexer::clear() noexcept
+{
+    free_script_source();
+    m_error_count = 0;
+    m_warn_count  = 0;
+    m_filename.clear();
+    // Note: m_flags remain unchanged.
+}
+
+void lexer::reset() noexcept
+{
+    m_script_ptr           = m_buffer_head_ptr;
+    m_last_script_ptr      = m_buffer_head_ptr;
+    m_whitespace_start_ptr = nullptr;
+    m_whitespace_end_ptr   = nullptr;
+    m_line_cache_ptr       = m_buffer_head_ptr;
+    m_last_line_num        = 1;
+    m_line_num             = 1;
+    m_line_cache_num       = 1;
+    m_error_count          = 0;
+    m_warn_count           = 0;
+    m_static_token_cursor  = 0;
+    m_token_available      = false;
+
+    m_leftover_token.clear();
+    m_match_leftover_text.clear();
+}
+
+void lexer::free_script_source() noexcept
+{
+    internal_free_script_buffer();
+
+    m_buffer_head_ptr      = nullptr;
+    m_script_ptr           = nullptr;
+    m_end_ptr              = nullptr;
+    m_last_script_ptr      = nullptr;
+    m_whitespace_start_ptr = nullptr;
+    m_whitespace_end_ptr   = nullptr;
+    m_line_cache_ptr       = nullptr;
+    m_last_line_num        = 0;
+    m_line_num             = 0;
+    m_line_cache_num       = 0;
+    m_script_length        = 0;
+    m_static_tokens        = nullptr;
+    m_static_token_count   = 0;
+    m_static_token_cursor  = 0;
+    m_token_available      = false;
+    m_initialized          = false;
+    m_allocated            = false;
+    m_structural_indexed   = false;
+
+    m_leftover_token.clear();
+    m_match_leftover_text.clear();
+    m_structural_index.clear();
+}
+
+void lexer::set_flags(const std::uint32_t new_flags) noexcept
+{
+    // The structural index depends on how strings are scanned.
+    if ((m_flags ^ new_flags) & flags::no_string_escape_chars)
+    {
+        m_structural_indexed = false;
+    }
+
+    // Hand over the current line when switching between eager and lazy line counting.
+    if ((m_flags ^ new_flags) & flags::lazy_line_numbers)
+    {
+        if (new_flags & flags::lazy_line_numbers)
+        {
+            m_line_cache_ptr = m_script_ptr;
+            m_line_cache_num = m_line_num;
+        }
+        else if (is_initialized())
+        {
+            m_line_num      = get_line_number_at(get_script_offset());
+            m_last_line_num = m_line_num;
+        }
+    }
+
+    m_flags = new_flags;
+}
+
+void lexer::set_line_number(const std::uint32_t new_line_num) noexcept
+{
+    m_line_num       = new_line_num;
+    m_last_line_num  = new_line_num;
+    m_line_cache_ptr = m_script_ptr;
+    m_line_cache_num = new_line_num;
+}
+
+std::uint32_t lexer::get_line_number() const noexcept
+{
+    if ((m_flags & flags::lazy_line_numbers) && is_initialized())
+    {
+        return get_line_number_at(get_script_offset());
+    }
+    return m_line_num;
+}
+
+std::uint32_t lexer::get_line_number_at(const std::size_t offset) const noexcept
+{
+    LEXER_ASSERT(offset <= m_script_length);
+
+    if (m_buffer_head_ptr == nullptr)
+    {
+        return m_line_num;
+    }
+
+    // Count from the last position resolved, which is usually just behind.
+    const char * const ptr = m_buffer_head_ptr + offset;
+    if (ptr >= m_line_cache_ptr)
+    {
+        m_line_cache_num += lexer_detail::count_newlines(m_line_cache_ptr, ptr);
+    }
+    else
+    {
+        m_line_cache_num -= lexer_detail::count_newlines(ptr, m_line_cache_ptr);
+    }
+
+    m_line_cache_ptr = ptr;
+    return m_line_cache_num;
+}
+
+bool lexer::error(const std::string & message)
+{
+    return internal_error(error_code::custom, message);
+}
+
+bool lexer::error(const char * const message)
+{
+    return internal_error(error_code::custom, message);
+}
+
+void lexer::warning(const std::string & message)
+{
+    internal_warning(error_code::custom, message);
+}
+
+void lexer::warning(const char * const message)
+{
+    internal_warning(error_code::custom, message);
+}
+
+bool lexer::internal_error(const error_code code, const diagnostic::text arg0,
+                           const diagnostic::text arg1, const std::uint32_t int_arg)
+{
+    ++m_error_count;
+    if (m_flags & flags::no_errors)
+    {
+        return false;
+    }
+
+    diagnostic diag;
+    diag.source   = this;
+    diag.code     = code;
+    diag.line_num = internal_last_line_number();
+    diag.int_arg  = int_arg;
+    diag.args[0]  = arg0;
+    diag.args[1]  = arg1;
+    diag.is_fatal = !(m_flags & flags::no_fatal_errors);
+    internal_get_error_callbacks()->diagnose(diag);
+
+    // Always returns false so we can write 'return error("foobar");' on methods returning boolean.
+    return false;
+}
+
+void lexer::internal_warning(const error_code code, const diagnostic::text arg0)
+{
+    ++m_warn_count;
+    if (m_flags & flags::no_warnings)
+    {
+        return;
+    }
+
+    diagnostic diag;
+    diag.source     = this;
+    diag.code       = code;
+    diag.line_num   = internal_last_line_number();
+    diag.args[0]    = arg0;
+    diag.is_warning = true;
+    internal_get_error_callbacks()->diagnose(diag);
+}
+
+namespace lexer_detail
+{
+
+// Shared by the lexer::load_text_file() overloads. 'allocate(size)' returns a buffer
+// of 'size' chars or null and 'deallocate(ptr, size)' frees it if the read fails.
+template<typename AllocFunc, typename FreeFunc>
+bool read_text_file(const std::string & filename, AllocFunc allocate, FreeFunc deallocate,
+                    char ** out_file_contents, std::uint32_t * out_file_length, bool * out_of_memory)
+{
+    FILE * file_in;
+
+#ifdef _MSC_VER
+    if (fopen_s(&file_in, filename.c_str(), "rb") != 0)
+    {
+        return false;
+    }
+#else // !_MSC_VER
+    if ((file_in = std::fopen(filename.c_str(), "rb")) == nullptr)
+    {
+        return false;
+    }
+#endif // _MSC_VER
+
+    std::fseek(file_in, 0, SEEK_END);
+    const auto file_length = std::ftell(file_in);
+    std::fseek(file_in, 0, SEEK_SET);
+
+    if (file_length <= 0 || std::ferror(file_in))
+    {
+        std::fclose(file_in);
+        return false;
+    }
+
+    const auto buffer_size = static_cast<std::size_t>(file_length) + 1;
+    char * const file_contents = allocate(buffer_size);
+    if (file_contents == nullptr)
+    {
+        if (out_of_memory != nullptr)
+        {
+            *out_of_memory = true;
+        }
+        std::fclose(file_in);
+        return false;
+    }
+
+    if (std::fread(file_contents, 1, file_length, file_in) != static_cast<std::size_t>(file_length))
+    {
+        deallocate(file_contents, buffer_size);
+        std::fclose(file_in);
+        return false;
+    }
+
+    file_contents[file_length] = '\0';
+    std::fclose(file_in);
+
+    *out_file_contents = file_contents;
+    *out_file_length   = static_cast<std::uint32_t>(file_length);
+    return true;
+}
+
+} // namespace lexer_detail {}
+
+bool lexer::load_text_file(const std::string & filename, char ** out_file_contents, std::uint32_t * out_file_length)
+{
+    LEXER_ASSERT(!filename.empty());
+    LEXER_ASSERT(out_file_contents != nullptr);
+    LEXER_ASSERT(out_file_length   != nullptr);
+
+    return lexer_detail::read_text_file(filename,
+                                        [](const std::size_t size) { return new char[size]; },
+                                        [](char * ptr, std::size_t) { delete[] ptr; },
+                                        out_file_contents, out_file_length, nullptr);
+}
+
+bool lexer::load_text_file(const std::string & filename, memory_resource * resource, char ** out_file_contents,
+                           std::uint32_t * out_file_length, bool * out_of_memory)
+{
+    LEXER_ASSERT(!filename.empty());
+    LEXER_ASSERT(out_file_contents != nullptr);
+    LEXER_ASSERT(out_file_length   != nullptr);
+
+    if (out_of_memory != nullptr)
+    {
+        *out_of_memory = false;
+    }
+
+    return lexer_detail::read_text_file(filename,
+                                        [resource](const std::size_t size)
+                                        {
+                                            return static_cast<char *>(memory_resource::allocate_from(resource, size, 1));
+                                        },
+                                        [resource](char * ptr, const std::size_t size)
+                                        {
+                                            memory_resource::deallocate_from(resource, ptr, size, 1);
+                                        },
+                                        out_file_contents, out_file_length, out_of_memory);
+}
+
+void lexer::internal_free_script_buffer() noexcept
+{
+    if (m_allocated && m_buffer_head_ptr != nullptr)
+    {
+        memory_resource::deallocate_from(m_memory_resource, const_cast<char *>(m_buffer_head_ptr), m_script_length + 1, 1);
+    }
+}
+
+bool lexer::next_token(token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    if (!is_initialized())
+    {
+        return internal_error(error_code::not_initialized);
+    }
+
+    // If there is a token available (from unget_token)...
+    if (m_token_available)
+    {
+        *out_token = std::move(m_leftover_token);
+        m_token_available = false;
+        return true;
+    }
+
+    // If pre-tokenized, try taking the token from the records first.
+    if (m_static_tokens != nullptr && internal_replay_static_token(out_token))
+    {
+        return true;
+    }
+
+    // Save script & line pointers:
+    m_last_line_num        = m_line_num;
+    m_last_script_ptr      = m_script_ptr;
+    m_whitespace_start_ptr = m_script_ptr;
+
+    if (!internal_read_whitespace())
+    {
+        return false;
+    }
+
+    m_whitespace_end_ptr = m_script_ptr;
+
+    out_token->clear(); // Ensure it is cleared
+
+    if (!(m_flags & flags::lazy_line_numbers))
+    {
+        out_token->set_line_number(m_line_num);                     // Line the token is on
+        out_token->set_lines_crossed(m_line_num - m_last_line_num); // # of lines crossed before token
+    }
+
+    // Custom token rules take precedence over everything else.
+    if (m_token_rules != nullptr && internal_read_custom_token(out_token))
+    {
+        return true;
+    }
+
+    int c = *m_script_ptr;
+
+    // If we're keeping everything as whitespace delimited strings...
+    if (m_flags & flags::only_strings)
+    {
+        // If there is a leading quote or double-quote:
+        if (c == '\'' || c == '"')
+        {
+            if (!internal_read_string(c, out_token))
+            {
+                return false;
+            }
+        }
+        else if (!internal_read_name_ident(out_token))
+        {
+            return false;
+        }
+    }
+    // If there is a number...
+    else if ((c >= '0' && c <= '9') ||
+             (c == '.' && (*(m_script_ptr + 1) >= '0' && *(m_script_ptr + 1) <= '9')))
+    {
+        if (!internal_read_number(out_token))
+        {
+            return false;
+        }
+
+        // If names are allowed to start with a number:
+        if (m_flags & flags::allow_number_names)
+        {
+            c = *m_script_ptr;
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+            {
+                if (!internal_read_name_ident(out_token))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    // If there is a leading (double) quote...
+    else if (c == '\'' || c == '"')
+    {
+        if (!internal_read_string(c, out_token))
+        {
+            return false;
+        }
+    }
+    // If there is a name/identifier...
+    else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+    {
+        if (!internal_read_name_ident(out_token))
+        {
+            return false;
+        }
+    }
+    // Names may also start with a slash or dot when pathnames are allowed...
+    else if ((m_flags & flags::allow_path_names) && ((c == '/' || c == '\\') || c == '.'))
+    {
+        if (!internal_read_name_ident(out_token))
+        {
+            return false;
+        }
+    }
+    // Finally, check for punctuations:
+    else if (!internal_read_punctuation(out_token))
+    {
+        const char ch = static_cast<char>(c);
+        return internal_error(error_code::unknown_punctuation, { &ch, 1 });
+    }
+
+    // Successfully read a token.
+    return true;
+}
+
+bool lexer::next_token_on_line(token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    token tok;
+    if (!next_token(&tok))
+    {
+        m_script_ptr = m_last_script_ptr;
+        m_line_num   = m_last_line_num;
+        return false;
+    }
+
+    // If no lines were crossed before this token, OK.
+    if (internal_lines_crossed(tok) == 0)
+    {
+        *out_token = std::move(tok);
+        return true;
+    }
+
+    // Restore our previous position:
+    m_script_ptr = m_last_script_ptr;
+    m_line_num   = m_last_line_num;
+    out_token->clear();
+    return false;
+}
+
+bool lexer::next_static_token(token * out_token, static_token * out_record)
+{
+    LEXER_ASSERT(out_record != nullptr);
+    LEXER_ASSERT(!m_token_available); // The position of a token put back is lost.
+
+    if (!next_token(out_token))
+    {
+        return false;
+    }
+
+    const auto start  = static_cast<std::uint32_t>(m_whitespace_end_ptr - m_buffer_head_ptr);
+    const auto end    = static_cast<std::uint32_t>(m_script_ptr - m_buffer_head_ptr);
+    const auto length = static_cast<std::uint32_t>(out_token->get_length());
+
+    *out_record             = static_token{};
+    out_record->start       = start;
+    out_record->end         = end;
+    out_record->text_length = length;
+    out_record->flags       = out_token->get_flags();
+    out_record->type        = out_token->get_type();
+
+    // Replaying takes the text as a slice of the script, inside the quotes for strings,
+    // and only counts the newlines between tokens. Anything else is scanned again.
+    const bool quoted = out_token->is_string() || out_token->is_literal();
+    const auto text_start = start + (quoted ? 1 : 0);
+
+    if (text_start + length <= end &&
+        out_token->as_string().compare(0, length, m_buffer_head_ptr + text_start, length) == 0)
+    {
+        out_record->text_start = text_start;
+    }
+    else
+    {
+        out_record->rescan = true;
+    }
+
+    if (std::memchr(m_whitespace_end_ptr, '\n', end - start) != nullptr)
+    {
+        out_record->rescan = true;
+    }
+    return true;
+}
+
+bool lexer::expect_token_char(const char c)
+{
+    token tok;
+    return expect_token_char(c, &tok);
+}
+
+bool lexer::expect_token_char(const char c, token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    if (!next_token(out_token))
+    {
+        return internal_error(error_code::expected_token_missing, { &c, 1 });
+    }
+    if (*out_token != c)
+    {
+        return internal_error(error_code::unexpected_token, { &c, 1 }, out_token->as_string());
+    }
+    return true;
+}
+
+bool lexer::expect_token_string(const char * const string)
+{
+    token tok;
+    return expect_token_string(string, &tok);
+}
+
+bool lexer::expect_token_string(const char * const string, token * out_token)
+{
+    LEXER_ASSERT(string    != nullptr);
+    LEXER_ASSERT(out_token != nullptr);
+
+    if (!next_token(out_token))
+    {
+        return internal_error(error_code::expected_token_missing, string);
+    }
+    if (*out_token != string)
+    {
+        return internal_error(error_code::unexpected_token, string, out_token->as_string());
+    }
+    return true;
+}
+
+bool lexer::expect_token_type(const token::type type, const std::uint32_t subtype_flags, token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    if (!next_token(out_token))
+    {
+        return internal_error(error_code::token_missing);
+    }
+
+    if (out_token->get_type() != type)
+    {
+        return internal_error(error_code::unexpected_token_type, {}, out_token->as_string(), static_cast<std::uint32_t>(type));
+    }
+
+    if (out_token->get_type() == token::type::number)
+    {
+        if ((out_token->get_flags() & subtype_flags) != subtype_flags)
+        {
+            return internal_error(error_code::unexpected_number_type, {}, out_token->as_string(), subtype_flags);
+        }
+    }
+    else if (out_token->get_type() == token::type::punctuation)
+    {
+        // subtype_flags == some punctuation_id
+        if (subtype_flags >= m_punctuations_size)
+        {
+            return internal_error(error_code::bad_punctuation_index);
+        }
+
+        if (out_token->get_flags() != subtype_flags)
+        {
+            const char * const expected = (subtype_flags != 0) ? m_punctuations[subtype_flags].str : "(unknown punctuation)";
+            return internal_error(error_code::unexpected_token, expected, out_token->as_string());
+        }
+    }
+
+    return true;
+}
+
+bool lexer::expect_any_token(token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+    if (!next_token(out_token))
+    {
+        return internal_error(error_code::token_missing);
+    }
+    return true;
+}
+
+bool lexer::check_token_string(const char * const string)
+{
+    token tok;
+    return check_token_string(string, &tok);
+}
+
+bool lexer::check_token_string(const char * const string, token * out_token)
+{
+    LEXER_ASSERT(string    != nullptr);
+    LEXER_ASSERT(out_token != nullptr);
+
+    if (!next_token(out_token))
+    {
+        return false;
+    }
+
+    // If the given string is available:
+    if (*out_token == string)
+    {
+        return true;
+    }
+
+    // Unread the token:
+    m_script_ptr = m_last_script_ptr;
+    m_line_num   = m_last_line_num;
+    return false;
+
+}
+
+bool lexer::check_token_type(const token::type type, const std::uint32_t subtype_flags, token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    token tok;
+    if (!next_token(&tok))
+    {
+        return false;
+    }
+
+    if ((tok.get_type() == type) && ((tok.get_flags() & subtype_flags) == subtype_flags))
+    {
+        *out_token = std::move(tok);
+        return true;
+    }
+
+    // Unread the token:
+    m_script_ptr = m_last_script_ptr;
+    m_line_num   = m_last_line_num;
+    return false;
+}
+
+bool lexer::peek_token_string(const char * const string)
+{
+    LEXER_ASSERT(string != nullptr);
+
+    token tok;
+    if (!next_token(&tok))
+    {
+        return false;
+    }
+
+    // Unread the token:
+    m_script_ptr = m_last_script_ptr;
+    m_line_num   = m_last_line_num;
+
+    if (tok == string)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+bool lexer::peek_token_type(const token::type type, const std::uint32_t subtype_flags, token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    token tok;
+    if (!next_token(&tok))
+    {
+        return false;
+    }
+
+    // Unread the token:
+    m_script_ptr = m_last_script_ptr;
+    m_line_num   = m_last_line_num;
+
+    if ((tok.get_type() == type) && ((tok.get_flags() & subtype_flags) == subtype_flags))
+    {
+        *out_token = std::move(tok);
+        return true;
+    }
+
+    return false;
+}
+
+bool lexer::skip_until_string(const char * const string)
+{
+    LEXER_ASSERT(string != nullptr);
+
+    // Single structural characters can be found with the index.
+    if (string[0] != '\0' && string[1] == '\0' && std::strchr("{}();", string[0]) != nullptr &&
+        internal_use_structural_index())
+    {
+        return internal_skip_until_indexed_char(string[0]);
+    }
+
+    token tok;
+    while (next_token(&tok))
+    {
+        if (tok == string)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool lexer::skip_rest_of_line()
+{
+    token tok;
+    while (next_token(&tok))
+    {
+        if (internal_lines_crossed(tok) != 0)
+        {
+            m_script_ptr = m_last_script_ptr;
+            m_line_num   = m_last_line_num;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool lexer::skip_to_line_starting_with(const char c)
+{
+    if (!is_initialized())
+    {
+        return internal_error(error_code::not_initialized);
+    }
+
+    // A token put back is scanned again, in case it is the one we are looking for.
+    if (m_token_available)
+    {
+        m_script_ptr = m_whitespace_end_ptr;
+        if (!(m_flags & flags::lazy_line_numbers))
+        {
+            m_line_num = m_leftover_token.get_line_number();
+        }
+        m_leftover_token.clear();
+        m_token_available = false;
+    }
+
+    const char * ptr = m_script_ptr;
+    std::uint32_t newlines = 0;
+
+    // At a line start if only blanks precede us on this line.
+    bool line_start = true;
+    for (const char * prev = ptr; prev != m_buffer_head_ptr && prev[-1] != '\n'; --prev)
+    {
+        if (prev[-1] != ' ' && prev[-1] != '\t' && prev[-1] != '\r')
+        {
+            line_start = false;
+            break;
+        }
+    }
+
+    // The script is null terminated, so looking one char ahead is safe.
+    while (ptr < m_end_ptr)
+    {
+        const char ch = *ptr;
+        if (ch == '\n')
+        {
+            ++newlines;
+            line_start = true;
+            ++ptr;
+        }
+        else if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v')
+        {
+            ++ptr;
+        }
+        else if (ch == '\\' && (ptr[1] == '\n' || (ptr[1] == '\r' && ptr[2] == '\n'))) // Line continuation.
+        {
+            ptr += (ptr[1] == '\n') ? 2 : 3;
+            ++newlines;
+        }
+        else if (ch == '/' && ptr[1] == '/')
+        {
+            // Until the end of the line, which might be continued.
+            for (ptr += 2; ptr < m_end_ptr && *ptr != '\n'; ++ptr)
+            {
+                if (*ptr == '\\' && ptr[1] == '\n')
+                {
+                    ++newlines;
+                    ++ptr;
+                }
+            }
+        }
+        else if (ch == '/' && ptr[1] == '*')
+        {
+            // Comments count as blanks, so they don't end a line start. The search starts
+            // at the opener's '*', like internal_skip_block_comment(), so "/*/" is a comment.
+            for (ptr += 1; ptr < m_end_ptr && !(ptr[0] == '*' && ptr[1] == '/'); ++ptr)
+            {
+                newlines += (*ptr == '\n') ? 1 : 0;
+            }
+            ptr = (ptr < m_end_ptr) ? (ptr + 2) : m_end_ptr;
+        }
+        else if (ch == c && line_start)
+        {
+            break;
+        }
+        else if (ch == '"' || ch == '\'')
+        {
+            // Unterminated quotes end with the line, like apostrophes in prose.
+            for (++ptr; ptr < m_end_ptr && *ptr != ch && *ptr != '\n'; ++ptr)
+            {
+                if (*ptr == '\\' && ptr[1] != '\0')
+                {
+                    newlines += (ptr[1] == '\n') ? 1 : 0;
+                    ++ptr;
+                }
+            }
+            ptr += (ptr < m_end_ptr && *ptr == ch) ? 1 : 0;
+            line_start = false;
+        }
+        else
+        {
+            line_start = false;
+            ++ptr;
+        }
+    }
+
+    m_last_line_num        = m_line_num;
+    m_last_script_ptr      = m_script_ptr;
+    m_whitespace_start_ptr = m_script_ptr;
+    m_whitespace_end_ptr   = ptr;
+    m_script_ptr           = ptr;
+
+    if (!(m_flags & flags::lazy_line_numbers))
+    {
+        m_line_num += newlines;
+    }
+    return ptr < m_end_ptr;
+}
+
+void lexer::jump_to_offset(const std::size_t offset, const std::uint32_t line_num) noexcept
+{
+    LEXER_ASSERT(is_initialized());
+    LEXER_ASSERT(offset <= m_script_length);
+
+    m_script_ptr           = m_buffer_head_ptr + offset;
+    m_last_script_ptr      = m_script_ptr;
+    m_whitespace_start_ptr = m_script_ptr;
+    m_whitespace_end_ptr   = m_script_ptr;
+    m_token_available      = false;
+    m_leftover_token.clear();
+
+    if (!(m_flags & flags::lazy_line_numbers))
+    {
+        m_line_num      = line_num;
+        m_last_line_num = line_num;
+    }
+}
+
+bool lexer::skip_bracketed_section(const bool scan_first_bracket)
+{
+    // Skips until a matching close curly bracket is found.
+    // Internal bracket depths are properly skipped.
+
+    if (internal_use_structural_index())
+    {
+        return internal_skip_indexed_section(scan_first_bracket);
+    }
+
+    token tok;
+    int depth = (scan_first_bracket ? 0 : 1);
+
+    do
+    {
+        if (!next_token(&tok))
+        {
+            return false;
+        }
+
+        if (tok.get_type() == token::type::punctuation)
+        {
+            if (is_punctuation_token(tok, punctuation_id::open_curly_bracket))
+            {
+                ++depth;
+            }
+            else if (is_punctuation_token(tok, punctuation_id::close_curly_bracket))
+            {
+                --depth;
+            }
+        }
+    }
+    while (depth);
+
+    return true;
+}
+
+bool lexer::build_structural_index()
+{
+    if (!is_initialized())
+    {
+        return internal_error(error_code::not_initialized);
+    }
+
+    m_structural_indexed = false;
+
+    // The offsets are allocated from m_memory_resource, which may be capped.
+#ifndef LEXER_NO_CXX_EXCEPTIONS
+    try
+    {
+        internal_build_structural_index();
+    }
+    catch (const std::bad_alloc &)
+    {
+        // Give back what was allocated so far.
+        structural_index_vector{ m_structural_index.get_allocator() }.swap(m_structural_index);
+        return internal_error(error_code::out_of_memory, "build_structural_index");
+    }
+#else // LEXER_NO_CXX_EXCEPTIONS
+    internal_build_structural_index();
+#endif // LEXER_NO_CXX_EXCEPTIONS
+
+    m_structural_indexed = true;
+    return true;
+}
+
+void lexer::internal_build_structural_index()
+{
+    lexer_detail::structural_scanner<structural_index_vector> scanner{ m_buffer_head_ptr,
+                                                                       !(m_flags & flags::no_string_escape_chars),
+                                                                       &m_structural_index };
+    m_structural_index.clear();
+
+    const char * p = m_buffer_head_ptr;
+
+#ifdef LEXER_USE_SSE2
+    // Classify 16 chars at a time and only visit the ones that can matter.
+    const __m128i candidates[] =
+    {
+        _mm_set1_epi8('{'), _mm_set1_epi8('}'),  _mm_set1_epi8('('), _mm_set1_epi8(')'),
+        _mm_set1_epi8(';'), _mm_set1_epi8('"'),  _mm_set1_epi8('\''),_mm_set1_epi8('/'),
+        _mm_set1_epi8('*'), _mm_set1_epi8('\\'), _mm_set1_epi8('\n')
+    };
+
+    for (; (m_end_ptr - p) >= 16; p += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i hits = _mm_setzero_si128();
+        for (const __m128i & candidate : candidates)
+        {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, candidate));
+        }
+
+        auto mask = static_cast<std::uint32_t>(_mm_movemask_epi8(hits));
+        while (mask != 0)
+        {
+            scanner.feed(p + lexer_detail::count_trailing_zeros(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif // LEXER_USE_SSE2
+
+    for (; p < m_end_ptr; ++p)
+    {
+        if (lexer_detail::is_structural_candidate(*p))
+        {
+            scanner.feed(p);
+        }
+    }
+}
+
+bool lexer::skip_whitespace(const bool current_line)
+{
+    for (;;)
+    {
+        LEXER_ASSERT(m_script_ptr <= m_end_ptr);
+        if (m_script_ptr == m_end_ptr)
+        {
+            return false;
+        }
+
+        // Skip whitespace:
+        while (*m_script_ptr <= ' ')
+        {
+            if (m_script_ptr == m_end_ptr)
+            {
+                return false;
+            }
+            if (!*m_script_ptr)
+            {
+                return false;
+            }
+            if (*m_script_ptr == '\n')
+            {
+                ++m_line_num;
+                if (current_line)
+                {
+                    ++m_script_ptr;
+                    return true;
+                }
+            }
+            ++m_script_ptr;
+        }
+
+        // Skip comments:
+        if (m_comment_style != nullptr)
+        {
+            const comment_kind kind = internal_skip_styled_comment(/* track_lines = */ true);
+            if (kind == comment_kind::none)
+            {
+                break;
+            }
+            if (kind == comment_kind::line && current_line && *(m_script_ptr - 1) == '\n')
+            {
+                return true;
+            }
+            if (!*m_script_ptr)
+            {
+                return false;
+            }
+            continue;
+        }
+        if (*m_script_ptr == '/')
+        {
+            // C++-style comments:
+            if (*(m_script_ptr + 1) == '/')
+            {
+                ++m_script_ptr;
+                do
+                {
+                    ++m_script_ptr;
+                    if (!*m_script_ptr)
+                    {
+                        return false;
+                    }
+                }
+                while (*m_script_ptr != '\n');
+
+                ++m_line_num;
+                ++m_script_ptr;
+
+                if (current_line)
+                {
+                    return true;
+                }
+                if (!*m_script_ptr)
+                {
+                    return false;
+                }
+                continue;
+            }
+            // C-style/multi-line comments:
+            else if (*(m_script_ptr + 1) == '*')
+            {
+                ++m_script_ptr;
+                for (;;)
+                {
+                    ++m_script_ptr;
+                    if (!*m_script_ptr)
+                    {
+                        return false;
+                    }
+                    if (*m_script_ptr == '\n')
+                    {
+                        ++m_line_num;
+                    }
+                    else if (*m_script_ptr == '/')
+                    {
+                        if (*(m_script_ptr - 1) == '*')
+                        {
+                            break;
+                        }
+                        if (*(m_script_ptr + 1) == '*')
+                        {
+                            internal_warning(error_code::nested_comment);
+                        }
+                    }
+                }
+
+                ++m_script_ptr;
+                if (!*m_script_ptr)
+                {
+                    return false;
+                }
+                continue;
+            }
+        }
+        break;
+    }
+    return true;
+}
+
+void lexer::unget_token(const token & in_token)
+{
+    if (m_token_available)
+    {
+        internal_warning(error_code::unget_token_twice);
+    }
+
+    m_leftover_token  = in_token;
+    m_token_available = true;
+}
+
+void lexer::internal_save_match_state(match_state * out_state, token * out_leftover) const
+{
+    out_state->script_ptr           = m_script_ptr;
+    out_state->last_script_ptr      = m_last_script_ptr;
+    out_state->whitespace_start_ptr = m_whitespace_start_ptr;
+    out_state->whitespace_end_ptr   = m_whitespace_end_ptr;
+    out_state->line_num             = m_line_num;
+    out_state->last_line_num        = m_last_line_num;
+    out_state->static_token_cursor  = m_static_token_cursor;
+    out_state->token_available      = m_token_available;
+
+    // Only copied when there is one, which is rare.
+    if (m_token_available)
+    {
+        *out_leftover = m_leftover_token;
+    }
+}
+
+void lexer::internal_restore_match_state(const match_state & state, token * leftover) noexcept
+{
+    m_script_ptr           = state.script_ptr;
+    m_last_script_ptr      = state.last_script_ptr;
+    m_whitespace_start_ptr = state.whitespace_start_ptr;
+    m_whitespace_end_ptr   = state.whitespace_end_ptr;
+    m_line_num             = state.line_num;
+    m_last_line_num        = state.last_line_num;
+    m_static_token_cursor  = state.static_token_cursor;
+    m_token_available      = state.token_available;
+
+    if (m_token_available)
+    {
+        m_leftover_token = std::move(*leftover);
+    }
+}
+
+bool lexer::internal_match_next(token * out_token, text_view * out_text)
+{
+    const bool from_leftover = m_token_available;
+    if (!next_token(out_token))
+    {
+        return false;
+    }
+
+    if (out_text != nullptr)
+    {
+        if (from_leftover) // Not in the script, so it has to be copied.
+        {
+            m_match_leftover_text = out_token->as_string();
+            *out_text = text_view{ m_match_leftover_text.data(), m_match_leftover_text.length() };
+        }
+        else
+        {
+            *out_text = text_view{ m_whitespace_end_ptr, static_cast<std::size_t>(m_script_ptr - m_whitespace_end_ptr) };
+        }
+    }
+    return true;
+}
+
+bool lexer::internal_match_number(token * out_token, bool * out_negative)
+{
+    if (!internal_match_next(out_token, nullptr))
+    {
+        return false;
+    }
+
+    *out_negative = (out_token->get_type() == token::type::punctuation && *out_token == '-');
+    if (*out_negative && !internal_match_next(out_token, nullptr))
+    {
+        return false;
+    }
+    return out_token->get_type() == token::type::number;
+}
+
+bool lexer::internal_match_element(token * tok, const char c)
+{
+    return internal_match_next(tok, nullptr) && *tok == c;
+}
+
+bool lexer::internal_match_element(token * tok, const char * const string)
+{
+    LEXER_ASSERT(string != nullptr);
+    return internal_match_next(tok, nullptr) && *tok == string;
+}
+
+bool lexer::internal_match_element(token * tok, const match_identifier_element & element)
+{
+    return internal_match_next(tok, element.out) && tok->is_identifier();
+}
+
+bool lexer::internal_match_element(token * tok, const match_string_element & element)
+{
+    if (!internal_match_next(tok, nullptr) || !tok->is_string())
+    {
+        return false;
+    }
+
+    if (element.out != nullptr)
+    {
+        tok->move_to(element.out);
+    }
+    return true;
+}
+
+bool lexer::internal_match_element(token * tok, const match_any_element & element)
+{
+    if (!internal_match_next(tok, nullptr))
+    {
+        return false;
+    }
+
+    if (element.out != nullptr)
+    {
+        *element.out = std::move(*tok);
+    }
+    return true;
+}
+
+bool lexer::scan_bool()
+{
+    token tok;
+    if (!next_token(&tok))
+    {
+        return internal_error(error_code::bool_missing);
+    }
+
+    if (!tok.is_boolean() && !tok.is_number())
+    {
+        return internal_error(error_code::bool_expected, {}, tok.as_string());
+    }
+
+    if (tok.as_uint64() > 1)
+    {
+        internal_warning(error_code::bool_not_0_or_1);
+    }
+
+    return tok.as_bool();
+}
+
+double lexer::scan_double()
+{
+    token tok;
+    if (!next_token(&tok))
+    {
+        internal_error(error_code::float_missing);
+        return 0.0;
+    }
+
+    // These are numbers but cannot be scanned as float/double.
+    constexpr auto bad_flags = (token::flags::binary      |
+                                token::flags::octal       |
+                                token::flags::hexadecimal |
+                                token::flags::ip_address  |
+                                token::flags::ip_port);
+
+    if ((tok.get_type() == token::type::number) && (tok.get_flags() & bad_flags))
+    {
+        internal_error(error_code::float_format);
+        return 0.0;
+    }
+
+    if (tok.get_type() == token::type::punctuation && tok == '-') // negative number
+    {
+        if (!expect_token_type(token::type::number, 0, &tok))
+        {
+            return 0.0;
+        }
+
+        if (tok.get_flags() & bad_flags)
+        {
+            internal_error(error_code::float_format);
+            return 0.0;
+        }
+
+        return -tok.as_double();
+    }
+    else if (tok.get_type() != token::type::number) // invalid
+    {
+        internal_error(error_code::float_expected, {}, tok.as_string());
+        return 0.0;
+    }
+    else // valid positive number
+    {
+        return tok.as_double();
+    }
+}
+
+std::uint64_t lexer::scan_uint64()
+{
+    token tok;
+    if (!next_token(&tok))
+    {
+        internal_error(error_code::uint_missing);
+        return 0;
+    }
+
+    if (tok.is_float())
+    {
+        internal_warning(error_code::uint_from_float);
+    }
+
+    if (tok.get_type() == token::type::punctuation && tok == '-') // negative number
+    {
+        internal_warning(error_code::uint_from_negative);
+
+        if (!expect_token_type(token::type::number, 0, &tok))
+        {
+            return 0;
+        }
+
+        if (tok.is_float())
+        {
+            internal_warning(error_code::uint_from_float);
+        }
+
+        return static_cast<std::uint64_t>(-tok.as_int64());
+    }
+    else if (tok.get_type() != token::type::number) // invalid
+    {
+        internal_error(error_code::uint_expected, {}, tok.as_string());
+        return 0;
+    }
+    else // valid positive number
+    {
+        return tok.as_uint64();
+    }
+}
+
+std::int64_t lexer::scan_int64()
+{
+    token tok;
+    if (!next_token(&tok))
+    {
+        internal_error(error_code::int_missing);
+        return 0;
+    }
+
+    if (tok.is_float())
+    {
+        internal_warning(error_code::int_from_float);
+    }
+
+    if (tok.get_type() == token::type::punctuation && tok == '-') // negative number
+    {
+        if (!expect_token_type(token::type::number, 0, &tok))
+        {
+            return 0;
+        }
+
+        if (tok.is_float())
+        {
+            internal_warning(error_code::int_from_float);
+        }
+
+        return -tok.as_int64();
+    }
+    else if (tok.get_type() != token::type::number) // invalid
+    {
+        internal_error(error_code::int_expected, {}, tok.as_string());
+        return 0;
+    }
+    else // valid positive number
+    {
+        return tok.as_int64();
+    }
+}
+
+std::string lexer::scan_string()
+{
+    token tok;
+    std::string out;
+
+    if (!next_token(&tok))
+    {
+        internal_error(error_code::string_missing);
+        return out;
+    }
+
+    if (tok.get_type() != token::type::string &&
+        tok.get_type() != token::type::literal)
+    {
+        internal_error(error_code::string_expected, {}, tok.as_string());
+        return out;
+    }
+
+    tok.move_to(&out);
+    return out;
+}
+
+std::string lexer::scan_bracketed_section()
+{
+    // The next token should be an open curly bracket.
+    // Scans until a matching close bracket is found.
+    // Internal bracket depths are properly skipped.
+
+    token tok;
+    int depth;
+    std::string out;
+
+    if (!expect_token_type(lexer::token::type::punctuation,
+        static_cast<std::uint32_t>(lexer::punctuation_id::open_curly_bracket), &tok))
+    {
+        return out;
+    }
+
+    out   = "{";
+    depth = 1;
+
+    do
+    {
+        if (!next_token(&tok))
+        {
+            internal_error(error_code::missing_closing_bracket);
+            return out;
+        }
+
+        // If the token is on a new line...
+        const std::uint32_t lines_crossed = internal_lines_crossed(tok);
+        for (std::uint32_t i = 0; i < lines_crossed; ++i)
+        {
+            out.push_back('\n');
+        }
+
+        if (tok.get_type() == token::type::punctuation)
+        {
+            if (is_punctuation_token(tok, punctuation_id::open_curly_bracket))
+            {
+                ++depth;
+            }
+            else if (is_punctuation_token(tok, punctuation_id::close_curly_bracket))
+            {
+                --depth;
+            }
+        }
+
+        if (tok.get_type() == token::type::string)
+        {
+            out += "\"";
+            out += tok.as_string();
+            out += "\"";
+        }
+        else
+        {
+            out += tok.as_string();
+        }
+        out += " ";
+    }
+    while (depth);
+
+    return out;
+}
+
+std::string lexer::scan_bracketed_section_exact(int tabs)
+{
+    std::string out;
+    if (!expect_token_char('{'))
+    {
+        return out;
+    }
+
+    out = "{";
+    int  depth      = 1;
+    bool skip_white = false;
+    bool do_tabs    = (tabs >= 0);
+
+    while (depth && *m_script_ptr)
+    {
+        const char c = *(m_script_ptr++);
+        switch (c)
+        {
+        case '\t' :
+        case ' '  :
+            if (skip_white)
+            {
+                continue;
+            }
+            break;
+
+        case '\n' :
+            if (do_tabs)
+            {
+                out.push_back(c);
+                skip_white = true;
+                continue;
+            }
+            break;
+
+        case '{' :
+            ++depth;
+            ++tabs;
+            break;
+
+        case '}' :
+            --depth;
+            --tabs;
+            break;
+
+        default :
+            break;
+        } // switch (c)
+
+        if (skip_white)
+        {
+            int i = tabs;
+            if (c == '{')
+            {
+                --i;
+            }
+
+            skip_white = false;
+            for (; i > 0; --i)
+            {
+                out.push_back('\t');
+            }
+        }
+        out.push_back(c);
+    }
+
+    return out;
+}
+
+std::string lexer::scan_rest_of_line()
+{
+    token tok;
+    std::string out;
+
+    while (next_token(&tok))
+    {
+        if (internal_lines_crossed(tok) != 0)
+        {
+            m_script_ptr = m_last_script_ptr;
+            m_line_num   = m_last_line_num;
+            break;
+        }
+
+        if (!out.empty())
+        {
+            out.push_back(' ');
+        }
+        out += tok.as_string();
+    }
+
+    return out;
+}
+
+std::string lexer::scan_complete_line()
+{
+    return complete_line_view().as_string();
+}
+
+lexer::text_view lexer::bracketed_section_view()
+{
+    if (!expect_token_char('{'))
+    {
+        return {};
+    }
+
+    // Points at the '{', even if it came from unget_token().
+    const char * const start_ptr = m_whitespace_end_ptr;
+    LEXER_ASSERT(*start_ptr == '{');
+
+    if (!skip_bracketed_section(/* scan_first_bracket = */ false))
+    {
+        internal_error(error_code::missing_closing_bracket);
+        return {};
+    }
+
+    return { start_ptr, static_cast<std::size_t>(m_script_ptr - start_ptr) };
+}
+
+lexer::text_view lexer::rest_of_line_view()
+{
+    // A token put back starts the line.
+    if (m_token_available)
+    {
+        m_script_ptr      = m_whitespace_end_ptr;
+        m_token_available = false;
+    }
+
+    while (*m_script_ptr == ' ' || *m_script_ptr == '\t')
+    {
+        ++m_script_ptr;
+    }
+
+    const char * const start_ptr = m_script_ptr;
+    while (*m_script_ptr != '\0' && *m_script_ptr != '\n')
+    {
+        ++m_script_ptr;
+    }
+
+    const char * end_ptr = m_script_ptr;
+    while (end_ptr != start_ptr && *(end_ptr - 1) <= ' ')
+    {
+        --end_ptr;
+    }
+
+    return { start_ptr, static_cast<std::size_t>(end_ptr - start_ptr) };
+}
+
+lexer::text_view lexer::complete_line_view()
+{
+    // Returns a view up to the '\n', but doesn't eat any
+    // whitespace at the beginning of the next line.
+
+    const char * start_ptr = m_script_ptr;
+    for (;; ++m_script_ptr)
+    {
+        if (*m_script_ptr == '\0')
+        {
+            break; // End of the buffer
+        }
+
+        if (*m_script_ptr == '\n')
+        {
+            ++m_line_num;
+            ++m_script_ptr;
+            break;
+        }
+    }
+
+    return { start_ptr, static_cast<std::size_t>(m_script_ptr - start_ptr) };
+}
+
+std::string lexer::get_last_whitespace() const
+{
+    std::string whitespace;
+    for (const char * p = m_whitespace_start_ptr; p < m_whitespace_end_ptr; ++p)
+    {
+        whitespace.push_back(*p);
+    }
+    return whitespace;
+}
+
+std::uint32_t lexer::internal_lines_crossed(const token & tok) const noexcept
+{
+    if (!(m_flags & flags::lazy_line_numbers))
+    {
+        return tok.get_lines_crossed();
+    }
+
+    // The token doesn't know, but the whitespace before it is still at hand.
+    if (m_whitespace_start_ptr == nullptr || m_whitespace_end_ptr == nullptr)
+    {
+        return 0;
+    }
+    return lexer_detail::count_newlines(m_whitespace_start_ptr, m_whitespace_end_ptr);
+}
+
+std::uint32_t lexer::internal_last_line_number() const noexcept
+{
+    if ((m_flags & flags::lazy_line_numbers) && m_last_script_ptr != nullptr && m_buffer_head_ptr != nullptr)
+    {
+        return get_line_number_at(static_cast<std::size_t>(m_last_script_ptr - m_buffer_head_ptr));
+    }
+    return m_last_line_num;
+}
+
+bool lexer::internal_read_whitespace()
+{
+    if (m_flags & flags::lazy_line_numbers)
+    {
+        return internal_skip_whitespace_and_comments<false>();
+    }
+    return internal_skip_whitespace_and_comments<true>();
+}
+
+template<bool TrackLines>
+bool lexer::internal_skip_whitespace_and_comments()
+{
+    for (;;)
+    {
+        // Skip whitespace:
+        while (*m_script_ptr <= ' ')
+        {
+            if (!*m_script_ptr)
+            {
+                return false;
+            }
+            if (TrackLines && *m_script_ptr == '\n')
+            {
+                ++m_line_num;
+            }
+            ++m_script_ptr;
+        }
+
+        // Skip comments:
+        if (m_comment_style != nullptr)
+        {
+            if (internal_skip_styled_comment(TrackLines) == comment_kind::none)
+            {
+                break;
+            }
+            if (!*m_script_ptr)
+            {
+                return false;
+            }
+            continue;
+        }
+        if (*m_script_ptr == '/')
+        {
+            // C++-style comments:
+            if (*(m_script_ptr + 1) == '/')
+            {
+                ++m_script_ptr;
+                if (!internal_skip_line_comment<TrackLines>() || !*m_script_ptr)
+                {
+                    return false;
+                }
+                continue;
+            }
+            // C-style/multi-line comments:
+            else if (*(m_script_ptr + 1) == '*')
+            {
+                ++m_script_ptr;
+                if (!internal_skip_block_comment<TrackLines>() || !*m_script_ptr)
+                {
+                    return false;
+                }
+                continue;
+            }
+        }
+        break;
+    }
+    return true;
+}
+
+template<bool TrackLines>
+bool lexer::internal_skip_line_comment()
+{
+    // m_script_ptr is at the last char scanned, the second '/' of the comment start.
+    if (TrackLines)
+    {
+        do
+        {
+            ++m_script_ptr;
+            if (!*m_script_ptr)
+            {
+                return false;
+            }
+        }
+        while (*m_script_ptr != '\n');
+        ++m_line_num;
+    }
+    else
+    {
+        // No lines to count, so just jump to the end of the comment.
+        m_script_ptr = std::strchr(m_script_ptr + 1, '\n');
+        if (m_script_ptr == nullptr)
+        {
+            m_script_ptr = m_end_ptr;
+            return false;
+        }
+    }
+    ++m_script_ptr;
+    return true;
+}
+
+template<bool TrackLines>
+bool lexer::internal_skip_block_comment()
+{
+    // m_script_ptr is at the last char scanned, the '*' of the comment start. So '/*/' is a whole comment.
+    for (;;)
+    {
+        ++m_script_ptr;
+        if (!*m_script_ptr)
+        {
+            return false;
+        }
+        if (*m_script_ptr == '\n')
+        {
+            if (TrackLines)
+            {
+                ++m_line_num;
+            }
+        }
+        else if (*m_script_ptr == '/')
+        {
+            if (*(m_script_ptr - 1) == '*')
+            {
+                break;
+            }
+            if (*(m_script_ptr + 1) == '*')
+            {
+                internal_warning(error_code::nested_comment);
+            }
+        }
+    }
+    ++m_script_ptr;
+    return true;
+}
+
+bool lexer::internal_resume_whitespace(comment_kind * open_comment)
+{
+    LEXER_ASSERT(open_comment != nullptr && m_comment_style == nullptr);
+    if (m_flags & flags::lazy_line_numbers)
+    {
+        return internal_resume_whitespace_and_comments<false>(open_comment);
+    }
+    return internal_resume_whitespace_and_comments<true>(open_comment);
+}
+
+template<bool TrackLines>
+bool lexer::internal_resume_whitespace_and_comments(comment_kind * open_comment)
+{
+    // Same as internal_skip_whitespace_and_comments(), but a comment at a time, to tell which one the script ended in.
+    if (*open_comment != comment_kind::none)
+    {
+        // Continue from the last char scanned. A '/' there might have been followed by a '*' that wasn't there yet.
+        --m_script_ptr;
+        bool closed;
+        if (*open_comment == comment_kind::line)
+        {
+            closed = internal_skip_line_comment<TrackLines>();
+        }
+        else
+        {
+            if (*m_script_ptr == '/' && *(m_script_ptr + 1) == '*')
+            {
+                internal_warning(error_code::nested_comment);
+            }
+            closed = internal_skip_block_comment<TrackLines>();
+        }
+        if (!closed)
+        {
+            return false;
+        }
+        *open_comment = comment_kind::none;
+    }
+
+    for (;;)
+    {
+        while (*m_script_ptr <= ' ')
+        {
+            if (!*m_script_ptr)
+            {
+                return false;
+            }
+            if (TrackLines && *m_script_ptr == '\n')
+            {
+                ++m_line_num;
+            }
+            ++m_script_ptr;
+        }
+
+        if (*m_script_ptr != '/' || (*(m_script_ptr + 1) != '/' && *(m_script_ptr + 1) != '*'))
+        {
+            return true;
+        }
+
+        ++m_script_ptr;
+        if (*m_script_ptr == '/')
+        {
+            *open_comment = comment_kind::line;
+            if (!internal_skip_line_comment<TrackLines>())
+            {
+                return false;
+            }
+        }
+        else
+        {
+            *open_comment = comment_kind::block;
+            if (!internal_skip_block_comment<TrackLines>())
+            {
+                return false;
+            }
+        }
+        *open_comment = comment_kind::none;
+    }
+}
+
+lexer::comment_kind lexer::internal_skip_styled_comment(const bool track_lines)
+{
+    const char * p = m_script_ptr;
+    if (!m_comment_style->may_start_comment(*p))
+    {
+        return comment_kind::none;
+    }
+
+    // The longest opening delimiter wins.
+    const comment_style::delimiter * found = nullptr;
+    for (std::size_t i = 0; i < m_comment_style->m_count; ++i)
+    {
+        const comment_style::delimiter & d = m_comment_style->m_delimiters[i];
+        if ((found == nullptr || d.open_length > found->open_length) &&
+            std::strncmp(p, d.open, d.open_length) == 0)
+        {
+            found = &d;
+        }
+    }
+
+    if (found == nullptr)
+    {
+        return comment_kind::none;
+    }
+
+    p += found->open_length;
+
+    if (found->close_length == 0)
+    {
+        const char * const newline = std::strchr(p, '\n');
+        if (newline == nullptr)
+        {
+            m_script_ptr = m_end_ptr;
+        }
+        else
+        {
+            if (track_lines)
+            {
+                ++m_line_num;
+            }
+            m_script_ptr = newline + 1;
+        }
+        return comment_kind::line;
+    }
+
+    // Unterminated block comments end with the script, like the C-style ones.
+    for (; *p; ++p)
+    {
+        if (*p == '\n' && track_lines)
+        {
+            ++m_line_num;
+        }
+        if (*p == found->close[0] && std::strncmp(p, found->close, found->close_length) == 0)
+        {
+            // The first char was counted above.
+            m_script_ptr = p + found->close_length;
+            if (track_lines)
+            {
+                m_line_num += lexer_detail::count_newlines(p + 1, m_script_ptr);
+            }
+            return comment_kind::block;
+        }
+    }
+
+    m_script_ptr = p;
+    return comment_kind::block;
+}
+
+bool lexer::internal_read_escape_character(char * out_char)
+{
+    LEXER_ASSERT(out_char != nullptr);
+
+    int c, val, i;
+    ++m_script_ptr; // Step over the leading '\\'
+
+    // Determine the escape character:
+    switch (*m_script_ptr)
+    {
+    case '0'  : c = '\0'; break;
+    case 'n'  : c = '\n'; break;
+    case 'r'  : c = '\r'; break;
+    case 't'  : c = '\t'; break;
+    case 'v'  : c = '\v'; break;
+    case 'b'  : c = '\b'; break;
+    case 'f'  : c = '\f'; break;
+    case 'a'  : c = '\a'; break;
+    case '\\' : c = '\\'; break;
+    case '\'' : c = '\''; break;
+    case '\"' : c = '\"'; break;
+    case '\?' : c = '\?'; break;
+    case 'x'  : // Scan hexadecimal constant:
+        {
+            ++m_script_ptr;
+            for (i = 0, val = 0; ; ++i, ++m_script_ptr)
+            {
+                c = *m_script_ptr;
+                if (c >= '0' && c <= '9')
+                {
+                    c = c - '0';
+                }
+                else if (c >= 'A' && c <= 'Z')
+                {
+                    c = c - 'A' + 10;
+                }
+                else if (c >= 'a' && c <= 'z')
+                {
+                    c = c - 'a' + 10;
+                }
+                else
+                {
+                    break;
+                }
+                val = (val << 4) + c;
+            }
+            --m_script_ptr;
+
+            if (val > 0xFF)
+            {
+                internal_warning(error_code::hex_escape_too_big);
+                val = 0xFF;
+            }
+
+            c = val;
+            break;
+        }
+    default : // NOTE: decimal ASCII code, NOT octal!
+        {
+            if (*m_script_ptr < '0' || *m_script_ptr > '9')
+            {
+                return internal_error(error_code::invalid_escape_char);
+            }
+
+            for (i = 0, val = 0; ; ++i, ++m_script_ptr)
+            {
+                c = *m_script_ptr;
+                if (c >= '0' && c <= '9')
+                {
+                    c = c - '0';
+                }
+                else
+                {
+                    break;
+                }
+                val = val * 10 + c;
+            }
+            --m_script_ptr;
+
+            if (val > 0xFF)
+            {
+                internal_warning(error_code::escape_value_too_big);
+                val = 0xFF;
+            }
+
+            c = val;
+            break;
+        }
+    } // switch (*m_script_ptr)
+
+    // Step over the escape character or the last digit of the number.
+    ++m_script_ptr;
+
+    *out_char = static_cast<char>(c);
+    return true;
+}
+
+bool lexer::internal_read_string(const int quote, token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    // Escape characters are interpreted.
+    // Reads two strings with only a white space between them as one string.
+
+    std::uint32_t tmp_line_num;
+    const char * tmp_script_ptr;
+    char ch;
+
+    if (quote == '"') // Quoted string
+    {
+        out_token->set_type(token::type::string);
+    }
+    else // Character literal (maybe a multi-char literal)
+    {
+        out_token->set_type(token::type::literal);
+    }
+
+    ++m_script_ptr; // Skip leading quote
+
+    for (;;)
+    {
+        // If there is an escape character and escape characters are allowed...
+        if (*m_script_ptr == '\\' && !(m_flags & flags::no_string_escape_chars))
+        {
+            if (!internal_read_escape_character(&ch))
+            {
+                return false;
+            }
+            out_token->append(ch);
+        }
+        // If a trailing quote...
+        else if (*m_script_ptr == quote)
+        {
+            // Step over the quote:
+            ++m_script_ptr;
+
+            // If consecutive strings should not be concatenated...
+            if ((m_flags & flags::no_string_concat) &&
+              (!(m_flags & flags::allow_backslash_string_concat) || quote != '"'))
+            {
+                break;
+            }
+
+            tmp_script_ptr = m_script_ptr;
+            tmp_line_num   = m_line_num;
+
+            // Read white space between possible two consecutive strings.
+            // Restore line index on failure.
+            if (!internal_read_whitespace())
+            {
+                m_script_ptr = tmp_script_ptr;
+                m_line_num   = tmp_line_num;
+                break;
+            }
+
+            if (m_flags & flags::no_string_concat)
+            {
+                if (*m_script_ptr != '\\')
+                {
+                    m_script_ptr = tmp_script_ptr;
+                    m_line_num   = tmp_line_num;
+                    break;
+                }
+
+                ++m_script_ptr; // Step over the '\\'
+
+                if (!internal_read_whitespace() || *m_script_ptr != quote)
+                {
+                    return internal_error(error_code::missing_concat_string);
+                }
+            }
+
+            // If there's no leading quote...
+            if (*m_script_ptr != quote)
+            {
+                m_script_ptr = tmp_script_ptr;
+                m_line_num   = tmp_line_num;
+                break;
+            }
+
+            ++m_script_ptr; // Step over the new leading quote.
+        }
+        else
+        {
+            if (*m_script_ptr == '\0')
+            {
+                return internal_error(error_code::missing_trailing_quote);
+            }
+            if (*m_script_ptr == '\n')
+            {
+                return internal_error(error_code::newline_in_string);
+            }
+            out_token->append(*m_script_ptr++);
+        }
+    }
+
+    if (out_token->get_type() == token::type::literal)
+    {
+        if (!(m_flags & flags::allow_multi_char_literals))
+        {
+            if (out_token->get_length() > 1)
+            {
+                return internal_error(error_code::multi_char_literal);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool lexer::internal_read_name_ident(token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    // Names can contain aA-zZ letters, numbers or underscore.
+    auto valid_name_char = [](const int c) -> bool
+    {
+        return ((c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '_');
+    };
+
+    // If treating all tokens as strings, don't parse '-' as a separate token.
+    auto strings_only = [](const int c, const std::uint32_t lex_flags) -> bool
+    {
+        return (lex_flags & flags::only_strings) && (c == '-');
+    };
+
+    // If special path name characters are allowed.
+    auto allowing_path_names = [](const int c, const std::uint32_t lex_flags) -> bool
+    {
+        return (lex_flags & flags::allow_path_names) && (c == '/' || c == '\\' || c == ':' || c == '.');
+    };
+
+    int c;
+    const char * const start_ptr = m_script_ptr;
+    out_token->set_type(token::type::identifier);
+
+    do
+    {
+        out_token->append(*m_script_ptr++);
+        c = *m_script_ptr;
+    }
+    while (valid_name_char(c) || strings_only(c, m_flags) || allowing_path_names(c, m_flags));
+
+    // The name is still in cache, so hashing it now is cheaper than from the token later.
+    if (m_flags & flags::hash_identifiers)
+    {
+        out_token->set_hash(hash_text(start_ptr, static_cast<std::size_t>(m_script_ptr - start_ptr)));
+    }
+
+    // Names reserved for the boolean constants:
+    if (*out_token == "true" || *out_token == "false")
+    {
+        out_token->set_flags(token::flags::boolean);
+    }
+    else
+    {
+        out_token->set_flags(0);
+    }
+
+    return true;
+}
+
+bool lexer::internal_read_number(token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    char c1 = *m_script_ptr;
+    char c2 = *(m_script_ptr + 1);
+    std::uint32_t token_flags = 0;
+
+    if (c1 == '0' && c2 != '.') // Integer:
+    {
+        // Check for a hexadecimal number:
+        if (c2 == 'x' || c2 == 'X')
+        {
+            out_token->append(*m_script_ptr++);
+            out_token->append(*m_script_ptr++);
+            c1 = *m_script_ptr;
+
+            while ((c1 >= '0' && c1 <= '9') ||
+                   (c1 >= 'a' && c1 <= 'f') ||
+                   (c1 >= 'A' && c1 <= 'F'))
+            {
+                out_token->append(c1);
+                c1 = *(++m_script_ptr);
+            }
+
+            token_flags = token::flags::hexadecimal | token::flags::integer;
+        }
+        // Check for a binary number:
+        else if (c2 == 'b' || c2 == 'B')
+        {
+            out_token->append(*m_script_ptr++);
+            out_token->append(*m_script_ptr++);
+            c1 = *m_script_ptr;
+
+            while (c1 == '0' || c1 == '1')
+            {
+                out_token->append(c1);
+                c1 = *(++m_script_ptr);
+            }
+
+            token_flags = token::flags::binary | token::flags::integer;
+        }
+        // Its an octal number:
+        else
+        {
+            out_token->append(*m_script_ptr++);
+            c1 = *m_script_ptr;
+
+            while (c1 >= '0' && c1 <= '7')
+            {
+                out_token->append(c1);
+                c1 = *(++m_script_ptr);
+            }
+
+            token_flags = token::flags::octal | token::flags::integer;
+        }
+    }
+    else // Decimal integer or floating point number or even an IP address:
+    {
+        // Count the number of '.' in the number:
+        int dot = 0;
+        for (;;)
+        {
+            if (c1 >= '0' && c1 <= '9')
+            {
+                // Nothing
+            }
+            else if (c1 == '.')
+            {
+                ++dot;
+            }
+            else
+            {
+                break;
+            }
+
+            out_token->append(c1);
+            c1 = *(++m_script_ptr);
+        }
+
+        if (c1 == 'e' && dot == 0)
+        {
+            // We have scientific notation without a decimal point.
+            ++dot;
+        }
+
+        // If a floating point number...
+        if (dot == 1)
+        {
+            token_flags = token::flags::decimal | token::flags::floating_point;
+
+            // Check for floating point exponent:
+            if (c1 == 'e')
+            {
+                // Append the 'e' so that token::update_cached_values() parses the value properly.
+                out_token->append(c1);
+                c1 = *(++m_script_ptr);
+
+                if (c1 == '-')
+                {
+                    out_token->append(c1);
+                    c1 = *(++m_script_ptr);
+                }
+                else if (c1 == '+')
+                {
+                    out_token->append(c1);
+                    c1 = *(++m_script_ptr);
+                }
+
+                while (c1 >= '0' && c1 <= '9')
+                {
+                    out_token->append(c1);
+                    c1 = *(++m_script_ptr);
+                }
+            }
+            // Check for floating point exceptions -> infinite 1.#INF or indefinite 1.#IND or NaN:
+            else if (c1 == '#')
+            {
+                c2 = 4;
+                if (internal_check_string("INF"))
+                {
+                    token_flags |= token::flags::infinite;
+                }
+                else if (internal_check_string("IND"))
+                {
+                    token_flags |= token::flags::indefinite;
+                }
+                else if (internal_check_string("NAN"))
+                {
+                    token_flags |= token::flags::nan;
+                }
+                else if (internal_check_string("QNAN"))
+                {
+                    token_flags |= token::flags::nan;
+                    c2++;
+                }
+                else if (internal_check_string("SNAN"))
+                {
+                    token_flags |= token::flags::nan;
+                    c2++;
+                }
+
+                for (int i = 0; i < c2; ++i)
+                {
+                    out_token->append(c1);
+                    c1 = *(++m_script_ptr);
+                }
+
+                while (c1 >= '0' && c1 <= '9')
+                {
+                    out_token->append(c1);
+                    c1 = *(++m_script_ptr);
+                }
+
+                if (!(m_flags & flags::allow_float_exceptions))
+                {
+                    return internal_error(error_code::float_exception, {}, out_token->as_string());
+                }
+            }
+        }
+        else if (dot > 1)
+        {
+            if (!(m_flags & flags::allow_ip_addresses))
+            {
+                return internal_error(error_code::multiple_dots_in_number);
+            }
+            if (dot != 3)
+            {
+                return internal_error(error_code::bad_ip_address);
+            }
+            token_flags = token::flags::ip_address;
+        }
+        else
+        {
+            token_flags = token::flags::decimal | token::flags::integer;
+        }
+    }
+
+    if (token_flags & token::flags::floating_point)
+    {
+        if (c1 > ' ')
+        {
+            // Single-precision: float
+            if (c1 == 'f' || c1 == 'F')
+            {
+                token_flags |= token::flags::single_precision;
+                ++m_script_ptr;
+            }
+            // Extended-precision: long double
+            else if (c1 == 'l' || c1 == 'L')
+            {
+                token_flags |= token::flags::extended_precision;
+                ++m_script_ptr;
+            }
+            // Default is double-precision: double
+            else
+            {
+                token_flags |= token::flags::double_precision;
+            }
+        }
+        else
+        {
+            token_flags |= token::flags::double_precision;
+        }
+    }
+    else if (token_flags & token::flags::integer)
+    {
+        // Default: signed
+        std::uint32_t int_flag = token::flags::signed_integer;
+
+        if (c1 > ' ')
+        {
+            // 1u, 1l, 1ul, 1lu
+            for (int i = 0; i < 2; ++i)
+            {
+                if (c1 == 'u' || c1 == 'U') // unsigned integer supersedes signed
+                {
+                    int_flag = token::flags::unsigned_integer;
+                }
+                else if (c1 == 'l' || c1 == 'L') // signed integer
+                {
+                    // Already set; ignore.
+                }
+                else
+                {
+                    break;
+                }
+                c1 = *(++m_script_ptr);
             }
-            return error("expected " + str + " but found \'" + out_token->as_string() + "\'");
         }
+
+        token_flags |= int_flag;
     }
-    else if (out_token->get_type() == token::type::punctuation)
+    else if (token_flags & token::flags::ip_address)
     {
-        // subtype_flags == some punctuation_id
-        if (subtype_flags >= m_punctuations_size)
+        if (c1 == ':')
         {
-            return error("bad punctuation index in subtype_flags!");
-        }
+            out_token->append(c1);
+            c1 = *(++m_script_ptr);
 
-        if (out_token->get_flags() != subtype_flags)
-        {
-            auto str = get_punctuation_from_id(static_cast<punctuation_id>(subtype_flags));
-            return error("expected \'" + str + "\' but found \'" + out_token->as_string() + "\'");
+            while (c1 >= '0' && c1 <= '9')
+            {
+                out_token->append(c1);
+                c1 = *(++m_script_ptr);
+            }
+
+            token_flags |= token::flags::ip_port;
         }
     }
 
+    out_token->set_type(token::type::number);
+    out_token->set_flags(token_flags);
     return true;
 }
 
-bool lexer::expect_any_token(token * out_token)
-{
-    LEXER_ASSERT(out_token != nullptr);
-    if (!next_token(out_token))
-    {
-        return error("couldn't read expected token!");
-    }
-    return true;
-}
-
-bool lexer::check_token_string(const char * const string)
+bool lexer::internal_read_punctuation(token * out_token)
 {
-    token tok;
-    return check_token_string(string, &tok);
-}
+    LEXER_ASSERT(out_token          != nullptr);
+    LEXER_ASSERT(m_punctuation_trie != nullptr);
 
-bool lexer::check_token_string(const char * const string, token * out_token)
-{
-    LEXER_ASSERT(string    != nullptr);
-    LEXER_ASSERT(out_token != nullptr);
+    // Walk down the trie remembering the last node that completed a punctuation,
+    // so the longest match is found without backtracking. The null terminator
+    // never matches a node, so we can't run past the end of the script.
+    const punctuation_trie_node * const nodes = m_punctuation_trie->nodes.data();
+    int n = m_punctuation_trie->roots[static_cast<unsigned char>(*m_script_ptr)];
+    int match = -1;
+    int match_length = 0;
 
-    if (!next_token(out_token))
+    for (int length = 1; n >= 0; ++length)
     {
-        return false;
-    }
+        if (nodes[n].punctuation >= 0)
+        {
+            match = nodes[n].punctuation;
+            match_length = length;
+        }
 
-    // If the given string is available:
-    if (*out_token == string)
-    {
-        return true;
+        const char next_char = m_script_ptr[length];
+        for (n = nodes[n].first_child; n >= 0 && nodes[n].ch != next_char; n = nodes[n].next_sibling)
+        {
+        }
     }
 
-    // Unread the token:
-    m_script_ptr = m_last_script_ptr;
-    m_line_num   = m_last_line_num;
-    return false;
-
-}
-
-bool lexer::check_token_type(const token::type type, const std::uint32_t subtype_flags, token * out_token)
-{
-    LEXER_ASSERT(out_token != nullptr);
-
-    token tok;
-    if (!next_token(&tok))
+    if (match < 0)
     {
         return false;
     }
 
-    if ((tok.get_type() == type) && ((tok.get_flags() & subtype_flags) == subtype_flags))
-    {
-        *out_token = std::move(tok);
-        return true;
-    }
+    out_token->set_string(m_script_ptr, static_cast<std::size_t>(match_length));
+    out_token->set_type(token::type::punctuation);
+    out_token->set_flags(static_cast<std::uint32_t>(m_punctuations[match].id)); // Subtype/flags is the punctuation id.
 
-    // Unread the token:
-    m_script_ptr = m_last_script_ptr;
-    m_line_num   = m_last_line_num;
-    return false;
+    m_script_ptr += match_length;
+    return true;
 }
 
-bool lexer::peek_token_string(const char * const string)
+lexer::error_callbacks * lexer::internal_get_error_callbacks() const noexcept
 {
-    LEXER_ASSERT(string != nullptr);
-
-    token tok;
-    if (!next_token(&tok))
-    {
-        return false;
-    }
-
-    // Unread the token:
-    m_script_ptr = m_last_script_ptr;
-    m_line_num   = m_last_line_num;
-
-    if (tok == string)
-    {
-        return true;
-    }
-
-    return false;
+    return (m_instance_callbacks != nullptr) ? m_instance_callbacks : m_error_callbacks;
 }
 
-bool lexer::peek_token_type(const token::type type, const std::uint32_t subtype_flags, token * out_token)
+bool lexer::internal_use_structural_index()
 {
-    LEXER_ASSERT(out_token != nullptr);
-
-    token tok;
-    if (!next_token(&tok))
+    // The index only knows about the default punctuations and comments, and can't replay an ungot token.
+    if (!(m_flags & flags::structural_index) || (m_flags & flags::only_strings) ||
+        m_token_available || m_punctuations != default_punctuations || !is_initialized() ||
+        m_token_rules != nullptr || m_comment_style != nullptr)
     {
         return false;
     }
-
-    // Unread the token:
-    m_script_ptr = m_last_script_ptr;
-    m_line_num   = m_last_line_num;
-
-    if ((tok.get_type() == type) && ((tok.get_flags() & subtype_flags) == subtype_flags))
-    {
-        *out_token = std::move(tok);
-        return true;
-    }
-
-    return false;
-}
-
-bool lexer::skip_until_string(const char * const string)
-{
-    LEXER_ASSERT(string != nullptr);
-
-    token tok;
-    while (next_token(&tok))
-    {
-        if (tok == string)
-        {
-            return true;
-        }
-    }
-    return false;
-}
-
-bool lexer::skip_rest_of_line()
-{
-    token tok;
-    while (next_token(&tok))
-    {
-        if (tok.get_lines_crossed() != 0)
-        {
-            m_script_ptr = m_last_script_ptr;
-            m_line_num   = m_last_line_num;
-            return true;
-        }
-    }
-    return false;
+    return m_structural_indexed || build_structural_index();
 }
 
-bool lexer::skip_bracketed_section(const bool scan_first_bracket)
+bool lexer::internal_skip_indexed_section(const bool scan_first_bracket)
 {
-    // Skips until a matching close curly bracket is found.
-    // Internal bracket depths are properly skipped.
-
-    token tok;
-    int depth = (scan_first_bracket ? 0 : 1);
-
-    do
+    if (scan_first_bracket)
     {
-        if (!next_token(&tok))
-        {
-            return false;
-        }
-
-        if (tok.get_type() == token::type::punctuation)
-        {
-            if (is_punctuation_token(tok, punctuation_id::open_curly_bracket))
-            {
-                ++depth;
-            }
-            else if (is_punctuation_token(tok, punctuation_id::close_curly_bracket))
-            {
-                --depth;
-            }
-        }
-    }
-    while (depth);
-
-    return true;
-}
+        const char * const start_ptr = m_script_ptr;
+        const std::uint32_t start_line = m_line_num;
 
-bool lexer::skip_whitespace(const bool current_line)
-{
-    for (;;)
-    {
-        LEXER_ASSERT(m_script_ptr <= m_end_ptr);
-        if (m_script_ptr == m_end_ptr)
+        if (!internal_read_whitespace())
         {
             return false;
         }
 
-        // Skip whitespace:
-        while (*m_script_ptr <= ' ')
-        {
-            if (m_script_ptr == m_end_ptr)
-            {
-                return false;
-            }
-            if (!*m_script_ptr)
-            {
-                return false;
-            }
-            if (*m_script_ptr == '\n')
-            {
-                ++m_line_num;
-                if (current_line)
-                {
-                    ++m_script_ptr;
-                    return true;
-                }
-            }
-            ++m_script_ptr;
-        }
-
-        // Skip comments:
-        if (*m_script_ptr == '/')
+        // Like the tokenized version, anything other than a '{' is consumed as a single token.
+        if (*m_script_ptr != '{')
         {
-            // C++-style comments:
-            if (*(m_script_ptr + 1) == '/')
-            {
-                ++m_script_ptr;
-                do
-                {
-                    ++m_script_ptr;
-                    if (!*m_script_ptr)
-                    {
-                        return false;
-                    }
-                }
-                while (*m_script_ptr != '\n');
-
-                ++m_line_num;
-                ++m_script_ptr;
+            m_script_ptr = start_ptr;
+            m_line_num   = start_line;
 
-                if (current_line)
-                {
-                    return true;
-                }
-                if (!*m_script_ptr)
-                {
-                    return false;
-                }
-                continue;
-            }
-            // C-style/multi-line comments:
-            else if (*(m_script_ptr + 1) == '*')
-            {
-                ++m_script_ptr;
-                for (;;)
-                {
-                    ++m_script_ptr;
-                    if (!*m_script_ptr)
-                    {
-                        return false;
-                    }
-                    if (*m_script_ptr == '\n')
-                    {
-                        ++m_line_num;
-                    }
-                    else if (*m_script_ptr == '/')
-                    {
-                        if (*(m_script_ptr - 1) == '*')
-                        {
-                            break;
-                        }
-                        if (*(m_script_ptr + 1) == '*')
-                        {
-                            warning("nested C-style multi-line comment!");
-                        }
-                    }
-                }
+            token tok;
+            return next_token(&tok);
+        }
+        ++m_script_ptr;
+    }
 
-                ++m_script_ptr;
-                if (!*m_script_ptr)
-                {
-                    return false;
-                }
-                continue;
-            }
+    const auto first = std::lower_bound(m_structural_index.begin(), m_structural_index.end(),
+                                        static_cast<std::uint32_t>(m_script_ptr - m_buffer_head_ptr));
+    int depth = 1;
+
+    for (auto it = first; it != m_structural_index.end(); ++it)
+    {
+        const char c = m_buffer_head_ptr[*it];
+        if (c == '{')
+        {
+            ++depth;
+        }
+        else if (c == '}' && --depth == 0)
+        {
+            internal_jump_to_script_ptr(m_buffer_head_ptr + *it);
+            return true;
         }
-        break;
     }
-    return true;
+
+    // Unbalanced brackets. The tokenized version would also consume the rest of the script.
+    internal_jump_to_script_ptr(m_end_ptr);
+    return false;
 }
 
-void lexer::unget_token(const token & in_token)
+bool lexer::internal_skip_until_indexed_char(const char c)
 {
-    if (m_token_available)
+    const auto first = std::lower_bound(m_structural_index.begin(), m_structural_index.end(),
+                                        static_cast<std::uint32_t>(m_script_ptr - m_buffer_head_ptr));
+
+    for (auto it = first; it != m_structural_index.end(); ++it)
     {
-        warning("lexer::unget_token() called twice in a row!");
+        if (m_buffer_head_ptr[*it] == c)
+        {
+            internal_jump_to_script_ptr(m_buffer_head_ptr + *it);
+            return true;
+        }
     }
 
-    m_leftover_token  = in_token;
-    m_token_available = true;
+    internal_jump_to_script_ptr(m_end_ptr);
+    return false;
 }
 
-bool lexer::scan_bool()
+void lexer::internal_jump_to_script_ptr(const char * const new_script_ptr)
 {
-    token tok;
-    if (!next_token(&tok))
+    // Leaves the lexer as if the single char token at 'new_script_ptr' was just read.
+    LEXER_ASSERT(new_script_ptr >= m_script_ptr && new_script_ptr <= m_end_ptr);
+
+    if (!(m_flags & flags::lazy_line_numbers))
     {
-        return error("couldn't read expected boolean literal!");
+        m_line_num += lexer_detail::count_newlines(m_script_ptr, new_script_ptr);
     }
+    m_last_line_num        = m_line_num;
+    m_last_script_ptr      = new_script_ptr;
+    m_whitespace_start_ptr = new_script_ptr;
+    m_whitespace_end_ptr   = new_script_ptr;
+    m_script_ptr           = (new_script_ptr != m_end_ptr) ? (new_script_ptr + 1) : m_end_ptr;
+}
 
-    if (!tok.is_boolean() && !tok.is_number())
+bool lexer::internal_replay_static_token(token * out_token)
+{
+    // Records are only valid if scanning now would produce the same tokens.
+    if (((m_flags ^ m_static_token_flags) & static_token_scan_flags) != 0 ||
+        m_punctuations != default_punctuations || m_token_rules != nullptr || m_comment_style != nullptr)
     {
-        return error("expected boolean literal or number, found \'" + tok.as_string() + "\'.");
+        return false;
     }
 
-    if (tok.as_uint64() > 1)
+    const auto offset = static_cast<std::uint32_t>(m_script_ptr - m_buffer_head_ptr);
+    std::size_t index = m_static_token_cursor;
+
+    // Usually the next record follows the last one replayed, unless
+    // the script pointer was moved back by a peek method or forward by a skip.
+    if (index >= m_static_token_count || m_static_tokens[index].start < offset ||
+        (index != 0 && m_static_tokens[index - 1].end > offset))
     {
-        warning("expected 0 or 1 for numerical boolean literal!");
+        const static_token * const first = m_static_tokens;
+        const static_token * const last  = m_static_tokens + m_static_token_count;
+        index = static_cast<std::size_t>(std::lower_bound(first, last, offset,
+            [](const static_token & tok, const std::uint32_t pos) { return tok.end <= pos; }) - first);
     }
 
-    return tok.as_bool();
-}
-
-double lexer::scan_double()
-{
-    token tok;
-    if (!next_token(&tok))
+    // Past the last record or in the middle of a token: scan it.
+    if (index >= m_static_token_count || m_static_tokens[index].start < offset)
     {
-        error("couldn't read expected floating-point number!");
-        return 0.0;
+        return false;
     }
 
-    // These are numbers but cannot be scanned as float/double.
-    constexpr auto bad_flags = (token::flags::binary      |
-                                token::flags::octal       |
-                                token::flags::hexadecimal |
-                                token::flags::ip_address  |
-                                token::flags::ip_port);
+    const static_token & record = m_static_tokens[index];
+    m_static_token_cursor = index + 1;
 
-    if ((tok.get_type() == token::type::number) && (tok.get_flags() & bad_flags))
+    // Let the normal path scan strings that need their escapes or concatenation handled.
+    if (record.rescan)
     {
-        error("number format cannot be scanned as a floating-point value!");
-        return 0.0;
+        return false;
     }
 
-    if (tok.get_type() == token::type::punctuation && tok == '-') // negative number
-    {
-        if (!expect_token_type(token::type::number, 0, &tok))
-        {
-            return 0.0;
-        }
+    m_last_line_num        = m_line_num;
+    m_last_script_ptr      = m_script_ptr;
+    m_whitespace_start_ptr = m_script_ptr;
+    m_whitespace_end_ptr   = m_buffer_head_ptr + record.start;
+    m_script_ptr           = m_buffer_head_ptr + record.end;
 
-        if (tok.get_flags() & bad_flags)
-        {
-            error("number format cannot be scanned as a floating-point value!");
-            return 0.0;
-        }
+    out_token->clear();
 
-        return -tok.as_double();
-    }
-    else if (tok.get_type() != token::type::number) // invalid
+    if (!(m_flags & flags::lazy_line_numbers))
     {
-        error("expected float value, found \'" + tok.as_string() + "\'.");
-        return 0.0;
+        // Only whitespace and comments are between the records, and tokens don't span lines.
+        m_line_num += lexer_detail::count_newlines(m_whitespace_start_ptr, m_whitespace_end_ptr);
+        out_token->set_line_number(m_line_num);
+        out_token->set_lines_crossed(m_line_num - m_last_line_num);
     }
-    else // valid positive number
+
+    out_token->set_type(record.type);
+    out_token->set_flags(record.flags);
+    out_token->set_string(m_buffer_head_ptr + record.text_start, record.text_length);
+
+    if (record.type == token::type::identifier && (m_flags & flags::hash_identifiers))
     {
-        return tok.as_double();
+        out_token->set_hash(hash_text(m_buffer_head_ptr + record.text_start, record.text_length));
     }
+    return true;
 }
 
-std::uint64_t lexer::scan_uint64()
+bool lexer::internal_read_custom_token(token * out_token)
 {
-    token tok;
-    if (!next_token(&tok))
+    LEXER_ASSERT(m_token_rules->is_compiled());
+
+    std::uint32_t rule_id = 0;
+    const std::size_t length = m_token_rules->match(m_script_ptr, m_end_ptr, &rule_id);
+    if (length == 0)
     {
-        error("couldn't read expected unsigned integer number!");
-        return 0;
+        return false;
     }
 
-    if (tok.is_float())
+    out_token->set_type(token::type::custom);
+    out_token->set_flags(rule_id);
+    out_token->set_string(m_script_ptr, length);
+
+    // Rules are free to match newlines.
+    if (!(m_flags & flags::lazy_line_numbers))
     {
-        warning("expected unsigned integer number, got float; truncating it to integer...");
+        m_line_num += lexer_detail::count_newlines(m_script_ptr, m_script_ptr + length);
     }
 
-    if (tok.get_type() == token::type::punctuation && tok == '-') // negative number
-    {
-        warning("expected unsigned integer number, got a negative value instead!");
+    m_script_ptr += length;
+    return true;
+}
 
-        if (!expect_token_type(token::type::number, 0, &tok))
-        {
-            return 0;
-        }
+bool lexer::internal_check_string(const char * const string) const
+{
+    LEXER_ASSERT(string != nullptr);
 
-        if (tok.is_float())
+    for (std::size_t i = 0; string[i] != '\0'; ++i)
+    {
+        if (m_script_ptr[i] != string[i])
         {
-            warning("expected unsigned integer number, got float; truncating it to integer...");
+            return false;
         }
-
-        return static_cast<std::uint64_t>(-tok.as_int64());
-    }
-    else if (tok.get_type() != token::type::number) // invalid
-    {
-        error("expected unsigned integer value, found \'" + tok.as_string() + "\'.");
-        return 0;
-    }
-    else // valid positive number
-    {
-        return tok.as_uint64();
     }
+    return true;
 }
 
-std::int64_t lexer::scan_int64()
+std::string & lexer::ltrim_string(std::string * s)
 {
-    token tok;
-    if (!next_token(&tok))
+    LEXER_ASSERT(s != nullptr);
+    const auto first_non_blank = s->find_first_not_of(" \t\r\n\v\f");
+    return s->erase(0, first_non_blank);
+}
+
+std::string & lexer::rtrim_string(std::string * s)
+{
+    LEXER_ASSERT(s != nullptr);
+    const auto last_non_blank = s->find_last_not_of(" \t\r\n\v\f");
+    return s->erase((last_non_blank != std::string::npos) ? last_non_blank + 1 : 0);
+}
+
+std::string & lexer::trim_string(std::string * s)
+{
+    rtrim_string(s);
+    ltrim_string(s);
+    return *s;
+}
+
+std::uint64_t lexer::hash_text(const char * const str, const std::size_t count) noexcept
+{
+    LEXER_ASSERT(str != nullptr || count == 0);
+
+    //
+    // Multiply-xorshift hash in the style of wyhash, consuming 8 bytes per step.
+    // The tail is zero padded and the length is mixed in, so "A" and "A\0" differ.
+    //
+    static constexpr std::uint64_t k0 = 0xA0761D6478BD642FULL;
+    static constexpr std::uint64_t k1 = 0xE7037ED1A0B428DBULL;
+    static constexpr std::uint64_t k2 = 0x8EBC6AF09C88C6E3ULL;
+
+    auto mix = [](std::uint64_t x) noexcept
     {
-        error("couldn't read expected integer number!");
-        return 0;
+        x ^= x >> 32;
+        x *= k2;
+        x ^= x >> 29;
+        return x;
+    };
+
+    std::uint64_t h = k0 ^ (static_cast<std::uint64_t>(count) * k1);
+    std::size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, str + i, 8);
+        h = (h ^ mix(word ^ k0)) * k1;
     }
 
-    if (tok.is_float())
+    if (i < count)
     {
-        warning("expected integer number, got float; truncating it to integer...");
+        std::uint64_t word = 0;
+        std::memcpy(&word, str + i, count - i);
+        h = (h ^ mix(word ^ k0)) * k1;
     }
 
-    if (tok.get_type() == token::type::punctuation && tok == '-') // negative number
+    return mix(h);
+}
+
+// ========================================================
+// Shared error callbacks:
+// ========================================================
+
+lexer::error_callbacks * lexer::m_error_callbacks = nullptr;
+
+void lexer::set_error_callbacks(error_callbacks * err_callbacks) noexcept
+{
+    struct default_error_callbacks final : public lexer::error_callbacks
     {
-        if (!expect_token_type(token::type::number, 0, &tok))
+        void error(const std::string & message, bool fatal) override
         {
-            return 0;
+            std::cerr << message << std::endl;
+
+            #ifndef LEXER_NO_CXX_EXCEPTIONS
+            if (fatal)
+            {
+                throw lexer::exception{ message };
+            }
+            #else // ignored
+            (void)fatal;
+            #endif // LEXER_NO_CXX_EXCEPTIONS
         }
 
-        if (tok.is_float())
+        void warning(const std::string & message) override
         {
-            warning("expected integer number, got float; truncating it to integer...");
+            std::cerr << message << std::endl;
         }
+    };
+    static default_error_callbacks default_err_cbs;
 
-        return -tok.as_int64();
-    }
-    else if (tok.get_type() != token::type::number) // invalid
+    if (err_callbacks == nullptr)
     {
-        error("expected integer value, found \'" + tok.as_string() + "\'.");
-        return 0;
+        m_error_callbacks = &default_err_cbs;
     }
-    else // valid positive number
+    else
     {
-        return tok.as_int64();
+        m_error_callbacks = err_callbacks;
     }
 }
 
-std::string lexer::scan_string()
+lexer::error_callbacks * lexer::get_error_callbacks() noexcept
 {
-    token tok;
-    std::string out;
+    return m_error_callbacks;
+}
 
-    if (!next_token(&tok))
+// ========================================================
+// lexer::diagnostic_queue:
+// ========================================================
+
+#ifndef LEXER_NO_THREADS
+
+lexer::diagnostic_queue::~diagnostic_queue()
+{
+    node * n = m_head.load(std::memory_order_acquire);
+    while (n != nullptr)
     {
-        error("couldn't read expected string!");
-        return out;
+        node * const next = n->next;
+        delete n;
+        n = next;
     }
+}
 
-    if (tok.get_type() != token::type::string &&
-        tok.get_type() != token::type::literal)
+void lexer::diagnostic_queue::push(entry item)
+{
+    // Plain lock-free stack push; drain() restores the order.
+    node * const n = new node{ std::move(item), m_head.load(std::memory_order_relaxed) };
+    while (!m_head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed))
     {
-        error("expected string or character literal, found \'" + tok.as_string() + "\'.");
-        return out;
+        // n->next was updated with the current head. Try again.
     }
+}
 
-    tok.move_to(&out);
-    return out;
+void lexer::diagnostic_queue::diagnose(const diagnostic & diag)
+{
+    push(entry{ diag.to_string(), diag.code, diag.is_warning, diag.is_fatal });
 }
 
-std::string lexer::scan_bracketed_section()
+void lexer::diagnostic_queue::error(const std::string & message, const bool fatal)
 {
-    // The next token should be an open curly bracket.
-    // Scans until a matching close bracket is found.
-    // Internal bracket depths are properly skipped.
+    push(entry{ message, error_code::custom, false, fatal });
+}
 
-    token tok;
-    int depth;
-    std::string out;
+void lexer::diagnostic_queue::warning(const std::string & message)
+{
+    push(entry{ message, error_code::custom, true, false });
+}
 
-    if (!expect_token_type(lexer::token::type::punctuation,
-        static_cast<std::uint32_t>(lexer::punctuation_id::open_curly_bracket), &tok))
+std::size_t lexer::diagnostic_queue::drain(std::vector<entry> * out_entries)
+{
+    LEXER_ASSERT(out_entries != nullptr);
+
+    // Take the whole list at once, then reverse it to get the push order.
+    node * n = m_head.exchange(nullptr, std::memory_order_acquire);
+    node * reversed = nullptr;
+    while (n != nullptr)
     {
-        return out;
+        node * const next = n->next;
+        n->next  = reversed;
+        reversed = n;
+        n = next;
     }
 
-    out   = "{";
-    depth = 1;
-
-    do
+    std::size_t count = 0;
+    while (reversed != nullptr)
     {
-        if (!next_token(&tok))
-        {
-            error("missing closing \'{\'!");
-            return out;
-        }
+        node * const next = reversed->next;
+        out_entries->push_back(std::move(reversed->item));
+        delete reversed;
+        reversed = next;
+        ++count;
+    }
+    return count;
+}
 
-        // If the token is on a new line...
-        for (std::uint32_t i = 0; i < tok.get_lines_crossed(); ++i)
-        {
-            out.push_back('\n');
-        }
+std::size_t lexer::diagnostic_queue::drain(error_callbacks * target)
+{
+    if (target == nullptr)
+    {
+        target = get_error_callbacks();
+    }
 
-        if (tok.get_type() == token::type::punctuation)
-        {
-            if (is_punctuation_token(tok, punctuation_id::open_curly_bracket))
-            {
-                ++depth;
-            }
-            else if (is_punctuation_token(tok, punctuation_id::close_curly_bracket))
-            {
-                --depth;
-            }
-        }
+    std::vector<entry> entries;
+    drain(&entries);
 
-        if (tok.get_type() == token::type::string)
+    for (const entry & e : entries)
+    {
+        if (e.is_warning)
         {
-            out += "\"";
-            out += tok.as_string();
-            out += "\"";
+            target->warning(e.message);
         }
         else
         {
-            out += tok.as_string();
+            target->error(e.message, e.is_fatal);
         }
-        out += " ";
     }
-    while (depth);
+    return entries.size();
+}
 
-    return out;
+bool lexer::diagnostic_queue::empty() const noexcept
+{
+    return m_head.load(std::memory_order_acquire) == nullptr;
 }
 
-std::string lexer::scan_bracketed_section_exact(int tabs)
+#endif // LEXER_NO_THREADS
+
+// ========================================================
+// Batch loading:
+// ========================================================
+
+bool lexer::lex_files(const std::vector<std::string> & filenames, const std::uint32_t flags,
+                      batch_result * out_result, unsigned num_threads)
 {
-    std::string out;
-    if (!expect_token_char('{'))
+    LEXER_ASSERT(out_result != nullptr);
+
+    // Collects the messages of one file instead of printing them.
+    struct collecting_callbacks final : public lexer::error_callbacks
     {
-        return out;
-    }
+        std::vector<std::string> * messages = nullptr;
+        void error(const std::string & message, bool) override { messages->push_back(message); }
+        void warning(const std::string & message) override     { messages->push_back(message); }
+    };
 
-    out = "{";
-    int  depth      = 1;
-    bool skip_white = false;
-    bool do_tabs    = (tabs >= 0);
+    // Each file is lexed into its own list first, the shared arena is assembled at the end.
+    const std::size_t file_count = filenames.size();
+    std::vector<std::vector<token>> file_tokens(file_count);
 
-    while (depth && *m_script_ptr)
+    out_result->tokens.clear();
+    out_result->files.clear();
+    out_result->files.resize(file_count);
+
+    auto lex_one_file = [&](const std::size_t index)
     {
-        const char c = *(m_script_ptr++);
-        switch (c)
+        batch_file & file = out_result->files[index];
+        file.filename = filenames[index];
+
+        collecting_callbacks callbacks;
+        callbacks.messages = &file.diagnostics;
+
+        lexer lex;
+        lex.m_instance_callbacks = &callbacks;
+        lex.m_flags = flags; // So init errors honor no_errors too.
+
+        if (lex.init_from_file(filenames[index], flags))
         {
-        case '\t' :
-        case ' '  :
-            if (skip_white)
+            token tok;
+            while (lex.next_token(&tok))
             {
-                continue;
+                file_tokens[index].push_back(std::move(tok));
             }
-            break;
+        }
 
-        case '\n' :
-            if (do_tabs)
-            {
-                out.push_back(c);
-                skip_white = true;
-                continue;
-            }
-            break;
+        file.token_count   = file_tokens[index].size();
+        file.error_count   = lex.get_error_count();
+        file.warning_count = lex.get_warning_count();
+    };
 
-        case '{' :
-            ++depth;
-            ++tabs;
-            break;
+#ifndef LEXER_NO_THREADS
+    if (num_threads == 0)
+    {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    num_threads = static_cast<unsigned>(std::min<std::size_t>(num_threads, file_count));
 
-        case '}' :
-            --depth;
-            --tabs;
-            break;
+    // Workers grab the next unprocessed file until all are done. The caller is one of the workers.
+    std::atomic<std::size_t> next_file{ 0 };
+    auto worker = [&]()
+    {
+        for (std::size_t i = next_file++; i < file_count; i = next_file++)
+        {
+            lex_one_file(i);
+        }
+    };
 
-        default :
-            break;
-        } // switch (c)
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < num_threads; ++t)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & thread : threads)
+    {
+        thread.join();
+    }
+#else // LEXER_NO_THREADS
+    (void)num_threads;
+    for (std::size_t i = 0; i < file_count; ++i)
+    {
+        lex_one_file(i);
+    }
+#endif // LEXER_NO_THREADS
 
-        if (skip_white)
-        {
-            int i = tabs;
-            if (c == '{')
-            {
-                --i;
-            }
+    std::size_t total_tokens = 0;
+    for (const auto & list : file_tokens)
+    {
+        total_tokens += list.size();
+    }
+    out_result->tokens.reserve(total_tokens);
 
-            skip_white = false;
-            for (; i > 0; --i)
-            {
-                out.push_back('\t');
-            }
+    bool all_succeeded = true;
+    for (std::size_t i = 0; i < file_count; ++i)
+    {
+        out_result->files[i].first_token = out_result->tokens.size();
+        std::move(file_tokens[i].begin(), file_tokens[i].end(), std::back_inserter(out_result->tokens));
+
+        if (out_result->files[i].error_count != 0)
+        {
+            all_succeeded = false;
         }
-        out.push_back(c);
     }
 
-    return out;
+    return all_succeeded;
 }
 
-std::string lexer::scan_rest_of_line()
+// ========================================================
+// lexer::incremental_lexer:
+// ========================================================
+
+lexer::incremental_lexer::incremental_lexer(std::string filename, const std::uint32_t flags)
+    : m_lexer{}
+    , m_deferred{}
+    , m_pending{}
+    , m_filename{ std::move(filename) }
+    , m_ready{}
+    , m_flags{ flags }
 {
-    token tok;
-    std::string out;
+}
 
-    while (next_token(&tok))
+bool lexer::incremental_lexer::feed(const char * const data, const std::size_t length)
+{
+    LEXER_ASSERT(data != nullptr || length == 0);
+
+    if (m_finished || m_failed)
+    {
+        return false;
+    }
+
+    // The lexer needs a null terminator past the data, which std::string has.
+    m_pending.append(data, length);
+    return internal_lex_pending(m_pending.data(), m_pending.size(), /* at_end = */ false);
+}
+
+bool lexer::incremental_lexer::feed_in_place(const char * const data, const std::size_t length)
+{
+    LEXER_ASSERT(data != nullptr && data[length] == '\0');
+
+    if (m_finished || m_failed)
+    {
+        return false;
+    }
+
+    std::size_t taken = 0;
+
+    // Finish the token left over from the previous fragment, copying as little of the new one
+    // as possible. Once all the held data is consumed, the rest is lexed in place.
+    for (std::size_t chunk = 64; !m_pending.empty() && taken < length; chunk *= 2)
     {
-        if (tok.get_lines_crossed() != 0)
+        const std::size_t count = std::min(chunk, length - taken);
+        m_pending.append(data + taken, count);
+        taken += count;
+
+        if (!internal_lex_pending(m_pending.data(), m_pending.size(), /* at_end = */ false))
         {
-            m_script_ptr = m_last_script_ptr;
-            m_line_num   = m_last_line_num;
-            break;
+            return false;
         }
 
-        if (!out.empty())
+        // What is left over is all from the new fragment, so it doesn't need a copy.
+        if (m_pending.size() <= taken)
         {
-            out.push_back(' ');
+            taken -= m_pending.size();
+            m_pending.clear();
         }
-        out += tok.as_string();
     }
 
-    return out;
+    if (taken == length)
+    {
+        return true;
+    }
+    return internal_lex_pending(data + taken, length - taken, /* at_end = */ false);
 }
 
-std::string lexer::scan_complete_line()
+bool lexer::incremental_lexer::finish()
 {
-    // Returns a string up to the '\n', but doesn't eat any
-    // whitespace at the beginning of the next line.
+    if (m_finished || m_failed)
+    {
+        return !m_failed;
+    }
 
-    const char * start_ptr = m_script_ptr;
-    for (;; ++m_script_ptr)
+    m_finished = true;
+    return internal_lex_pending(m_pending.data(), m_pending.size(), /* at_end = */ true);
+}
+
+bool lexer::incremental_lexer::next_token(token * out_token)
+{
+    LEXER_ASSERT(out_token != nullptr);
+
+    if (!has_token())
     {
-        if (*m_script_ptr == '\0')
-        {
-            break; // End of the buffer
-        }
+        return false;
+    }
 
-        if (*m_script_ptr == '\n')
-        {
-            ++m_line_num;
-            ++m_script_ptr;
-            break;
-        }
+    *out_token = std::move(m_ready[m_ready_head++]);
+    if (m_ready_head == m_ready.size())
+    {
+        m_ready.clear();
+        m_ready_head = 0;
     }
+    return true;
+}
 
-    std::string out;
-    out.assign(start_ptr, static_cast<std::size_t>(m_script_ptr - start_ptr));
-    return out;
+void lexer::incremental_lexer::clear()
+{
+    m_lexer.clear();
+    m_deferred.entries.clear();
+    m_pending.clear();
+    m_ready.clear();
+    m_ready_head     = 0;
+    m_forwarded      = 0;
+    m_scanned        = 0;
+    m_line_num       = 1;
+    m_token_line     = 1;
+    m_scanned_line   = 1;
+    m_open_comment   = comment_kind::none;
+    m_held_pending = false;
+    m_error_count    = 0;
+    m_warn_count     = 0;
+    m_finished       = false;
+    m_failed         = false;
 }
 
-std::string lexer::get_last_whitespace() const
+void lexer::incremental_lexer::deferred_callbacks::diagnose(const diagnostic & diag)
 {
-    std::string whitespace;
-    for (const char * p = m_whitespace_start_ptr; p < m_whitespace_end_ptr; ++p)
+    // The text arguments point into the lexer's buffers, so they are copied.
+    entries.emplace_back();
+    entry & e = entries.back();
+    e.diag = diag;
+    for (int i = 0; i < 2; ++i)
     {
-        whitespace.push_back(*p);
+        if (diag.args[i].str != nullptr)
+        {
+            e.args[i].assign(diag.args[i].str, diag.args[i].length);
+        }
     }
-    return whitespace;
 }
 
-bool lexer::internal_read_whitespace()
+void lexer::incremental_lexer::internal_forward_diagnostics(const std::size_t count)
 {
-    for (;;)
+    error_callbacks * const callbacks = (m_instance_callbacks != nullptr) ? m_instance_callbacks : lexer::get_error_callbacks();
+
+    for (; m_forwarded < count; ++m_forwarded)
     {
-        // Skip whitespace:
-        while (*m_script_ptr <= ' ')
+        auto & e = m_deferred.entries[m_forwarded];
+        if (e.diag.is_warning)
         {
-            if (!*m_script_ptr)
+            ++m_warn_count;
+            if (m_flags & flags::no_warnings)
             {
-                return false;
+                continue;
             }
-            if (*m_script_ptr == '\n')
+        }
+        else
+        {
+            ++m_error_count;
+            if (m_flags & flags::no_errors)
             {
-                ++m_line_num;
+                continue;
             }
-            ++m_script_ptr;
         }
 
-        // Skip comments:
-        if (*m_script_ptr == '/')
+        for (int i = 0; i < 2; ++i)
         {
-            // C++-style comments:
-            if (*(m_script_ptr + 1) == '/')
+            if (e.diag.args[i].str != nullptr)
             {
-                ++m_script_ptr;
-                do
-                {
-                    ++m_script_ptr;
-                    if (!*m_script_ptr)
-                    {
-                        return false;
-                    }
-                }
-                while (*m_script_ptr != '\n');
+                e.diag.args[i] = diagnostic::text{ e.args[i] };
+            }
+        }
+        callbacks->diagnose(e.diag);
+    }
+}
 
-                ++m_line_num;
-                ++m_script_ptr;
+bool lexer::incremental_lexer::internal_is_terminated(const token & tok, const std::size_t end_offset) const noexcept
+{
+    // Whitespace or a comment ends anything but a string or char literal, which could be concatenated
+    // with the next one. Same rules as lexer::internal_read_string().
+    if (tok.get_type() == token::type::string &&
+        (!(m_flags & flags::no_string_concat) || (m_flags & flags::allow_backslash_string_concat)))
+    {
+        return false;
+    }
+    if (tok.get_type() == token::type::literal && !(m_flags & flags::no_string_concat))
+    {
+        return false;
+    }
 
-                if (!*m_script_ptr)
-                {
-                    return false;
-                }
-                continue;
-            }
-            // C-style/multi-line comments:
-            else if (*(m_script_ptr + 1) == '*')
-            {
-                ++m_script_ptr;
-                for (;;)
-                {
-                    ++m_script_ptr;
-                    if (!*m_script_ptr)
-                    {
-                        return false;
-                    }
-                    if (*m_script_ptr == '\n')
-                    {
-                        ++m_line_num;
-                    }
-                    else if (*m_script_ptr == '/')
-                    {
-                        if (*(m_script_ptr - 1) == '*')
-                        {
-                            break;
-                        }
-                        if (*(m_script_ptr + 1) == '*')
-                        {
-                            warning("nested C-style, multi-line comment!");
-                        }
-                    }
-                }
+    // Same tests used to skip whitespace and comments in the lexer.
+    if (end_offset >= m_source_size)
+    {
+        return false;
+    }
+    const char c = m_source[end_offset];
+    return c <= ' ' || (c == '/' && (m_source[end_offset + 1] == '/' || m_source[end_offset + 1] == '*'));
+}
 
-                ++m_script_ptr;
-                if (!*m_script_ptr)
-                {
-                    return false;
-                }
+bool lexer::incremental_lexer::internal_may_grow(const token & tok, const std::size_t end_offset) const noexcept
+{
+    // The punctuation set isn't prefix closed (there's "..." but no ".."), so a
+    // punctuation followed by the start of another one might still be part of a
+    // longer punctuation that hasn't fully arrived yet.
+    if (tok.get_type() != token::type::punctuation)
+    {
+        return false;
+    }
 
-                ++m_script_ptr;
-                if (!*m_script_ptr)
-                {
-                    return false;
-                }
-                continue;
-            }
+    const std::size_t start_offset = end_offset - tok.get_length();
+    const char * const text = m_source + start_offset;
+    const std::size_t available = m_source_size - start_offset;
+
+    for (std::size_t p = 0; p < lexer::m_punctuations_size; ++p)
+    {
+        const char * const punct = lexer::m_punctuations[p].str;
+        if (punct == nullptr) // Entry zero is a placeholder for punctuation_id::none.
+        {
+            continue;
+        }
+
+        const std::size_t punct_len = std::strlen(punct);
+
+        if (punct_len > tok.get_length() && punct_len > available && std::strncmp(punct, text, available) == 0)
+        {
+            return true;
         }
-        break;
     }
-    return true;
+    return false;
 }
 
-bool lexer::internal_read_escape_character(char * out_char)
+bool lexer::incremental_lexer::internal_lex_pending(const char * const source, const std::size_t source_size, const bool at_end)
 {
-    LEXER_ASSERT(out_char != nullptr);
+    // Errors and warnings are recorded and only reported for complete tokens. Fatal errors are
+    // handled here, so that a failure caused by a token cut short doesn't throw.
+    const std::uint32_t scan_flags = (m_flags & ~(flags::no_errors | flags::no_warnings)) | flags::no_fatal_errors;
 
-    int c, val, i;
-    ++m_script_ptr; // Step over the leading '\\'
+    m_source      = source;
+    m_source_size = source_size;
+    m_consumed    = 0;
 
-    // Determine the escape character:
-    switch (*m_script_ptr)
+    m_lexer.clear();
+    m_lexer.set_instance_error_callbacks(&m_deferred);
+    m_lexer.init_from_memory(source, static_cast<std::uint32_t>(source_size), m_filename, scan_flags, m_line_num);
+
+    m_deferred.entries.clear();
+    m_forwarded = 0;
+
+    // The last token read is held until something shows it is complete.
+    token held;
+    bool has_held = false;
+    std::size_t held_end = 0; // Offset in m_source.
+    std::size_t held_diagnostics = 0;
+    std::uint32_t held_line = 0;
+    std::uint32_t token_line = m_token_line; // Line where the last token read ended.
+
+    auto confirm_held = [&]()
     {
-    case '0'  : c = '\0'; break;
-    case 'n'  : c = '\n'; break;
-    case 'r'  : c = '\r'; break;
-    case 't'  : c = '\t'; break;
-    case 'v'  : c = '\v'; break;
-    case 'b'  : c = '\b'; break;
-    case 'f'  : c = '\f'; break;
-    case 'a'  : c = '\a'; break;
-    case '\\' : c = '\\'; break;
-    case '\'' : c = '\''; break;
-    case '\"' : c = '\"'; break;
-    case '\?' : c = '\?'; break;
-    case 'x'  : // Scan hexadecimal constant:
+        internal_forward_diagnostics(held_diagnostics);
+        m_ready.push_back(std::move(held));
+        m_consumed   = held_end;
+        m_line_num   = held_line;
+        m_token_line = held_line;
+        has_held     = false;
+    };
+
+    // Like lexer::next_token(), everything is reported at the line where the last token ended,
+    // which the lexer loses track of when the whitespace before a token is skipped separately.
+    auto set_diagnostic_lines = [&](const std::size_t first, const std::uint32_t line)
+    {
+        for (std::size_t i = first; i < m_deferred.entries.size(); ++i)
         {
-            ++m_script_ptr;
-            for (i = 0, val = 0; ; ++i, ++m_script_ptr)
+            m_deferred.entries[i].diag.line_num = line;
+        }
+    };
+
+    // Whitespace and comments up to the current position are done with, so they are dropped.
+    auto consume_gap = [&]()
+    {
+        internal_forward_diagnostics(m_deferred.entries.size());
+        m_consumed = m_lexer.get_script_offset();
+        m_line_num = m_lexer.get_line_number();
+    };
+
+    // A '/' ending the data could still be the start of a comment.
+    auto at_trailing_slash = [&]()
+    {
+        return !at_end && m_lexer.get_script_offset() + 1 == source_size && source[source_size - 1] == '/';
+    };
+
+    // Skips whitespace and comments, false if they might go on past the data.
+    auto resume_gap = [&](comment_kind * const open_comment)
+    {
+        return m_lexer.internal_resume_whitespace(open_comment) && !at_trailing_slash();
+    };
+
+    // Whitespace and comments ran to the end of the data. Scanning continues where it stopped on the next pass.
+    // Nothing is dropped after a token that could still be continued, like a string concatenated with the next one.
+    auto save_gap = [&](const comment_kind open_comment, const bool after_held)
+    {
+        m_open_comment = open_comment;
+        m_scanned_line = m_lexer.get_line_number();
+
+        if (after_held)
+        {
+            m_deferred.entries.clear(); // Reported when the token is lexed again.
+            m_scanned        = m_lexer.get_script_offset() - m_consumed;
+            m_held_pending = true;
+            return;
+        }
+
+        // An open comment keeps its last char, which tells where it ends.
+        consume_gap();
+        if (open_comment != comment_kind::none)
+        {
+            --m_consumed;
+            if (source[m_consumed] == '\n')
             {
-                c = *m_script_ptr;
-                if (c >= '0' && c <= '9')
-                {
-                    c = c - '0';
-                }
-                else if (c >= 'A' && c <= 'Z')
-                {
-                    c = c - 'A' + 10;
-                }
-                else if (c >= 'a' && c <= 'z')
-                {
-                    c = c - 'a' + 10;
-                }
-                else
-                {
-                    break;
-                }
-                val = (val << 4) + c;
+                --m_line_num;
             }
-            --m_script_ptr;
+        }
+        m_scanned        = m_lexer.get_script_offset() - m_consumed;
+        m_held_pending = false;
+    };
 
-            if (val > 0xFF)
+    bool fatal = false;
+    bool done  = false;
+
+    if (m_scanned != 0)
+    {
+        // Pick up the whitespace and comments where the previous pass left them.
+        m_lexer.jump_to_offset(m_scanned, m_scanned_line);
+        m_lexer.set_line_number(m_scanned_line);
+
+        comment_kind open_comment = m_open_comment;
+        const bool gap_ended = resume_gap(&open_comment);
+        set_diagnostic_lines(0, m_token_line);
+        m_scanned      = 0;
+        m_open_comment = comment_kind::none;
+
+        if (!gap_ended && !at_end)
+        {
+            save_gap(open_comment, m_held_pending);
+            done = true;
+        }
+        else if (m_held_pending)
+        {
+            // What follows the token is known now, so it is lexed again from the start.
+            m_lexer.jump_to_offset(0, m_line_num);
+            m_lexer.set_line_number(m_line_num);
+            m_deferred.entries.clear();
+            m_held_pending = false;
+        }
+        else
+        {
+            consume_gap();
+        }
+    }
+
+    while (!done)
+    {
+        // Whitespace and comments are skipped here rather than by next_token(), to know where they end.
+        const std::size_t first_diagnostic = m_deferred.entries.size();
+        comment_kind open_comment = comment_kind::none;
+        if (!resume_gap(&open_comment))
+        {
+            set_diagnostic_lines(first_diagnostic, token_line);
+
+            // Out of data.
+            if (has_held && (at_end || internal_is_terminated(held, held_end)))
             {
-                warning("hexadecimal value in escape character is too big! Truncating to 0xFF...");
-                val = 0xFF;
+                confirm_held();
+            }
+            if (!at_end)
+            {
+                save_gap(open_comment, has_held);
             }
-
-            c = val;
             break;
         }
-    default : // NOTE: decimal ASCII code, NOT octal!
+
+        const std::uint32_t errors_before = m_lexer.get_error_count();
+        const std::size_t token_start = m_lexer.get_script_offset();
+        token tok;
+
+        const bool got_token = m_lexer.next_token(&tok);
+        set_diagnostic_lines(first_diagnostic, token_line);
+
+        if (got_token)
         {
-            if (*m_script_ptr < '0' || *m_script_ptr > '9')
+            // Lines crossed since the last token, even the ones skipped by a previous pass.
+            if (!(m_flags & flags::lazy_line_numbers))
             {
-                return error("unknown/invalid escape char!");
+                tok.set_lines_crossed(tok.get_line_number() - token_line);
             }
+            token_line = m_lexer.get_line_number();
 
-            for (i = 0, val = 0; ; ++i, ++m_script_ptr)
+            // Something new started, so the previous token was complete.
+            if (has_held)
             {
-                c = *m_script_ptr;
-                if (c >= '0' && c <= '9')
-                {
-                    c = c - '0';
-                }
-                else
-                {
-                    break;
-                }
-                val = val * 10 + c;
+                confirm_held();
             }
-            --m_script_ptr;
 
-            if (val > 0xFF)
+            if (!at_end && internal_may_grow(tok, m_lexer.get_script_offset()))
             {
-                warning("value in escape character is too big! Truncating to 0xFF...");
-                val = 0xFF;
+                break;
             }
 
-            c = val;
+            held             = std::move(tok);
+            has_held         = true;
+            held_end         = m_lexer.get_script_offset();
+            held_line        = token_line;
+            held_diagnostics = m_deferred.entries.size();
+            continue;
+        }
+
+        if (m_lexer.get_error_count() == errors_before)
+        {
+            // Out of data.
+            if (has_held && (at_end || internal_is_terminated(held, held_end)))
+            {
+                confirm_held();
+            }
             break;
         }
-    } // switch (*m_script_ptr)
 
-    // Step over the escape character or the last digit of the number.
-    ++m_script_ptr;
+        if (!at_end && (m_lexer.is_at_end() || at_trailing_slash()))
+        {
+            // Failed at the end of the data, possibly because the token was cut
+            // short. It is lexed again, with its diagnostics, on the next pass.
+            if (has_held && internal_is_terminated(held, held_end))
+            {
+                confirm_held();
+            }
+            break;
+        }
 
-    *out_char = static_cast<char>(c);
-    return true;
-}
+        // A genuine error. Report it and carry on past it, like lexer::next_token() does.
+        // An unknown character doesn't move the lexer, so it is stepped over, not reported again.
+        if (has_held)
+        {
+            confirm_held();
+        }
+        if (m_lexer.get_script_offset() == token_start)
+        {
+            m_lexer.jump_to_offset(token_start + 1, m_lexer.get_line_number());
+        }
 
-bool lexer::internal_read_string(const int quote, token * out_token)
-{
-    LEXER_ASSERT(out_token != nullptr);
+        internal_forward_diagnostics(m_deferred.entries.size());
+        m_consumed   = m_lexer.get_script_offset();
+        m_line_num   = m_lexer.get_line_number();
+        m_token_line = m_line_num;
+        token_line   = m_line_num;
 
-    // Escape characters are interpreted.
-    // Reads two strings with only a white space between them as one string.
+        if (!(m_flags & (flags::no_fatal_errors | flags::no_errors)))
+        {
+            fatal = true;
+            break;
+        }
+    }
 
-    std::uint32_t tmp_line_num;
-    const char * tmp_script_ptr;
-    char ch;
+    if (at_end && !fatal)
+    {
+        // Warnings about trailing whitespace or comments.
+        internal_forward_diagnostics(m_deferred.entries.size());
+        m_consumed = source_size;
+    }
 
-    if (quote == '"') // Quoted string
+    // m_lexer points into the source, which might be gone after this returns.
+    m_lexer.clear();
+    m_deferred.entries.clear();
+    m_forwarded = 0;
+
+    // Keep what wasn't consumed for the next pass.
+    if (source == m_pending.data())
     {
-        out_token->set_type(token::type::string);
+        m_pending.erase(0, m_consumed);
     }
-    else // Character literal (maybe a multi-char literal)
+    else
     {
-        out_token->set_type(token::type::literal);
+        m_pending.assign(source + m_consumed, source_size - m_consumed);
     }
 
-    ++m_script_ptr; // Skip leading quote
+    m_source      = nullptr;
+    m_source_size = 0;
+    m_consumed    = 0;
 
-    for (;;)
+    m_failed = fatal;
+    return !fatal;
+}
+
+// ========================================================
+// lexer::segmented_lexer:
+// ========================================================
+
+lexer::segmented_lexer::segmented_lexer(std::vector<segment> segments, std::string filename, const std::uint32_t flags)
+    : m_segments{ std::move(segments) }
+    , m_incremental{ std::move(filename), flags }
+{
+}
+
+bool lexer::segmented_lexer::next_token(token * out_token)
+{
+    while (!m_incremental.next_token(out_token))
     {
-        // If there is an escape character and escape characters are allowed...
-        if (*m_script_ptr == '\\' && !(m_flags & flags::no_string_escape_chars))
+        if (m_failed || m_incremental.is_finished())
         {
-            if (!internal_read_escape_character(&ch))
-            {
-                return false;
-            }
-            out_token->append(ch);
+            return false;
         }
-        // If a trailing quote...
-        else if (*m_script_ptr == quote)
+
+        bool ok;
+        if (m_next_segment < m_segments.size())
         {
-            // Step over the quote:
-            ++m_script_ptr;
+            const segment & seg = m_segments[m_next_segment++];
+            ok = seg.null_terminated ? m_incremental.feed_in_place(seg.data, seg.length)
+                                     : m_incremental.feed(seg.data, seg.length);
+        }
+        else
+        {
+            ok = m_incremental.finish();
+        }
 
-            // If consecutive strings should not be concatenated...
-            if ((m_flags & flags::no_string_concat) &&
-              (!(m_flags & flags::allow_backslash_string_concat) || quote != '"'))
-            {
-                break;
-            }
+        // Tokens found before a fatal error are still handed out.
+        if (!ok)
+        {
+            m_failed = true;
+        }
+    }
+    return true;
+}
 
-            tmp_script_ptr = m_script_ptr;
-            tmp_line_num   = m_line_num;
+// ========================================================
+// lexer::token_rules:
+// ========================================================
 
-            // Read white space between possible two consecutive strings.
-            // Restore line index on failure.
-            if (!internal_read_whitespace())
-            {
-                m_script_ptr = tmp_script_ptr;
-                m_line_num   = tmp_line_num;
-                break;
-            }
+constexpr std::size_t lexer::token_rules::max_states;
 
-            if (m_flags & flags::no_string_concat)
-            {
-                if (*m_script_ptr != '\\')
-                {
-                    m_script_ptr = tmp_script_ptr;
-                    m_line_num   = tmp_line_num;
-                    break;
-                }
+// Recursive descent parser turning a pattern into an NFA fragment.
+class lexer::token_rules::pattern_parser final
+{
+public:
 
-                ++m_script_ptr; // Step over the '\\'
+    pattern_parser(token_rules * rules, const char * pattern)
+        : m_rules{ rules }, m_pattern{ pattern }, m_pos{ pattern }, m_error{}
+    { }
 
-                if (!internal_read_whitespace() || *m_script_ptr != quote)
-                {
-                    return error("expecting string after '\\' terminated line!");
-                }
-            }
+    pattern_parser(const pattern_parser &) = delete;
+    pattern_parser & operator = (const pattern_parser &) = delete;
 
-            // If there's no leading quote...
-            if (*m_script_ptr != quote)
-            {
-                m_script_ptr = tmp_script_ptr;
-                m_line_num   = tmp_line_num;
-                break;
-            }
+    bool parse(fragment * out_frag)
+    {
+        if (!parse_alternation(out_frag))
+        {
+            return false;
+        }
+        if (*m_pos != '\0')
+        {
+            return fail("unbalanced ')'");
+        }
+        return true;
+    }
 
-            ++m_script_ptr; // Step over the new leading quote.
+    const std::string & get_error() const noexcept { return m_error; }
+
+private:
+
+    bool fail(const char * message)
+    {
+        m_error = std::string{ message } + " at offset " + std::to_string(m_pos - m_pattern);
+        return false;
+    }
+
+    static void set_range(char_set * chars, const int first, const int last) noexcept
+    {
+        for (int c = first; c <= last; ++c)
+        {
+            chars->set(static_cast<unsigned char>(c));
+        }
+    }
+
+    bool parse_alternation(fragment * out_frag)
+    {
+        if (!parse_sequence(out_frag))
+        {
+            return false;
         }
-        else
+
+        while (*m_pos == '|')
         {
-            if (*m_script_ptr == '\0')
-            {
-                return error("missing trailing quote!");
-            }
-            if (*m_script_ptr == '\n')
+            ++m_pos;
+            fragment other;
+            if (!parse_sequence(&other))
             {
-                return error("newline inside string!");
+                return false;
             }
-            out_token->append(*m_script_ptr++);
+            *out_frag = m_rules->make_alternation(*out_frag, other);
         }
+        return true;
     }
 
-    if (out_token->get_type() == token::type::literal)
+    bool parse_sequence(fragment * out_frag)
     {
-        if (!(m_flags & flags::allow_multi_char_literals))
+        *out_frag = m_rules->make_empty();
+
+        while (*m_pos != '\0' && *m_pos != '|' && *m_pos != ')')
         {
-            if (out_token->get_length() > 1)
+            fragment frag;
+            if (!parse_repetition(&frag))
             {
-                return error("char literal is not one character long! Set \'lexer::flags::allow_multi_char_literals\' to allow them.");
+                return false;
             }
+            *out_frag = m_rules->make_concat(*out_frag, frag);
         }
+        return true;
     }
 
-    return true;
-}
-
-bool lexer::internal_read_name_ident(token * out_token)
-{
-    LEXER_ASSERT(out_token != nullptr);
-
-    // Names can contain aA-zZ letters, numbers or underscore.
-    auto valid_name_char = [](const int c) -> bool
-    {
-        return ((c >= 'a' && c <= 'z') ||
-                (c >= 'A' && c <= 'Z') ||
-                (c >= '0' && c <= '9') || c == '_');
-    };
-
-    // If treating all tokens as strings, don't parse '-' as a separate token.
-    auto strings_only = [](const int c, const std::uint32_t lex_flags) -> bool
-    {
-        return (lex_flags & flags::only_strings) && (c == '-');
-    };
-
-    // If special path name characters are allowed.
-    auto allowing_path_names = [](const int c, const std::uint32_t lex_flags) -> bool
+    bool parse_repetition(fragment * out_frag)
     {
-        return (lex_flags & flags::allow_path_names) && (c == '/' || c == '\\' || c == ':' || c == '.');
-    };
+        const char * const atom_start = m_pos;
+        if (!parse_atom(out_frag))
+        {
+            return false;
+        }
 
-    int c;
-    out_token->set_type(token::type::identifier);
+        switch (*m_pos)
+        {
+        case '*' : ++m_pos; *out_frag = m_rules->make_star(*out_frag);     break;
+        case '+' : ++m_pos; *out_frag = m_rules->make_plus(*out_frag);     break;
+        case '?' : ++m_pos; *out_frag = m_rules->make_optional(*out_frag); break;
+        case '{' :
+            if (!parse_counted(atom_start, out_frag))
+            {
+                return false;
+            }
+            break;
+        default :
+            return true;
+        } // switch (*m_pos)
 
-    do
-    {
-        out_token->append(*m_script_ptr++);
-        c = *m_script_ptr;
+        if (*m_pos == '*' || *m_pos == '+' || *m_pos == '?' || *m_pos == '{')
+        {
+            return fail("multiple quantifiers");
+        }
+        return true;
     }
-    while (valid_name_char(c) || strings_only(c, m_flags) || allowing_path_names(c, m_flags));
 
-    // Names reserved for the boolean constants:
-    if (*out_token == "true" || *out_token == "false")
-    {
-        out_token->set_flags(token::flags::boolean);
-    }
-    else
+    bool parse_count(int * out_count)
     {
-        out_token->set_flags(0);
-    }
-
-    return true;
-}
-
-bool lexer::internal_read_number(token * out_token)
-{
-    LEXER_ASSERT(out_token != nullptr);
+        if (*m_pos < '0' || *m_pos > '9')
+        {
+            return fail("expected a number");
+        }
 
-    char c1 = *m_script_ptr;
-    char c2 = *(m_script_ptr + 1);
-    std::uint32_t token_flags = 0;
+        int count = 0;
+        while (*m_pos >= '0' && *m_pos <= '9')
+        {
+            count = (count * 10) + (*m_pos++ - '0');
+            if (count > 255)
+            {
+                return fail("repetition count over 255");
+            }
+        }
+        *out_count = count;
+        return true;
+    }
 
-    if (c1 == '0' && c2 != '.') // Integer:
+    // {n}, {n,} and {n,m}. The atom is parsed again for each copy needed. {0} and {0,0} leave an empty fragment.
+    bool parse_counted(const char * const atom_start, fragment * out_frag)
     {
-        // Check for a hexadecimal number:
-        if (c2 == 'x' || c2 == 'X')
+        ++m_pos; // Skip '{'
+        int min_count = 0;
+        int max_count = 0;
+
+        if (!parse_count(&min_count))
         {
-            out_token->append(*m_script_ptr++);
-            out_token->append(*m_script_ptr++);
-            c1 = *m_script_ptr;
+            return false;
+        }
 
-            while ((c1 >= '0' && c1 <= '9') ||
-                   (c1 >= 'a' && c1 <= 'f') ||
-                   (c1 >= 'A' && c1 <= 'F'))
+        if (*m_pos == ',')
+        {
+            ++m_pos;
+            max_count = (*m_pos == '}') ? -1 : 0;
+            if (max_count == 0 && !parse_count(&max_count))
             {
-                out_token->append(c1);
-                c1 = *(++m_script_ptr);
+                return false;
             }
+        }
+        else
+        {
+            max_count = min_count;
+        }
 
-            token_flags = token::flags::hexadecimal | token::flags::integer;
+        if (*m_pos != '}')
+        {
+            return fail("expected '}'");
         }
-        // Check for a binary number:
-        else if (c2 == 'b' || c2 == 'B')
+        if (max_count >= 0 && max_count < min_count)
         {
-            out_token->append(*m_script_ptr++);
-            out_token->append(*m_script_ptr++);
-            c1 = *m_script_ptr;
+            return fail("invalid repetition range");
+        }
 
-            while (c1 == '0' || c1 == '1')
-            {
-                out_token->append(c1);
-                c1 = *(++m_script_ptr);
-            }
+        const char * const quantifier_end = m_pos + 1;
+        auto copy_atom = [&]()
+        {
+            fragment copy;
+            m_pos = atom_start;
+            parse_atom(&copy); // Can't fail, it was parsed before.
+            return copy;
+        };
+
+        fragment result = (min_count > 0) ? *out_frag : m_rules->make_empty();
+        for (int i = 1; i < min_count; ++i)
+        {
+            result = m_rules->make_concat(result, copy_atom());
+        }
 
-            token_flags = token::flags::binary | token::flags::integer;
+        if (max_count < 0)
+        {
+            result = m_rules->make_concat(result, m_rules->make_star((min_count > 0) ? copy_atom() : *out_frag));
         }
-        // Its an octal number:
         else
         {
-            out_token->append(*m_script_ptr++);
-            c1 = *m_script_ptr;
-
-            while (c1 >= '0' && c1 <= '7')
+            for (int i = min_count; i < max_count; ++i)
             {
-                out_token->append(c1);
-                c1 = *(++m_script_ptr);
+                const fragment copy = (i == 0) ? *out_frag : copy_atom();
+                result = m_rules->make_concat(result, m_rules->make_optional(copy));
             }
-
-            token_flags = token::flags::octal | token::flags::integer;
         }
+
+        m_pos = quantifier_end;
+        *out_frag = result;
+        return true;
     }
-    else // Decimal integer or floating point number or even an IP address:
+
+    bool parse_atom(fragment * out_frag)
     {
-        // Count the number of '.' in the number:
-        int dot = 0;
-        for (;;)
+        char_set chars{};
+
+        switch (*m_pos)
         {
-            if (c1 >= '0' && c1 <= '9')
+        case '(' :
+            ++m_pos;
+            if (!parse_alternation(out_frag))
             {
-                // Nothing
+                return false;
             }
-            else if (c1 == '.')
+            if (*m_pos != ')')
             {
-                ++dot;
+                return fail("expected ')'");
             }
-            else
+            ++m_pos;
+            return true;
+
+        case '[' :
+            ++m_pos;
+            if (!parse_class(&chars))
             {
-                break;
+                return false;
             }
+            break;
 
-            out_token->append(c1);
-            c1 = *(++m_script_ptr);
-        }
-
-        if (c1 == 'e' && dot == 0)
-        {
-            // We have scientific notation without a decimal point.
-            ++dot;
-        }
-
-        // If a floating point number...
-        if (dot == 1)
-        {
-            token_flags = token::flags::decimal | token::flags::floating_point;
+        case '.' :
+            ++m_pos;
+            set_range(&chars, 1, 255);
+            chars.bits[0] &= ~(std::uint64_t{ 1 } << '\n');
+            break;
 
-            // Check for floating point exponent:
-            if (c1 == 'e')
+        case '\\' :
+            ++m_pos;
+            if (!parse_escape(&chars))
             {
-                // Append the 'e' so that token::update_cached_values() parses the value properly.
-                out_token->append(c1);
-                c1 = *(++m_script_ptr);
-
-                if (c1 == '-')
-                {
-                    out_token->append(c1);
-                    c1 = *(++m_script_ptr);
-                }
-                else if (c1 == '+')
-                {
-                    out_token->append(c1);
-                    c1 = *(++m_script_ptr);
-                }
-
-                while (c1 >= '0' && c1 <= '9')
-                {
-                    out_token->append(c1);
-                    c1 = *(++m_script_ptr);
-                }
+                return false;
             }
-            // Check for floating point exceptions -> infinite 1.#INF or indefinite 1.#IND or NaN:
-            else if (c1 == '#')
-            {
-                c2 = 4;
-                if (internal_check_string("INF"))
-                {
-                    token_flags |= token::flags::infinite;
-                }
-                else if (internal_check_string("IND"))
-                {
-                    token_flags |= token::flags::indefinite;
-                }
-                else if (internal_check_string("NAN"))
-                {
-                    token_flags |= token::flags::nan;
-                }
-                else if (internal_check_string("QNAN"))
-                {
-                    token_flags |= token::flags::nan;
-                    c2++;
-                }
-                else if (internal_check_string("SNAN"))
-                {
-                    token_flags |= token::flags::nan;
-                    c2++;
-                }
+            break;
 
-                for (int i = 0; i < c2; ++i)
-                {
-                    out_token->append(c1);
-                    c1 = *(++m_script_ptr);
-                }
+        case '*' : case '+' : case '?' : case '{' :
+            return fail("nothing to repeat");
 
-                while (c1 >= '0' && c1 <= '9')
-                {
-                    out_token->append(c1);
-                    c1 = *(++m_script_ptr);
-                }
+        default :
+            chars.set(static_cast<unsigned char>(*m_pos++));
+            break;
+        } // switch (*m_pos)
 
-                if (!(m_flags & flags::allow_float_exceptions))
-                {
-                    return error("floating-point exception scanned: " + out_token->as_string());
-                }
-            }
+        *out_frag = m_rules->make_chars(chars);
+        return true;
+    }
+
+    // After a backslash.
+    bool parse_escape(char_set * chars)
+    {
+        const char c = *m_pos;
+        if (c == '\0')
+        {
+            return fail("incomplete escape");
         }
-        else if (dot > 1)
+        ++m_pos;
+
+        switch (c)
         {
-            if (!(m_flags & flags::allow_ip_addresses))
-            {
-                return error("more than one dot in number! Set lexer::flags::allow_ip_addresses to parse IP addresses.");
-            }
-            if (dot != 3)
+        case 'd' : set_range(chars, '0', '9'); break;
+        case 'x' : set_range(chars, '0', '9'); set_range(chars, 'a', 'f'); set_range(chars, 'A', 'F'); break;
+        case 'w' : set_range(chars, '0', '9'); set_range(chars, 'a', 'z'); set_range(chars, 'A', 'Z'); chars->set('_'); break;
+        case 's' : chars->set(' '); chars->set('\t'); chars->set('\n'); chars->set('\r'); chars->set('\v'); chars->set('\f'); break;
+        case 'n' : chars->set('\n'); break;
+        case 't' : chars->set('\t'); break;
+        case 'r' : chars->set('\r'); break;
+        default  :
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
             {
-                return error("IP address should have three dots!");
+                --m_pos;
+                return fail("unknown escape");
             }
-            token_flags = token::flags::ip_address;
-        }
-        else
+            chars->set(static_cast<unsigned char>(c));
+            break;
+        } // switch (c)
+        return true;
+    }
+
+    // After the opening '['.
+    bool parse_class(char_set * chars)
+    {
+        const bool negated = (*m_pos == '^');
+        if (negated)
         {
-            token_flags = token::flags::decimal | token::flags::integer;
+            ++m_pos;
         }
-    }
 
-    if (token_flags & token::flags::floating_point)
-    {
-        if (c1 > ' ')
+        char_set members{};
+        for (bool first = true; first || *m_pos != ']'; first = false)
         {
-            // Single-precision: float
-            if (c1 == 'f' || c1 == 'F')
+            if (*m_pos == '\0')
             {
-                token_flags |= token::flags::single_precision;
-                ++m_script_ptr;
+                return fail("expected ']'");
             }
-            // Extended-precision: long double
-            else if (c1 == 'l' || c1 == 'L')
+
+            if (*m_pos == '\\')
             {
-                token_flags |= token::flags::extended_precision;
-                ++m_script_ptr;
+                ++m_pos;
+                if (!parse_escape(&members))
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            const unsigned char low = static_cast<unsigned char>(*m_pos++);
+            if (*m_pos == '-' && m_pos[1] != ']' && m_pos[1] != '\0')
+            {
+                const unsigned char high = static_cast<unsigned char>(m_pos[1]);
+                if (high < low)
+                {
+                    return fail("invalid class range");
+                }
+                set_range(&members, low, high);
+                m_pos += 2;
             }
-            // Default is double-precision: double
             else
             {
-                token_flags |= token::flags::double_precision;
+                members.set(low);
             }
         }
-        else
+        ++m_pos; // Skip ']'
+
+        for (int i = 0; i < 4; ++i)
         {
-            token_flags |= token::flags::double_precision;
+            chars->bits[i] = negated ? ~members.bits[i] : members.bits[i];
+        }
+        if (negated)
+        {
+            chars->bits[0] &= ~std::uint64_t{ 1 }; // Never the null terminator.
         }
+        return true;
     }
-    else if (token_flags & token::flags::integer)
-    {
-        // Default: signed
-        std::uint32_t int_flag = token::flags::signed_integer;
 
-        if (c1 > ' ')
+    token_rules * m_rules;
+    const char  * m_pattern;
+    const char  * m_pos;
+    std::string   m_error;
+};
+
+lexer::token_rules::token_rules()
+    : m_nfa{}
+    , m_rule_starts{}
+    , m_rule_ids{}
+    , m_transitions{}
+    , m_accept{}
+    , m_class_count{ 0 }
+    , m_compiled{ false }
+{
+    std::fill_n(m_byte_classes, 256, std::uint8_t{ 0 });
+}
+
+std::int32_t lexer::token_rules::new_state()
+{
+    nfa_state state{};
+    state.next   = -1;
+    state.eps[0] = -1;
+    state.eps[1] = -1;
+    state.accept = -1;
+    m_nfa.push_back(state);
+    return static_cast<std::int32_t>(m_nfa.size() - 1);
+}
+
+void lexer::token_rules::add_epsilon(const std::int32_t from, const std::int32_t to)
+{
+    nfa_state & state = m_nfa[from];
+    LEXER_ASSERT(state.eps[1] < 0);
+    state.eps[(state.eps[0] < 0) ? 0 : 1] = to;
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_chars(const char_set & chars)
+{
+    const fragment frag{ new_state(), new_state() };
+    m_nfa[frag.start].chars = chars;
+    m_nfa[frag.start].next  = frag.end;
+    return frag;
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_empty()
+{
+    const fragment frag{ new_state(), new_state() };
+    add_epsilon(frag.start, frag.end);
+    return frag;
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_concat(const fragment first, const fragment second)
+{
+    add_epsilon(first.end, second.start);
+    return { first.start, second.end };
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_alternation(const fragment first, const fragment second)
+{
+    const fragment frag{ new_state(), new_state() };
+    add_epsilon(frag.start, first.start);
+    add_epsilon(frag.start, second.start);
+    add_epsilon(first.end, frag.end);
+    add_epsilon(second.end, frag.end);
+    return frag;
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_star(const fragment frag)
+{
+    const fragment star{ new_state(), new_state() };
+    add_epsilon(star.start, frag.start);
+    add_epsilon(star.start, star.end);
+    add_epsilon(frag.end, frag.start);
+    add_epsilon(frag.end, star.end);
+    return star;
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_plus(const fragment frag)
+{
+    const std::int32_t end = new_state();
+    add_epsilon(frag.end, frag.start);
+    add_epsilon(frag.end, end);
+    return { frag.start, end };
+}
+
+lexer::token_rules::fragment lexer::token_rules::make_optional(const fragment frag)
+{
+    const fragment opt{ new_state(), new_state() };
+    add_epsilon(opt.start, frag.start);
+    add_epsilon(opt.start, opt.end);
+    add_epsilon(frag.end, opt.end);
+    return opt;
+}
+
+void lexer::token_rules::epsilon_closure(std::vector<std::int32_t> * states, std::vector<bool> * in_set) const
+{
+    // 'states' doubles as the work list; 'in_set' has an entry per NFA state.
+    for (std::size_t i = 0; i < states->size(); ++i)
+    {
+        const nfa_state & state = m_nfa[(*states)[i]];
+        for (const std::int32_t target : state.eps)
         {
-            // 1u, 1l, 1ul, 1lu
-            for (int i = 0; i < 2; ++i)
+            if (target >= 0 && !(*in_set)[target])
             {
-                if (c1 == 'u' || c1 == 'U') // unsigned integer supersedes signed
-                {
-                    int_flag = token::flags::unsigned_integer;
-                }
-                else if (c1 == 'l' || c1 == 'L') // signed integer
-                {
-                    // Already set; ignore.
-                }
-                else
-                {
-                    break;
-                }
-                c1 = *(++m_script_ptr);
+                (*in_set)[target] = true;
+                states->push_back(target);
             }
         }
-
-        token_flags |= int_flag;
     }
-    else if (token_flags & token::flags::ip_address)
+    std::sort(states->begin(), states->end());
+}
+
+bool lexer::token_rules::add_rule(const std::uint32_t rule_id, const std::string & pattern, std::string * out_error_message)
+{
+    const std::size_t nfa_size = m_nfa.size();
+
+    fragment frag;
+    pattern_parser parser{ this, pattern.c_str() };
+    if (!parser.parse(&frag))
     {
-        if (c1 == ':')
+        m_nfa.resize(nfa_size);
+        if (out_error_message != nullptr)
         {
-            out_token->append(c1);
-            c1 = *(++m_script_ptr);
+            *out_error_message = "token_rules::add_rule() -> '" + pattern + "': " + parser.get_error() + "!";
+        }
+        return false;
+    }
 
-            while (c1 >= '0' && c1 <= '9')
-            {
-                out_token->append(c1);
-                c1 = *(++m_script_ptr);
-            }
+    m_nfa[frag.end].accept = static_cast<std::int32_t>(m_rule_ids.size());
 
-            token_flags |= token::flags::ip_port;
+    // A rule that matches nothing would never let the lexer advance.
+    std::vector<std::int32_t> start_set{ frag.start };
+    std::vector<bool> in_set(m_nfa.size(), false);
+    in_set[frag.start] = true;
+    epsilon_closure(&start_set, &in_set);
+
+    if (in_set[frag.end])
+    {
+        m_nfa.resize(nfa_size);
+        if (out_error_message != nullptr)
+        {
+            *out_error_message = "token_rules::add_rule() -> '" + pattern + "' matches an empty string!";
         }
+        return false;
     }
 
-    out_token->set_type(token::type::number);
-    out_token->set_flags(token_flags);
+    m_rule_starts.push_back(frag.start);
+    m_rule_ids.push_back(rule_id);
+    m_compiled = false;
     return true;
 }
 
-bool lexer::internal_read_punctuation(token * out_token)
+bool lexer::token_rules::compile(std::string * out_error_message)
 {
-    LEXER_ASSERT(out_token      != nullptr);
-    LEXER_ASSERT(m_punctuations != nullptr);
+    m_transitions.clear();
+    m_accept.clear();
+    m_compiled = false;
+
+    // Byte classes: bytes contained in exactly the same char sets are interchangeable.
+    std::vector<char_set> sets;
+    for (const nfa_state & state : m_nfa)
+    {
+        if (!state.chars.empty())
+        {
+            sets.push_back(state.chars);
+        }
+    }
 
-    int l, n, i;
-    for (n = m_punctuations_table[static_cast<unsigned>(*m_script_ptr)]; n >= 0; n = m_punctuations_next[n])
+    std::vector<std::vector<bool>> class_signatures;
+    std::uint8_t class_reps[256];
+    for (int b = 0; b < 256; ++b)
     {
-        const punctuation_def punct = m_punctuations[n];
-        const char * const chars    = punct.str;
+        std::vector<bool> signature(sets.size(), false);
+        for (std::size_t i = 0; i < sets.size(); ++i)
+        {
+            signature[i] = (b != 0) && sets[i].test(static_cast<unsigned char>(b));
+        }
 
-        if (chars == nullptr) // punctuation_id::none
+        const auto iter = std::find(class_signatures.begin(), class_signatures.end(), signature);
+        if (iter == class_signatures.end())
         {
-            continue;
+            class_reps[class_signatures.size()] = static_cast<std::uint8_t>(b);
+            m_byte_classes[b] = static_cast<std::uint8_t>(class_signatures.size());
+            class_signatures.push_back(std::move(signature));
+        }
+        else
+        {
+            m_byte_classes[b] = static_cast<std::uint8_t>(iter - class_signatures.begin());
+        }
+    }
+    m_class_count = class_signatures.size();
+
+    // Subset construction. DFA states are sorted sets of NFA states.
+    std::vector<std::vector<std::int32_t>> dfa_sets;
+    std::map<std::vector<std::int32_t>, std::int32_t> dfa_lookup;
+    auto find_or_add = [&](std::vector<std::int32_t> nfa_set) -> std::int32_t
+    {
+        const auto iter = dfa_lookup.find(nfa_set);
+        if (iter != dfa_lookup.end())
+        {
+            return iter->second;
         }
 
-        // Check for this punctuation in the script:
-        for (l = 0; chars[l] && m_script_ptr[l]; ++l)
+        std::int32_t accept = -1;
+        for (const std::int32_t s : nfa_set)
         {
-            if (m_script_ptr[l] != chars[l])
+            const std::int32_t rule = m_nfa[s].accept;
+            if (rule >= 0 && (accept < 0 || rule < accept))
             {
-                break;
+                accept = rule;
             }
         }
 
-        if (!chars[l])
+        const auto index = static_cast<std::int32_t>(dfa_sets.size());
+        dfa_lookup.emplace(nfa_set, index);
+        dfa_sets.push_back(std::move(nfa_set));
+        m_accept.push_back(accept);
+        m_transitions.resize(m_transitions.size() + m_class_count, -1);
+        return index;
+    };
+
+    std::vector<bool> in_set(m_nfa.size(), false);
+    std::vector<std::int32_t> start_set;
+    for (const std::int32_t start : m_rule_starts)
+    {
+        in_set[start] = true;
+        start_set.push_back(start);
+    }
+    epsilon_closure(&start_set, &in_set);
+    find_or_add(std::move(start_set));
+
+    for (std::size_t d = 0; d < dfa_sets.size(); ++d)
+    {
+        for (std::size_t c = 0; c < m_class_count; ++c)
         {
-            for (i = 0; i <= l; ++i)
+            std::fill(in_set.begin(), in_set.end(), false);
+            std::vector<std::int32_t> next_set;
+
+            for (const std::int32_t s : dfa_sets[d])
+            {
+                const nfa_state & state = m_nfa[s];
+                if (state.next >= 0 && state.chars.test(class_reps[c]) && !in_set[state.next])
+                {
+                    in_set[state.next] = true;
+                    next_set.push_back(state.next);
+                }
+            }
+
+            if (next_set.empty())
             {
-                out_token->append(chars[i]);
+                continue;
             }
 
-            m_script_ptr += l;
-            out_token->set_type(token::type::punctuation);
-            out_token->set_flags(static_cast<std::uint32_t>(punct.id)); // Subtype/flags is the punctuation id.
-            return true;
+            epsilon_closure(&next_set, &in_set);
+            const std::int32_t target = find_or_add(std::move(next_set));
+
+            if (dfa_sets.size() > max_states)
+            {
+                m_transitions.clear();
+                m_accept.clear();
+                if (out_error_message != nullptr)
+                {
+                    *out_error_message = "token_rules::compile() -> too many DFA states!";
+                }
+                return false;
+            }
+
+            m_transitions[d * m_class_count + c] = target;
         }
     }
 
-    return false;
+    m_compiled = true;
+    return true;
 }
 
-bool lexer::internal_check_string(const char * const string) const
+void lexer::token_rules::clear()
 {
-    LEXER_ASSERT(string != nullptr);
+    m_nfa.clear();
+    m_rule_starts.clear();
+    m_rule_ids.clear();
+    m_transitions.clear();
+    m_accept.clear();
+    m_class_count = 0;
+    m_compiled    = false;
+}
 
-    for (std::size_t i = 0; string[i] != '\0'; ++i)
+std::size_t lexer::token_rules::match(const char * const text, const char * const text_end, std::uint32_t * out_rule_id) const noexcept
+{
+    LEXER_ASSERT(text != nullptr && out_rule_id != nullptr);
+
+    if (!m_compiled || m_rule_ids.empty())
     {
-        if (m_script_ptr[i] != string[i])
+        return 0;
+    }
+
+    // The null byte is in a class with no transitions, so the scan stops there too.
+    std::size_t longest = 0;
+    std::int32_t state = 0;
+    for (const char * p = text; p < text_end; ++p)
+    {
+        state = m_transitions[static_cast<std::size_t>(state) * m_class_count + m_byte_classes[static_cast<unsigned char>(*p)]];
+        if (state < 0)
         {
-            return false;
+            break;
+        }
+        if (m_accept[state] >= 0)
+        {
+            longest = static_cast<std::size_t>(p - text) + 1;
+            *out_rule_id = m_rule_ids[m_accept[state]];
         }
     }
-    return true;
+    return longest;
 }
 
-std::string & lexer::ltrim_string(std::string * s)
+// ========================================================
+// lexer::comment_style:
+// ========================================================
+
+constexpr std::size_t lexer::comment_style::max_delimiters;
+constexpr std::size_t lexer::comment_style::max_delimiter_length;
+
+lexer::comment_style::comment_style() noexcept
+    : m_count{ 0 }
 {
-    LEXER_ASSERT(s != nullptr);
-    const auto first_non_blank = s->find_first_not_of(" \t\r\n\v\f");
-    return s->erase(0, first_non_blank);
+    clear();
 }
 
-std::string & lexer::rtrim_string(std::string * s)
+bool lexer::comment_style::add_line_comment(const char * const prefix) noexcept
 {
-    LEXER_ASSERT(s != nullptr);
-    const auto last_non_blank = s->find_last_not_of(" \t\r\n\v\f");
-    return s->erase((last_non_blank != std::string::npos) ? last_non_blank + 1 : 0);
+    return internal_add(prefix, "");
 }
 
-std::string & lexer::trim_string(std::string * s)
+bool lexer::comment_style::add_block_comment(const char * const open, const char * const close) noexcept
 {
-    rtrim_string(s);
-    ltrim_string(s);
-    return *s;
+    LEXER_ASSERT(close != nullptr);
+    return *close != '\0' && internal_add(open, close);
 }
 
-// ========================================================
-// Shared error callbacks:
-// ========================================================
-
-lexer::error_callbacks * lexer::m_error_callbacks = nullptr;
-
-void lexer::set_error_callbacks(error_callbacks * err_callbacks) noexcept
+void lexer::comment_style::clear() noexcept
 {
-    struct default_error_callbacks final : public lexer::error_callbacks
-    {
-        void error(const std::string & message, bool fatal) override
-        {
-            std::cerr << message << std::endl;
+    std::memset(m_delimiters, 0, sizeof(m_delimiters));
+    std::fill_n(m_first_chars, 256, false);
+    m_count = 0;
+}
 
-            #ifndef LEXER_NO_CXX_EXCEPTIONS
-            if (fatal)
-            {
-                throw lexer::exception{ message };
-            }
-            #else // ignored
-            (void)fatal;
-            #endif // LEXER_NO_CXX_EXCEPTIONS
-        }
+bool lexer::comment_style::internal_add(const char * const open, const char * const close) noexcept
+{
+    LEXER_ASSERT(open != nullptr && close != nullptr);
 
-        void warning(const std::string & message) override
-        {
-            std::cerr << message << std::endl;
-        }
-    };
-    static default_error_callbacks default_err_cbs;
+    const std::size_t open_length  = std::strlen(open);
+    const std::size_t close_length = std::strlen(close);
 
-    if (err_callbacks == nullptr)
-    {
-        m_error_callbacks = &default_err_cbs;
-    }
-    else
+    if (open_length == 0 || open_length > max_delimiter_length ||
+        close_length > max_delimiter_length || m_count == max_delimiters)
     {
-        m_error_callbacks = err_callbacks;
+        return false;
     }
-}
 
-lexer::error_callbacks * lexer::get_error_callbacks() noexcept
-{
-    return m_error_callbacks;
+    delimiter & d = m_delimiters[m_count++];
+    std::memcpy(d.open,  open,  open_length  + 1);
+    std::memcpy(d.close, close, close_length + 1);
+    d.open_length  = static_cast<std::uint8_t>(open_length);
+    d.close_length = static_cast<std::uint8_t>(close_length);
+
+    m_first_chars[static_cast<unsigned char>(*open)] = true;
+    return true;
 }
 
 // ========================================================
@@ -3383,6 +8128,64 @@ const lexer::punctuation_def        * lexer::m_punctuations       = nullptr;
 const lexer::punct_table_index_type * lexer::m_punctuations_table = nullptr;
 const lexer::punct_table_index_type * lexer::m_punctuations_next  = nullptr;
 std::size_t                           lexer::m_punctuations_size  = 0;
+const lexer::punctuation_trie       * lexer::m_punctuation_trie   = nullptr;
+
+lexer::punctuation_trie * lexer::internal_get_punctuation_trie(const bool default_set)
+{
+    // The default set is compiled once and kept, so set_default_punctuation_tables()
+    // can just re-point to it. Any other set shares the second instance.
+    static punctuation_trie default_trie;
+    static punctuation_trie custom_trie;
+    return default_set ? &default_trie : &custom_trie;
+}
+
+void lexer::internal_build_punctuation_trie(const punctuation_def * const punctuations,
+                                            const std::size_t punctuations_size,
+                                            punctuation_trie * const trie)
+{
+    std::fill_n(trie->roots, 256, static_cast<punct_table_index_type>(-1));
+    trie->nodes.clear();
+
+    for (std::size_t i = 0; i < punctuations_size; ++i)
+    {
+        const char * chars = punctuations[i].str;
+        if (chars == nullptr || *chars == '\0') // punctuation_id::none
+        {
+            continue;
+        }
+
+        // Find or add a node for each char. Each link starts as the list head.
+        punct_table_index_type * link = &trie->roots[static_cast<unsigned char>(*chars)];
+        for (;;)
+        {
+            while (*link >= 0 && trie->nodes[*link].ch != *chars)
+            {
+                link = &trie->nodes[*link].next_sibling;
+            }
+
+            punct_table_index_type node = *link;
+            if (node < 0)
+            {
+                // Note: Adding the node might invalidate 'link'.
+                LEXER_ASSERT(trie->nodes.size() < 0x7FFF && "Punctuation set too big!");
+                node  = static_cast<punct_table_index_type>(trie->nodes.size());
+                *link = node;
+                trie->nodes.push_back({ -1, -1, -1, *chars });
+            }
+
+            if (*(++chars) == '\0')
+            {
+                // If the same string appears twice, the first one wins, like in the sorted chains.
+                if (trie->nodes[node].punctuation < 0)
+                {
+                    trie->nodes[node].punctuation = static_cast<punct_table_index_type>(i);
+                }
+                break;
+            }
+            link = &trie->nodes[node].first_child;
+        }
+    }
+}
 
 void lexer::set_punctuation_tables(const punctuation_def * const punctuations,
                                    punct_table_index_type * punctuations_table,
@@ -3445,12 +8248,16 @@ void lexer::set_punctuation_tables(const punctuation_def * const punctuations,
         }
     }
 
+    punctuation_trie * const trie = internal_get_punctuation_trie(punctuations == default_punctuations);
+    internal_build_punctuation_trie(punctuations, punctuations_size, trie);
+
     // Save the input pointers to the shared table pointers.
     // User must ensure the input arrays live long enough!
     m_punctuations       = punctuations;
     m_punctuations_size  = punctuations_size;
     m_punctuations_table = punctuations_table;
     m_punctuations_next  = punctuations_next;
+    m_punctuation_trie   = trie;
 }
 
 void lexer::set_default_punctuation_tables()
@@ -3471,6 +8278,7 @@ void lexer::set_default_punctuation_tables()
         m_punctuations_size  = default_punctuations_size;
         m_punctuations_table = default_punctuations_table;
         m_punctuations_next  = default_punctuations_next;
+        m_punctuation_trie   = internal_get_punctuation_trie(true);
     }
 }
 
@@ -3498,7 +8306,7 @@ lexer::punctuation_id lexer::get_punctuation_id_from_str(const char * const punc
 
     for (std::size_t i = 0; i < m_punctuations_size; ++i)
     {
-        if (std::strcmp(m_punctuations[i].str, punctuation_string) == 0)
+        if (m_punctuations[i].str != nullptr && std::strcmp(m_punctuations[i].str, punctuation_string) == 0)
         {
             return m_punctuations[i].id;
         }
@@ -3511,67 +8319,11 @@ lexer::punctuation_id lexer::get_punctuation_id_from_str(const char * const punc
 // Default C/C++ punctuation tables:
 // ========================================================
 
-const lexer::punctuation_def lexer::default_punctuations[]
-{
-    { nullptr, lexer::punctuation_id::none                },
-    { "=",     lexer::punctuation_id::assign              },
-    { "+",     lexer::punctuation_id::add                 },
-    { "-",     lexer::punctuation_id::sub                 },
-    { "*",     lexer::punctuation_id::mul                 },
-    { "/",     lexer::punctuation_id::div                 },
-    { "%",     lexer::punctuation_id::mod                 },
-    { ">>",    lexer::punctuation_id::rshift              },
-    { "<<",    lexer::punctuation_id::lshift              },
-    { "+=",    lexer::punctuation_id::add_assign          },
-    { "-=",    lexer::punctuation_id::sub_assign          },
-    { "*=",    lexer::punctuation_id::mul_assign          },
-    { "/=",    lexer::punctuation_id::div_assign          },
-    { "%=",    lexer::punctuation_id::mod_assign          },
-    { ">>=",   lexer::punctuation_id::rshift_assign       },
-    { "<<=",   lexer::punctuation_id::lshift_assign       },
-    { "&&",    lexer::punctuation_id::logic_and           },
-    { "||",    lexer::punctuation_id::logic_or            },
-    { "!",     lexer::punctuation_id::logic_not           },
-    { "==",    lexer::punctuation_id::logic_eq            },
-    { "!=",    lexer::punctuation_id::logic_not_eq        },
-    { ">",     lexer::punctuation_id::logic_greater       },
-    { "<",     lexer::punctuation_id::logic_less          },
-    { ">=",    lexer::punctuation_id::logic_greater_eq    },
-    { "<=",    lexer::punctuation_id::logic_less_eq       },
-    { "++",    lexer::punctuation_id::plus_plus           },
-    { "--",    lexer::punctuation_id::minus_minus         },
-    { "&",     lexer::punctuation_id::bitwise_and         },
-    { "|",     lexer::punctuation_id::bitwise_or          },
-    { "^",     lexer::punctuation_id::bitwise_xor         },
-    { "~",     lexer::punctuation_id::bitwise_not         },
-    { "&=",    lexer::punctuation_id::bitwise_and_assign  },
-    { "|=",    lexer::punctuation_id::bitwise_or_assign   },
-    { "^=",    lexer::punctuation_id::bitwise_xor_assign  },
-    { ".",     lexer::punctuation_id::dot                 },
-    { "->",    lexer::punctuation_id::arrow               },
-    { "::",    lexer::punctuation_id::colon_colon         },
-    { ".*",    lexer::punctuation_id::dot_star            },
-    { ",",     lexer::punctuation_id::comma               },
-    { ";",     lexer::punctuation_id::semicolon           },
-    { ":",     lexer::punctuation_id::colon               },
-    { "?",     lexer::punctuation_id::question_mark       },
-    { "...",   lexer::punctuation_id::ellipsis            },
-    { "\\",    lexer::punctuation_id::backslash           },
-    { "(",     lexer::punctuation_id::open_parentheses    },
-    { ")",     lexer::punctuation_id::close_parentheses   },
-    { "[",     lexer::punctuation_id::open_bracket        },
-    { "]",     lexer::punctuation_id::close_bracket       },
-    { "{",     lexer::punctuation_id::open_curly_bracket  },
-    { "}",     lexer::punctuation_id::close_curly_bracket },
-    { "#",     lexer::punctuation_id::preprocessor        },
-    { "##",    lexer::punctuation_id::preprocessor_merge  },
-    { "$",     lexer::punctuation_id::dollar_sign         }
-};
-
-const std::size_t lexer::default_punctuations_size =
-(
-    sizeof(lexer::default_punctuations) / sizeof(lexer::default_punctuations[0])
-);
+#if (__cplusplus < 201703L) && !(defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+// Definitions for the constexpr tables declared in the class. Implicit since C++17.
+constexpr lexer::punctuation_def lexer::default_punctuations[];
+constexpr std::size_t lexer::default_punctuations_size;
+#endif // C++17
 
 // These are initialized once by lexer::set_default_punctuation_tables().
 lexer::punct_table_index_type lexer::default_punctuations_table[256];
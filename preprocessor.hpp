@@ -24,6 +24,7 @@
 #ifndef PREPROCESSOR_NO_STD_INCLUDES
     #include <cstdint>
     #include <string>
+    #include <unordered_map>
     #include <vector>
 #endif // PREPROCESSOR_NO_STD_INCLUDES
 
@@ -115,16 +116,32 @@ public:
     // The output will be minified. The original spacing and indenting of the script is not preserved.
     bool preprocess(std::string * out_text_buffer);
 
-    // Flags, max output line length and search paths are preserved.
-    // Macros cleared, except for the built-ins.
+    // Flags, max output line length, search paths and the #include cache are preserved.
+    // Macros cleared, except for the built-ins. Compiled #if expressions are dropped.
     void clear();
 
     // Error handing forwards to the current lexer/script.
     bool error(const std::string & message);
     void warning(const std::string & message);
 
+    // Error callbacks for the scripts of this preprocessor instance only, including #included files.
+    // Null uses the shared lexer callbacks. Also applied to the lexer given to init_from_lexer(),
+    // which gets its own instance callbacks back with a null pointer, on clear() and on destruction.
+    // The preprocessor will never attempt to deallocate the provided pointer.
+    void set_error_callbacks(lexer::error_callbacks * err_callbacks) noexcept;
+    lexer::error_callbacks * get_error_callbacks() const noexcept;
+
+    // Memory resource for the macro tables, the conditional and include stacks, and the lexers
+    // and file buffers of the scripts loaded by the preprocessor. Null uses the global heap.
+    // Can only be changed while no script is loaded, returns false otherwise. Macros already
+    // defined are copied over. The preprocessor will never attempt to deallocate the provided
+    // pointer. Running out of memory fails init_from_file(), preprocess(), etc, with an error.
+    bool set_memory_resource(lexer::memory_resource * resource);
+    lexer::memory_resource * get_memory_resource() const noexcept;
+
     // Hash function used internally to hash macro names. Publicly visible.
-    static std::uint32_t hash_string(const char * str, std::size_t count);
+    // Same as lexer::hash_text(), so token::get_hash() can be used in its place.
+    static std::uint64_t hash_string(const char * str, std::size_t count);
 
     //
     // Getters/setters:
@@ -150,6 +167,14 @@ public:
     bool add_default_search_path(std::string path, char path_separator = '/');
     void clear_default_search_paths();
 
+    // The contents of #included files are cached, so including a file again doesn't reload
+    // it from disk. The cache persists across clear() and files that changed on disk since
+    // they were cached are reloaded. Changes are told by the modification time and size of
+    // the file; where the time only has a resolution of seconds (e.g. Windows), a rewrite of
+    // the same size within the same second goes unnoticed, so clear the cache explicitly then.
+    // Can only be cleared while no script is loaded.
+    bool clear_include_cache();
+
     //
     // Preprocessor macros:
     //
@@ -218,6 +243,14 @@ private:
     bool resolve_hash_directive();
     bool resolve_dollar_directive(std::string * out_text_buffer);
     bool try_open_include_file(const std::string & filename);
+    bool preprocess_tokens(std::string * out_text_buffer);
+    lexer * push_dynamic_script(lexer && script);
+    void free_dynamic_scripts() noexcept;
+
+    // Runs 'func', turning std::bad_alloc thrown by the containers when the memory
+    // resource can't satisfy a request into an error. Just returns false if 'func_name' is null.
+    template<typename Func>
+    bool guard_out_of_memory(const char * func_name, Func && func);
     void string_append_token(const lexer::token & tok, std::string * out_str) const;
 
     void output_append_token_text(const lexer::token & tok, std::string * out_text_buffer,
@@ -252,13 +285,27 @@ private:
     // Preprocessor macros (#define/#undef):
     //
 
+    enum class builtin_macro : std::uint8_t
+    {
+        none,
+        file,    // __FILE__
+        line,    // __LINE__
+        date,    // __DATE__
+        time,    // __TIME__
+        va_args  // __VA_ARGS__
+    };
+
     #pragma pack(push, 1)
     struct macro_def final
     {
-        // Indexes are into the m_macro_tokens vector.
-        std::uint32_t hashed_name;
+        // The name is in m_macro_names. Token indexes are into the m_macro_tokens vector.
+        std::uint32_t hashed_name;         // Folded hash_string() of the name. Compared before the names.
+        std::uint32_t name_offset;
+        std::uint16_t name_length;
         std::uint16_t param_token_count;
         std::uint16_t body_token_count;
+        builtin_macro builtin;
+        std::uint8_t  unused;
         std::uint64_t first_param_token     : 31;
         std::uint64_t first_body_token      : 31;
         std::uint64_t empty_func_like_macro : 1;
@@ -268,23 +315,39 @@ private:
 
     // We don't need more than the above specified bit widths, so packing the structure
     // helps save memory and allows fitting more macro_defs into each cache line.
-    static_assert(sizeof(macro_def) == 16, "Wrong size for macro_def struct!");
+    static_assert(sizeof(macro_def) == 24, "Wrong size for macro_def struct!");
 
-    // Constants generated with hash_string() using the corresponding text string.
-    static constexpr std::uint32_t builtin_macro_file    = 0x07215FFC; // __FILE__
-    static constexpr std::uint32_t builtin_macro_line    = 0x5DB1B324; // __LINE__
-    static constexpr std::uint32_t builtin_macro_date    = 0x70D6DAE9; // __DATE__
-    static constexpr std::uint32_t builtin_macro_time    = 0xC32DC18B; // __TIME__
-    static constexpr std::uint32_t builtin_macro_va_args = 0x9EE0B9AA; // __VA_ARGS__
+    // Longest macro name accepted, limited by macro_def::name_length.
+    static constexpr std::size_t max_macro_name_length = 0xFFFF;
 
     void macro_define_builtins();
     bool macro_expand_builtin(const macro_def & macro, std::string * out_text_buffer, macro_parameter_pack * va_args);
     bool macro_is_builtin(const macro_def & macro) const noexcept;
-    int  macro_find_index(std::uint32_t hashed_macro_name) const noexcept;
-    void macro_define(const std::string & macro_name, macro_def * new_macro);
+    int  macro_find_index(const char * name, std::size_t length, std::uint64_t hash) const noexcept;
+    int  macro_find_index(const std::string & name) const noexcept;
+    int  macro_find_index(const lexer::token & name_token) const noexcept;
+    const lexer::token * macro_find_constant(const char * name, std::size_t length, std::uint64_t hash) const noexcept;
+    bool macro_define(const std::string & macro_name, macro_def * new_macro);
     void macro_undefine(const std::string & macro_name);
     void macro_clear_tokens(const macro_def & macro);
 
+    // m_macro_slots is an open addressing hash table with linear probing, mapping
+    // the macro names to indexes into m_macros. Must be kept in sync with m_macros.
+    void macro_add(const char * name, std::size_t length, macro_def new_macro);
+    void macro_index_reserve(std::size_t macro_count);
+    void macro_index_insert(int macro_index) noexcept;
+    void macro_index_remove(int macro_index) noexcept;
+    void macro_index_rebuild() noexcept;
+    std::size_t macro_index_find_slot(std::uint32_t hashed_name, const char * name, std::size_t length) const noexcept;
+    std::size_t macro_index_slot_of(int macro_index) const noexcept;
+    static std::uint32_t macro_fold_hash(std::uint64_t hash) noexcept;
+
+    // m_macro_filter is a bloom filter of the names in m_macros, sized with the index.
+    // Most identifiers are not macros, and for those two bit tests usually suffice.
+    // Bits of #undefined macros are only cleared when the filter is rebuilt.
+    void macro_filter_add(std::uint32_t hashed_name) noexcept;
+    bool macro_filter_test(std::uint32_t hashed_name) const noexcept;
+
     //
     // Preprocessor conditionals:
     //
@@ -309,20 +372,100 @@ private:
     bool pop_conditional(conditional_type * out_type = nullptr, bool * out_skip = nullptr, bool * out_parent_state = nullptr);
     bool evaluate_preproc_conditional(bool * out_result);
 
+    // #if/#elif expressions are compiled by the expr_evaluator the first time they
+    // are evaluated, into m_expr_code, and found by their tokens after that. The
+    // result is kept until a macro is defined or undefined, since only they change it.
+    // The cache is dropped by clear() and when the code would grow past the size below.
+    friend class expr_evaluator;
+    static constexpr std::size_t max_expr_code_size = 32 * 1024;
+
+    struct compiled_expr final
+    {
+        std::uint32_t code_offset;   // Into m_expr_code.
+        std::uint32_t code_length;
+        std::uint64_t macro_version; // m_macro_version when 'result' was evaluated. Zero if never.
+        bool          result;
+    };
+
+    //
+    // #include file cache:
+    //
+
+    enum class include_guard : std::uint8_t
+    {
+        unknown, // Not scanned yet. Files are only scanned when included for the second time.
+        none,    // Something besides comments outside an #ifndef/#endif pair, or an #else for it.
+        found    // Skipped while the guard macro is defined, since the whole file would be.
+    };
+
+    // A directive line of an included file and where the next one is, at any depth.
+    struct directive_line final
+    {
+        std::uint32_t offset;      // Of the '#' of the directive.
+        std::uint32_t next_offset; // Of the '#' of the next directive. Zero if missing.
+        std::uint32_t next_line;   // Line number of the next directive.
+    };
+
+    struct include_file final
+    {
+        std::string   identity;    // Device, inode, modification time and size. See include_file_identity().
+        std::string   guard_macro; // Name from the #ifndef, if guard == include_guard::found.
+        char *        text;        // Cached contents, from m_memory_resource. Null if not loaded yet.
+        std::uint32_t text_length;
+        std::uint32_t token_flags; // Lexer flags the tokens were recorded with.
+        include_guard guard;
+        bool          pragma_once; // Had a #pragma once. Reset by clear().
+
+        // Tokens of the text, replayed instead of scanning it again. See lexer::init_from_static_tokens().
+        std::vector<lexer::static_token, lexer::resource_allocator<lexer::static_token>> tokens;
+
+        // Sorted by offset. Skipped blocks are jumped through with these. See skip_conditional_block().
+        std::vector<directive_line, lexer::resource_allocator<directive_line>> directives;
+    };
+
+    static bool include_file_identity(const std::string & filename, std::string * out_identity);
+    int  include_file_find(const std::string & filename);
+    void include_file_scan(include_file * file, std::uint32_t lex_flags);
+    void include_file_index_directives(include_file * file, std::uint32_t lex_flags);
+    void skip_conditional_block(std::size_t directive_offset) noexcept;
+    void free_include_cache() noexcept;
+    void release_external_script() noexcept;
+
 private:
 
-    lexer *                      m_current_script       = nullptr; // Pointer to an external lexer or to m_dynamic_scripts if at an #included file.
-    std::uint32_t                m_flags                = 0;       // preprocessor::flags ORed together or zero.
-    std::int32_t                 m_skipping_conditional = 0;       // > 0 when skipping code inside #ifs/#ifdefs/etc.
-    std::uint32_t                m_output_line_len      = 0;       // Current length of output. Reset whenever a newline character is emitted.
-    std::uint32_t                m_output_max_line_len  = 128;     // Max length hint for the output text. Lines only effectively broke at semicolons.
-    lexer::token::type           m_prev_token_type{};              // Used for the output minifier to figure out where to insert spaces.
-    std::vector<macro_def>       m_macros;                         // Macros currently defined via script code or preprocessor::define().
-    std::vector<lexer::token>    m_macro_tokens;                   // macro_def indexes point into this vector.
-    std::vector<conditional_def> m_cond_stack;                     // #if/#ifdef/#else/etc preprocessor conditionals.
-    std::vector<lexer *>         m_include_stack;                  // Stack top is the previous script before entering an #include.
-    std::vector<lexer *>         m_dynamic_scripts;                // Stuff allocated by the preprocessor (#includes, init_from_file(), etc).
-    std::vector<std::string>     m_search_paths;                   // User-provided search paths for #includes enclosed in < >.
+    template<typename T>
+    using resource_vector = std::vector<T, lexer::resource_allocator<T>>;
+
+    lexer *                          m_current_script       = nullptr; // Pointer to an external lexer or to m_dynamic_scripts if at an #included file.
+    lexer::error_callbacks *         m_error_callbacks      = nullptr; // Per instance error callbacks given to every script lexer. Null for the shared ones.
+    lexer *                          m_external_script      = nullptr; // Lexer given to init_from_lexer(), not owned. Null if none.
+    lexer::error_callbacks *         m_external_callbacks   = nullptr; // Instance callbacks m_external_script had before, given back by clear().
+    lexer::memory_resource *         m_memory_resource      = nullptr; // Allocates the containers below (but m_search_paths) and the script lexers. Global heap if null.
+    std::uint32_t                    m_flags                = 0;       // preprocessor::flags ORed together or zero.
+    std::int32_t                     m_skipping_conditional = 0;       // > 0 when skipping code inside #ifs/#ifdefs/etc.
+    std::uint32_t                    m_output_line_len      = 0;       // Current length of output. Reset whenever a newline character is emitted.
+    std::uint32_t                    m_output_max_line_len  = 128;     // Max length hint for the output text. Lines only effectively broke at semicolons.
+    lexer::token::type               m_prev_token_type{};              // Used for the output minifier to figure out where to insert spaces.
+    resource_vector<macro_def>       m_macros;                         // Macros currently defined via script code or preprocessor::define().
+    resource_vector<lexer::token>    m_macro_tokens;                   // macro_def indexes point into this vector.
+    resource_vector<char>            m_macro_names;                    // Names of the macros, not null terminated. See macro_def::name_offset.
+    resource_vector<std::int32_t>    m_macro_slots;                    // Hash index into m_macros, -1 if the slot is free. Size is a power of two.
+    resource_vector<std::uint64_t>   m_macro_filter;                   // Bloom filter of the macro names, 8 bits per slot of m_macro_slots.
+    std::size_t                      m_macro_filter_stale   = 0;       // Macros #undefined since the filter was last rebuilt.
+    std::uint64_t                    m_macro_version        = 1;       // Incremented whenever a macro is defined, redefined or undefined.
+    resource_vector<conditional_def> m_cond_stack;                     // #if/#ifdef/#else/etc preprocessor conditionals.
+    resource_vector<lexer *>         m_include_stack;                  // Stack top is the previous script before entering an #include.
+    resource_vector<std::int32_t>    m_include_file_stack;             // Parallel to m_include_stack, with the m_include_files index of each script or -1.
+    std::int32_t                     m_current_file         = -1;      // Index into m_include_files of m_current_script, -1 if not an #included file.
+    resource_vector<lexer *>         m_dynamic_scripts;                // Stuff allocated by the preprocessor (#includes, init_from_file(), etc).
+    std::vector<std::string>         m_search_paths;                   // User-provided search paths for #includes enclosed in < >.
+    std::vector<include_file>        m_include_files;                  // Cached #included files, one per file on disk.
+    std::unordered_map<std::string, std::int32_t> m_include_ids;       // include_file::identity to index into m_include_files.
+    std::unordered_map<std::string, std::int32_t> m_include_paths;     // Every path a file was opened with to index into m_include_files.
+    resource_vector<char>            m_expr_code;                      // Code of the compiled #if/#elif expressions, back to back.
+    std::unordered_map<std::string, compiled_expr> m_compiled_exprs;   // Token sequence of an #if/#elif expression to its code.
+    std::string                      m_expr_key;                       // Token sequence of the expression being evaluated. Kept to reuse its memory.
+    resource_vector<lexer::token>    m_expr_tokens;                    // Tokens of the expression being evaluated. Only compiled if not in m_compiled_exprs.
 };
 
 // ================== End of header file ==================
@@ -338,11 +481,14 @@ private:
 #ifdef PREPROCESSOR_IMPLEMENTATION
 
 #ifndef PREPROCESSOR_NO_STD_INCLUDES
+    #include <algorithm>
     #include <cmath>
     #include <ctime>
     #include <cstdio>
     #include <cstring>
     #include <utility>
+    #include <sys/types.h>
+    #include <sys/stat.h>
 #endif // PREPROCESSOR_NO_STD_INCLUDES
 
 #define PREPROC_FLOAT_FMT   "%.20lf"
@@ -400,6 +546,7 @@ public:
     explicit expr_evaluator(preprocessor * pp)
         : m_preproc{ pp }
         , m_next_token_index{ 0 }
+        , m_slot_count{ 0 }
     {
         PREPROCESSOR_ASSERT(pp != nullptr);
     }
@@ -432,8 +579,8 @@ public:
             return true;
         }
 
-        m_next_token_index = 0; // Point to the first token in m_eval_tokens[].
-        if (!process_tokens(&expr_result, flags))
+        compile(flags);
+        if (!run(m_code.data(), m_code.size(), &expr_result))
         {
             return false;
         }
@@ -449,11 +596,33 @@ public:
         return true;
     }
 
+    // Compiles the tokens pushed into code for run(), so an expression that is
+    // reached again doesn't have to be parsed again. Macro constants and 'defined'
+    // are only looked up when the code runs. Syntax errors are reported by run() too.
+    void compile(const std::uint32_t flags)
+    {
+        m_code.clear();
+        m_slot_count = 0;
+        m_next_token_index = 0; // Point to the first token in m_eval_tokens[].
+        process_tokens(flags);
+    }
+
+    const std::vector<char> & get_code() const noexcept
+    {
+        return m_code;
+    }
+
+    // Evaluates code from compile(), which might have been compiled by another evaluator.
+    bool run(const char * code, std::size_t code_length, eval_value * result_value);
+
 private:
 
     preprocessor *            m_preproc;          // Preprocessor with the error/warning callbacks and #define expansion.
     std::uint32_t             m_next_token_index; // Next token in the vector to process.
+    std::uint32_t             m_slot_count;       // Operands loaded by the code compiled so far.
     std::vector<lexer::token> m_eval_tokens;      // List of lexer::tokens making up the expression, including parenthesis.
+    std::vector<char>         m_code;             // Output of compile(). See opcode.
+    std::vector<eval_value>   m_slots;            // Operands of the code being run.
 
     //
     // Helper structures / types:
@@ -474,57 +643,44 @@ private:
     static const math_func  builtin_math_funcs[];
     static const math_const builtin_math_consts[];
 
-    struct operator_link final
+    // Operator read by the parser, waiting for the expression to end so that its
+    // precedence can be compared with the operators that follow it.
+    struct pending_op final
     {
-        operator_link   *     prev;
-        operator_link   *     next;
         const math_func *     mathfunc;
         int                   precedence;
         int                   parentheses;
+        std::uint32_t         values_before; // Operands loaded before the operator was read.
         lexer::punctuation_id op;
     };
 
-    struct value_link final
+    // Operands already combined by an operator form a group, represented by
+    // the slot holding the result. Groups are merged with a union-find.
+    struct value_group final
     {
-        value_link * prev;
-        value_link * next;
-        eval_value   value;
-        int          parentheses;
+        std::uint32_t parent;
+        std::uint32_t slot;
     };
 
-    class fixed_stack final
-    {
-    public:
-        fixed_stack() = default;
-
-        operator_link * new_operator() noexcept
-        {
-            if (operators_count < max_operators)
-            {
-                return &ops_stack[operators_count++];
-            }
-            return nullptr;
-        }
-        value_link * new_value() noexcept
-        {
-            if (values_count < max_values)
-            {
-                return &val_stack[values_count++];
-            }
-            return nullptr;
-        }
-
-    private:
-        static constexpr int max_operators = 128;
-        static constexpr int max_values    = 128;
-
-        int operators_count = 0;
-        int values_count    = 0;
-
-        operator_link ops_stack[max_operators];
-        value_link    val_stack[max_values];
+    // Instructions of the compiled code, each followed by its arguments. The operands
+    // are loaded into consecutive slots in the order they are read, like the parser
+    // resolved them, then the operators are applied to the slots in precedence order.
+    enum class opcode : std::uint8_t
+    {
+        load_value,   // eval_value.
+        load_macro,   // eval_value if the macro is undefined, bool fail if undefined, name.
+        load_defined, // name. Names are a hash, a length and the characters.
+        apply_op,     // punctuation_id, lhs and rhs slots. The result replaces lhs.
+        call_func,    // Index into builtin_math_funcs, lhs and rhs slots. The result replaces lhs.
+        fail,         // Error message, a length and the characters.
+        result        // Slot with the value of the expression.
     };
 
+    // Scratch state of compile(), kept to reuse the memory.
+    std::vector<pending_op>    m_operators;      // Operators in the order they were read.
+    std::vector<std::uint32_t> m_operator_stack; // Indexes of the operators waiting for their rhs.
+    std::vector<value_group>   m_value_groups;   // One per slot.
+
     //
     // Internal methods:
     //
@@ -553,57 +709,11 @@ private:
         return nullptr;
     }
 
-    template<typename ListNode>
-    static void list_add_link(ListNode ** first, ListNode ** last, ListNode * new_link) noexcept
+    bool process_tokens(const std::uint32_t flags)
     {
-        new_link->next = nullptr;
-        new_link->prev = *last;
-        if (*last != nullptr)
-        {
-            (*last)->next = new_link;
-        }
-        else
-        {
-            *first = new_link;
-        }
-        *last = new_link;
-    }
-
-    template<typename ListNode>
-    static void list_remove_link(ListNode ** first, ListNode ** last, ListNode * rem_link) noexcept
-    {
-        if (rem_link->prev != nullptr)
-        {
-            rem_link->prev->next = rem_link->next;
-        }
-        else
-        {
-            *first = rem_link->next;
-        }
-
-        if (rem_link->next != nullptr)
-        {
-            rem_link->next->prev = rem_link->prev;
-        }
-        else
-        {
-            *last = rem_link->prev;
-        }
-    }
-
-    bool process_tokens(eval_value * result_value, const std::uint32_t flags)
-    {
-        PREPROCESSOR_ASSERT(result_value != nullptr);
-
-        // Nodes for the below lists are sourced from this fixed-length static stack,
-        // so we avoid allocating any extra heap memory for the expression evaluation.
-        fixed_stack stack;
-
-        // Value and operator lists:
-        operator_link * first_operator = nullptr;
-        operator_link * last_operator  = nullptr;
-        value_link    * first_value    = nullptr;
-        value_link    * last_value     = nullptr;
+        // Values are loaded into slots in the order they are read, so only
+        // the operators have to be kept until the whole expression is read.
+        m_operators.clear();
 
         // Temp evaluator states:
         bool last_was_value    = false;
@@ -619,41 +729,26 @@ private:
                 {
                     if (last_was_value)
                     {
-                        return m_preproc->error("syntax error in preprocessor expression!");
+                        return emit_fail("syntax error in preprocessor expression!");
                     }
 
                     if (negative_value)
                     {
                         // Multiply the resulting expression or value by -1 to negate it.
-                        if (!emit_mul_by_minus1(&first_value,    &last_value,
-                                                &first_operator, &last_operator,
-                                                &stack, parentheses_count))
-                        {
-                            return false;
-                        }
+                        emit_mul_by_minus1(parentheses_count);
                         negative_value = false;
                     }
 
                     if (*t == "defined") // 'defined FOO' directive
                     {
-                        if (!resolve_defined_subexpr(&first_value, &last_value, &stack,
-                                                     parentheses_count, flags))
+                        if (!resolve_defined_subexpr(flags))
                         {
                             return false;
                         }
                     }
                     else if (t->is_boolean()) // Boolean literals
                     {
-                        value_link * v = stack.new_value();
-                        if (v == nullptr)
-                        {
-                            return m_preproc->error("preprocessor expression is too long! No more stack space.");
-                        }
-
-                        v->value.type   = eval_type_int;
-                        v->value.as_int = t->as_bool();
-                        v->parentheses  = parentheses_count;
-                        list_add_link(&first_value, &last_value, v);
+                        emit_load_value(int_value(t->as_bool()));
                     }
                     else
                     {
@@ -662,82 +757,19 @@ private:
                         {
                             if (const math_func * mf = find_math_func(t->as_string()))
                             {
-                                value_link    * v = stack.new_value();
-                                operator_link * o = stack.new_operator();
-
-                                if (v == nullptr || o == nullptr)
-                                {
-                                    return m_preproc->error("preprocessor expression is too long! No more stack space.");
-                                }
-
-                                // Dummy operator for the function call:
-                                o->mathfunc     = mf;
-                                o->precedence   = 999;
-                                o->parentheses  = parentheses_count;
-                                o->op           = lexer::punctuation_id::none;
-
-                                // The dummy operator also needs a following dummy value.
-                                v->value.as_int = 0;
-                                v->value.type   = eval_type_int;
-                                v->parentheses  = parentheses_count;
-
-                                list_add_link(&first_value,    &last_value,    v);
-                                list_add_link(&first_operator, &last_operator, o);
+                                // Dummy operator for the function call, after a dummy value,
+                                // so the argument is its right hand side.
+                                emit_load_value(int_value(0));
+                                m_operators.push_back(pending_op{ mf, 999, parentheses_count, m_slot_count,
+                                                                  lexer::punctuation_id::none });
 
                                 last_was_value = false; // No value emitted.
                                 break;
                             }
                         }
 
-                        // Could be a reference to a macro constant:
-                        lexer::token macro_token;
-                        if (!m_preproc->find_macro_token(t->as_string(), &macro_token))
-                        {
-                            // Try a built-in math constant:
-                            const math_const * mc;
-                            if ((flags & eval_flags::allow_math_consts) &&
-                                ((mc = find_math_const(t->as_string())) != nullptr))
-                            {
-                                char num_str[PREPROC_NUMBUF_SIZE] = {'\0'};
-                                std::snprintf(num_str, sizeof(num_str), PREPROC_FLOAT_FMT, mc->value);
-                                macro_token.set_string(num_str);
-                                macro_token.set_type(lexer::token::type::number);
-                                macro_token.set_flags(lexer::token::flags::floating_point  |
-                                                      lexer::token::flags::double_precision);
-                            }
-                            else
-                            {
-                                // Optionally don't emit errors for undefined macro constants, assume zero instead.
-                                if (flags & eval_flags::undefined_consts_are_zero)
-                                {
-                                    macro_token.set_string("0");
-                                    macro_token.set_type(lexer::token::type::number);
-                                    macro_token.set_flags(lexer::token::flags::integer |
-                                                          lexer::token::flags::decimal |
-                                                          lexer::token::flags::signed_integer);
-                                }
-                                else
-                                {
-                                    return m_preproc->error("reference to undefined preprocessor constant \'" +
-                                                            t->as_string() + "\'.");
-                                }
-                            }
-                        }
-
-                        value_link * v = stack.new_value();
-                        if (v == nullptr)
-                        {
-                            return m_preproc->error("preprocessor expression is too long! No more stack space.");
-                        }
-
-                        // Use the constant value (must be a number):
-                        if (!token_to_value(&v->value, &macro_token, false))
-                        {
-                            return false;
-                        }
-
-                        v->parentheses = parentheses_count;
-                        list_add_link(&first_value, &last_value, v);
+                        // Could be a reference to a macro constant, looked up when the code runs.
+                        emit_load_macro(t->as_string(), flags);
                     }
 
                     last_was_value = true; // Macro expansion creates a value.
@@ -747,22 +779,15 @@ private:
                 {
                     if (last_was_value)
                     {
-                        return m_preproc->error("syntax error in preprocessor expression!");
+                        return emit_fail("syntax error in preprocessor expression!");
                     }
 
-                    value_link * v = stack.new_value();
-                    if (v == nullptr)
+                    eval_value value;
+                    if (!token_to_value(&value, t, negative_value))
                     {
-                        return m_preproc->error("preprocessor expression is too long! No more stack space.");
+                        return emit_fail(expected_number_error(*t));
                     }
-
-                    if (!token_to_value(&v->value, t, negative_value))
-                    {
-                        return false;
-                    }
-
-                    v->parentheses = parentheses_count;
-                    list_add_link(&first_value, &last_value, v);
+                    emit_load_value(value);
 
                     last_was_value = true;
                     negative_value = false;
@@ -777,12 +802,7 @@ private:
                         // multiplication by -1, so we create two additional nodes for the value and * operator.
                         if (negative_value)
                         {
-                            if (!emit_mul_by_minus1(&first_value,    &last_value,
-                                                    &first_operator, &last_operator,
-                                                    &stack, parentheses_count))
-                            {
-                                return false;
-                            }
+                            emit_mul_by_minus1(parentheses_count);
                             last_was_value = false;
                             negative_value = false;
                         }
@@ -793,9 +813,9 @@ private:
                     {
                         if (--parentheses_count < 0)
                         {
-                            return m_preproc->error("too many \'" +
-                                                    lexer::get_punctuation_from_id(lexer::punctuation_id::close_parentheses) +
-                                                    "\' in preprocessor directive!");
+                            return emit_fail("too many \'" +
+                                             lexer::get_punctuation_from_id(lexer::punctuation_id::close_parentheses) +
+                                             "\' in preprocessor directive!");
                         }
                         break;
                     }
@@ -825,19 +845,14 @@ private:
                             // Same trick as used for the unary - before a ().
                             // Negate the final subexpression by multiplying by -1.
                             //
-                            if (!emit_mul_by_minus1(&first_value,    &last_value,
-                                                    &first_operator, &last_operator,
-                                                    &stack, parentheses_count))
-                            {
-                                return false;
-                            }
+                            emit_mul_by_minus1(parentheses_count);
                             last_was_value = false;
                             negative_value = false;
                             // Allow the ! or ~ op to be emitted below.
                         }
                         else
                         {
-                            return m_preproc->error("misplaced minus sign in preprocessor expression!");
+                            return emit_fail("misplaced minus sign in preprocessor expression!");
                         }
                     }
 
@@ -848,8 +863,8 @@ private:
                     case lexer::punctuation_id::bitwise_not :
                         if (last_was_value)
                         {
-                            return m_preproc->error("invalid logic not or two's complement after "
-                                                    "value in preprocessor expression.");
+                            return emit_fail("invalid logic not or two's complement after "
+                                             "value in preprocessor expression.");
                         }
                         break;
                     case lexer::punctuation_id::sub :
@@ -887,222 +902,129 @@ private:
                     case lexer::punctuation_id::question_mark :
                         if (!last_was_value)
                         {
-                            return m_preproc->error("invalid operator \'" + t->as_string() +
-                                                    "\' after operator in preprocessor expression.");
+                            return emit_fail("invalid operator \'" + t->as_string() +
+                                             "\' after operator in preprocessor expression.");
                         }
                         break;
 
                     default :
-                        return m_preproc->error("invalid operator \'" + t->as_string() +
-                                                "\' in preprocessor expression.");
+                        return emit_fail("invalid operator \'" + t->as_string() +
+                                         "\' in preprocessor expression.");
                     } // switch (punct_id)
 
                     // Make a new operator node if not a unary negation or unary plus:
                     if (!negative_value && !unary_plus)
                     {
-                        operator_link * o = stack.new_operator();
-                        if (o == nullptr)
-                        {
-                            return m_preproc->error("preprocessor expression is too long! No more stack space.");
-                        }
-
-                        o->op          = punct_id;
-                        o->mathfunc    = nullptr;
-                        o->parentheses = parentheses_count;
-                        o->precedence  = get_operator_precedence(punct_id);
-                        list_add_link(&first_operator, &last_operator, o);
+                        m_operators.push_back(pending_op{ nullptr, get_operator_precedence(punct_id),
+                                                          parentheses_count, m_slot_count, punct_id });
 
                         last_was_value = false;
                     }
                     break;
                 }
             default :
-                return m_preproc->error("unexpected token \'" + t->as_string() + "\' in preprocessor directive!");
+                return emit_fail("unexpected token \'" + t->as_string() + "\' in preprocessor directive!");
             } // switch (t->get_type())
         } // for each token
 
         if (!last_was_value)
         {
-            return m_preproc->error("trailing operator in preprocessor expression!");
+            return emit_fail("trailing operator in preprocessor expression!");
         }
 
         if (parentheses_count > 0)
         {
-            return m_preproc->error("too many \'" +
-                                    lexer::get_punctuation_from_id(lexer::punctuation_id::open_parentheses) +
-                                    "\' in preprocessor directive!");
+            return emit_fail("too many \'" +
+                             lexer::get_punctuation_from_id(lexer::punctuation_id::open_parentheses) +
+                             "\' in preprocessor directive!");
         }
 
-        // Ternary operator helpers:
-        eval_value ternary_op_condition{};
-        bool got_ternary_op_condition = false;
-
-        // Now execute the subexpressions with correct precedence:
-        while (first_operator != nullptr)
+        m_value_groups.resize(m_slot_count);
+        for (std::uint32_t i = 0; i < m_slot_count; ++i)
         {
-            value_link    * v = first_value;
-            operator_link * o = first_operator;
+            m_value_groups[i] = value_group{ i, i };
+        }
 
-            for (; o->next != nullptr; o = o->next)
+        // Now emit the subexpressions in the order they execute, by precedence.
+        // Operators wait in the stack while the next operator runs before them,
+        // so each operator is pushed and popped once.
+        m_operator_stack.clear();
+        for (std::uint32_t i = 0; i < m_operators.size(); ++i)
+        {
+            while (!m_operator_stack.empty() &&
+                   runs_before(m_operators[m_operator_stack.back()], m_operators[i]))
             {
-                // If the current operator is nested deeper in
-                // parentheses than the next operator...
-                if (o->parentheses > o->next->parentheses)
-                {
-                    break;
-                }
-
-                // If the current and next operator are nested equally deep in parentheses:
-                if (o->parentheses == o->next->parentheses)
-                {
-                    // If the precedence of the current operator is equal
-                    // or higher than the precedence of the next operator:
-                    if (o->precedence >= o->next->precedence)
-                    {
-                        break;
-                    }
-                }
-
-                // If the arity of the operator isn't equal to 1 (unary op):
-                if (o->op != lexer::punctuation_id::logic_not &&
-                    o->op != lexer::punctuation_id::bitwise_not)
-                {
-                    v = v->next;
-                }
-
-                // If there's no value or no next value it's an error.
-                if (v == nullptr)
-                {
-                    return m_preproc->error("expected more values in preprocessor expression!");
-                }
-            } // for each operator
+                emit_operator(m_operators[m_operator_stack.back()]);
+                m_operator_stack.pop_back();
+            }
+            m_operator_stack.push_back(i);
+        }
+        while (!m_operator_stack.empty())
+        {
+            emit_operator(m_operators[m_operator_stack.back()]);
+            m_operator_stack.pop_back();
+        }
 
-            value_link * v1 = v;
-            value_link * v2 = v->next;
+        emit(opcode::result);
+        emit(m_value_groups[find_value_group(0)].slot);
+        return true;
+    }
 
-            switch (o->op)
-            {
-            //
-            // Unary operators:
-            //
-            case lexer::punctuation_id::logic_not :
-                {
-                    if (v1->value.type == eval_type_int)
-                    {
-                        v1->value.as_int = !v1->value.as_int;
-                    }
-                    else
-                    {
-                        v1->value.as_double = !v1->value.as_double;
-                    }
-                    break;
-                }
-            case lexer::punctuation_id::bitwise_not :
-                {
-                    if (v1->value.type == eval_type_int) // Integers only.
-                    {
-                        v1->value.as_int = ~v1->value.as_int;
-                    }
-                    else
-                    {
-                        return m_preproc->error("operator \'" + lexer::get_punctuation_from_id(o->op) +
-                                                "\' cannot be applied to floating-point value!");
-                    }
-                    break;
-                }
+    // If the current operator is nested deeper in parentheses than the next one, or equally
+    // deep with a precedence equal or higher than the next, it goes first. So operators
+    // of the same precedence run from left to right.
+    static bool runs_before(const pending_op & current, const pending_op & next) noexcept
+    {
+        if (current.parentheses != next.parentheses)
+        {
+            return current.parentheses > next.parentheses;
+        }
+        return current.precedence >= next.precedence;
+    }
 
-            //
-            // Ternary operator:
-            //
-            case lexer::punctuation_id::colon :
-                {
-                    if (!got_ternary_op_condition)
-                    {
-                        return m_preproc->error("\'" + lexer::get_punctuation_from_id(lexer::punctuation_id::colon) +
-                                                "\' without \'" + lexer::get_punctuation_from_id(lexer::punctuation_id::question_mark) +
-                                                "\' in preprocessor directive!");
-                    }
+    std::uint32_t find_value_group(std::uint32_t slot) noexcept
+    {
+        while (m_value_groups[slot].parent != slot)
+        {
+            m_value_groups[slot].parent = m_value_groups[m_value_groups[slot].parent].parent;
+            slot = m_value_groups[slot].parent;
+        }
+        return slot;
+    }
 
-                    if (ternary_op_condition.type == eval_type_double)
-                    {
-                        if (!ternary_op_condition.as_double)
-                        {
-                            v1->value = v2->value;
-                        }
-                    }
-                    else
-                    {
-                        if (!ternary_op_condition.as_int)
-                        {
-                            v1->value = v2->value;
-                        }
-                    }
+    void emit_operator(const pending_op & o)
+    {
+        // The unary operators apply to the operand after them and only use the lhs.
+        // The others combine the operands before and after them into one group.
+        const bool unary = (o.op == lexer::punctuation_id::logic_not ||
+                            o.op == lexer::punctuation_id::bitwise_not);
 
-                    ternary_op_condition = eval_value{};
-                    got_ternary_op_condition = false;
-                    break;
-                }
-            case lexer::punctuation_id::question_mark :
-                {
-                    if (got_ternary_op_condition)
-                    {
-                        const std::string qm = lexer::get_punctuation_from_id(lexer::punctuation_id::question_mark);
-                        return m_preproc->error("\'" + qm + "\' after \'" + qm + "\' in preprocessor directive!");
-                    }
+        PREPROCESSOR_ASSERT(o.values_before < m_slot_count && (unary || o.values_before > 0));
+        const std::uint32_t lhs = find_value_group(unary ? o.values_before : o.values_before - 1);
+        const std::uint32_t rhs = find_value_group(o.values_before);
 
-                    ternary_op_condition = v1->value;
-                    got_ternary_op_condition = true;
-                    break;
-                }
-
-            //
-            // Other arithmetical and logical binary operators or built-in function call:
-            //
-            default :
-                {
-                    eval_value result;
-                    if (o->mathfunc != nullptr)
-                    {
-                        if (v2->value.type == eval_type_double)
-                        {
-                            result.as_double = o->mathfunc->fptr(v2->value.as_double);
-                        }
-                        else
-                        {
-                            result.as_double = o->mathfunc->fptr(static_cast<double>(v2->value.as_int));
-                        }
-                        result.type = eval_type_double;
-                    }
-                    else
-                    {
-                        if (!resolve_subexpr(&result, v1->value, v2->value, o->op))
-                        {
-                            return false;
-                        }
-                    }
-                    v1->value = result;
-                    break;
-                }
-            } // switch (o->op)
+        if (o.mathfunc != nullptr)
+        {
+            emit(opcode::call_func);
+            emit(static_cast<std::uint8_t>(o.mathfunc - builtin_math_funcs));
+        }
+        else
+        {
+            emit(opcode::apply_op);
+            emit(o.op);
+        }
+        emit(m_value_groups[lhs].slot);
+        emit(m_value_groups[rhs].slot);
 
-            if (o->op != lexer::punctuation_id::logic_not &&
-                o->op != lexer::punctuation_id::bitwise_not)
+        if (!unary)
+        {
+            // The ternary operator keeps the second value, to be picked by the ':'.
+            if (o.op == lexer::punctuation_id::question_mark)
             {
-                // Remove the second value if not the ternary operator.
-                if (o->op != lexer::punctuation_id::question_mark)
-                {
-                    v = v->next;
-                }
-                list_remove_link(&first_value, &last_value, v);
+                m_value_groups[lhs].slot = m_value_groups[rhs].slot;
             }
-
-            // Remove the operator:
-            list_remove_link(&first_operator, &last_operator, o);
-        } // while more operators
-
-        PREPROCESSOR_ASSERT(first_value != nullptr);
-        *result_value = first_value->value;
-        return true;
+            m_value_groups[rhs].parent = lhs;
+        }
     }
 
     static int get_operator_precedence(const lexer::punctuation_id op) noexcept
@@ -1144,34 +1066,14 @@ private:
         return nullptr;
     }
 
-    bool emit_mul_by_minus1(value_link ** first_value, value_link ** last_value,
-                            operator_link ** first_operator, operator_link ** last_operator,
-                            fixed_stack * stack, const int parentheses_count)
+    void emit_mul_by_minus1(const int parentheses_count)
     {
-        value_link    * new_val = stack->new_value();
-        operator_link * new_op  = stack->new_operator();
-
-        if (new_val == nullptr || new_op == nullptr)
-        {
-            return m_preproc->error("preprocessor expression is too long! No more stack space.");
-        }
-
-        new_val->value.as_int = -1; // Will promote to double if needed.
-        new_val->value.type   = eval_type_int;
-        new_val->parentheses  = parentheses_count;
-
-        new_op->parentheses   = parentheses_count;
-        new_op->mathfunc      = nullptr;
-        new_op->op            = lexer::punctuation_id::mul;
-        new_op->precedence    = get_operator_precedence(lexer::punctuation_id::mul);
-
-        list_add_link(first_value,    last_value,    new_val);
-        list_add_link(first_operator, last_operator, new_op);
-        return true;
+        emit_load_value(int_value(-1)); // Will promote to double if needed.
+        m_operators.push_back(pending_op{ nullptr, get_operator_precedence(lexer::punctuation_id::mul),
+                                          parentheses_count, m_slot_count, lexer::punctuation_id::mul });
     }
 
-    bool resolve_defined_subexpr(value_link ** first_value, value_link ** last_value, fixed_stack * stack,
-                                 const int parentheses_count, const std::uint32_t flags)
+    bool resolve_defined_subexpr(const std::uint32_t flags)
     {
         const lexer::token * t = next_token();
         bool open_par;
@@ -1189,45 +1091,110 @@ private:
         // Parenthesis are optional in a 'defined' command.
         if (t == nullptr || !t->is_identifier())
         {
-            return m_preproc->error("preprocessor \'defined\' directive without identifier!");
+            return emit_fail("preprocessor \'defined\' directive without identifier!");
         }
 
-        value_link * v = stack->new_value();
-        if (v == nullptr)
+        // Try the math consts first, if they are enabled. Otherwise check the user #defines when running.
+        if ((flags & eval_flags::allow_math_consts) && find_math_const(t->as_string()) != nullptr)
         {
-            return m_preproc->error("preprocessor expression is too long! No more stack space.");
+            emit_load_value(int_value(1));
         }
-
-        // Try the math consts first, if they are enabled:
-        int defined = 0;
-        if (flags & eval_flags::allow_math_consts)
-        {
-            defined = (find_math_const(t->as_string()) != nullptr);
-        }
-
-        // Math consts disabled or not a math const, check the user #defines:
-        if (!defined)
+        else
         {
-            defined = m_preproc->is_defined(t->as_string());
+            emit(opcode::load_defined);
+            emit_name(t->as_string());
+            ++m_slot_count;
         }
 
-        v->value.as_int = defined;
-        v->value.type   = eval_type_int;
-        v->parentheses  = parentheses_count;
-        list_add_link(first_value, last_value, v);
-
         if (open_par) // Expect the closing parentheses:
         {
             t = next_token();
             if (t == nullptr || !lexer::is_punctuation_token(*t, lexer::punctuation_id::close_parentheses))
             {
-                return m_preproc->error("preprocessor \'defined\' directive missing closing parentheses.");
+                return emit_fail("preprocessor \'defined\' directive missing closing parentheses.");
             }
         }
 
         return true;
     }
 
+    //
+    // Code emission:
+    //
+
+    template<typename T>
+    void emit(const T & arg)
+    {
+        const char * const bytes = reinterpret_cast<const char *>(&arg);
+        m_code.insert(m_code.end(), bytes, bytes + sizeof(T));
+    }
+
+    template<typename T>
+    static T fetch(const char ** ip) noexcept
+    {
+        T arg;
+        std::memcpy(&arg, *ip, sizeof(T));
+        *ip += sizeof(T);
+        return arg;
+    }
+
+    // Names are stored with their hash, so they don't have to be hashed to look them up.
+    void emit_name(const std::string & name)
+    {
+        emit(preprocessor::hash_string(name.c_str(), name.length()));
+        emit(static_cast<std::uint32_t>(name.length()));
+        m_code.insert(m_code.end(), name.begin(), name.end());
+    }
+
+    std::uint32_t emit_load_value(const eval_value & value)
+    {
+        emit(opcode::load_value);
+        emit(value);
+        return m_slot_count++;
+    }
+
+    std::uint32_t emit_load_macro(const std::string & name, const std::uint32_t flags)
+    {
+        // The value if the macro is undefined when the code runs, from a token
+        // like the macros are. Either a built-in math constant or zero, if enabled.
+        lexer::token if_undefined;
+        const math_const * mc;
+        if ((flags & eval_flags::allow_math_consts) && ((mc = find_math_const(name)) != nullptr))
+        {
+            char num_str[PREPROC_NUMBUF_SIZE] = {'\0'};
+            std::snprintf(num_str, sizeof(num_str), PREPROC_FLOAT_FMT, mc->value);
+            if_undefined.set_string(num_str);
+            if_undefined.set_type(lexer::token::type::number);
+            if_undefined.set_flags(lexer::token::flags::floating_point  |
+                                   lexer::token::flags::double_precision);
+        }
+        else if (flags & eval_flags::undefined_consts_are_zero)
+        {
+            if_undefined.set_string("0");
+            if_undefined.set_type(lexer::token::type::number);
+            if_undefined.set_flags(lexer::token::flags::integer |
+                                   lexer::token::flags::decimal |
+                                   lexer::token::flags::signed_integer);
+        }
+
+        eval_value value{};
+        const bool fail_if_undefined = !token_to_value(&value, &if_undefined, false);
+
+        emit(opcode::load_macro);
+        emit(value);
+        emit(fail_if_undefined);
+        emit_name(name);
+        return m_slot_count++;
+    }
+
+    bool emit_fail(const std::string & message)
+    {
+        emit(opcode::fail);
+        emit(static_cast<std::uint32_t>(message.length()));
+        m_code.insert(m_code.end(), message.begin(), message.end());
+        return false;
+    }
+
     template<typename T>
     static void set_value(eval_value * out_val, const T val, const eval_value_type type) noexcept
     {
@@ -1347,7 +1314,14 @@ private:
         return m_preproc->error("unexpected types in preprocessor expression!");
     }
 
-    bool token_to_value(eval_value * out_val, const lexer::token * tok, const bool negate_it)
+    static eval_value int_value(const std::int64_t val) noexcept
+    {
+        eval_value value;
+        set_value(&value, val, eval_type_int);
+        return value;
+    }
+
+    static bool token_to_value(eval_value * out_val, const lexer::token * tok, const bool negate_it)
     {
         if (tok->is_integer() || tok->is_boolean())
         {
@@ -1363,8 +1337,13 @@ private:
             return true;
         }
 
-        return m_preproc->error("expected number or boolean value in preprocessor expression, "
-                                "got \'" + tok->as_string() + "\'.");
+        return false;
+    }
+
+    static std::string expected_number_error(const lexer::token & tok)
+    {
+        return "expected number or boolean value in preprocessor expression, "
+               "got \'" + tok.as_string() + "\'.";
     }
 
     static void value_to_token(lexer::token * out_token, const eval_value & val, const std::uint32_t flags)
@@ -1393,47 +1372,247 @@ private:
                 token_flags |= lexer::token::flags::signed_integer;
                 break;
 
-            case eval_type_double :
-                token_flags |= lexer::token::flags::floating_point;
-                token_flags |= lexer::token::flags::double_precision;
-                break;
-            } // switch (val.type)
-        }
+            case eval_type_double :
+                token_flags |= lexer::token::flags::floating_point;
+                token_flags |= lexer::token::flags::double_precision;
+                break;
+            } // switch (val.type)
+        }
+
+        switch (val.type)
+        {
+        case eval_type_int :
+            if (flags & eval_flags::force_float_type) // Promote to double if necessary
+            {
+                std::snprintf(num_str, sizeof(num_str), " %f ",
+                              static_cast<double>(val.as_int));
+            }
+            else
+            {
+                std::snprintf(num_str, sizeof(num_str), " " PREPROC_INT64_FMT " ",
+                              val.as_int);
+            }
+            break;
+
+        case eval_type_double :
+            if (flags & eval_flags::force_int_type) // Truncate to integer if necessary
+            {
+                std::snprintf(num_str, sizeof(num_str), " " PREPROC_INT64_FMT " ",
+                              static_cast<std::int64_t>(val.as_double));
+            }
+            else
+            {
+                std::snprintf(num_str, sizeof(num_str), " " PREPROC_FLOAT_FMT " ",
+                              val.as_double);
+            }
+            break;
+        } // switch (val.type)
+
+        out_token->set_type(lexer::token::type::number);
+        out_token->set_flags(token_flags);
+        out_token->set_string(num_str);
+    }
+};
+
+// ========================================================
+// expr_evaluator compiled code execution:
+// ========================================================
+
+bool expr_evaluator::run(const char * const code, const std::size_t code_length, eval_value * result_value)
+{
+    PREPROCESSOR_ASSERT(code != nullptr && result_value != nullptr);
+
+    // Ternary operator helpers:
+    eval_value ternary_op_condition{};
+    bool got_ternary_op_condition = false;
+
+    m_slots.clear();
+    const char * ip = code;
+    const char * const code_end = code + code_length;
+
+    while (ip != code_end)
+    {
+        switch (fetch<opcode>(&ip))
+        {
+        //
+        // Operands:
+        //
+        case opcode::load_value :
+            {
+                m_slots.push_back(fetch<eval_value>(&ip));
+                break;
+            }
+        case opcode::load_macro :
+            {
+                eval_value value = fetch<eval_value>(&ip);
+                const bool fail_if_undefined = fetch<bool>(&ip);
+                const auto hash   = fetch<std::uint64_t>(&ip);
+                const auto length = fetch<std::uint32_t>(&ip);
+                const char * const name = ip;
+                ip += length;
+
+                // Only simple '#define FOO 42' macros, like find_macro_token().
+                if (const lexer::token * macro_token = m_preproc->macro_find_constant(name, length, hash))
+                {
+                    if (!token_to_value(&value, macro_token, false))
+                    {
+                        return m_preproc->error(expected_number_error(*macro_token));
+                    }
+                }
+                else if (fail_if_undefined)
+                {
+                    return m_preproc->error("reference to undefined preprocessor constant \'" +
+                                            std::string(name, length) + "\'.");
+                }
+                m_slots.push_back(value);
+                break;
+            }
+        case opcode::load_defined :
+            {
+                const auto hash   = fetch<std::uint64_t>(&ip);
+                const auto length = fetch<std::uint32_t>(&ip);
+                m_slots.push_back(int_value(m_preproc->macro_find_index(ip, length, hash) >= 0));
+                ip += length;
+                break;
+            }
+
+        //
+        // Operators, in the order they execute:
+        //
+        case opcode::apply_op :
+            {
+                const auto op = fetch<lexer::punctuation_id>(&ip);
+                eval_value & v1 = m_slots[fetch<std::uint32_t>(&ip)];
+                const eval_value v2 = m_slots[fetch<std::uint32_t>(&ip)];
+
+                switch (op)
+                {
+                //
+                // Unary operators:
+                //
+                case lexer::punctuation_id::logic_not :
+                    {
+                        if (v1.type == eval_type_int)
+                        {
+                            v1.as_int = !v1.as_int;
+                        }
+                        else
+                        {
+                            v1.as_double = !v1.as_double;
+                        }
+                        break;
+                    }
+                case lexer::punctuation_id::bitwise_not :
+                    {
+                        if (v1.type == eval_type_int) // Integers only.
+                        {
+                            v1.as_int = ~v1.as_int;
+                        }
+                        else
+                        {
+                            return m_preproc->error("operator \'" + lexer::get_punctuation_from_id(op) +
+                                                    "\' cannot be applied to floating-point value!");
+                        }
+                        break;
+                    }
+
+                //
+                // Ternary operator:
+                //
+                case lexer::punctuation_id::colon :
+                    {
+                        if (!got_ternary_op_condition)
+                        {
+                            return m_preproc->error("\'" + lexer::get_punctuation_from_id(lexer::punctuation_id::colon) +
+                                                    "\' without \'" + lexer::get_punctuation_from_id(lexer::punctuation_id::question_mark) +
+                                                    "\' in preprocessor directive!");
+                        }
+
+                        if (ternary_op_condition.type == eval_type_double)
+                        {
+                            if (!ternary_op_condition.as_double)
+                            {
+                                v1 = v2;
+                            }
+                        }
+                        else
+                        {
+                            if (!ternary_op_condition.as_int)
+                            {
+                                v1 = v2;
+                            }
+                        }
+
+                        ternary_op_condition = eval_value{};
+                        got_ternary_op_condition = false;
+                        break;
+                    }
+                case lexer::punctuation_id::question_mark :
+                    {
+                        if (got_ternary_op_condition)
+                        {
+                            const std::string qm = lexer::get_punctuation_from_id(lexer::punctuation_id::question_mark);
+                            return m_preproc->error("\'" + qm + "\' after \'" + qm + "\' in preprocessor directive!");
+                        }
 
-        switch (val.type)
-        {
-        case eval_type_int :
-            if (flags & eval_flags::force_float_type) // Promote to double if necessary
-            {
-                std::snprintf(num_str, sizeof(num_str), " %f ",
-                              static_cast<double>(val.as_int));
+                        ternary_op_condition = v1;
+                        got_ternary_op_condition = true;
+                        break;
+                    }
+
+                //
+                // Other arithmetical and logical binary operators:
+                //
+                default :
+                    {
+                        eval_value result;
+                        if (!resolve_subexpr(&result, v1, v2, op))
+                        {
+                            return false;
+                        }
+                        v1 = result;
+                        break;
+                    }
+                } // switch (op)
+                break;
             }
-            else
+        case opcode::call_func :
             {
-                std::snprintf(num_str, sizeof(num_str), " " PREPROC_INT64_FMT " ",
-                              val.as_int);
+                const math_func & mathfunc = builtin_math_funcs[fetch<std::uint8_t>(&ip)];
+                eval_value & v1 = m_slots[fetch<std::uint32_t>(&ip)];
+                const eval_value v2 = m_slots[fetch<std::uint32_t>(&ip)];
+
+                if (v2.type == eval_type_double)
+                {
+                    v1.as_double = mathfunc.fptr(v2.as_double);
+                }
+                else
+                {
+                    v1.as_double = mathfunc.fptr(static_cast<double>(v2.as_int));
+                }
+                v1.type = eval_type_double;
+                break;
             }
-            break;
 
-        case eval_type_double :
-            if (flags & eval_flags::force_int_type) // Truncate to integer if necessary
+        //
+        // End of the code:
+        //
+        case opcode::fail :
             {
-                std::snprintf(num_str, sizeof(num_str), " " PREPROC_INT64_FMT " ",
-                              static_cast<std::int64_t>(val.as_double));
+                const auto length = fetch<std::uint32_t>(&ip);
+                return m_preproc->error(std::string(ip, length));
             }
-            else
+        case opcode::result :
             {
-                std::snprintf(num_str, sizeof(num_str), " " PREPROC_FLOAT_FMT " ",
-                              val.as_double);
+                *result_value = m_slots[fetch<std::uint32_t>(&ip)];
+                return true;
             }
-            break;
-        } // switch (val.type)
-
-        out_token->set_type(lexer::token::type::number);
-        out_token->set_flags(token_flags);
-        out_token->set_string(num_str);
+        } // switch (opcode)
     }
-};
+
+    PREPROCESSOR_ASSERT(false && "compiled expression without a result!");
+    return false;
+}
 
 // ========================================================
 // expr_evaluator built-in math functions and constants:
@@ -1591,6 +1770,25 @@ private:
 // preprocessor class:
 // ========================================================
 
+template<typename Func>
+bool preprocessor::guard_out_of_memory(const char * const func_name, Func && func)
+{
+#ifndef LEXER_NO_CXX_EXCEPTIONS
+    try
+    {
+        return func();
+    }
+    catch (const std::bad_alloc &)
+    {
+        // Nothing is reported if there's no name. Caller will handle it.
+        return ((func_name != nullptr) ? error(std::string{ "preprocessor::" } + func_name + "() -> out of memory!") : false);
+    }
+#else // LEXER_NO_CXX_EXCEPTIONS
+    (void)func_name;
+    return func();
+#endif // LEXER_NO_CXX_EXCEPTIONS
+}
+
 preprocessor::preprocessor()
 {
     macro_define_builtins();
@@ -1598,14 +1796,17 @@ preprocessor::preprocessor()
 
 preprocessor::~preprocessor()
 {
-    for (lexer * script : m_dynamic_scripts)
-    {
-        delete script;
-    }
+    release_external_script();
+    free_dynamic_scripts();
+    free_include_cache();
 }
 
 preprocessor::preprocessor(preprocessor && other) noexcept
     : m_current_script       { other.m_current_script             }
+    , m_error_callbacks      { other.m_error_callbacks            }
+    , m_external_script      { other.m_external_script            }
+    , m_external_callbacks   { other.m_external_callbacks         }
+    , m_memory_resource      { other.m_memory_resource            }
     , m_flags                { other.m_flags                      }
     , m_skipping_conditional { other.m_skipping_conditional       }
     , m_output_line_len      { other.m_output_line_len            }
@@ -1613,18 +1814,40 @@ preprocessor::preprocessor(preprocessor && other) noexcept
     , m_prev_token_type      { other.m_prev_token_type            }
     , m_macros               { std::move(other.m_macros)          }
     , m_macro_tokens         { std::move(other.m_macro_tokens)    }
+    , m_macro_names          { std::move(other.m_macro_names)     }
+    , m_macro_slots          { std::move(other.m_macro_slots)     }
+    , m_macro_filter         { std::move(other.m_macro_filter)    }
+    , m_macro_filter_stale   { other.m_macro_filter_stale         }
+    , m_macro_version        { other.m_macro_version              }
     , m_cond_stack           { std::move(other.m_cond_stack)      }
     , m_include_stack        { std::move(other.m_include_stack)   }
+    , m_include_file_stack   { std::move(other.m_include_file_stack) }
+    , m_current_file         { other.m_current_file               }
     , m_dynamic_scripts      { std::move(other.m_dynamic_scripts) }
     , m_search_paths         { std::move(other.m_search_paths)    }
+    , m_include_files        { std::move(other.m_include_files)   }
+    , m_include_ids          { std::move(other.m_include_ids)     }
+    , m_include_paths        { std::move(other.m_include_paths)   }
+    , m_expr_code            { std::move(other.m_expr_code)       }
+    , m_compiled_exprs       { std::move(other.m_compiled_exprs)  }
+    , m_expr_key             { std::move(other.m_expr_key)        }
+    , m_expr_tokens          { std::move(other.m_expr_tokens)     }
 {
     other.m_dynamic_scripts.clear(); // Clear here so they are not deleted next.
+    other.m_external_script = nullptr; // Nor given its callbacks back.
     other.clear();
 }
 
 preprocessor & preprocessor::operator = (preprocessor && other) noexcept
 {
+    release_external_script();
+    free_include_cache();
+
     m_current_script       = other.m_current_script;
+    m_error_callbacks      = other.m_error_callbacks;
+    m_external_script      = other.m_external_script;
+    m_external_callbacks   = other.m_external_callbacks;
+    m_memory_resource      = other.m_memory_resource;
     m_flags                = other.m_flags;
     m_skipping_conditional = other.m_skipping_conditional;
     m_output_line_len      = other.m_output_line_len;
@@ -1632,22 +1855,36 @@ preprocessor & preprocessor::operator = (preprocessor && other) noexcept
     m_prev_token_type      = other.m_prev_token_type;
     m_macros               = std::move(other.m_macros);
     m_macro_tokens         = std::move(other.m_macro_tokens);
+    m_macro_names          = std::move(other.m_macro_names);
+    m_macro_slots          = std::move(other.m_macro_slots);
+    m_macro_filter         = std::move(other.m_macro_filter);
+    m_macro_filter_stale   = other.m_macro_filter_stale;
+    m_macro_version        = other.m_macro_version;
     m_cond_stack           = std::move(other.m_cond_stack);
     m_include_stack        = std::move(other.m_include_stack);
+    m_include_file_stack   = std::move(other.m_include_file_stack);
+    m_current_file         = other.m_current_file;
     m_dynamic_scripts      = std::move(other.m_dynamic_scripts);
     m_search_paths         = std::move(other.m_search_paths);
+    m_include_files        = std::move(other.m_include_files);
+    m_include_ids          = std::move(other.m_include_ids);
+    m_include_paths        = std::move(other.m_include_paths);
+    m_expr_code            = std::move(other.m_expr_code);
+    m_compiled_exprs       = std::move(other.m_compiled_exprs);
+    m_expr_key             = std::move(other.m_expr_key);
+    m_expr_tokens          = std::move(other.m_expr_tokens);
 
     other.m_dynamic_scripts.clear(); // Clear here so they are not deleted next.
+    other.m_include_files.clear();   // Same for the cached file contents.
+    other.m_external_script = nullptr;
     other.clear();
     return *this;
 }
 
 void preprocessor::clear()
 {
-    for (lexer * script : m_dynamic_scripts)
-    {
-        delete script;
-    }
+    release_external_script();
+    free_dynamic_scripts();
 
     m_current_script       = nullptr;
     m_skipping_conditional = 0;
@@ -1656,9 +1893,20 @@ void preprocessor::clear()
 
     m_macros.clear();
     m_macro_tokens.clear();
+    m_macro_names.clear();
+    ++m_macro_version;
     m_cond_stack.clear();
     m_include_stack.clear();
-    m_dynamic_scripts.clear();
+    m_include_file_stack.clear();
+    m_current_file = -1;
+    m_expr_code.clear();
+    m_compiled_exprs.clear();
+    macro_index_rebuild();
+
+    for (include_file & file : m_include_files)
+    {
+        file.pragma_once = false;
+    }
 
     macro_define_builtins();
 }
@@ -1680,6 +1928,78 @@ void preprocessor::warning(const std::string & message)
     }
 }
 
+void preprocessor::set_error_callbacks(lexer::error_callbacks * err_callbacks) noexcept
+{
+    m_error_callbacks = err_callbacks;
+
+    // Update the scripts already loaded. An external lexer goes back to its own callbacks if none are given.
+    for (lexer * script : m_dynamic_scripts)
+    {
+        script->set_instance_error_callbacks(err_callbacks);
+    }
+    if (m_external_script != nullptr)
+    {
+        m_external_script->set_instance_error_callbacks((err_callbacks != nullptr) ? err_callbacks : m_external_callbacks);
+    }
+}
+
+lexer::error_callbacks * preprocessor::get_error_callbacks() const noexcept
+{
+    return m_error_callbacks;
+}
+
+bool preprocessor::set_memory_resource(lexer::memory_resource * resource)
+{
+    if (m_current_script != nullptr)
+    {
+        return false;
+    }
+
+    PREPROCESSOR_ASSERT(m_dynamic_scripts.empty() && m_include_stack.empty() && m_cond_stack.empty());
+    const lexer::resource_allocator<char> allocator{ resource };
+
+    decltype(m_macros) macros{ allocator };
+    decltype(m_macro_tokens) macro_tokens{ allocator };
+    decltype(m_macro_names) macro_names{ allocator };
+    decltype(m_macro_slots) macro_slots{ allocator };
+    decltype(m_macro_filter) macro_filter{ allocator };
+
+    const bool copied = guard_out_of_memory("set_memory_resource", [&]()
+    {
+        macros.assign(m_macros.begin(), m_macros.end());
+        macro_tokens.assign(m_macro_tokens.begin(), m_macro_tokens.end());
+        macro_names.assign(m_macro_names.begin(), m_macro_names.end());
+        macro_slots.assign(m_macro_slots.begin(), m_macro_slots.end());
+        macro_filter.assign(m_macro_filter.begin(), m_macro_filter.end());
+        return true;
+    });
+    if (!copied)
+    {
+        return false;
+    }
+
+    m_macros          = std::move(macros);
+    m_macro_tokens    = std::move(macro_tokens);
+    m_macro_names     = std::move(macro_names);
+    m_macro_slots     = std::move(macro_slots);
+    m_macro_filter    = std::move(macro_filter);
+    free_include_cache(); // Allocated from the previous resource.
+    m_expr_code       = decltype(m_expr_code){ allocator };
+    m_compiled_exprs.clear();
+    m_expr_tokens     = decltype(m_expr_tokens){ allocator };
+    m_cond_stack      = decltype(m_cond_stack){ allocator };
+    m_include_stack   = decltype(m_include_stack){ allocator };
+    m_include_file_stack = decltype(m_include_file_stack){ allocator };
+    m_dynamic_scripts = decltype(m_dynamic_scripts){ allocator };
+    m_memory_resource = resource;
+    return true;
+}
+
+lexer::memory_resource * preprocessor::get_memory_resource() const noexcept
+{
+    return m_memory_resource;
+}
+
 bool preprocessor::is_initialized() const noexcept
 {
     return m_current_script != nullptr;
@@ -1760,6 +2080,17 @@ void preprocessor::clear_default_search_paths()
     m_search_paths.clear();
 }
 
+bool preprocessor::clear_include_cache()
+{
+    if (m_current_script != nullptr)
+    {
+        return false; // Scripts on the include stack might be using the cached contents.
+    }
+
+    free_include_cache();
+    return true;
+}
+
 bool preprocessor::init_from_file(std::string filename, const std::uint32_t flags, const bool silent)
 {
     if (m_current_script != nullptr)
@@ -1768,7 +2099,7 @@ bool preprocessor::init_from_file(std::string filename, const std::uint32_t flag
     }
 
     m_flags = flags;
-    std::uint32_t lex_flags = lexer::flags::no_string_concat;
+    std::uint32_t lex_flags = lexer::flags::no_string_concat | lexer::flags::hash_identifiers;
 
     if (m_flags != 0)
     {
@@ -1788,13 +2119,23 @@ bool preprocessor::init_from_file(std::string filename, const std::uint32_t flag
     }
 
     lexer new_script;
+    new_script.set_instance_error_callbacks(m_error_callbacks);
+    new_script.set_memory_resource(m_memory_resource);
     if (!new_script.init_from_file(std::move(filename), lex_flags, silent))
     {
         return false;
     }
 
-    m_dynamic_scripts.push_back(new lexer{ std::move(new_script) });
-    m_current_script = m_dynamic_scripts.back();
+    // new_script is left untouched if it can't be moved to the heap.
+    const bool pushed = guard_out_of_memory(nullptr, [&]()
+    {
+        m_current_script = push_dynamic_script(std::move(new_script));
+        return true;
+    });
+    if (!pushed)
+    {
+        return (!silent ? new_script.error("preprocessor::init_from_file() -> out of memory!") : false);
+    }
     return true;
 }
 
@@ -1807,7 +2148,7 @@ bool preprocessor::init_from_memory(const char * const ptr, const std::uint32_t
     }
 
     m_flags = flags;
-    std::uint32_t lex_flags = lexer::flags::no_string_concat;
+    std::uint32_t lex_flags = lexer::flags::no_string_concat | lexer::flags::hash_identifiers;
 
     if (m_flags != 0)
     {
@@ -1827,13 +2168,23 @@ bool preprocessor::init_from_memory(const char * const ptr, const std::uint32_t
     }
 
     lexer new_script;
+    new_script.set_instance_error_callbacks(m_error_callbacks);
+    new_script.set_memory_resource(m_memory_resource);
     if (!new_script.init_from_memory(ptr, length, std::move(filename), lex_flags, starting_line))
     {
         return false;
     }
 
-    m_dynamic_scripts.push_back(new lexer{ std::move(new_script) });
-    m_current_script = m_dynamic_scripts.back();
+    // new_script is left untouched if it can't be moved to the heap.
+    const bool pushed = guard_out_of_memory(nullptr, [&]()
+    {
+        m_current_script = push_dynamic_script(std::move(new_script));
+        return true;
+    });
+    if (!pushed)
+    {
+        return new_script.error("preprocessor::init_from_memory() -> out of memory!");
+    }
     return true;
 }
 
@@ -1852,6 +2203,17 @@ bool preprocessor::init_from_lexer(lexer * initial_script, const std::uint32_t f
     m_current_script = initial_script;
     m_flags = flags;
 
+    // Errors go to the preprocessor's callbacks while it uses the lexer. Its own are given back by clear().
+    m_external_script    = initial_script;
+    m_external_callbacks = initial_script->get_instance_error_callbacks();
+    if (m_error_callbacks != nullptr)
+    {
+        m_current_script->set_instance_error_callbacks(m_error_callbacks);
+    }
+
+    // Macro lookups reuse the hashes of the identifiers.
+    m_current_script->set_flags(m_current_script->get_flags() | lexer::flags::hash_identifiers);
+
     if (m_flags != 0)
     {
         // Error/warning flags override the lexer settings.
@@ -1880,19 +2242,39 @@ bool preprocessor::preprocess(std::string * out_text_buffer)
         return false;
     }
 
+    return guard_out_of_memory("preprocess", [this, out_text_buffer]()
+    {
+        return preprocess_tokens(out_text_buffer);
+    });
+}
+
+bool preprocessor::preprocess_tokens(std::string * out_text_buffer)
+{
+
     // Likely for the result to be <= the size of the input,
     // unless there's a lot of conditional code removed or a bunch of #includes...
     out_text_buffer->reserve(m_current_script->get_script_length());
 
     for (lexer::token tok; ;)
     {
+        // Inside a skipped #if/#ifdef/etc block only the directives matter,
+        // so jump from line to line without tokenizing the ones in between.
+        // Custom comments or tokens might hide a '#', so those are lexed.
+        if (m_skipping_conditional > 0 && m_current_script->get_comment_style() == nullptr &&
+            m_current_script->get_token_rules() == nullptr)
+        {
+            m_current_script->skip_to_line_starting_with('#');
+        }
+
         if (!next_token(&tok))
         {
             if (!m_include_stack.empty())
             {
                 // Restore the previous script:
                 m_current_script = m_include_stack.back();
+                m_current_file   = m_include_file_stack.back();
                 m_include_stack.pop_back();
+                m_include_file_stack.pop_back();
 
                 // The top of the dynamic scripts stack is the lexer
                 // instance for the include file we've just finished.
@@ -1908,12 +2290,20 @@ bool preprocessor::preprocess(std::string * out_text_buffer)
 
         if (check_preproc(tok))
         {
+            const lexer * const directive_script = m_current_script;
+            const std::size_t directive_offset = m_current_script->get_last_whitespace_end();
+
             // Resolve the preprocessor directive and
             // append the result to the output buffer.
             if (!resolve_preproc_and_append(tok, out_text_buffer))
             {
                 return false;
             }
+
+            if (m_skipping_conditional > 0 && m_current_script == directive_script)
+            {
+                skip_conditional_block(directive_offset);
+            }
             continue;
         }
 
@@ -1926,8 +2316,7 @@ bool preprocessor::preprocess(std::string * out_text_buffer)
         // Is the token a macro that needs to be expanded first?
         if (tok.is_identifier())
         {
-            const auto hashed_name = hash_string(tok.as_string().c_str(), tok.get_length());
-            const int  macro_index = macro_find_index(hashed_name);
+            const int macro_index = macro_find_index(tok);
             if (macro_index >= 0)
             {
                 macro_parameter_pack param_pack{ m_current_script };
@@ -2237,37 +2626,24 @@ bool preprocessor::resolve_dollar_directive(std::string * out_text_buffer)
     return true;
 }
 
-std::uint32_t preprocessor::hash_string(const char * const str, const std::size_t count)
+std::uint64_t preprocessor::hash_string(const char * const str, const std::size_t count)
 {
     PREPROCESSOR_ASSERT(str != nullptr);
 
-    //
-    // Simple and fast One-at-a-Time (OAT) hash algorithm:
-    //  http://en.wikipedia.org/wiki/Jenkins_hash_function
-    //
-    // String not required to be null-terminated.
-    //
-    std::uint32_t h = 0;
-    for (std::size_t i = 0; i < count; ++i)
-    {
-        h += str[i];
-        h += (h << 10);
-        h ^= (h >> 6);
-    }
-
-    h += (h << 3);
-    h ^= (h >> 11);
-    h += (h << 15);
-    return h;
+    // Same as the hashes of lexer tokens, so the ones computed while lexing can be reused.
+    return lexer::hash_text(str, count);
 }
 
 bool preprocessor::define(const std::string & macro_name, lexer::token value, const bool allow_redefinition)
 {
-    const auto hashed_name = hash_string(macro_name.c_str(), macro_name.length());
-    const int  macro_index = macro_find_index(hashed_name);
+    if (macro_name.length() > max_macro_name_length)
+    {
+        return false;
+    }
 
-    macro_def new_macro;
-    new_macro.hashed_name           = hashed_name;
+    const int macro_index = macro_find_index(macro_name);
+
+    macro_def new_macro{};
     new_macro.first_param_token     = 0;
     new_macro.param_token_count     = 0;
     new_macro.first_body_token      = static_cast<std::uint32_t>(m_macro_tokens.size());
@@ -2275,23 +2651,33 @@ bool preprocessor::define(const std::string & macro_name, lexer::token value, co
     new_macro.empty_func_like_macro = false;
     new_macro.va_args_macro         = false;
 
-    if (macro_index >= 0) // Redefined:
+    if (macro_index >= 0 && !allow_redefinition)
     {
-        if (!allow_redefinition)
-        {
-            return false;
-        }
-
-        macro_clear_tokens(m_macros[macro_index]);
-        m_macros[macro_index] = new_macro;
+        return false;
     }
-    else // New definition:
+
+    // Body token goes in first, so the macro never points past the end of
+    // m_macro_tokens if we run out of memory. An unused token is harmless.
+    return guard_out_of_memory("define", [&]()
     {
-        m_macros.push_back(new_macro);
-    }
+        m_macro_tokens.emplace_back(std::move(value));
 
-    m_macro_tokens.emplace_back(std::move(value));
-    return true;
+        if (macro_index >= 0) // Redefined:
+        {
+            macro_def & old_macro = m_macros[macro_index];
+            macro_clear_tokens(old_macro);
+            new_macro.hashed_name = old_macro.hashed_name;
+            new_macro.name_offset = old_macro.name_offset;
+            new_macro.name_length = old_macro.name_length;
+            new_macro.builtin     = old_macro.builtin;
+            old_macro = new_macro;
+        }
+        else // New definition:
+        {
+            macro_add(macro_name.c_str(), macro_name.length(), new_macro);
+        }
+        return true;
+    });
 }
 
 bool preprocessor::define(const std::string & macro_name, std::string value, const bool allow_redefinition)
@@ -2373,17 +2759,21 @@ bool preprocessor::define(const std::string & define_string, const bool allow_re
 
     auto old_script = m_current_script;
 
+    // The define string lexer doesn't report errors, so running out of memory just fails.
     m_current_script = &lex;
-    resolve_define_directive();
+    const bool defined = guard_out_of_memory("define", [this]()
+    {
+        resolve_define_directive();
+        return true;
+    });
 
     m_current_script = old_script;
-    return true;
+    return defined;
 }
 
 bool preprocessor::is_defined(const std::string & macro_name) const
 {
-    const auto hashed_name = hash_string(macro_name.c_str(), macro_name.length());
-    return macro_find_index(hashed_name) >= 0;
+    return macro_find_index(macro_name) >= 0;
 }
 
 void preprocessor::undef(const std::string & macro_name)
@@ -2395,6 +2785,9 @@ void preprocessor::undef_all(const bool keep_built_ins)
 {
     m_macros.clear();
     m_macro_tokens.clear();
+    m_macro_names.clear();
+    ++m_macro_version;
+    macro_index_rebuild();
 
     if (keep_built_ins) // Restore the built-in macros:
     {
@@ -2404,8 +2797,7 @@ void preprocessor::undef_all(const bool keep_built_ins)
 
 bool preprocessor::find_macro_token(const std::string & macro_name, lexer::token * out_token, const bool allow_built_ins) const
 {
-    const auto hashed_name = hash_string(macro_name.c_str(), macro_name.length());
-    const int  macro_index = macro_find_index(hashed_name);
+    const int macro_index = macro_find_index(macro_name);
 
     if (macro_index < 0)
     {
@@ -2437,10 +2829,27 @@ bool preprocessor::find_macro_token(const std::string & macro_name, lexer::token
     return true;
 }
 
+const lexer::token * preprocessor::macro_find_constant(const char * const name, const std::size_t length,
+                                                      const std::uint64_t hash) const noexcept
+{
+    const int macro_index = macro_find_index(name, length, hash);
+    if (macro_index < 0)
+    {
+        return nullptr;
+    }
+
+    // Same as find_macro_token() without the built-ins, but doesn't copy the token.
+    const macro_def & macro = m_macros[macro_index];
+    if (macro.param_token_count != 0 || macro.body_token_count != 1)
+    {
+        return nullptr;
+    }
+    return &m_macro_tokens[macro.first_body_token];
+}
+
 const lexer::token * preprocessor::find_macro_tokens(const std::string & macro_name, int * out_num_tokens) const
 {
-    const auto hashed_name = hash_string(macro_name.c_str(), macro_name.length());
-    const int  macro_index = macro_find_index(hashed_name);
+    const int macro_index = macro_find_index(macro_name);
 
     if (macro_index < 0)
     {
@@ -2508,15 +2917,7 @@ bool preprocessor::find_macro_value(const std::string & macro_name, double * out
 
 bool preprocessor::macro_is_builtin(const macro_def & macro) const noexcept
 {
-    switch (macro.hashed_name)
-    {
-    case builtin_macro_file    : return true;
-    case builtin_macro_line    : return true;
-    case builtin_macro_date    : return true;
-    case builtin_macro_time    : return true;
-    case builtin_macro_va_args : return true;
-    default                    : return false;
-    } // switch (macro.hashed_name)
+    return macro.builtin != builtin_macro::none;
 }
 
 bool preprocessor::macro_expand_builtin(const macro_def & macro, std::string * out_text_buffer, macro_parameter_pack * va_args)
@@ -2529,22 +2930,22 @@ bool preprocessor::macro_expand_builtin(const macro_def & macro, std::string * o
     }
 
     // Output as quoted strings, except for the __LINE__ number and varargs.
-    switch (macro.hashed_name)
+    switch (macro.builtin)
     {
-    case builtin_macro_file :
+    case builtin_macro::file :
         {
             out_text_buffer->push_back('"');
             out_text_buffer->append(m_current_script->get_filename());
             out_text_buffer->push_back('"');
             break;
         }
-    case builtin_macro_line :
+    case builtin_macro::line :
         {
             const auto lineno_str = std::to_string(m_current_script->get_line_number());
             out_text_buffer->append(lineno_str);
             break;
         }
-    case builtin_macro_date :
+    case builtin_macro::date :
         {
             // Expected ctime output format:
             // Www Mmm dd hh:mm:ss yyyy
@@ -2571,7 +2972,7 @@ bool preprocessor::macro_expand_builtin(const macro_def & macro, std::string * o
             }
             break;
         }
-    case builtin_macro_time :
+    case builtin_macro::time :
         {
             // Expected ctime output format:
             // Www Mmm dd hh:mm:ss yyyy
@@ -2589,80 +2990,246 @@ bool preprocessor::macro_expand_builtin(const macro_def & macro, std::string * o
             {
                 const std::string daytime{ time_str + 11, 8 };
 
-                out_text_buffer->push_back('"');
-                out_text_buffer->append(daytime);
-                out_text_buffer->push_back('"');
-            }
-            break;
-        }
-    case builtin_macro_va_args :
+                out_text_buffer->push_back('"');
+                out_text_buffer->append(daytime);
+                out_text_buffer->push_back('"');
+            }
+            break;
+        }
+    case builtin_macro::va_args :
+        {
+            if (va_args == nullptr)
+            {
+                return error("\'__VA_ARGS__\' macro expansion failed!");
+            }
+
+            lexer::token tok;
+            while (va_args->next_token(&tok))
+            {
+                string_append_token(tok, out_text_buffer);
+                if (va_args->tokens_left() != 0)
+                {
+                    out_text_buffer->push_back(',');
+                    out_text_buffer->push_back(' ');
+                }
+            }
+            va_args->reset();
+            break;
+        }
+    default :
+        {
+            return error("undefined built-in macro expansion!");
+        }
+    } // switch (macro.builtin)
+
+    return true;
+}
+
+void preprocessor::macro_define_builtins()
+{
+    macro_def builtin{};
+
+    builtin.builtin = builtin_macro::file;
+    macro_add("__FILE__", 8, builtin);
+
+    builtin.builtin = builtin_macro::line;
+    macro_add("__LINE__", 8, builtin);
+
+    builtin.builtin = builtin_macro::date;
+    macro_add("__DATE__", 8, builtin);
+
+    builtin.builtin = builtin_macro::time;
+    macro_add("__TIME__", 8, builtin);
+
+    builtin.builtin = builtin_macro::va_args;
+    macro_add("__VA_ARGS__", 11, builtin);
+}
+
+std::uint32_t preprocessor::macro_fold_hash(const std::uint64_t hash) noexcept
+{
+    return static_cast<std::uint32_t>(hash ^ (hash >> 32));
+}
+
+int preprocessor::macro_find_index(const char * const name, const std::size_t length, const std::uint64_t hash) const noexcept
+{
+    if (m_macro_slots.empty())
+    {
+        return -1;
+    }
+
+    const std::uint32_t hashed_name = macro_fold_hash(hash);
+    if (!macro_filter_test(hashed_name))
+    {
+        return -1;
+    }
+    return m_macro_slots[macro_index_find_slot(hashed_name, name, length)];
+}
+
+int preprocessor::macro_find_index(const std::string & name) const noexcept
+{
+    return macro_find_index(name.c_str(), name.length(), hash_string(name.c_str(), name.length()));
+}
+
+int preprocessor::macro_find_index(const lexer::token & name_token) const noexcept
+{
+    // Identifiers from the scripts were already hashed while lexing, and the
+    // hash of a macro body token is cached after the first expansion.
+    const std::string & name = name_token.as_string();
+    return macro_find_index(name.c_str(), name.length(), name_token.get_hash());
+}
+
+std::size_t preprocessor::macro_index_find_slot(const std::uint32_t hashed_name, const char * const name,
+                                                const std::size_t length) const noexcept
+{
+    // The names are already hashed, so the low bits pick the first slot. The
+    // table is never full, so the probing always stops at a free slot. Names
+    // are only compared when the hashes match, so collisions cost little.
+    const std::size_t mask = m_macro_slots.size() - 1;
+    std::size_t slot = hashed_name & mask;
+
+    for (;;)
+    {
+        const std::int32_t macro_index = m_macro_slots[slot];
+        if (macro_index < 0)
         {
-            if (va_args == nullptr)
-            {
-                return error("\'__VA_ARGS__\' macro expansion failed!");
-            }
-
-            lexer::token tok;
-            while (va_args->next_token(&tok))
-            {
-                string_append_token(tok, out_text_buffer);
-                if (va_args->tokens_left() != 0)
-                {
-                    out_text_buffer->push_back(',');
-                    out_text_buffer->push_back(' ');
-                }
-            }
-            va_args->reset();
-            break;
+            return slot;
         }
-    default :
+
+        const macro_def & macro = m_macros[macro_index];
+        if (macro.hashed_name == hashed_name && macro.name_length == length &&
+            std::memcmp(&m_macro_names[macro.name_offset], name, length) == 0)
         {
-            return error("undefined built-in macro expansion!");
+            return slot;
         }
-    } // switch (macro.hashed_name)
+        slot = (slot + 1) & mask;
+    }
+}
 
-    return true;
+std::size_t preprocessor::macro_index_slot_of(const int macro_index) const noexcept
+{
+    const std::size_t mask = m_macro_slots.size() - 1;
+    std::size_t slot = m_macros[macro_index].hashed_name & mask;
+
+    while (m_macro_slots[slot] != macro_index)
+    {
+        PREPROCESSOR_ASSERT(m_macro_slots[slot] >= 0);
+        slot = (slot + 1) & mask;
+    }
+    return slot;
 }
 
-void preprocessor::macro_define_builtins()
+void preprocessor::macro_add(const char * const name, const std::size_t length, macro_def new_macro)
 {
-    macro_def builtin{};
+    PREPROCESSOR_ASSERT(length <= max_macro_name_length);
 
-    builtin.hashed_name = builtin_macro_file;
-    m_macros.push_back(builtin);
+    // Growing the index and the name pool first keeps them valid if pushing the macro fails.
+    macro_index_reserve(m_macros.size() + 1);
 
-    builtin.hashed_name = builtin_macro_line;
-    m_macros.push_back(builtin);
+    new_macro.hashed_name = macro_fold_hash(hash_string(name, length));
+    new_macro.name_offset = static_cast<std::uint32_t>(m_macro_names.size());
+    new_macro.name_length = static_cast<std::uint16_t>(length);
+    m_macro_names.insert(m_macro_names.end(), name, name + length);
 
-    builtin.hashed_name = builtin_macro_date;
-    m_macros.push_back(builtin);
+    m_macros.push_back(new_macro);
+    macro_index_insert(static_cast<int>(m_macros.size() - 1));
+    ++m_macro_version;
+}
 
-    builtin.hashed_name = builtin_macro_time;
-    m_macros.push_back(builtin);
+void preprocessor::macro_index_reserve(const std::size_t macro_count)
+{
+    // Kept at most half full, so probe sequences stay short.
+    std::size_t slot_count = 64;
+    while (slot_count < macro_count * 2)
+    {
+        slot_count *= 2;
+    }
 
-    builtin.hashed_name = builtin_macro_va_args;
-    m_macros.push_back(builtin);
+    if (slot_count > m_macro_slots.size())
+    {
+        m_macro_slots.resize(slot_count); // Entries are rewritten below.
+        m_macro_filter.resize(slot_count / 8);
+        macro_index_rebuild();
+    }
 }
 
-int preprocessor::macro_find_index(const std::uint32_t hashed_macro_name) const noexcept
+void preprocessor::macro_index_insert(const int macro_index) noexcept
 {
-    const int macro_count = static_cast<int>(m_macros.size());
+    PREPROCESSOR_ASSERT(m_macros.size() * 2 <= m_macro_slots.size());
 
-    for (int i = 0; i < macro_count; ++i)
+    // Names are unique, so the new entry goes in the first free slot.
+    const std::size_t mask = m_macro_slots.size() - 1;
+    std::size_t slot = m_macros[macro_index].hashed_name & mask;
+
+    while (m_macro_slots[slot] >= 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    m_macro_slots[slot] = macro_index;
+    macro_filter_add(m_macros[macro_index].hashed_name);
+}
+
+void preprocessor::macro_index_remove(const int macro_index) noexcept
+{
+    const std::size_t mask = m_macro_slots.size() - 1;
+    std::size_t hole = macro_index_slot_of(macro_index);
+
+    // Backward shift deletion: entries after the hole whose probe sequence
+    // crosses it are moved back, so no tombstones are needed.
+    for (std::size_t slot = (hole + 1) & mask; m_macro_slots[slot] >= 0; slot = (slot + 1) & mask)
     {
-        if (m_macros[i].hashed_name == hashed_macro_name)
+        const std::size_t home = m_macros[m_macro_slots[slot]].hashed_name & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
         {
-            return i;
+            m_macro_slots[hole] = m_macro_slots[slot];
+            hole = slot;
         }
     }
+    m_macro_slots[hole] = -1;
+}
+
+void preprocessor::macro_index_rebuild() noexcept
+{
+    std::fill(m_macro_slots.begin(), m_macro_slots.end(), -1);
+    std::fill(m_macro_filter.begin(), m_macro_filter.end(), std::uint64_t{ 0 });
+    m_macro_filter_stale = 0;
+
+    const int macro_count = static_cast<int>(m_macros.size());
+    for (int i = 0; i < macro_count; ++i)
+    {
+        macro_index_insert(i);
+    }
+}
+
+void preprocessor::macro_filter_add(const std::uint32_t hashed_name) noexcept
+{
+    // Two bits per name, from the low and high halves of the hash.
+    // The filter has a power of two number of bits, at least 512.
+    const std::uint32_t mask = static_cast<std::uint32_t>(m_macro_filter.size() * 64 - 1);
+    const std::uint32_t bit0 = hashed_name & mask;
+    const std::uint32_t bit1 = ((hashed_name >> 16) | (hashed_name << 16)) & mask;
+
+    m_macro_filter[bit0 / 64] |= std::uint64_t{ 1 } << (bit0 % 64);
+    m_macro_filter[bit1 / 64] |= std::uint64_t{ 1 } << (bit1 % 64);
+}
+
+bool preprocessor::macro_filter_test(const std::uint32_t hashed_name) const noexcept
+{
+    const std::uint32_t mask = static_cast<std::uint32_t>(m_macro_filter.size() * 64 - 1);
+    const std::uint32_t bit0 = hashed_name & mask;
+    const std::uint32_t bit1 = ((hashed_name >> 16) | (hashed_name << 16)) & mask;
 
-    return -1;
+    return (m_macro_filter[bit0 / 64] & (std::uint64_t{ 1 } << (bit0 % 64))) != 0 &&
+           (m_macro_filter[bit1 / 64] & (std::uint64_t{ 1 } << (bit1 % 64))) != 0;
 }
 
-void preprocessor::macro_define(const std::string & macro_name, macro_def * new_macro)
+bool preprocessor::macro_define(const std::string & macro_name, macro_def * new_macro)
 {
-    new_macro->hashed_name = hash_string(macro_name.c_str(), macro_name.length());
-    const int  macro_index = macro_find_index(new_macro->hashed_name);
+    if (macro_name.length() > max_macro_name_length)
+    {
+        return error("macro name is too long!");
+    }
+
+    const int macro_index = macro_find_index(macro_name);
 
     if (macro_index >= 0) // Redefined:
     {
@@ -2671,13 +3238,19 @@ void preprocessor::macro_define(const std::string & macro_name, macro_def * new_
             warning("macro \'" + macro_name + "\' is already defined and will be overwritten.");
         }
 
-        macro_clear_tokens(m_macros[macro_index]);
-        m_macros[macro_index] = *new_macro;
+        macro_def & old_macro = m_macros[macro_index];
+        macro_clear_tokens(old_macro);
+        new_macro->hashed_name = old_macro.hashed_name;
+        new_macro->name_offset = old_macro.name_offset;
+        new_macro->name_length = old_macro.name_length;
+        new_macro->builtin     = old_macro.builtin;
+        old_macro = *new_macro;
     }
     else // New definition:
     {
-        m_macros.push_back(*new_macro);
+        macro_add(macro_name.c_str(), macro_name.length(), *new_macro);
     }
+    return true;
 }
 
 void preprocessor::macro_undefine(const std::string & macro_name)
@@ -2687,32 +3260,44 @@ void preprocessor::macro_undefine(const std::string & macro_name)
         return;
     }
 
-    const auto hashed_name = hash_string(macro_name.c_str(), macro_name.length());
-    const int  macro_index = macro_find_index(hashed_name);
+    const int macro_index = macro_find_index(macro_name);
 
     if (macro_index >= 0)
     {
         // This will ensure token strings release any allocated heap memory.
         macro_clear_tokens(m_macros[macro_index]);
+        macro_index_remove(macro_index);
 
         // Swap with the last item, so we don't have to shift the array.
         const int last_macro = static_cast<int>(m_macros.size() - 1);
         if (macro_index != last_macro)
         {
+            m_macro_slots[macro_index_slot_of(last_macro)] = macro_index;
             m_macros[macro_index] = m_macros[last_macro];
         }
         m_macros.pop_back();
+
+        // Once most of the bits set are stale the filter stops rejecting
+        // much, so rebuild it. Amortized, it is constant time per #undef.
+        if (++m_macro_filter_stale > m_macros.size())
+        {
+            macro_index_rebuild();
+        }
     }
 
     // Note that the macro parameters and body tokens, if it had any,
     // will remain allocated in m_macro_tokens. Since macro #undefing
     // is not a frequent thing, it is better to just leave that stale
     // memory in the array than shifting the vector to erase entries
-    // taken by the tokens of the removed macro.
+    // taken by the tokens of the removed macro. Same for the name
+    // in m_macro_names.
 }
 
 void preprocessor::macro_clear_tokens(const macro_def & macro)
 {
+    // Only done when the macro is redefined or undefined.
+    ++m_macro_version;
+
     const lexer::token empty_token{};
     for (std::uint32_t i = 0; i < macro.param_token_count; ++i)
     {
@@ -2784,8 +3369,7 @@ bool preprocessor::expand_macro_and_append(const int macro_index, std::string *
             // defined macro we might need to recursively expand.
             if (tok.is_identifier())
             {
-                const auto hashed_name = hash_string(tok.as_string().c_str(), tok.get_length());
-                const int other_index  = macro_find_index(hashed_name);
+                const int other_index = macro_find_index(tok);
                 if (other_index >= 0)
                 {
                     if (macro_index == other_index)
@@ -2793,7 +3377,7 @@ bool preprocessor::expand_macro_and_append(const int macro_index, std::string *
                         return error("macro parameter references itself!");
                     }
 
-                    if (m_macros[other_index].hashed_name == builtin_macro_va_args)
+                    if (m_macros[other_index].builtin == builtin_macro::va_args)
                     {
                         // We have to preserve the commas for a __VA_ARGS__ reference in
                         // the parameter list of another macro, so it gets expanded here
@@ -2916,8 +3500,7 @@ bool preprocessor::expand_macro_and_append(const int macro_index, std::string *
             // recursively perform the expansions.
             if (body_token.is_identifier())
             {
-                const auto hashed_name = hash_string(body_token.as_string().c_str(), body_token.get_length());
-                const int other_index  = macro_find_index(hashed_name);
+                const int other_index = macro_find_index(body_token);
                 if (other_index >= 0)
                 {
                     const int tokens_consumed = expand_recursive_macro_and_append(
@@ -3049,8 +3632,7 @@ bool preprocessor::expand_macro_and_append(const int macro_index, std::string *
                 // Recursive substitution of other macros referenced in the body.
                 if (body_token.is_identifier())
                 {
-                    const auto hashed_name = hash_string(body_token.as_string().c_str(), body_token.get_length());
-                    const int other_index  = macro_find_index(hashed_name);
+                    const int other_index = macro_find_index(body_token);
                     if (other_index >= 0)
                     {
                         const int tokens_consumed = expand_recursive_macro_and_append(
@@ -3250,6 +3832,8 @@ bool preprocessor::evaluate_preproc_conditional(bool * out_result)
     lexer::token tok;
     bool got_backlash = false;
     int parentheses_depth = 0;
+    m_expr_key.clear();
+    m_expr_tokens.clear();
 
     // Reads tokens until the end of a line is encountered.
     // If the last token was a '\', continue scanning the next line.
@@ -3274,7 +3858,16 @@ bool preprocessor::evaluate_preproc_conditional(bool * out_result)
             --parentheses_depth;
         }
 
-        evaluator.push_token(std::move(tok));
+        // Type, flags and text of each token identify the expression.
+        const std::string & text = tok.as_string();
+        const std::uint32_t token_flags = tok.get_flags();
+        const auto text_length = static_cast<std::uint32_t>(text.length());
+        m_expr_key.push_back(static_cast<char>(tok.get_type()));
+        m_expr_key.append(reinterpret_cast<const char *>(&token_flags), sizeof(token_flags));
+        m_expr_key.append(reinterpret_cast<const char *>(&text_length), sizeof(text_length));
+        m_expr_key.append(text);
+
+        m_expr_tokens.push_back(std::move(tok));
         got_backlash = false;
     }
 
@@ -3283,15 +3876,46 @@ bool preprocessor::evaluate_preproc_conditional(bool * out_result)
     {
         return error("unbalanced opening/closing parentheses in #if/elif directive!");
     }
-    if (evaluator.get_token_count() == 0)
+    if (m_expr_tokens.empty())
     {
         return error("no expression after #if/#elif directive!");
     }
 
+    auto expr_iter = m_compiled_exprs.find(m_expr_key);
+    if (expr_iter == m_compiled_exprs.end())
+    {
+        for (lexer::token & expr_token : m_expr_tokens)
+        {
+            evaluator.push_token(std::move(expr_token));
+        }
+        evaluator.compile(expr_evaluator::eval_flags::detect_type |
+                          expr_evaluator::eval_flags::undefined_consts_are_zero);
+
+        // Start over rather than growing without bounds with scripts that have
+        // many distinct expressions, e.g. generated ones.
+        const std::vector<char> & code = evaluator.get_code();
+        if (m_expr_code.size() + code.size() > max_expr_code_size)
+        {
+            m_expr_code.clear();
+            m_compiled_exprs.clear();
+        }
+
+        const compiled_expr expr{ static_cast<std::uint32_t>(m_expr_code.size()),
+                                  static_cast<std::uint32_t>(code.size()), 0, false };
+
+        m_expr_code.insert(m_expr_code.end(), code.begin(), code.end());
+        expr_iter = m_compiled_exprs.emplace(m_expr_key, expr).first;
+    }
+
+    compiled_expr & expr = expr_iter->second;
+    if (expr.macro_version == m_macro_version)
+    {
+        *out_result = expr.result;
+        return true;
+    }
+
     // Evaluate the expression. Treat the result as a boolean.
-    if (!evaluator.evaluate(nullptr, &expr_result,
-                            expr_evaluator::eval_flags::detect_type |
-                            expr_evaluator::eval_flags::undefined_consts_are_zero))
+    if (!evaluator.run(&m_expr_code[expr.code_offset], expr.code_length, &expr_result))
     {
         return false;
     }
@@ -3304,6 +3928,9 @@ bool preprocessor::evaluate_preproc_conditional(bool * out_result)
     {
         *out_result = (expr_result.as_double != 0.0);
     }
+
+    expr.macro_version = m_macro_version;
+    expr.result        = *out_result;
     return true;
 }
 
@@ -3327,7 +3954,7 @@ bool preprocessor::resolve_ifdef_directive()
         return error("expected name/identifier immediately after #ifdef directive!");
     }
 
-    push_conditional(conditional_type::cond_ifdef, !is_defined(tok.as_string()));
+    push_conditional(conditional_type::cond_ifdef, macro_find_index(tok) < 0);
     return true;
 }
 
@@ -3339,7 +3966,7 @@ bool preprocessor::resolve_ifndef_directive()
         return error("expected name/identifier immediately after #ifndef directive!");
     }
 
-    push_conditional(conditional_type::cond_ifndef, is_defined(tok.as_string()));
+    push_conditional(conditional_type::cond_ifndef, macro_find_index(tok) >= 0);
     return true;
 }
 
@@ -3545,8 +4172,7 @@ bool preprocessor::resolve_define_directive()
         new_macro.first_body_token = 0;
     }
 
-    macro_define(macro_name, &new_macro);
-    return true;
+    return macro_define(macro_name, &new_macro);
 }
 
 bool preprocessor::resolve_undef_directive()
@@ -3657,22 +4283,33 @@ bool preprocessor::resolve_pragma_directive()
 
     if (tok == "once") // #pragma once
     {
-        // If the filename shows more than once in the dynamic scripts list, we don't need to include it again.
-        int include_count = 0;
-        for (const lexer * script : m_dynamic_scripts)
+        // Files on disk are not opened again by try_open_include_file(), whatever the path.
+        const int file_index = include_file_find(m_current_script->get_filename());
+        if (file_index >= 0 && !m_include_files[file_index].pragma_once)
         {
-            if (script->get_filename() == m_current_script->get_filename())
+            m_include_files[file_index].pragma_once = true;
+        }
+        else
+        {
+            // If the filename shows more than once in the dynamic scripts list, we don't need to include it again.
+            int include_count = 0;
+            for (const lexer * script : m_dynamic_scripts)
             {
-                ++include_count;
+                if (script->get_filename() == m_current_script->get_filename())
+                {
+                    ++include_count;
+                }
             }
-        }
 
-        if (include_count > 1)
-        {
-            PREPROCESSOR_ASSERT(!m_include_stack.empty());
-            m_current_script = m_include_stack.back();
-            m_include_stack.pop_back();
-            return true;
+            if (include_count > 1)
+            {
+                PREPROCESSOR_ASSERT(!m_include_stack.empty());
+                m_current_script = m_include_stack.back();
+                m_current_file   = m_include_file_stack.back();
+                m_include_stack.pop_back();
+                m_include_file_stack.pop_back();
+                return true;
+            }
         }
     }
     else if (tok == "warning") // #pragma (warning: [enabled|disable])
@@ -3838,17 +4475,345 @@ bool preprocessor::try_open_include_file(const std::string & filename)
         }
     }
 
-    if (!included_script.init_from_file(filename, lex_flags, /* silent = */ true))
+    const int file_index = include_file_find(filename);
+    if (file_index < 0)
+    {
+        return false;
+    }
+
+    include_file & file = m_include_files[file_index];
+    if (file.pragma_once)
+    {
+        return true; // Already included in this run.
+    }
+
+    if (file.text != nullptr)
+    {
+        // Included before, so it might keep being included. Record its tokens to
+        // replay them from now on. If it has an include guard that is defined,
+        // the whole file would be skipped, so don't open it.
+        if (file.guard == include_guard::unknown)
+        {
+            include_file_scan(&file, lex_flags);
+        }
+        if (file.guard == include_guard::found && macro_find_index(file.guard_macro) >= 0)
+        {
+            return true;
+        }
+    }
+    else if (!lexer::load_text_file(filename, m_memory_resource, &file.text, &file.text_length))
+    {
+        return false;
+    }
+
+    // Tokens recorded with other scanning flags are ignored by the lexer.
+    included_script.set_instance_error_callbacks(m_error_callbacks);
+    included_script.set_memory_resource(m_memory_resource);
+    if (!included_script.init_from_static_tokens(file.text, file.text_length, file.tokens.data(), file.tokens.size(),
+                                                 file.token_flags, filename, lex_flags))
     {
         return false;
     }
 
+    // Only called by preprocess(), which handles running out of memory.
+    lexer * const script = push_dynamic_script(std::move(included_script));
+    m_include_file_stack.reserve(m_include_stack.size() + 1); // Keeps both stacks in sync if growing fails.
     m_include_stack.push_back(m_current_script);
-    m_dynamic_scripts.push_back(new lexer{ std::move(included_script) });
-    m_current_script = m_dynamic_scripts.back();
+    m_include_file_stack.push_back(m_current_file);
+    m_current_script = script;
+    m_current_file   = file_index;
+    return true;
+}
+
+lexer * preprocessor::push_dynamic_script(lexer && script)
+{
+    // Grow the list first, so that the new script is never left without an owner.
+    // If std::bad_alloc is thrown, 'script' is not moved from.
+    if (m_dynamic_scripts.size() == m_dynamic_scripts.capacity())
+    {
+        m_dynamic_scripts.reserve(m_dynamic_scripts.size() * 2 + 4);
+    }
+
+    lexer::resource_allocator<lexer> allocator{ m_memory_resource };
+    lexer * const new_script = allocator.allocate(1);
+
+    ::new(static_cast<void *>(new_script)) lexer{ std::move(script) };
+    m_dynamic_scripts.push_back(new_script);
+    return new_script;
+}
+
+void preprocessor::free_dynamic_scripts() noexcept
+{
+    lexer::resource_allocator<lexer> allocator{ m_memory_resource };
+    for (lexer * script : m_dynamic_scripts)
+    {
+        script->~lexer();
+        allocator.deallocate(script, 1);
+    }
+    m_dynamic_scripts.clear();
+}
+
+bool preprocessor::include_file_identity(const std::string & filename, std::string * out_identity)
+{
+    // Tells the same file reached via different paths apart from different files.
+    // Modification times are taken in nanoseconds where the system provides them.
+    // Elsewhere (and on Windows) they only have a resolution of seconds, so the size
+    // is included as well to catch more of the files changed in the meantime.
+#ifdef _MSC_VER
+    struct _stat64 info;
+    if (_stat64(filename.c_str(), &info) != 0 || (info.st_mode & _S_IFMT) != _S_IFREG)
+    {
+        return false;
+    }
+#else // !_MSC_VER
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        return false;
+    }
+#endif // _MSC_VER
+
+    std::uint64_t mtime_nsec = 0;
+#if defined(__APPLE__)
+    mtime_nsec = static_cast<std::uint64_t>(info.st_mtimespec.tv_nsec);
+#elif defined(__linux__) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L)
+    mtime_nsec = static_cast<std::uint64_t>(info.st_mtim.tv_nsec);
+#endif // __APPLE__
+
+    *out_identity = std::to_string(static_cast<std::uint64_t>(info.st_mtime)) + "." +
+                    std::to_string(mtime_nsec) + ":" +
+                    std::to_string(static_cast<std::uint64_t>(info.st_size))  + ":";
+
+    // Windows has no inode numbers, so fall back to the path there.
+    if (info.st_ino != 0)
+    {
+        *out_identity += std::to_string(static_cast<std::uint64_t>(info.st_dev)) + ":" +
+                         std::to_string(static_cast<std::uint64_t>(info.st_ino));
+    }
+    else
+    {
+        *out_identity += filename;
+    }
     return true;
 }
 
+int preprocessor::include_file_find(const std::string & filename)
+{
+    std::string identity;
+    if (!include_file_identity(filename, &identity))
+    {
+        return -1;
+    }
+
+    const auto id_iter = m_include_ids.find(identity);
+    if (id_iter != m_include_ids.end())
+    {
+        m_include_paths[filename] = id_iter->second; // Might be a new path to the same file.
+        return id_iter->second;
+    }
+
+    // A file not seen before, or one that changed on disk since it was cached.
+    // The entry of the old version is reused, so edits don't grow the cache.
+    int file_index;
+    const auto path_iter = m_include_paths.find(filename);
+    if (path_iter != m_include_paths.end())
+    {
+        file_index = path_iter->second;
+        include_file & old_file = m_include_files[file_index];
+
+        if (old_file.text != nullptr)
+        {
+            lexer::memory_resource::deallocate_from(m_memory_resource, old_file.text, old_file.text_length + 1, 1);
+        }
+        m_include_ids.erase(old_file.identity);
+        old_file = include_file{};
+    }
+    else
+    {
+        file_index = static_cast<int>(m_include_files.size());
+        m_include_files.push_back(include_file{});
+        m_include_paths.emplace(filename, file_index);
+    }
+
+    m_include_ids.emplace(identity, file_index);
+    m_include_files[file_index].identity = std::move(identity);
+    return file_index;
+}
+
+void preprocessor::include_file_scan(include_file * file, const std::uint32_t lex_flags)
+{
+    PREPROCESSOR_ASSERT(file->text != nullptr);
+
+    // Only called by preprocess(), which handles running out of memory.
+    file->tokens      = decltype(file->tokens){ lexer::resource_allocator<lexer::static_token>{ m_memory_resource } };
+    file->token_flags = lex_flags;
+    file->guard       = include_guard::none;
+
+    lexer scan;
+    scan.set_memory_resource(m_memory_resource);
+    if (!scan.init_from_memory(file->text, file->text_length, "include_scan",
+                               lex_flags | lexer::flags::no_errors | lexer::flags::no_warnings))
+    {
+        return;
+    }
+
+    // The include guard check is the same as the multiple include optimization of GCC:
+    // if the file is just an '#ifndef X' with a matching '#endif' at the end and no
+    // #else/#elif for it, nothing in it is preprocessed while X is defined. Comments
+    // are allowed outside. Anything unusual gives up, which costs reopening the file.
+    lexer::token tok;
+    lexer::static_token record;
+    std::string guard_name;
+    std::size_t token_count = 0;
+    int  depth      = 0;
+    bool guarded    = true;
+    bool after_hash = false;
+
+    while (scan.next_static_token(&tok, &record))
+    {
+        file->tokens.push_back(record);
+        ++token_count;
+
+        if (!guarded)
+        {
+            continue;
+        }
+
+        const bool is_hash = lexer::is_punctuation_token(tok, lexer::punctuation_id::preprocessor);
+        if (token_count <= 3) // '#ifndef X' at the start.
+        {
+            guarded = (token_count == 1) ? is_hash : (tok.get_lines_crossed() == 0 &&
+                      ((token_count == 2) ? (tok == "ifndef") : tok.is_identifier()));
+            if (guarded && token_count == 3)
+            {
+                guard_name = tok.as_string();
+                depth = 1;
+            }
+        }
+        else if (depth == 0) // Something after the closing #endif.
+        {
+            guarded = false;
+        }
+        else if (after_hash)
+        {
+            if (tok == "if" || tok == "ifdef" || tok == "ifndef")
+            {
+                ++depth;
+            }
+            else if (tok == "endif")
+            {
+                --depth;
+            }
+            else if ((tok == "else" || tok == "elif") && depth == 1)
+            {
+                guarded = false;
+            }
+        }
+        after_hash = is_hash;
+    }
+
+    // Errors are reported even inside skipped blocks, and stop the scan.
+    if (guarded && depth == 0 && token_count >= 3 && scan.get_error_count() == 0)
+    {
+        file->guard       = include_guard::found;
+        file->guard_macro = std::move(guard_name);
+    }
+
+    include_file_index_directives(file, lex_flags);
+}
+
+void preprocessor::include_file_index_directives(include_file * file, const std::uint32_t lex_flags)
+{
+    file->directives = decltype(file->directives){ lexer::resource_allocator<directive_line>{ m_memory_resource } };
+
+    lexer scan;
+    scan.set_memory_resource(m_memory_resource);
+    if (!scan.init_from_memory(file->text, file->text_length, "include_directives",
+                               lex_flags | lexer::flags::no_errors | lexer::flags::no_warnings))
+    {
+        return;
+    }
+
+    // Finds the directives the same way skipped blocks are searched for them,
+    // so jumping to the next one lands where skipping line by line would.
+    lexer::token hash, name;
+
+    while (scan.skip_to_line_starting_with('#'))
+    {
+        const auto offset = static_cast<std::uint32_t>(scan.get_script_offset());
+        if (!scan.next_token(&hash) || !lexer::is_punctuation_token(hash, lexer::punctuation_id::preprocessor))
+        {
+            continue; // Some longer punctuation, like '##'.
+        }
+
+        if (!file->directives.empty())
+        {
+            directive_line & prev = file->directives.back();
+            prev.next_offset = offset;
+            prev.next_line   = hash.get_line_number();
+        }
+        file->directives.push_back(directive_line{ offset, 0, 0 });
+
+        // The directive is an error, reported when it is reached. Nothing past it is indexed.
+        if (!scan.next_token(&name) || name.get_lines_crossed() != 0)
+        {
+            break;
+        }
+    }
+}
+
+void preprocessor::skip_conditional_block(const std::size_t directive_offset) noexcept
+{
+    // A directive just started or kept skipping a block. Everything up to the next
+    // directive, whatever its depth, is skipped, so go straight there if the directive
+    // is known. Nested directives are still handled one by one, like in scripts that
+    // aren't cached and skip line by line.
+    if (m_current_file < 0)
+    {
+        return;
+    }
+
+    const include_file & file = m_include_files[m_current_file];
+    if (m_current_script->get_comment_style() != nullptr || m_current_script->get_token_rules() != nullptr ||
+        m_current_script->get_script_start() != file.text)
+    {
+        return;
+    }
+
+    const auto iter = std::lower_bound(file.directives.begin(), file.directives.end(), directive_offset,
+        [](const directive_line & directive, const std::size_t offset) { return directive.offset < offset; });
+
+    if (iter != file.directives.end() && iter->offset == directive_offset && iter->next_offset != 0 &&
+        iter->next_offset >= m_current_script->get_script_offset())
+    {
+        m_current_script->jump_to_offset(iter->next_offset, iter->next_line);
+    }
+}
+
+void preprocessor::release_external_script() noexcept
+{
+    if (m_external_script != nullptr)
+    {
+        m_external_script->set_instance_error_callbacks(m_external_callbacks);
+        m_external_script    = nullptr;
+        m_external_callbacks = nullptr;
+    }
+}
+
+void preprocessor::free_include_cache() noexcept
+{
+    for (include_file & file : m_include_files)
+    {
+        if (file.text != nullptr)
+        {
+            lexer::memory_resource::deallocate_from(m_memory_resource, file.text, file.text_length + 1, 1);
+        }
+    }
+    m_include_files.clear();
+    m_include_ids.clear();
+    m_include_paths.clear();
+}
+
 bool preprocessor::eval(const std::string & expression, std::int64_t * out_i_result, double * out_f_result,
                         const bool math_consts, const bool math_funcs, const bool undefined_consts_are_zero)
 {
@@ -3859,7 +4824,7 @@ bool preprocessor::eval(const std::string & expression, std::int64_t * out_i_res
         return false;
     }
 
-    std::uint32_t lex_flags = lexer::flags::no_string_concat;
+    std::uint32_t lex_flags = lexer::flags::no_string_concat | lexer::flags::hash_identifiers;
     if (m_flags != 0)
     {
         if (m_flags & flags::no_errors)
@@ -3877,6 +4842,7 @@ bool preprocessor::eval(const std::string & expression, std::int64_t * out_i_res
     }
 
     lexer lex;
+    lex.set_instance_error_callbacks(m_error_callbacks);
     if (!lex.init_from_memory(expression.c_str(), static_cast<std::uint32_t>(expression.length()),
                               "(eval-string)", lex_flags))
     {
@@ -0,0 +1,243 @@
+
+// ================================================================================================
+// -*- C++ -*-
+// File: test_grammar.cpp
+// Created on: 18/10/26
+// License: GNU GPL v3.
+// Brief: Tests for the LL(1) grammar and parser built on top of the lexer.
+// ================================================================================================
+
+// Compiles with:
+//  c++ -std=c++11 -Wall -Wextra -Weffc++ -Wshadow -pedantic -I../../ test_grammar.cpp -o test_grammar
+
+#define LEXER_IMPLEMENTATION
+#include "lexer.hpp"
+
+#define GRAMMAR_IMPLEMENTATION
+#include "grammar.hpp"
+
+#include <iostream>
+#include <cassert>
+#include <map>
+
+// Semantic actions of the calculator grammar below.
+enum calc_action : std::uint32_t
+{
+    calc_add,
+    calc_sub,
+    calc_mul,
+    calc_div,
+    calc_neg,
+    calc_load,
+    calc_store
+};
+
+// Evaluates the statements as they are parsed, with a value stack.
+class calculator final
+    : public grammar::listener
+{
+public:
+
+    std::map<std::string, double> variables;
+    std::vector<double>           values;
+    std::vector<std::string>      names;
+    std::uint32_t                 productions_entered;
+    std::uint32_t                 productions_exited;
+
+    calculator()
+        : variables{}, values{}, names{}
+        , productions_entered{ 0 }
+        , productions_exited{ 0 }
+    { }
+
+    void enter_production(std::uint32_t) override { ++productions_entered; }
+    void exit_production(std::uint32_t) override { ++productions_exited; }
+
+    void on_terminal(const grammar::symbol terminal, const lexer::token & tok) override
+    {
+        if (terminal == grammar::number)
+        {
+            values.push_back(tok.as_double());
+        }
+        else if (terminal == grammar::identifier)
+        {
+            names.push_back(tok.as_string());
+        }
+    }
+
+    void on_action(const std::uint32_t action_id) override
+    {
+        if (action_id == calc_load)
+        {
+            values.push_back(variables.at(names.back()));
+            names.pop_back();
+            return;
+        }
+        if (action_id == calc_store)
+        {
+            variables[names.back()] = values.back();
+            names.pop_back();
+            values.pop_back();
+            return;
+        }
+        if (action_id == calc_neg)
+        {
+            values.back() = -values.back();
+            return;
+        }
+
+        const double rhs = values.back();
+        values.pop_back();
+        double & lhs = values.back();
+
+        switch (action_id)
+        {
+        case calc_add : lhs += rhs; break;
+        case calc_sub : lhs -= rhs; break;
+        case calc_mul : lhs *= rhs; break;
+        case calc_div : lhs /= rhs; break;
+        default : assert(false);
+        } // switch (action_id)
+    }
+};
+
+static grammar make_calculator_grammar()
+{
+    grammar g;
+
+    const auto stmts  = g.nonterminal("statements");
+    const auto stmt   = g.nonterminal("statement");
+    const auto expr   = g.nonterminal("expression");
+    const auto expr_r = g.nonterminal("expression-rest");
+    const auto term   = g.nonterminal("term");
+    const auto term_r = g.nonterminal("term-rest");
+    const auto factor = g.nonterminal("factor");
+
+    const auto kw_let = g.atom("let");
+    const auto assign = g.atom("=");
+    const auto semi   = g.atom(";");
+    const auto plus   = g.atom("+");
+    const auto minus  = g.atom("-");
+    const auto mul    = g.atom("*");
+    const auto div    = g.atom("/");
+    const auto lparen = g.atom("(");
+    const auto rparen = g.atom(")");
+
+    // Same text, same atom.
+    assert(g.atom("let") == kw_let && g.atom("=") == assign);
+
+    g.production(stmts,  { stmt, stmts });
+    g.production(stmts,  {});
+    g.production(stmt,   { kw_let, grammar::identifier, assign, expr, semi, grammar::action(calc_store) });
+
+    // Left associative operators, with the actions after the right operand.
+    g.production(expr,   { term, expr_r });
+    g.production(expr_r, { plus,  term, grammar::action(calc_add), expr_r });
+    g.production(expr_r, { minus, term, grammar::action(calc_sub), expr_r });
+    g.production(expr_r, {});
+    g.production(term,   { factor, term_r });
+    g.production(term_r, { mul, factor, grammar::action(calc_mul), term_r });
+    g.production(term_r, { div, factor, grammar::action(calc_div), term_r });
+    g.production(term_r, {});
+    g.production(factor, { grammar::number });
+    g.production(factor, { grammar::identifier, grammar::action(calc_load) });
+    g.production(factor, { minus, factor, grammar::action(calc_neg) });
+    g.production(factor, { lparen, expr, rparen });
+
+    std::string error_message;
+    const bool built = g.build(stmts, &error_message);
+    assert(built && error_message.empty());
+    (void)built;
+
+    return g;
+}
+
+int main()
+{
+    const grammar calc = make_calculator_grammar();
+    assert(calc.is_built());
+    assert(calc.get_terminal_count() == 5 + 9);
+    assert(calc.get_nonterminal_count() == 7);
+
+    // Parsing and evaluating a script:
+    {
+        const char script[] = "let a = 1 + 2 * 3;\n"
+                              "let b = (a - 1) - 2;\n"
+                              "let c = -b * 3 / 4 - -1;\n"
+                              "let d = 10 - 4 - 3;\n";
+
+        lexer lex{ script, sizeof(script) - 1, "calc" };
+        grammar::parser parser{ calc };
+        calculator calc_listener;
+
+        assert(parser.parse(&lex, &calc_listener));
+        assert(calc_listener.variables.at("a") == 7.0);
+        assert(calc_listener.variables.at("b") == 4.0);
+        assert(calc_listener.variables.at("c") == -2.0);
+        assert(calc_listener.variables.at("d") == 3.0);
+        assert(calc_listener.values.empty() && calc_listener.names.empty());
+        assert(calc_listener.productions_entered == calc_listener.productions_exited);
+
+        // The same parser can be reused, with no listener.
+        lex.reset();
+        assert(parser.parse(&lex, nullptr));
+
+        std::cout << "Calculator variables:\n";
+        for (const auto & var : calc_listener.variables)
+        {
+            std::cout << var.first << " = " << var.second << "\n";
+        }
+    }
+
+    // Syntax errors:
+    {
+        const char * const bad_scripts[] =
+        {
+            "let a = 1 + ;",     // Unexpected ';' in 'term'.
+            "let a = (1 + 2;",   // Expected ')'.
+            "let = 3;",          // Expected identifier.
+            "let a = 1 % 2;",    // '%' isn't a terminal of the grammar.
+            "let a = 1",         // Unexpected end of input.
+        };
+
+        grammar::parser parser{ calc };
+        for (const char * bad : bad_scripts)
+        {
+            lexer::diagnostic_queue diagnostics;
+            lexer lex{ bad, static_cast<std::uint32_t>(std::strlen(bad)), "bad_calc" };
+            lex.set_instance_error_callbacks(&diagnostics);
+
+            assert(parser.parse(&lex, nullptr) == false);
+            assert(lex.get_error_count() == 1);
+
+            std::vector<lexer::diagnostic_queue::entry> entries;
+            assert(diagnostics.drain(&entries) == 1);
+            std::cout << entries[0].message << "\n";
+        }
+    }
+
+    // Grammars that are not LL(1):
+    {
+        grammar g;
+        const auto list  = g.nonterminal("list");
+        const auto comma = g.atom(",");
+
+        // Left recursion: both productions start with an identifier.
+        g.production(list, { list, comma, grammar::identifier });
+        g.production(list, { grammar::identifier });
+
+        std::string error_message;
+        assert(g.build(list, &error_message) == false);
+        assert(!g.is_built());
+        assert(error_message.find("LL(1) conflict in 'list' on 'identifier'") != std::string::npos);
+        std::cout << error_message << "\n";
+
+        // A nonterminal that can't be expanded.
+        grammar g2;
+        const auto start   = g2.nonterminal("start");
+        const auto missing = g2.nonterminal("missing");
+        g2.production(start, { missing });
+        assert(g2.build(start, &error_message) == false);
+        assert(error_message.find("'missing' has no productions") != std::string::npos);
+    }
+}
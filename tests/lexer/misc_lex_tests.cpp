@@ -9,7 +9,8 @@
 // ================================================================================================
 
 // Compiles with:
-//  c++ -std=c++11 -Wall -Wextra -Weffc++ -pedantic -I../../ -o misc_lex_tests misc_lex_tests.cpp
+//  c++ -std=c++11 -Wall -Wextra -Weffc++ -pedantic -pthread -I../../ -o misc_lex_tests misc_lex_tests.cpp
+// Use -std=c++17 to also test lexer::static_tokenize().
 
 #define LEXER_ERROR_WARN_USE_ANSI_COLOR_CODES
 #define LEXER_IMPLEMENTATION
@@ -17,7 +18,11 @@
 
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <vector>
+#include <thread>
 #include <cmath>
+#include <algorithm>
 
 // Verbose unless specified otherwise.
 #ifndef LEX_TESTS_VERBOSE
@@ -265,6 +270,31 @@ static void lex_test_custom_punct_table()
     lexer::set_default_punctuation_tables();
 }
 
+static void lex_test_longest_punctuation_match()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nMatching the longest punctuations...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char script[] = ">>>= ....<<=< .*->::-";
+    const char * const expected[] = { ">>", ">=", "...", ".", "<<=", "<", ".*", "->", "::", "-" };
+
+    lexer lex{ script, sizeof(script) - 1, "punctuations" };
+    lexer::token tok;
+
+    for (const char * punct : expected)
+    {
+        assert(lex.next_token(&tok));
+        assert(tok.is_punctuation() && tok == punct);
+        assert(lexer::get_punctuation_id_from_str(punct) == static_cast<lexer::punctuation_id>(tok.get_flags()));
+
+        #if LEX_TESTS_VERBOSE
+        print_token(tok);
+        #endif // LEX_TESTS_VERBOSE
+    }
+    assert(!lex.next_token(&tok));
+}
+
 static void lex_test_line_count()
 {
     #if LEX_TESTS_VERBOSE
@@ -325,10 +355,1257 @@ static void lex_test_word_count()
     assert(word_count == 527);
 }
 
+static void lex_test_structural_index()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nSkipping sections with the structural index...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    // Brackets and semicolons inside strings or comments must not be indexed.
+    const char script[] =
+        "func { a = \"{ not a bracket\"; b = '}';\n"
+        "  /* { ; } */ inner { c = \"\\\"}\"; // }\n"
+        "  }\n"
+        "}\n"
+        "after ( x ; y ) ; last\n";
+
+    lexer indexed{ script, sizeof(script) - 1, "indexed", lexer::flags::structural_index };
+    lexer tokenized{ script, sizeof(script) - 1, "tokenized" };
+    lexer::token tok1, tok2;
+
+    assert(indexed.expect_token_string("func") && tokenized.expect_token_string("func"));
+    assert(indexed.skip_bracketed_section() && tokenized.skip_bracketed_section());
+    assert(indexed.get_line_number() == tokenized.get_line_number());
+
+    assert(indexed.next_token(&tok1) && tokenized.next_token(&tok2));
+    assert(tok1 == "after" && tok2 == "after");
+    assert(tok1.get_line_number() == 5 && tok2.get_line_number() == 5);
+
+    assert(indexed.skip_until_string(";") && tokenized.skip_until_string(";"));
+    assert(indexed.next_token(&tok1) && tokenized.next_token(&tok2));
+    assert(tok1 == "y" && tok2 == "y");
+
+    assert(indexed.skip_until_string(";") && tokenized.skip_until_string(";"));
+    assert(indexed.next_token(&tok1) && tok1 == "last");
+    assert(!indexed.skip_until_string(";") && indexed.is_at_end());
+
+    // The '*' of "/*" also closes the comment, so "/*/" is a whole comment.
+    const char slash_script[] = "{ a /*/ } b */ c } d } e";
+    lexer slash_indexed{ slash_script, sizeof(slash_script) - 1, "indexed", lexer::flags::structural_index };
+    lexer slash_tokenized{ slash_script, sizeof(slash_script) - 1, "tokenized" };
+
+    assert(slash_indexed.skip_bracketed_section() && slash_tokenized.skip_bracketed_section());
+    assert(slash_indexed.next_token(&tok1) && slash_tokenized.next_token(&tok2));
+    assert(tok1 == "b" && tok2 == "b");
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Structural index and tokenized skips match.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_batch_loading()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nLexing several files in parallel...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const std::uint32_t flags = lexer::flags::no_string_concat | lexer::flags::allow_multi_char_literals;
+    const std::vector<std::string> filenames{ "lex_test_1.txt", "lex_test_2.txt", "missing_file.txt",
+                                              "lex_test_3.txt", "lex_test_4.txt" };
+
+    lexer::batch_result result;
+    const bool all_ok = lexer::lex_files(filenames, flags, &result, 4);
+
+    // The missing file fails, but doesn't prevent the others from loading.
+    assert(!all_ok);
+    assert(result.files.size() == filenames.size());
+    assert(result.files[2].error_count == 1 && result.files[2].token_count == 0);
+    assert(result.files[2].diagnostics.size() == 1);
+
+    // Must match lexing each file sequentially, in the same order.
+    for (std::size_t f = 0; f < filenames.size(); ++f)
+    {
+        const lexer::batch_file & file = result.files[f];
+        assert(file.filename == filenames[f]);
+
+        if (f == 2)
+        {
+            continue;
+        }
+        assert(file.error_count == 0);
+
+        lexer lex{ filenames[f], flags | lexer::flags::no_errors };
+        lexer::token tok;
+        std::size_t count = 0;
+
+        while (lex.next_token(&tok))
+        {
+            const lexer::token & batch_tok = result.tokens[file.first_token + count++];
+            assert(batch_tok == tok.as_string());
+            assert(batch_tok.get_type() == tok.get_type());
+            assert(batch_tok.get_line_number() == tok.get_line_number());
+        }
+        assert(count == file.token_count);
+
+        #if LEX_TESTS_VERBOSE
+        std::cout << file.filename << ": " << file.token_count << " tokens, " << file.error_count << " errors.\n";
+        #endif // LEX_TESTS_VERBOSE
+    }
+}
+
 // ========================================================
 // main():
 // ========================================================
 
+static void lex_test_lazy_line_numbers()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nComparing lazy line numbers against tracked ones...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char * const filenames[] = { "lex_test_1.txt", "lex_test_2.txt", "lex_test_3.txt", "lex_test_4.txt", "lex_test_6.txt" };
+    const std::uint32_t flags = lexer::flags::no_string_concat | lexer::flags::allow_multi_char_literals;
+
+    for (const char * filename : filenames)
+    {
+        lexer eager{ filename, flags };
+        lexer lazy{ filename, flags | lexer::flags::lazy_line_numbers };
+        lexer::token eager_tok;
+        lexer::token lazy_tok;
+
+        while (eager.next_token(&eager_tok))
+        {
+            assert(lazy.next_token(&lazy_tok));
+            assert(eager_tok.as_string() == lazy_tok.as_string());
+            assert(lazy_tok.get_line_number() == 0);
+            assert(lazy.get_last_whitespace_end() == eager.get_last_whitespace_end());
+            assert(lazy.get_line_number_at(lazy.get_last_whitespace_end()) == eager_tok.get_line_number());
+            assert(lazy.get_line_number() == eager.get_line_number());
+        }
+        assert(!lazy.next_token(&lazy_tok));
+
+        // Going back is also allowed.
+        assert(lazy.get_line_number_at(0) == 1);
+
+        // Switching back to eager tracking picks up the current line.
+        lazy.set_flags(flags);
+        assert(lazy.get_line_number() == eager.get_line_number());
+    }
+
+    // Lines are counted from the whitespace when needed by next_token_on_line().
+    const char script[] = "a b // comment\n c /* \n */ d\ne";
+    lexer lex{ script, sizeof(script) - 1, "lazy", lexer::flags::lazy_line_numbers };
+    lexer::token tok;
+
+    assert(lex.next_token_on_line(&tok) && tok == "a");
+    assert(lex.next_token_on_line(&tok) && tok == "b");
+    assert(!lex.next_token_on_line(&tok));
+    assert(lex.next_token(&tok) && tok == "c");
+    assert(!lex.next_token_on_line(&tok));
+    assert(lex.next_token(&tok) && tok == "d");
+    assert(lex.get_line_number() == 3);
+    assert(lex.skip_rest_of_line());
+    assert(lex.next_token(&tok) && tok == "e");
+    assert(lex.get_line_number_at(lex.get_last_whitespace_end()) == 4);
+}
+
+static void lex_test_error_codes()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nChecking structured diagnostics...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    struct recording_callbacks final : public lexer::error_callbacks
+    {
+        std::vector<lexer::error_code> codes     {};
+        std::vector<std::string>       messages  {};
+        int                            formatted = 0;
+
+        void error(const std::string & message, bool) override { messages.push_back(message); ++formatted; }
+        void warning(const std::string & message) override     { messages.push_back(message); ++formatted; }
+        void diagnose(const lexer::diagnostic & diag) override
+        {
+            codes.push_back(diag.code);
+            if (diag.code == lexer::error_code::unexpected_token)
+            {
+                // Formatted on demand only.
+                messages.push_back(diag.to_string());
+            }
+        }
+    };
+
+    recording_callbacks callbacks;
+    lexer::set_error_callbacks(&callbacks);
+
+    const char script[] = "foo 'ab' 42 \"unterminated";
+    lexer lex{ script, sizeof(script) - 1, "diag", lexer::flags::no_fatal_errors };
+    lexer::token tok;
+
+    assert(!lex.expect_token_string("bar"));
+    assert(!lex.next_token(&tok));
+    lex.set_flags(lexer::flags::no_fatal_errors | lexer::flags::no_errors);
+    assert(lex.scan_float() == 42.0f);
+    assert(!lex.next_token(&tok));
+
+    // Suppressed errors are counted but never reach the callbacks.
+    assert(lex.get_error_count() == 3);
+    assert(callbacks.codes.size() == 2);
+    assert(callbacks.codes[0] == lexer::error_code::unexpected_token);
+    assert(callbacks.codes[1] == lexer::error_code::multi_char_literal);
+    assert(callbacks.formatted == 0);
+    assert(callbacks.messages.size() == 1);
+    assert(callbacks.messages[0].find("diag(1):") == 0);
+    assert(callbacks.messages[0].find("expected 'bar' but found 'foo'") != std::string::npos);
+
+    // The default diagnose() formats and forwards to error()/warning().
+    struct forwarding_callbacks final : public lexer::error_callbacks
+    {
+        std::vector<std::string> messages {};
+        void error(const std::string & message, bool) override { messages.push_back(message); }
+        void warning(const std::string & message) override     { messages.push_back(message); }
+    };
+
+    forwarding_callbacks forwarding;
+    lexer::set_error_callbacks(&forwarding);
+
+    lexer lex2{ script, sizeof(script) - 1, "diag", lexer::flags::no_fatal_errors };
+    assert(!lex2.expect_token_string("x"));
+    lex2.warning("custom warning");
+    assert(forwarding.messages.size() == 2);
+    assert(forwarding.messages[0].find("expected 'x' but found 'foo'") != std::string::npos);
+    assert(forwarding.messages[1].find("custom warning") != std::string::npos);
+
+    lexer::set_error_callbacks(nullptr);
+}
+
+static void lex_test_diagnostic_queue()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nCollecting diagnostics from worker threads...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    lexer::diagnostic_queue queue;
+    const int num_threads = 4;
+    const int num_errors  = 200;
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        workers.emplace_back([&queue, t]()
+        {
+            const std::string filename = "worker" + std::to_string(t);
+            const char script[] = "unterminated \"string";
+
+            for (int i = 0; i < num_errors; ++i)
+            {
+                lexer lex{ script, sizeof(script) - 1, filename, lexer::flags::no_fatal_errors };
+                lex.set_instance_error_callbacks(&queue);
+                lexer::token tok;
+                assert(lex.next_token(&tok));
+                assert(!lex.next_token(&tok));
+                lex.warning(std::to_string(i));
+            }
+        });
+    }
+
+    // Drain concurrently with the producers.
+    std::vector<lexer::diagnostic_queue::entry> entries;
+    while (entries.size() < static_cast<std::size_t>(num_threads * num_errors * 2))
+    {
+        queue.drain(&entries);
+        std::this_thread::yield();
+    }
+    for (auto & worker : workers)
+    {
+        worker.join();
+    }
+    assert(queue.empty());
+
+    // Each thread's diagnostics come out in the order they were pushed.
+    std::vector<int> next_warning(num_threads, 0);
+    for (const auto & e : entries)
+    {
+        const int t = e.message[std::string("worker").length()] - '0';
+        assert(t >= 0 && t < num_threads);
+        if (e.is_warning)
+        {
+            assert(e.code == lexer::error_code::custom);
+            const std::string expected = std::to_string(next_warning[t]);
+            assert(e.message.length() > expected.length());
+            assert(e.message.compare(e.message.length() - expected.length(), expected.length(), expected) == 0);
+            ++next_warning[t];
+        }
+        else
+        {
+            assert(e.code == lexer::error_code::missing_trailing_quote && !e.is_fatal);
+        }
+    }
+    for (int t = 0; t < num_threads; ++t)
+    {
+        assert(next_warning[t] == num_errors);
+    }
+}
+
+static void lex_test_memory_resources()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nLoading scripts from capped and arena memory resources...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    struct code_callbacks final : public lexer::error_callbacks
+    {
+        std::vector<lexer::error_code> codes {};
+        void error(const std::string &, bool) override { }
+        void warning(const std::string &) override { }
+        void diagnose(const lexer::diagnostic & diag) override { codes.push_back(diag.code); }
+    };
+
+    const std::uint32_t flags = lexer::flags::no_string_concat | lexer::flags::allow_multi_char_literals;
+    code_callbacks callbacks;
+    lexer::token tok;
+
+    // A cap smaller than the file fails init_from_file() with an error instead of throwing.
+    lexer::capped_memory_resource small_cap{ 64 };
+    lexer capped;
+    capped.set_instance_error_callbacks(&callbacks);
+    assert(capped.set_memory_resource(&small_cap));
+    assert(!capped.init_from_file("lex_test_1.txt", flags | lexer::flags::no_fatal_errors));
+    assert(callbacks.codes.size() == 1 && callbacks.codes[0] == lexer::error_code::out_of_memory);
+    assert(small_cap.get_used_bytes() == 0 && small_cap.get_failed_count() == 1);
+
+    // Within the cap, the file buffer and the structural index come from the resource.
+    lexer::capped_memory_resource big_cap{ 64 * 1024 };
+    lexer fits;
+    assert(fits.set_memory_resource(&big_cap));
+    assert(fits.init_from_file("lex_test_1.txt", flags));
+    assert(!fits.set_memory_resource(nullptr)); // Can't change with a script loaded.
+    assert(big_cap.get_used_bytes() == fits.get_script_length() + 1);
+    assert(fits.build_structural_index());
+    assert(big_cap.get_used_bytes() == fits.get_allocated_bytes());
+    assert(big_cap.get_peak_bytes() >= big_cap.get_used_bytes());
+    fits.clear();
+    assert(big_cap.get_used_bytes() == fits.get_allocated_bytes()); // Index capacity is kept.
+
+    // Moving a lexer onto itself keeps its buffer.
+    lexer self_moved;
+    assert(self_moved.set_memory_resource(&big_cap));
+    assert(self_moved.init_from_file("lex_test_1.txt", flags));
+    const std::size_t used_before_move = big_cap.get_used_bytes();
+    lexer & same_lexer = self_moved;
+    self_moved = std::move(same_lexer);
+    assert(big_cap.get_used_bytes() == used_before_move);
+    assert(self_moved.next_token(&tok) && self_moved.get_script_length() != 0);
+
+    // Running out of memory while indexing is reported, but the script can still be scanned.
+    const char script[] = "a { b ( c ; d ) e } f ; g { h } i";
+    lexer::capped_memory_resource tiny_cap{ 8 };
+    lexer unindexed;
+    unindexed.set_instance_error_callbacks(&callbacks);
+    assert(unindexed.set_memory_resource(&tiny_cap));
+    assert(unindexed.init_from_memory(script, sizeof(script) - 1, "unindexed", lexer::flags::no_fatal_errors));
+    assert(!unindexed.build_structural_index());
+    assert(callbacks.codes.size() == 2 && callbacks.codes[1] == lexer::error_code::out_of_memory);
+    assert(tiny_cap.get_used_bytes() == 0);
+    assert(unindexed.expect_token_string("a") && unindexed.skip_bracketed_section());
+    assert(unindexed.next_token(&tok) && tok == "f");
+
+    // Scripts loaded from an arena are released all at once.
+    lexer::monotonic_memory_resource arena{ 512 };
+    {
+        lexer first;
+        lexer second;
+        assert(first.set_memory_resource(&arena) && second.set_memory_resource(&arena));
+        assert(first.init_from_file("lex_test_1.txt", flags) && second.init_from_file("lex_test_2.txt", flags));
+        assert(arena.get_allocated_bytes() >= first.get_script_length() + second.get_script_length() + 2);
+
+        std::size_t count = 0;
+        while (first.next_token(&tok))  { ++count; }
+        while (second.next_token(&tok)) { ++count; }
+        assert(count != 0);
+    }
+    assert(arena.get_allocated_bytes() != 0);
+    arena.release();
+    assert(arena.get_allocated_bytes() == 0);
+
+    #if LEXER_PMR_MEMORY_RESOURCE
+    // Any std::pmr resource can be plugged in through the adapter.
+    char pmr_buffer[600]; // Fits lex_test_2.txt but not lex_test_1.txt.
+    std::pmr::monotonic_buffer_resource pmr_arena{ pmr_buffer, sizeof(pmr_buffer), std::pmr::null_memory_resource() };
+    lexer::pmr_memory_resource pmr_adapter{ &pmr_arena };
+    lexer from_pmr;
+    assert(from_pmr.set_memory_resource(&pmr_adapter));
+    assert(!from_pmr.init_from_file("lex_test_1.txt", flags, /* silent = */ true));
+    assert(from_pmr.init_from_file("lex_test_2.txt", flags));
+    #endif // LEXER_PMR_MEMORY_RESOURCE
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Peak bytes used under the cap: " << big_cap.get_peak_bytes() << "\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_incremental()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nFeeding scripts to the incremental lexer in fragments...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char * const filenames[] = { "lex_test_1.txt", "lex_test_2.txt", "lex_test_3.txt", "lex_test_4.txt", "lex_test_6.txt" };
+    const std::uint32_t flags = lexer::flags::no_string_concat | lexer::flags::allow_multi_char_literals;
+    const std::size_t fragment_sizes[] = { 1, 2, 3, 7, 64, 4096 };
+
+    for (const char * filename : filenames)
+    {
+        char * contents = nullptr;
+        std::uint32_t length = 0;
+        assert(lexer::load_text_file(filename, &contents, &length));
+
+        std::vector<lexer::token> expected;
+        lexer whole{ contents, length, filename, flags };
+        for (lexer::token tok; whole.next_token(&tok);)
+        {
+            expected.push_back(tok);
+        }
+
+        for (const std::size_t fragment_size : fragment_sizes)
+        {
+            lexer::incremental_lexer incremental{ filename, flags };
+            std::vector<lexer::token> tokens;
+            lexer::token tok;
+
+            for (std::uint32_t offset = 0; offset < length; offset += static_cast<std::uint32_t>(fragment_size))
+            {
+                const std::size_t count = std::min<std::size_t>(fragment_size, length - offset);
+                assert(incremental.feed(contents + offset, count));
+                while (incremental.next_token(&tok))
+                {
+                    tokens.push_back(tok);
+                }
+                // Only the tail is buffered between fragments.
+                assert(incremental.get_pending_bytes() <= offset + count);
+            }
+
+            assert(incremental.finish());
+            while (incremental.next_token(&tok))
+            {
+                tokens.push_back(tok);
+            }
+
+            assert(incremental.is_at_end());
+            assert(incremental.get_error_count() == whole.get_error_count());
+            assert(tokens.size() == expected.size());
+            for (std::size_t t = 0; t < tokens.size(); ++t)
+            {
+                assert(tokens[t].as_string() == expected[t].as_string());
+                assert(tokens[t].get_type() == expected[t].get_type());
+                assert(tokens[t].get_flags() == expected[t].get_flags());
+                assert(tokens[t].get_line_number() == expected[t].get_line_number());
+            }
+        }
+
+        delete[] contents;
+    }
+
+    // Tokens cut by a fragment boundary are held back without errors; real errors are reported once.
+    struct code_callbacks final : public lexer::error_callbacks
+    {
+        std::vector<lexer::error_code> codes {};
+        void error(const std::string &, bool) override { }
+        void warning(const std::string &) override { }
+        void diagnose(const lexer::diagnostic & diag) override { codes.push_back(diag.code); }
+    };
+
+    code_callbacks callbacks;
+    lexer::incremental_lexer incremental{ "(stream)", lexer::flags::no_fatal_errors };
+    incremental.set_instance_error_callbacks(&callbacks);
+    lexer::token tok;
+
+    assert(incremental.feed("name = \"split str", 17));
+    assert(incremental.next_token(&tok) && tok == "name");
+    assert(incremental.next_token(&tok) && tok == "=");
+    assert(!incremental.next_token(&tok));
+    assert(callbacks.codes.empty());
+
+    assert(incremental.feed("ing\" \"concat\"; 12", 17));
+    assert(incremental.next_token(&tok) && tok.is_string() && tok == "split stringconcat");
+    assert(incremental.next_token(&tok) && tok == ";");
+    assert(!incremental.next_token(&tok)); // The number could still grow.
+    assert(incremental.feed("34 'ab' /* comm", 15));
+    assert(incremental.next_token(&tok) && tok.is_number() && tok.as_int32() == 1234);
+    assert(!incremental.next_token(&tok));
+    assert(callbacks.codes.size() == 1 && callbacks.codes[0] == lexer::error_code::multi_char_literal);
+
+    assert(incremental.feed("ent */\nlast", 11));
+    assert(incremental.finish());
+    assert(incremental.next_token(&tok) && tok == "last" && tok.get_line_number() == 2);
+    assert(incremental.is_at_end());
+    assert(callbacks.codes.size() == 1 && incremental.get_error_count() == 1);
+    assert(!incremental.feed("more", 4));
+
+    // Long comments arriving in small fragments are dropped as they are scanned, with only
+    // their last char kept. A string that could be concatenated keeps what follows it.
+    std::string long_comments = "first /*";
+    for (int i = 0; i < 40000; ++i)
+    {
+        long_comments += (i == 20000) ? "nested /* comment\n" : "a long comment line\n";
+    }
+    long_comments += "*/ //";
+    long_comments.append(500000, '-');
+    long_comments += "\n\n\"split\" /*";
+    long_comments.append(300000, '*');
+    long_comments += "/ \"string\" last";
+
+    std::vector<lexer::token> long_expected;
+    lexer long_whole{ long_comments.c_str(), static_cast<std::uint32_t>(long_comments.size()), "(long)", lexer::flags::no_warnings };
+    for (lexer::token t; long_whole.next_token(&t);)
+    {
+        long_expected.push_back(t);
+    }
+    assert(long_expected.size() == 3 && long_expected[1] == "splitstring");
+
+    lexer::incremental_lexer long_incremental{ "(long)", lexer::flags::no_warnings };
+    std::vector<lexer::token> long_tokens;
+    for (std::size_t offset = 0; offset < long_comments.size(); offset += 256)
+    {
+        const std::size_t count = std::min<std::size_t>(256, long_comments.size() - offset);
+        assert(long_incremental.feed(long_comments.data() + offset, count));
+        while (long_incremental.next_token(&tok))
+        {
+            long_tokens.push_back(tok);
+        }
+        if (offset + count < long_comments.size() - 300100)
+        {
+            assert(long_incremental.get_pending_bytes() <= 1);
+        }
+    }
+    assert(long_incremental.finish());
+    while (long_incremental.next_token(&tok))
+    {
+        long_tokens.push_back(tok);
+    }
+
+    assert(long_incremental.get_warning_count() == long_whole.get_warning_count());
+    assert(long_incremental.get_warning_count() == 1);
+    assert(long_tokens.size() == long_expected.size());
+    for (std::size_t t = 0; t < long_tokens.size(); ++t)
+    {
+        assert(long_tokens[t].as_string() == long_expected[t].as_string());
+        assert(long_tokens[t].get_line_number() == long_expected[t].get_line_number());
+        assert(long_tokens[t].get_lines_crossed() == long_expected[t].get_lines_crossed());
+    }
+
+    // Strings and char literals are concatenated across whitespace and comments however they are split.
+    // Errors are reported once, even for a character the lexer can't step over by itself.
+    struct split_case final
+    {
+        const char *             script;
+        std::uint32_t            flags;
+        std::vector<std::string> tokens;
+        std::uint32_t            error_count;
+    };
+    const split_case split_cases[] =
+    {
+        { "\"s1\" \"s2\"/* a */\"s3\" x",   0, { "s1s2s3", "x" }, 0 },
+        { "\"str\"//c\n\"a\" /",           0, { "stra", "/" }, 0 },
+        { "'a' 'b' /**/'c'",               lexer::flags::allow_multi_char_literals, { "abc" }, 0 },
+        { "\"a\" \\ /* b */ \"b\" 'c' 'd'", lexer::flags::no_string_concat | lexer::flags::allow_backslash_string_concat, { "ab", "c", "d" }, 0 },
+        { "x @ y @@ \"z\"",                lexer::flags::no_fatal_errors, { "x", "y", "z" }, 3 },
+    };
+    const std::size_t split_sizes[] = { 1, 2, 3, 5, 10, 64 };
+
+    for (const split_case & split : split_cases)
+    {
+        const std::size_t length = std::strlen(split.script);
+        const std::uint32_t split_flags = split.flags | lexer::flags::no_errors;
+
+        if (split.error_count == 0)
+        {
+            std::vector<std::string> whole_tokens;
+            lexer split_whole{ split.script, static_cast<std::uint32_t>(length), "(split)", split_flags };
+            for (lexer::token t; split_whole.next_token(&t);)
+            {
+                whole_tokens.push_back(t.as_string());
+            }
+            assert(whole_tokens == split.tokens);
+        }
+
+        for (const std::size_t split_size : split_sizes)
+        {
+            lexer::incremental_lexer split_incremental{ "(split)", split_flags };
+            std::vector<std::string> split_tokens;
+            for (std::size_t offset = 0; offset < length; offset += split_size)
+            {
+                assert(split_incremental.feed(split.script + offset, std::min(split_size, length - offset)));
+                while (split_incremental.next_token(&tok))
+                {
+                    split_tokens.push_back(tok.as_string());
+                }
+            }
+            assert(split_incremental.finish());
+            while (split_incremental.next_token(&tok))
+            {
+                split_tokens.push_back(tok.as_string());
+            }
+
+            assert(split_tokens == split.tokens);
+            assert(split_incremental.get_error_count() == split.error_count);
+        }
+    }
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Incremental tokens match the whole-script tokens.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_segments()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nLexing scripts split into non-contiguous segments...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char * const filenames[] = { "lex_test_1.txt", "lex_test_3.txt", "lex_test_6.txt" };
+    const std::uint32_t flags = lexer::flags::allow_multi_char_literals;
+    const std::size_t segment_sizes[] = { 0, 1, 5, 13, 200, 2 };
+
+    for (const char * filename : filenames)
+    {
+        char * contents = nullptr;
+        std::uint32_t length = 0;
+        assert(lexer::load_text_file(filename, &contents, &length));
+
+        std::vector<lexer::token> expected;
+        lexer whole{ contents, length, filename, flags };
+        for (lexer::token tok; whole.next_token(&tok);)
+        {
+            expected.push_back(tok);
+        }
+
+        // Each segment is copied to its own buffer, so they aren't contiguous.
+        // Every other segment is marked as not null terminated to force a copy.
+        std::vector<std::string> buffers;
+        std::vector<lexer::segment> segments;
+        for (std::uint32_t offset = 0, s = 0; offset < length; ++s)
+        {
+            const std::size_t count = std::min<std::size_t>(segment_sizes[s % 6], length - offset);
+            buffers.emplace_back(contents + offset, count);
+            offset += static_cast<std::uint32_t>(count);
+        }
+        for (std::size_t b = 0; b < buffers.size(); ++b)
+        {
+            segments.emplace_back(buffers[b].data(), buffers[b].size(), (b % 2) == 0);
+        }
+
+        lexer::segmented_lexer segmented{ segments, filename, flags };
+        std::vector<lexer::token> tokens;
+        for (lexer::token tok; segmented.next_token(&tok);)
+        {
+            tokens.push_back(tok);
+        }
+
+        assert(segmented.is_at_end() && !segmented.has_failed());
+        assert(segmented.get_next_segment() == segmented.get_segment_count());
+        assert(segmented.get_error_count() == whole.get_error_count());
+        assert(tokens.size() == expected.size());
+        for (std::size_t t = 0; t < tokens.size(); ++t)
+        {
+            assert(tokens[t].as_string() == expected[t].as_string());
+            assert(tokens[t].get_type() == expected[t].get_type());
+            assert(tokens[t].get_flags() == expected[t].get_flags());
+            assert(tokens[t].get_line_number() == expected[t].get_line_number());
+        }
+
+        delete[] contents;
+    }
+
+    // Header template, cached body and generated footer.
+    const std::string header = "#header\nvalue = 12";
+    const std::string body   = "34;\n/* multi\nline */ name";
+    const std::string footer = "_suffix \"a\" \"b\"\n";
+
+    lexer::segmented_lexer segmented{ { header, body, footer } };
+    lexer::token tok;
+    assert(segmented.next_token(&tok) && tok == "#");
+    assert(segmented.next_token(&tok) && tok == "header");
+    assert(segmented.next_token(&tok) && tok == "value");
+    assert(segmented.next_token(&tok) && tok == "=");
+    assert(segmented.next_token(&tok) && tok.as_int32() == 1234 && tok.get_line_number() == 2);
+    assert(segmented.next_token(&tok) && tok == ";");
+    assert(segmented.next_token(&tok) && tok == "name_suffix" && tok.get_line_number() == 4);
+    assert(segmented.next_token(&tok) && tok.is_string() && tok == "ab" && tok.get_line_number() == 4);
+    assert(!segmented.next_token(&tok) && segmented.is_at_end());
+
+    // Strings and char literals are joined across segments, even with a comment starting at a segment edge.
+    const std::string split_parts[] = { "s = \"spl", "it\" /", "* c */ \"str\" 'a", "' /", "/ c\n'b' x" };
+    lexer::segmented_lexer split{ { split_parts[0], split_parts[1], lexer::segment{ split_parts[2].data(), split_parts[2].size() },
+                                    split_parts[3], split_parts[4] }, "(split)", lexer::flags::allow_multi_char_literals };
+    assert(split.next_token(&tok) && tok == "s");
+    assert(split.next_token(&tok) && tok == "=");
+    assert(split.next_token(&tok) && tok.is_string() && tok == "splitstr");
+    assert(split.next_token(&tok) && tok.is_literal() && tok == "ab" && tok.get_line_number() == 1);
+    assert(split.next_token(&tok) && tok == "x" && tok.get_line_number() == 2);
+    assert(!split.next_token(&tok) && split.is_at_end() && !split.has_failed());
+
+    // Without fatal errors, a character that can't start a token is reported once and skipped.
+    const std::string bad_parts[] = { "x @", "@ y", " @" };
+    lexer::segmented_lexer bad{ { bad_parts[0], bad_parts[1], bad_parts[2] }, "(bad)",
+                                lexer::flags::no_fatal_errors | lexer::flags::no_errors };
+    assert(bad.next_token(&tok) && tok == "x");
+    assert(bad.next_token(&tok) && tok == "y");
+    assert(!bad.next_token(&tok) && bad.is_at_end() && !bad.has_failed());
+    assert(bad.get_error_count() == 3);
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Segmented tokens match the whole-script tokens.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_match()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nMatching token patterns...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char script[] = "width = 640;\n"
+                          "ratio = -1.5;\n"
+                          "title = \"main window\";\n"
+                          "offset = -0x10;\n"
+                          "count = 2.5;\n"
+                          "[section]\n";
+
+    lexer lex{ script, sizeof(script) - 1, "match" };
+    lexer::text_view key;
+    std::int32_t ival = 0;
+    std::uint32_t uval = 0;
+    double dval = 0.0;
+    std::string sval;
+
+    assert(lex.match(lexer::match_identifier(&key), '=', lexer::match_number(&ival), ';'));
+    assert(key == "width" && key.length == 5 && ival == 640);
+
+    // A mismatch leaves the position untouched and generates no errors.
+    assert(!lex.match(lexer::match_identifier(&key), '=', lexer::match_string(&sval), ';'));
+    assert(!lex.match(lexer::match_identifier(), "=", lexer::match_number(&uval), ";")); // Negative.
+    assert(!lex.match(lexer::match_identifier(), '=', lexer::match_number(&ival), ';'));  // Float.
+    assert(lex.match(lexer::match_identifier(&key), '=', lexer::match_number(&dval), ';'));
+    assert(key == "ratio" && dval == -1.5);
+
+    assert(lex.match(lexer::match_identifier(&key), '=', lexer::match_string(&sval), ';'));
+    assert(key == "title" && sval == "main window");
+
+    assert(!lex.match(lexer::match_identifier(), '=', lexer::match_number<double>(), ';')); // Hex.
+    assert(lex.match(lexer::match_identifier(&key), '=', lexer::match_number(&ival), ';'));
+    assert(key == "offset" && ival == -16);
+
+    lexer::token tok;
+    assert(lex.match(lexer::match_identifier(&key), '=', lexer::match_any(&tok), ';'));
+    assert(key == "count" && tok.is_float());
+
+    // The token put back is matched too, and restored on a mismatch.
+    assert(lex.next_token(&tok) && tok == '[');
+    lex.unget_token(tok);
+    assert(!lex.match('[', lexer::match_identifier(&key), ';'));
+    assert(lex.match('[', lexer::match_identifier(&key), ']'));
+    assert(key == "section" && key.as_string() == "section");
+    assert(!lex.match(lexer::match_any()));
+    assert(!lex.next_token(&tok));
+    assert(lex.get_error_count() == 0 && lex.get_warning_count() == 0);
+
+    // The text of an identifier put back is copied.
+    lexer::token name;
+    lex.reset();
+    assert(lex.next_token(&name) && name == "width");
+    lex.unget_token(name);
+    assert(lex.match(lexer::match_identifier(&key), '='));
+    assert(key == "width" && (key.data < script || key.data >= script + sizeof(script)));
+    assert(lex.match(lexer::match_number<std::uint16_t>(), ';'));
+    assert(lex.get_line_number() == 1);
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Token patterns matched.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_token_rules()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nLexing with custom token rules...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    enum rule_id : std::uint32_t { color = 1, duration, version, guid };
+
+    lexer::token_rules rules;
+    std::string error_message;
+    assert(rules.add_rule(color,    "#\\x{6}", &error_message));
+    assert(rules.add_rule(duration, "\\d+(ms|s|m|h)", &error_message));
+    assert(rules.add_rule(version,  "\\d+\\.\\d+\\.\\d+", &error_message));
+    assert(rules.add_rule(guid,     "\\x{8}(-\\x{4}){3}-\\x{12}", &error_message));
+    assert(!rules.is_compiled());
+    assert(rules.compile(&error_message) && rules.is_compiled());
+    assert(rules.get_rule_count() == 4 && rules.get_state_count() > 0);
+    assert(error_message.empty());
+
+    const char script[] = "fill = #ff00Aa;\n"
+                          "timeout = 250ms + 3h;\n"
+                          "version = 1.12.0;\n"
+                          "id = 6f9619ff-8b86-d011-b42d-00cf4fc964ff;\n"
+                          "plain = 1.5 + 42 + #abc;\n";
+
+    lexer lex{ script, sizeof(script) - 1, "token_rules" };
+    lex.set_token_rules(&rules);
+    assert(lex.get_token_rules() == &rules);
+
+    lexer::token tok;
+    assert(lex.next_token(&tok) && tok == "fill");
+    assert(lex.next_token(&tok) && tok == '=');
+    assert(lex.next_token(&tok) && tok.is_custom() && tok.get_flags() == color && tok == "#ff00Aa");
+    assert(lex.next_token(&tok) && tok == ';');
+
+    assert(lex.next_token(&tok) && tok == "timeout" && tok.get_line_number() == 2);
+    assert(lex.next_token(&tok) && tok == '=');
+    assert(lex.next_token(&tok) && tok.is_custom() && tok.get_flags() == duration && tok == "250ms");
+    assert(lex.next_token(&tok) && tok == '+');
+    assert(lex.next_token(&tok) && tok.is_custom() && tok.get_flags() == duration && tok == "3h");
+    assert(lex.next_token(&tok) && tok == ';');
+
+    assert(lex.next_token(&tok) && tok == "version");
+    assert(lex.next_token(&tok) && tok == '=');
+    assert(lex.next_token(&tok) && tok.is_custom() && tok.get_flags() == version && tok == "1.12.0");
+    assert(lex.next_token(&tok) && tok == ';');
+
+    assert(lex.next_token(&tok) && tok == "id");
+    assert(lex.next_token(&tok) && tok == '=');
+    assert(lex.next_token(&tok) && tok.is_custom() && tok.get_flags() == guid);
+    assert(tok == "6f9619ff-8b86-d011-b42d-00cf4fc964ff" && tok.get_line_number() == 4);
+    assert(lex.next_token(&tok) && tok == ';');
+
+    // Tokens no rule matches are lexed as usual.
+    assert(lex.next_token(&tok) && tok == "plain" && tok.get_line_number() == 5);
+    assert(lex.next_token(&tok) && tok == '=');
+    assert(lex.next_token(&tok) && tok.is_number() && tok.as_double() == 1.5);
+    assert(lex.next_token(&tok) && tok == '+');
+    assert(lex.next_token(&tok) && tok.is_number() && tok.as_int32() == 42);
+    assert(lex.next_token(&tok) && tok == '+');
+    assert(lex.next_token(&tok) && tok.is_punctuation() && tok == '#');
+    assert(lex.next_token(&tok) && tok == "abc");
+    assert(lex.next_token(&tok) && tok == ';');
+    assert(!lex.next_token(&tok));
+    assert(lex.get_error_count() == 0);
+
+    // The longest match wins, then the rule added first.
+    lexer::token_rules overlapping;
+    assert(overlapping.add_rule(10, "ab+"));
+    assert(overlapping.add_rule(11, "a\\w*"));
+    assert(overlapping.add_rule(12, "[a-c]{2,3}"));
+    assert(overlapping.compile());
+
+    std::uint32_t matched_rule = 0;
+    const char text[] = "abbb abc ac a";
+    assert(overlapping.match(text, text + 4, &matched_rule) == 4 && matched_rule == 10);
+    assert(overlapping.match(text, text + 3, &matched_rule) == 3 && matched_rule == 10);
+    assert(overlapping.match(text + 5, text + 8, &matched_rule) == 3 && matched_rule == 11);
+    assert(overlapping.match(text + 9, text + 11, &matched_rule) == 2 && matched_rule == 11);
+    assert(overlapping.match(text + 12, text + 13, &matched_rule) == 1 && matched_rule == 11);
+    assert(overlapping.match(text + 4, text + 13, &matched_rule) == 0);
+
+    // Malformed patterns and patterns that match nothing are rejected.
+    const char * const bad_patterns[] =
+    {
+        "(ab", "ab)", "[a-", "[z-a]", "a**", "+a", "a{3,1}", "a{300}", "\\q", "a*", "(x|y?)", "", "a{0}", "(ab){0,0}",
+    };
+    for (const char * bad : bad_patterns)
+    {
+        error_message.clear();
+        assert(!overlapping.add_rule(99, bad, &error_message));
+        assert(!error_message.empty());
+        #if LEX_TESTS_VERBOSE
+        std::cout << error_message << "\n";
+        #endif // LEX_TESTS_VERBOSE
+    }
+    assert(overlapping.get_rule_count() == 3 && overlapping.is_compiled());
+
+    // A repetition of zero drops the atom, which is fine as long as something else is matched.
+    lexer::token_rules zero_repeat;
+    assert(zero_repeat.add_rule(20, "ab{0,0}c", &error_message));
+    assert(zero_repeat.add_rule(21, "x(yz){0}w", &error_message));
+    assert(zero_repeat.compile(&error_message));
+    const char zero_text[] = "ac abc xw xyzw";
+    assert(zero_repeat.match(zero_text, zero_text + 2, &matched_rule) == 2 && matched_rule == 20);
+    assert(zero_repeat.match(zero_text + 3, zero_text + 6, &matched_rule) == 0);
+    assert(zero_repeat.match(zero_text + 7, zero_text + 9, &matched_rule) == 2 && matched_rule == 21);
+    assert(zero_repeat.match(zero_text + 10, zero_text + 14, &matched_rule) == 0);
+
+    overlapping.clear();
+    assert(overlapping.get_rule_count() == 0 && !overlapping.is_compiled());
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Custom tokens lexed.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_comment_style()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nSkipping custom comment styles...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    lexer::comment_style style;
+    assert(style.add_line_comment("#"));
+    assert(style.add_line_comment(";"));
+    assert(style.add_line_comment("--"));
+    assert(style.add_block_comment("--[[", "]]"));
+    assert(!style.add_line_comment(""));
+    assert(!style.add_line_comment("#####"));
+    assert(!style.add_block_comment("<", ""));
+    assert(style.get_delimiter_count() == 4);
+    assert(style.may_start_comment('#') && style.may_start_comment('-') && !style.may_start_comment('/'));
+
+    const char script[] = "# header comment\n"
+                          "; another one\n"
+                          "a = 1 // not a comment anymore\n"
+                          "b = 2 -- trailing\n"
+                          "--[[ block\n"
+                          "     over lines ]] c = 3 - 4\n"
+                          "d = \"#;\"\n"
+                          "--[[ unterminated";
+
+    for (const std::uint32_t flags : { 0u, static_cast<std::uint32_t>(lexer::flags::lazy_line_numbers) })
+    {
+        lexer lex{ script, sizeof(script) - 1, "comment_style", flags };
+        lex.set_comment_style(&style);
+        assert(lex.get_comment_style() == &style);
+
+        // Tokens get zero line numbers without line tracking.
+        const std::uint32_t line_scale = (flags == 0) ? 1 : 0;
+
+        lexer::token tok;
+        assert(lex.next_token(&tok) && tok == "a" && tok.get_line_number() == 3 * line_scale);
+        assert(lex.next_token(&tok) && tok == '=');
+        assert(lex.next_token(&tok) && tok.as_int32() == 1);
+        assert(lex.next_token(&tok) && tok == "/");
+        assert(lex.next_token(&tok) && tok == "/");
+        assert(lex.next_token(&tok) && tok == "not");
+        assert(lex.skip_rest_of_line());
+        assert(lex.next_token(&tok) && tok == "b" && tok.get_line_number() == 4 * line_scale);
+        assert(lex.next_token(&tok) && tok == '=');
+        assert(lex.next_token(&tok) && tok.as_int32() == 2);
+        assert(lex.next_token(&tok) && tok == "c" && tok.get_line_number() == 6 * line_scale);
+        assert(lex.next_token(&tok) && tok == '=');
+        assert(lex.next_token(&tok) && tok.as_int32() == 3);
+        assert(lex.next_token(&tok) && tok == '-');
+        assert(lex.next_token(&tok) && tok.as_int32() == 4);
+        assert(lex.next_token(&tok) && tok == "d" && tok.get_line_number() == 7 * line_scale);
+        assert(lex.next_token(&tok) && tok == '=');
+        assert(lex.next_token(&tok) && tok.is_string() && tok == "#;");
+        assert(!lex.next_token(&tok));
+        assert(lex.get_line_number() == 8);
+        assert(lex.get_error_count() == 0);
+    }
+
+    // skip_whitespace() stops after the line comment ending the current line.
+    {
+        const char line_script[] = "x ; comment\ny";
+        lexer lex{ line_script, sizeof(line_script) - 1, "comment_style_line" };
+        lex.set_comment_style(&style);
+
+        lexer::token tok;
+        assert(lex.next_token(&tok) && tok == "x");
+        assert(lex.skip_whitespace(/* current_line = */ true));
+        assert(lex.get_line_number() == 2);
+        assert(lex.next_token(&tok) && tok == "y");
+    }
+
+    // A style with no delimiters skips no comments at all.
+    {
+        const lexer::comment_style no_comments;
+        const char plain_script[] = "/* x */";
+        lexer lex{ plain_script, sizeof(plain_script) - 1, "no_comments" };
+        lex.set_comment_style(&no_comments);
+
+        lexer::token tok;
+        assert(lex.next_token(&tok) && tok == "/");
+        assert(lex.next_token(&tok) && tok == "*");
+        assert(lex.next_token(&tok) && tok == "x");
+
+        // Back to the default C and C++ comments.
+        lex.set_comment_style(nullptr);
+        lex.reset();
+        assert(!lex.next_token(&tok));
+    }
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Custom comments skipped.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_views()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nExtracting views of the script...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char script[] = "material rock\n"
+                          "{\n"
+                          "    shader { vec4 c = vec4(\"}\"); /* } */ }\n"
+                          "}\n"
+                          "#define  WIDTH 640 // comment   \r\n"
+                          "whole line\n"
+                          "{ unclosed";
+
+    for (const std::uint32_t flags : { 0u, static_cast<std::uint32_t>(lexer::flags::structural_index) })
+    {
+        lexer lex{ script, sizeof(script) - 1, "views", flags | lexer::flags::no_errors };
+        lexer::token tok;
+
+        assert(lex.next_token(&tok) && tok == "material");
+        assert(lex.next_token(&tok) && tok == "rock");
+
+        const lexer::text_view material = lex.bracketed_section_view();
+        assert(material.data == lex.get_script_start() + 14);
+        assert(material.as_string() == "{\n    shader { vec4 c = vec4(\"}\"); /* } */ }\n}");
+        assert(lex.get_line_number() == 4);
+
+        // Nested sections, with the '{' put back.
+        lexer sub_lex{ material.data, static_cast<std::uint32_t>(material.length), "material" };
+        assert(sub_lex.next_token(&tok) && tok == '{');
+        assert(sub_lex.next_token(&tok) && tok == "shader");
+        assert(sub_lex.next_token(&tok) && tok == '{');
+        sub_lex.unget_token(tok);
+        assert(sub_lex.bracketed_section_view() == "{ vec4 c = vec4(\"}\"); /* } */ }");
+
+        assert(lex.next_token(&tok) && tok == '#');
+        assert(lex.next_token(&tok) && tok == "define");
+        const lexer::text_view directive = lex.rest_of_line_view();
+        assert(directive == "WIDTH 640 // comment");
+        assert(lex.rest_of_line_view().empty());
+        assert(lex.get_line_number() == 5);
+
+        const lexer::text_view line = lex.complete_line_view();
+        assert(line == "\n");
+        assert(lex.complete_line_view() == "whole line\n");
+        assert(lex.get_line_number() == 7);
+
+        // Errors give empty views.
+        assert(lex.get_error_count() == 0);
+        assert(lex.bracketed_section_view().empty());
+        assert(lex.get_error_count() == 1);
+        assert(lex.bracketed_section_view().empty());
+        assert(lex.get_error_count() == 2);
+    }
+
+    #if LEX_TESTS_VERBOSE
+    std::cout << "Views extracted.\n";
+    #endif // LEX_TESTS_VERBOSE
+}
+
+static void lex_test_token_hash()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nHashing identifiers while lexing...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char script[] = "alpha beta_1 _gamma alpha 42 \"alpha\" x";
+
+    for (const std::uint32_t flags : { 0u, static_cast<std::uint32_t>(lexer::flags::hash_identifiers) })
+    {
+        lexer lex{ script, sizeof(script) - 1, "hash", flags };
+        lexer::token tok;
+        std::vector<lexer::token> tokens;
+
+        while (lex.next_token(&tok))
+        {
+            assert(tok.get_hash() == lexer::hash_text(tok.as_string().c_str(), tok.get_length()));
+            tokens.push_back(tok);
+        }
+        assert(tokens.size() == 7);
+
+        // Same text, same hash, regardless of the token type.
+        assert(tokens[0].get_hash() == tokens[3].get_hash());
+        assert(tokens[0].get_hash() == tokens[5].get_hash());
+        assert(tokens[0].get_hash() != tokens[1].get_hash());
+
+        // Copies keep the hash, changing the text updates it.
+        lexer::token copy = tokens[1];
+        assert(copy.get_hash() == tokens[1].get_hash());
+        copy.append("_2");
+        assert(copy == "beta_1_2" && copy.get_hash() == lexer::hash_text("beta_1_2", 8));
+        copy.set_string("alpha");
+        assert(copy.get_hash() == tokens[0].get_hash());
+    }
+}
+
+static void lex_test_record_tokens()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nRecording tokens at runtime and replaying them...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char script[] = "// Comment\n"
+                          "value = 0x1F + 3.5f; name = \"plain\" \"concat\"\n"
+                          "  \"escaped\\n\" 'c' /* block\n comment */ ident_2 >>= \"split\"\n"
+                          "\"lines\" end";
+
+    for (const std::uint32_t flags : { 0u, static_cast<std::uint32_t>(lexer::flags::no_string_concat) })
+    {
+        lexer recorder{ script, sizeof(script) - 1, "record", flags };
+        std::vector<lexer::static_token> records;
+        lexer::token tok;
+        lexer::static_token record;
+
+        while (recorder.next_static_token(&tok, &record))
+        {
+            records.push_back(record);
+        }
+        assert(records.size() == ((flags != 0) ? 17u : 14u));
+
+        // Escapes and concatenated strings spanning lines are scanned again when replaying.
+        std::size_t rescans = 0;
+        for (const lexer::static_token & r : records)
+        {
+            rescans += r.rescan ? 1 : 0;
+        }
+        assert(rescans != 0 && rescans < records.size());
+
+        lexer scanned{ script, sizeof(script) - 1, "record", flags | lexer::flags::hash_identifiers };
+        lexer replayed;
+        assert(replayed.init_from_static_tokens(script, sizeof(script) - 1, records.data(), records.size(),
+                                                flags, "record", flags | lexer::flags::hash_identifiers));
+
+        lexer::token replayed_tok;
+        while (scanned.next_token(&tok))
+        {
+            assert(replayed.next_token(&replayed_tok));
+            assert(replayed_tok.as_string()         == tok.as_string());
+            assert(replayed_tok.get_type()          == tok.get_type());
+            assert(replayed_tok.get_flags()         == tok.get_flags());
+            assert(replayed_tok.get_line_number()   == tok.get_line_number());
+            assert(replayed_tok.get_lines_crossed() == tok.get_lines_crossed());
+            assert(replayed_tok.get_hash()          == tok.get_hash());
+            assert(replayed.get_script_offset()     == scanned.get_script_offset());
+        }
+        assert(!replayed.next_token(&replayed_tok));
+    }
+}
+
+static void lex_test_skip_to_line_start()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nSkipping lines without tokenizing them...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    const char script[] = "start # not at a line start\n"
+                          "'unterminated # \"# in a string\"\n"
+                          "/* # in a\n # comment */ x \\\n"
+                          "# continued line\n"
+                          "  /* */ # found\n"
+                          "#";
+
+    lexer lex{ script, sizeof(script) - 1, "skip_lines" };
+    lexer::token tok;
+
+    assert(lex.next_token(&tok) && tok == "start");
+    assert(lex.skip_to_line_starting_with('#'));
+    assert(lex.next_token(&tok) && tok == "#" && tok.get_line_number() == 6);
+    assert(lex.next_token(&tok) && tok == "found");
+
+    // A token put back is looked at again.
+    assert(lex.next_token(&tok) && tok == "#" && tok.get_line_number() == 7);
+    lex.unget_token(tok);
+    assert(lex.skip_to_line_starting_with('#'));
+    assert(lex.next_token(&tok) && tok == "#" && tok.get_line_number() == 7);
+    assert(!lex.skip_to_line_starting_with('#'));
+    assert(!lex.next_token(&tok));
+
+    // The opener's '*' also closes a comment, as when tokenizing.
+    const char slash_script[] = "x /*/ y\n# found\n*/";
+    lexer slash_lex{ slash_script, sizeof(slash_script) - 1, "skip_lines" };
+    assert(slash_lex.next_token(&tok) && tok == "x");
+    assert(slash_lex.skip_to_line_starting_with('#'));
+    assert(slash_lex.next_token(&tok) && tok == "#" && tok.get_line_number() == 2);
+}
+
+#if LEXER_STATIC_TOKENIZE
+static constexpr char static_script[] =
+    "// Embedded defaults\n"
+    "config {\n"
+    "    name = \"default\" \"config\";   /* concatenated */\n"
+    "    path = \"a\\tb\\x41\";\n"
+    "    chars = 'x', '\\n';\n"
+    "    sizes = [ 0x1F 0b101 017 42u 7ul 3.5 1e3 .25f 2.0L ];\n"
+    "    enabled = true; flip = !false;\n"
+    "    a->b::c >>= d ... e.*f ## g;\n"
+    "}\n";
+
+static constexpr auto static_tokens        = lexer::static_tokenize<128>(static_script);
+static constexpr auto static_tokens_concat = lexer::static_tokenize<128>(static_script, lexer::flags::no_string_concat);
+static constexpr auto static_tokens_short  = lexer::static_tokenize<10>(static_script);
+
+static_assert(static_tokens.complete && static_tokens_concat.complete, "Static tokenization failed!");
+static_assert(!static_tokens_short.complete && static_tokens_short.count == 10, "Expected a partial tokenization!");
+static_assert(lexer::static_tokenize<8>("1.2.3.4").count == 0, "IP addresses should be left to the runtime lexer!");
+
+template<std::size_t MaxTokens>
+static void compare_static_tokens(const lexer::static_token_array<MaxTokens> & tokens, const std::uint32_t flags)
+{
+    lexer scanned{ static_script, sizeof(static_script) - 1, "static_script", flags };
+    lexer replayed;
+    assert(replayed.init_from_static_tokens(static_script, sizeof(static_script) - 1, tokens, "static_script", flags));
+
+    lexer::token scanned_tok;
+    lexer::token replayed_tok;
+
+    while (scanned.next_token(&scanned_tok))
+    {
+        assert(replayed.next_token(&replayed_tok));
+        assert(replayed_tok.as_string()         == scanned_tok.as_string());
+        assert(replayed_tok.get_type()          == scanned_tok.get_type());
+        assert(replayed_tok.get_flags()         == scanned_tok.get_flags());
+        assert(replayed_tok.get_line_number()   == scanned_tok.get_line_number());
+        assert(replayed_tok.get_lines_crossed() == scanned_tok.get_lines_crossed());
+        assert(replayed.get_script_offset()     == scanned.get_script_offset());
+
+        #if LEX_TESTS_VERBOSE
+        print_token(replayed_tok);
+        #endif // LEX_TESTS_VERBOSE
+    }
+    assert(!replayed.next_token(&replayed_tok));
+}
+
+static void lex_test_static_tokenize()
+{
+    #if LEX_TESTS_VERBOSE
+    std::cout << "\nReplaying tokens from compile-time tokenization...\n";
+    #endif // LEX_TESTS_VERBOSE
+
+    compare_static_tokens(static_tokens, 0);
+    compare_static_tokens(static_tokens_concat, lexer::flags::no_string_concat);
+    compare_static_tokens(static_tokens_short, 0);
+
+    // Mismatched flags make it fall back to scanning.
+    compare_static_tokens(static_tokens, lexer::flags::no_string_concat);
+
+    // Moving around the script keeps the replay in sync.
+    lexer lex;
+    lexer::token tok;
+    assert(lex.init_from_static_tokens(static_script, sizeof(static_script) - 1, static_tokens, "static_script"));
+
+    assert(lex.expect_token_string("config"));
+    assert(lex.skip_bracketed_section());
+    assert(!lex.next_token(&tok));
+
+    lex.reset();
+    assert(lex.skip_until_string("sizes"));
+    assert(lex.next_token(&tok) && tok == "=");
+    lex.unget_token(tok);
+    assert(lex.next_token(&tok) && tok == "=");
+    assert(lex.next_token(&tok) && tok == "[");
+    assert(lex.peek_token_string("0x1F"));
+    assert(lex.next_token(&tok) && tok.as_uint32() == 0x1F && tok.get_line_number() == 6);
+    assert(lex.skip_rest_of_line());
+    assert(lex.next_token(&tok) && tok == "enabled" && tok.get_line_number() == 7);
+    assert(lex.skip_until_string(";"));
+    assert(lex.next_token(&tok) && tok == "flip");
+}
+#endif // LEXER_STATIC_TOKENIZE
+
 int main()
 {
     std::cout << "\nRunning lexer tests...\n";
@@ -337,8 +1614,27 @@ int main()
     lex_test_scan_matrices();
     lex_test_scan_punctuations();
     lex_test_custom_punct_table();
+    lex_test_longest_punctuation_match();
     lex_test_line_count();
     lex_test_word_count();
+    lex_test_structural_index();
+    lex_test_batch_loading();
+    lex_test_lazy_line_numbers();
+    lex_test_error_codes();
+    lex_test_diagnostic_queue();
+    lex_test_memory_resources();
+    lex_test_incremental();
+    lex_test_segments();
+    lex_test_match();
+    lex_test_token_rules();
+    lex_test_comment_style();
+    lex_test_views();
+    lex_test_token_hash();
+    lex_test_record_tokens();
+    lex_test_skip_to_line_start();
+    #if LEXER_STATIC_TOKENIZE
+    lex_test_static_tokenize();
+    #endif // LEXER_STATIC_TOKENIZE
 
     std::cout << "\nAll tests passed!\n";
 }
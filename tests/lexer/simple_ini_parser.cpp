@@ -57,24 +57,27 @@ void parse_file(std::string filename, sections_list * out_sections)
     lexer::token tok;
     section * current_section = nullptr;
 
+    // ini-style comments. The lexer only skips C and C++ style comments by default.
+    lexer::comment_style ini_comments;
+    ini_comments.add_line_comment("#");
+    ini_comments.add_line_comment(";");
+    lex.set_comment_style(&ini_comments);
+
     lex.init_from_file(std::move(filename), lexer::flags::allow_ip_addresses);
 
     while (lex.next_token(&tok))
     {
         if (tok.is_punctuation())
         {
-            if (tok == '#' || tok == ';')
-            {
-                // ini-style comments.
-                // The lexer only skips C and C++ style comments by default.
-                lex.skip_rest_of_line();
-            }
-            else if (tok == '[') // New section
+            if (tok == '[') // New section
             {
-                lex.expect_token_type(lexer::token::type::identifier, 0, &tok);
-                lex.expect_token_char(']'); // Closing the section
+                lexer::text_view section_name;
+                if (!lex.match(lexer::match_identifier(&section_name), ']'))
+                {
+                    lex.error("expected section name followed by \']\'!");
+                }
 
-                current_section = &(*out_sections)[tok.as_string()];
+                current_section = &(*out_sections)[section_name.as_string()];
             }
         }
         else if (tok.is_identifier()) // Key=value pair
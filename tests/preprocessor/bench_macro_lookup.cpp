@@ -0,0 +1,68 @@
+
+// ================================================================================================
+// -*- C++ -*-
+// File: bench_macro_lookup.cpp
+// Created on: 18/10/26
+// License: GNU GPL v3.
+// Brief: Measures how preprocessing time scales with the number of macros defined.
+// ================================================================================================
+
+// Compiles with:
+//  c++ -std=c++11 -O2 -Wall -Wextra -Weffc++ -Wshadow -pedantic -I../../ bench_macro_lookup.cpp -o pp_bench_macro_lookup
+
+#define LEXER_IMPLEMENTATION
+#include "lexer.hpp"
+
+#define PREPROCESSOR_IMPLEMENTATION
+#include "preprocessor.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cassert>
+
+// Defines 'macro_count' macros, then uses each of them once in
+// an #ifdef and once in an expression, so the number of lookups
+// grows linearly with the number of macros. With constant time
+// lookups the time per macro should stay roughly flat.
+static std::string make_script(const int macro_count)
+{
+    std::string script;
+    for (int i = 0; i < macro_count; ++i)
+    {
+        script += "#define MACRO_" + std::to_string(i) + " " + std::to_string(i) + "\n";
+    }
+    for (int i = 0; i < macro_count; ++i)
+    {
+        const std::string name = "MACRO_" + std::to_string(i);
+        script += "#ifdef " + name + "\n";
+        script += "int v" + std::to_string(i) + " = " + name + " + 1;\n";
+        script += "#endif\n";
+    }
+    return script;
+}
+
+int main()
+{
+    using clock = std::chrono::steady_clock;
+
+    std::printf("macros      total ms    ns/macro\n");
+
+    for (const int macro_count : { 10, 100, 1000, 10000, 100000 })
+    {
+        const std::string script = make_script(macro_count);
+
+        preprocessor pp;
+        const bool initialized = pp.init_from_memory(script.c_str(), static_cast<std::uint32_t>(script.length()), "bench_script");
+
+        std::string result;
+        const auto start = clock::now();
+        const bool ok = pp.preprocess(&result);
+        const auto end = clock::now();
+
+        assert(initialized && ok && pp.is_defined("MACRO_" + std::to_string(macro_count - 1)));
+        (void)initialized; (void)ok;
+
+        const double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        std::printf("%-10d  %-10.3f  %.1f\n", macro_count, ns / 1e6, ns / macro_count);
+    }
+}
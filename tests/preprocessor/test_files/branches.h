@@ -0,0 +1,22 @@
+
+// Included with BRANCH set to each of 1, 2 and 3. The blocks not taken are jumped over.
+#if BRANCH == 1
+branch_one = __LINE__;
+#if 1
+nested_taken;
+#else
+nested_skipped;
+#endif
+#elif BRANCH == 2
+# if 0
+/* #endif */ not_here;
+#elif BRANCH == 3
+"#else"; not_here_either;
+#  endif
+branch_two = __LINE__;
+#else
+#ifdef BRANCH
+branch_three = __LINE__;
+#endif
+#endif
+after_branches = __LINE__;
@@ -0,0 +1,7 @@
+// The #elif nested in the skipped block is invalid, whether the file is cached or not.
+#if 0
+#if 1
+#elif --1
+#endif
+#endif
+body
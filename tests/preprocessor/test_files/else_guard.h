@@ -0,0 +1,8 @@
+
+// Not an include guard: the #else is still preprocessed when the macro is defined.
+#ifndef ELSE_GUARD_H_
+#define ELSE_GUARD_H_
+first_pass;
+#else
+later_pass;
+#endif
@@ -0,0 +1,10 @@
+
+// Include guard with comments around it and nested conditionals inside.
+#ifndef GUARDED_H_
+#define GUARDED_H_
+
+#if 1
+guarded_contents;
+#endif
+
+#endif // GUARDED_H_
@@ -18,7 +18,13 @@
 #include "preprocessor.hpp"
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <thread>
 
 int main()
 {
@@ -41,4 +47,161 @@ int main()
     std::cout << "\n";
     std::cout << result << "\n";
     std::cout << "\n";
+
+    // Including the same files over and over, via different paths:
+    {
+        const char script[] = "#include \"test_files/guarded.h\"\n"
+                              "#include \"test_files/guarded.h\"\n"
+                              "#include \"test_files/../test_files/guarded.h\"\n"
+                              "#undef GUARDED_H_\n"
+                              "#include \"test_files/guarded.h\"\n"
+                              "#include \"test_files/else_guard.h\"\n"
+                              "#include \"test_files/else_guard.h\"\n"
+                              "#include \"test_files/else_guard.h\"\n"
+                              "#include \"test_files/inc_test_1.h\"\n"
+                              "#include \"./test_files/inc_test_1.h\"\n";
+
+        const auto count_of = [](const std::string & text, const std::string & what)
+        {
+            int count = 0;
+            for (auto pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1))
+            {
+                ++count;
+            }
+            return count;
+        };
+
+        // Twice, since the cached files and their guards are kept across clear().
+        for (int run = 0; run < 2; ++run)
+        {
+            pp.clear();
+            result.clear();
+            if (!pp.init_from_memory(script, sizeof(script) - 1, "repeated_includes") || !pp.preprocess(&result))
+            {
+                std::cerr << "Failed to preprocess the repeated includes\n";
+                return EXIT_FAILURE;
+            }
+
+            assert(count_of(result, "guarded_contents") == 2);
+            assert(count_of(result, "first_pass") == 1);
+            assert(count_of(result, "later_pass") == 2);
+            assert(count_of(result, "inc_test_1.h") == 1);
+        }
+
+        pp.clear();
+        assert(pp.clear_include_cache());
+    }
+
+    // Skipped blocks of a repeatedly included file, which are jumped over
+    // once the file is cached. Line numbers must not change when they are:
+    {
+        const char script[] = "#define BRANCH 1\n"
+                              "#include \"test_files/branches.h\"\n"
+                              "#undef BRANCH\n"
+                              "#define BRANCH 2\n"
+                              "#include \"test_files/branches.h\"\n"
+                              "#undef BRANCH\n"
+                              "#define BRANCH 3\n"
+                              "#include \"test_files/branches.h\"\n"
+                              "#undef BRANCH\n"
+                              "#define BRANCH 2\n"
+                              "#include \"test_files/branches.h\"\n";
+
+        for (int run = 0; run < 2; ++run)
+        {
+            pp.clear();
+            result.clear();
+            if (!pp.init_from_memory(script, sizeof(script) - 1, "repeated_branches") || !pp.preprocess(&result))
+            {
+                std::cerr << "Failed to preprocess the repeated branches\n";
+                return EXIT_FAILURE;
+            }
+
+            const char * const expected[] =
+            {
+                "branch_one=4", "nested_taken", "after_branches=22",
+                "branch_two=16", "after_branches=22",
+                "branch_three=19", "after_branches=22",
+                "branch_two=16", "after_branches=22"
+            };
+
+            std::size_t pos = 0;
+            for (const char * text : expected)
+            {
+                pos = result.find(text, pos);
+                assert(pos != std::string::npos);
+                pos += std::strlen(text);
+            }
+            assert(result.find("skipped") == std::string::npos);
+            assert(result.find("not_here") == std::string::npos);
+        }
+
+        pp.clear();
+        assert(pp.clear_include_cache());
+    }
+
+    // Directives nested in a skipped block are handled the same whether the
+    // file is cached and jumped through or not, so the diagnostics match:
+    {
+        const char script[] = "#include \"test_files/dead_elif.h\"\n";
+        lexer::diagnostic_queue diagnostics;
+        std::vector<std::string> first_messages;
+
+        for (int run = 0; run < 3; ++run)
+        {
+            pp.clear();
+            pp.set_error_callbacks(&diagnostics);
+            result.clear();
+            assert(pp.init_from_memory(script, sizeof(script) - 1, "dead_elif"));
+            assert(!pp.preprocess(&result));
+
+            std::vector<lexer::diagnostic_queue::entry> entries;
+            std::vector<std::string> messages;
+            diagnostics.drain(&entries);
+            for (const auto & entry : entries)
+            {
+                messages.push_back(entry.message);
+            }
+
+            assert(!messages.empty());
+            if (run == 0)
+            {
+                first_messages = messages;
+            }
+            assert(messages == first_messages);
+        }
+
+        pp.set_error_callbacks(nullptr);
+        pp.clear();
+        assert(pp.clear_include_cache());
+    }
+
+    // A cached file rewritten with the same size within the same second is still
+    // reloaded where modification times are finer than a second:
+    {
+        const char filename[] = "test_files/rewritten.h";
+        const char script[]   = "#include \"test_files/rewritten.h\"\n";
+
+        for (int value = 1; value <= 2; ++value)
+        {
+            {
+                std::ofstream file{ filename };
+                file << "#define REWRITTEN " << value << "\n";
+            }
+
+            pp.clear();
+            result.clear();
+            assert(pp.init_from_memory(script, sizeof(script) - 1, "rewritten") && pp.preprocess(&result));
+
+            std::int64_t num = 0;
+            assert(pp.find_macro_value("REWRITTEN", &num) && num == value);
+
+            // Past the timestamp granularity of the file system, but not a whole second.
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+        }
+
+        pp.clear();
+        assert(pp.clear_include_cache());
+        std::remove(filename);
+    }
 }
@@ -19,6 +19,7 @@
 
 #include <iostream>
 #include <cassert>
+#include <unordered_map>
 
 int main()
 {
@@ -98,6 +99,16 @@ int main()
         assert(success == true);
         assert(iresult == 1);
         assert(dresult == 1);
+
+        // There's no limit on the number of operands in an expression.
+        std::string long_expr = "0";
+        for (int i = 1; i <= 200; ++i)
+        {
+            long_expr += " + (" + std::to_string(i) + " * 2 - -" + std::to_string(i) + " % 3) - " + std::to_string(i);
+        }
+        success = pp.eval(long_expr, &iresult, &dresult, false, false, false);
+        assert(success == true);
+        assert(iresult == 20100 + 201);
     }
 
     // Built-in macros, scripts:
@@ -142,4 +153,333 @@ int main()
         assert(pp.find_macro_value("THREE", &num) && num == 3);
         assert(pp.find_macro_value("FOUR",  &num) && num == 4);
     }
+
+    // Per-instance error callbacks:
+    {
+        lexer::diagnostic_queue diagnostics;
+        preprocessor pp_queued;
+        pp_queued.set_error_callbacks(&diagnostics);
+
+        const char scr[] = "#warning \"queued warning\"\n"
+                           "#error \"queued error\"\n";
+        assert(pp_queued.init_from_memory(scr, sizeof(scr) - 1, "queued_script.txt"));
+
+        // Errors are fatal, but the queue doesn't throw, so preprocess() just fails.
+        std::string result;
+        assert(pp_queued.preprocess(&result) == false);
+
+        std::vector<lexer::diagnostic_queue::entry> entries;
+        assert(diagnostics.drain(&entries) == 2);
+        assert(diagnostics.empty());
+        assert(entries[0].is_warning && entries[0].message.find("queued warning") != std::string::npos);
+        assert(!entries[1].is_warning && entries[1].is_fatal);
+        assert(entries[1].message.find("queued_script.txt(2)") == 0);
+    }
+
+    // An external lexer gets its own error callbacks back once the preprocessor is done with it:
+    {
+        lexer::diagnostic_queue own_diagnostics;
+        lexer::diagnostic_queue pp_diagnostics;
+        const char scr[] = "int x;\n";
+
+        lexer script;
+        script.set_instance_error_callbacks(&own_diagnostics);
+        {
+            preprocessor pp_external;
+            pp_external.set_error_callbacks(&pp_diagnostics);
+            assert(pp_external.init_from_lexer(&script) == false); // Nothing loaded yet.
+            assert(script.get_instance_error_callbacks() == &own_diagnostics);
+
+            assert(script.init_from_memory(scr, sizeof(scr) - 1, "external_script.txt"));
+            assert(pp_external.init_from_lexer(&script));
+            assert(script.get_instance_error_callbacks() == &pp_diagnostics);
+
+            pp_external.set_error_callbacks(nullptr);
+            assert(script.get_instance_error_callbacks() == &own_diagnostics);
+            pp_external.set_error_callbacks(&pp_diagnostics);
+            assert(script.get_instance_error_callbacks() == &pp_diagnostics);
+
+            pp_external.clear();
+            assert(script.get_instance_error_callbacks() == &own_diagnostics);
+
+            assert(pp_external.init_from_lexer(&script));
+            assert(script.get_instance_error_callbacks() == &pp_diagnostics);
+
+            // Moving hands the lexer over, it is released by the new owner only.
+            preprocessor pp_moved{ std::move(pp_external) };
+            assert(script.get_instance_error_callbacks() == &pp_diagnostics);
+        }
+        assert(script.get_instance_error_callbacks() == &own_diagnostics);
+    }
+
+    // Memory resources:
+    {
+        const char scr[] = "#define SIZE 4\n"
+                           "#define NAME \"table\"\n"
+                           "#if SIZE > 2\n"
+                           "int big[SIZE];\n"
+                           "#else\n"
+                           "int small;\n"
+                           "#endif\n"
+                           "#define A0 0\n#define A1 1\n#define A2 2\n#define A3 3\n#define A4 4\n"
+                           "#define A5 5\n#define A6 6\n#define A7 7\n#define A8 8\n#define A9 9\n";
+
+        // Everything allocated for the script comes from the arena, under the cap.
+        lexer::monotonic_memory_resource arena;
+        lexer::capped_memory_resource capped{ 64 * 1024, &arena };
+        std::size_t used_after_init = 0;
+        {
+            preprocessor pp_capped;
+            assert(pp_capped.set_memory_resource(&capped));
+            assert(pp_capped.is_defined("__FILE__")); // Built-ins are copied over.
+            assert(pp_capped.init_from_memory(scr, sizeof(scr) - 1, "capped_script.txt"));
+            assert(pp_capped.set_memory_resource(nullptr) == false);
+            used_after_init = capped.get_used_bytes();
+
+            std::string result;
+            assert(pp_capped.preprocess(&result));
+            assert(result.find("big") != std::string::npos && result.find("small") == std::string::npos);
+            assert(pp_capped.is_defined("A9"));
+            assert(capped.get_peak_bytes() > used_after_init);
+        }
+        assert(capped.get_used_bytes() == 0);
+        arena.release();
+
+        // Not enough room for the macros defined by the script: preprocess() fails with an error.
+        lexer::diagnostic_queue diagnostics;
+        lexer::capped_memory_resource tight_cap{ used_after_init + 32 };
+        preprocessor pp_tight;
+        pp_tight.set_error_callbacks(&diagnostics);
+        assert(pp_tight.set_memory_resource(&tight_cap));
+        assert(pp_tight.init_from_memory(scr, sizeof(scr) - 1, "tight_script.txt"));
+
+        std::string result;
+        assert(pp_tight.preprocess(&result) == false);
+        assert(tight_cap.get_failed_count() != 0);
+
+        std::vector<lexer::diagnostic_queue::entry> entries;
+        assert(diagnostics.drain(&entries) == 1);
+        assert(entries[0].message.find("preprocessor::preprocess() -> out of memory!") != std::string::npos);
+    }
+
+    // Skipped blocks are not tokenized, only searched for directives:
+    {
+        const char scr[] = "#if 0\n"
+                           "\"#endif\" '#endif' don't stop here\n"
+                           "/* a comment\n"
+                           "#endif */ still skipped\n"
+                           "// #endif in a comment \\\n"
+                           "#endif continued comment\n"
+                           "  ` invalid punctuation, never scanned\n"
+                           "#define SKIPPED 1\n"
+                           "  #  if 1\n"
+                           "inner\n"
+                           "  # endif\n"
+                           "#elif 1\n"
+                           "line_a = __LINE__;\n"
+                           "#else\n"
+                           "not_here;\n"
+                           "#endif\n"
+                           "/* x */ #ifdef NOT_DEFINED\n"
+                           "also_skipped \"unterminated\n"
+                           "#endif\n"
+                           "line_b = __LINE__;\n";
+
+        preprocessor pp_skip;
+        assert(pp_skip.init_from_memory(scr, sizeof(scr) - 1, "skip_script.txt"));
+
+        std::string result;
+        assert(pp_skip.preprocess(&result));
+        assert(result.find("line_a=13;") != std::string::npos);
+        assert(result.find("line_b=20;") != std::string::npos);
+        assert(!pp_skip.is_defined("SKIPPED"));
+
+        for (const char * skipped : { "still", "continued", "SKIPPED", "inner", "not_here", "also_skipped" })
+        {
+            assert(result.find(skipped) == std::string::npos);
+        }
+    }
+
+    // "/*/" is a whole comment in a skipped block too, so it doesn't hide the #endif:
+    {
+        const char scr[] = "#if 0\n"
+                           "x /*/ y\n"
+                           "#endif\n"
+                           "after\n"
+                           "*/ z\n";
+
+        preprocessor pp_slash;
+        assert(pp_slash.init_from_memory(scr, sizeof(scr) - 1, "slash_script.txt"));
+
+        std::string result;
+        assert(pp_slash.preprocess(&result));
+        assert(result.find("after") != std::string::npos && result.find('z') != std::string::npos);
+        assert(result.find('y') == std::string::npos);
+    }
+
+    // The same #if expressions, compiled once and evaluated again as the macros change:
+    {
+        const char scr[] = "#define LEVEL 1\n"
+                           "#if LEVEL > 1 && defined(FEATURE)\n"
+                           "first_on;\n"
+                           "#endif\n"
+                           "#define FEATURE\n"
+                           "#if LEVEL > 1 && defined(FEATURE)\n"
+                           "second_on;\n"
+                           "#endif\n"
+                           "#undef LEVEL\n"
+                           "#define LEVEL 2\n"
+                           "#if LEVEL > 1 && defined(FEATURE)\n"
+                           "third_on;\n"
+                           "#endif\n"
+                           "#if LEVEL > 1 && defined(FEATURE)\n"
+                           "fourth_on;\n"
+                           "#endif\n"
+                           "#undef FEATURE\n"
+                           "#if LEVEL > 1 && defined(FEATURE)\n"
+                           "fifth_on;\n"
+                           "#elif LEVEL == 2 ? -LEVEL == -2 : 0\n"
+                           "fifth_elif;\n"
+                           "#endif\n";
+
+        lexer::diagnostic_queue diagnostics;
+        preprocessor pp_cond;
+        pp_cond.set_error_callbacks(&diagnostics);
+
+        // clear() drops the compiled expressions, so the second run compiles them again.
+        for (int run = 0; run < 2; ++run)
+        {
+            pp_cond.clear();
+            assert(pp_cond.init_from_memory(scr, sizeof(scr) - 1, "cond_script.txt"));
+
+            std::string result;
+            assert(pp_cond.preprocess(&result));
+            assert(result.find("first_on")   == std::string::npos);
+            assert(result.find("second_on")  == std::string::npos);
+            assert(result.find("third_on")   != std::string::npos);
+            assert(result.find("fourth_on")  != std::string::npos);
+            assert(result.find("fifth_on")   == std::string::npos);
+            assert(result.find("fifth_elif") != std::string::npos);
+        }
+
+        // Errors come from running the code, so they are reported every time.
+        const char bad_scr[] = "#define ZERO 0\n"
+                               "#if 1 / ZERO\n"
+                               "#endif\n";
+        for (int run = 0; run < 2; ++run)
+        {
+            pp_cond.clear();
+            assert(pp_cond.init_from_memory(bad_scr, sizeof(bad_scr) - 1, "bad_cond_script.txt"));
+
+            std::string result;
+            assert(pp_cond.preprocess(&result) == false);
+
+            std::vector<lexer::diagnostic_queue::entry> entries;
+            assert(diagnostics.drain(&entries) == 1);
+            assert(entries[0].message.find("integer division by zero") != std::string::npos);
+        }
+
+        // Many distinct expressions don't grow the cache past a bound, within
+        // a script or across clear(), so they fit under a memory cap.
+        std::string many_scr = "#define N 1\n";
+        for (int i = 0; i < 3000; ++i)
+        {
+            many_scr += "#if N + X > " + std::to_string(i) + " || N * " + std::to_string(i) + " == 7\n"
+                        "taken_" + std::to_string(i) + ";\n"
+                        "#endif\n";
+        }
+
+        lexer::capped_memory_resource capped{ 256 * 1024 };
+        preprocessor pp_capped;
+        assert(pp_capped.set_memory_resource(&capped));
+        assert(pp_capped.init_from_memory(many_scr.c_str(), static_cast<std::uint32_t>(many_scr.length()), "many_exprs.txt"));
+
+        std::string result;
+        assert(pp_capped.preprocess(&result));
+        assert(result.find("taken_0;") != std::string::npos && result.find("taken_1;") == std::string::npos);
+        assert(capped.get_failed_count() == 0);
+
+        for (int i = 0; i < 3000; ++i)
+        {
+            const std::string scr_i = "#if N + X > " + std::to_string(i) + "\nabove;\n#endif\n";
+            pp_capped.clear();
+            assert(pp_capped.init_from_memory(scr_i.c_str(), static_cast<std::uint32_t>(scr_i.length()), "one_expr.txt"));
+            assert(pp_capped.preprocess(&result));
+        }
+        assert(capped.get_failed_count() == 0);
+    }
+
+    // Many macros, undefined out of order, so the lookup index is grown and shuffled around:
+    {
+        preprocessor pp_many;
+        const int macro_count = 5000;
+
+        for (int i = 0; i < macro_count; ++i)
+        {
+            assert(pp_many.define("MANY_" + std::to_string(i), std::int64_t{ i }, false));
+        }
+        for (int i = 0; i < macro_count; i += 3)
+        {
+            pp_many.undef("MANY_" + std::to_string(i));
+        }
+        for (int i = 1; i < macro_count; i += 3) // Redefined in place.
+        {
+            assert(pp_many.define("MANY_" + std::to_string(i), std::int64_t{ i * 10 }, true));
+        }
+
+        lexer::token tok;
+        for (int i = 0; i < macro_count; ++i)
+        {
+            const std::string name = "MANY_" + std::to_string(i);
+            assert(pp_many.is_defined(name) == (i % 3 != 0));
+            if (i % 3 != 0)
+            {
+                assert(pp_many.find_macro_token(name, &tok));
+                assert(tok.as_int64() == ((i % 3 == 1) ? (i * 10) : i));
+            }
+        }
+        assert(pp_many.is_defined("__LINE__") && pp_many.is_defined("__VA_ARGS__"));
+
+        // Two names whose hashes collide in the 32 bits kept for each macro are still told apart.
+        std::unordered_map<std::uint32_t, std::string> seen_hashes;
+        std::string name_a, name_b;
+        for (int i = 0; name_a.empty(); ++i)
+        {
+            const std::string name = "COLLIDE_" + std::to_string(i);
+            const std::uint64_t hash = preprocessor::hash_string(name.c_str(), name.length());
+            const auto folded = static_cast<std::uint32_t>(hash ^ (hash >> 32));
+
+            const auto iter = seen_hashes.find(folded);
+            if (iter != seen_hashes.end())
+            {
+                name_a = iter->second;
+                name_b = name;
+            }
+            seen_hashes.emplace(folded, name);
+        }
+        assert(pp_many.define(name_a, std::int64_t{ 1 }, false));
+        assert(!pp_many.is_defined(name_b));
+        assert(pp_many.define(name_b, std::int64_t{ 2 }, false));
+        assert(pp_many.find_macro_token(name_a, &tok) && tok.as_int64() == 1);
+        assert(pp_many.find_macro_token(name_b, &tok) && tok.as_int64() == 2);
+        pp_many.undef(name_a);
+        assert(!pp_many.is_defined(name_a) && pp_many.is_defined(name_b));
+
+        // Undefining most of them, so the name filter gets rebuilt along the way.
+        for (int i = 0; i < macro_count; ++i)
+        {
+            pp_many.undef("MANY_" + std::to_string(i));
+            assert(!pp_many.is_defined("MANY_" + std::to_string(i)));
+            assert(pp_many.is_defined(name_b) && pp_many.is_defined("__FILE__"));
+        }
+        assert(pp_many.define("MANY_2", std::int64_t{ 2 }, false));
+        assert(pp_many.find_macro_token("MANY_2", &tok) && tok.as_int64() == 2);
+        assert(!pp_many.is_defined("MANY_3"));
+
+        // Back to just the built-ins.
+        pp_many.undef_all(true);
+        assert(!pp_many.is_defined("MANY_1") && pp_many.is_defined("__FILE__"));
+        assert(pp_many.define("MANY_1", std::int64_t{ 1 }, false));
+        assert(pp_many.is_defined("MANY_1"));
+    }
 }